@@ -172,6 +172,15 @@ typedef enum {
 #define ARES_FLAG_NOALIASES   (1 << 6)
 #define ARES_FLAG_NOCHECKRESP (1 << 7)
 #define ARES_FLAG_EDNS        (1 << 8)
+#define ARES_FLAG_BATCHSEND   (1 << 9)
+#define ARES_FLAG_IOURING     (1 << 10)
+#define ARES_FLAG_TIMERWHEEL  (1 << 11)
+#define ARES_FLAG_COALESCE    (1 << 12)
+#define ARES_FLAG_SRTT        (1 << 13)
+#define ARES_FLAG_AUTOTIMEOUT (1 << 14)
+#define ARES_FLAG_THREADSAFE  (1 << 15)
+#define ARES_FLAG_SUBMITQ     (1 << 16)
+#define ARES_FLAG_FILEWATCH   (1 << 17)
 
 /* Option mask values */
 #define ARES_OPT_FLAGS           (1 << 0)
@@ -194,6 +203,12 @@ typedef enum {
 #define ARES_OPT_RESOLVCONF      (1 << 17)
 #define ARES_OPT_HOSTS_FILE      (1 << 18)
 #define ARES_OPT_UDP_MAX_QUERIES (1 << 19)
+#define ARES_OPT_QUERY_CACHE     (1 << 20)
+#define ARES_OPT_SERVE_STALE     (1 << 21)
+#define ARES_OPT_PREFETCH        (1 << 22)
+#define ARES_OPT_SERVER_BACKOFF  (1 << 23)
+#define ARES_OPT_HEDGE           (1 << 24)
+#define ARES_OPT_TCP_CACHE       (1 << 25)
 
 /* Nameinfo flag values */
 #define ARES_NI_NOFQDN        (1 << 0)
@@ -239,6 +254,10 @@ typedef enum {
 #define ARES_GETSOCK_WRITABLE(bits, num) \
   (bits & (1 << ((num) + ARES_GETSOCK_MAXNUM)))
 
+/* ares_getsock_all() event flags */
+#define ARES_SOCK_READ  (1 << 0)
+#define ARES_SOCK_WRITE (1 << 1)
+
 /* c-ares library initialization flag values */
 #define ARES_LIB_INIT_NONE  (0)
 #define ARES_LIB_INIT_WIN32 (1 << 0)
@@ -263,6 +282,12 @@ typedef int ares_socket_t;
 typedef void (*ares_sock_state_cb)(void *data, ares_socket_t socket_fd,
                                    int readable, int writable);
 
+/* Called once per change in interest for a socket, old_events and new_events
+ * are ARES_SOCK_READ/ARES_SOCK_WRITE masks.  new_events of 0 means the socket
+ * is about to be closed. */
+typedef void (*ares_sock_change_callback)(void *data, ares_socket_t socket_fd,
+                                          int old_events, int new_events);
+
 struct apattern;
 
 /* NOTE about the ares_options struct to users and developers.
@@ -304,6 +329,14 @@ struct ares_options {
   char              *resolvconf_path;
   char              *hosts_path;
   int                udp_max_queries;
+  unsigned int       qcache_max_ttl; /* in seconds */
+  unsigned int       stale_window;   /* in seconds */
+  unsigned int       stale_timeout;  /* in milliseconds */
+  unsigned int       prefetch_pct;   /* percent of TTL */
+  unsigned int       prefetch_hits;
+  unsigned int       server_backoff; /* in milliseconds */
+  unsigned int       hedge_delay;    /* in milliseconds */
+  unsigned int       tcpcache_max_entries;
 };
 
 struct hostent;
@@ -368,6 +401,19 @@ CARES_EXTERN void        ares_destroy(ares_channel channel);
 
 CARES_EXTERN void        ares_cancel(ares_channel channel);
 
+/* Whether the library was built with thread support, which channels
+ * created with ARES_FLAG_THREADSAFE need */
+CARES_EXTERN ares_bool_t ares_threadsafety(void);
+
+/* Number of queries in progress on the channel */
+CARES_EXTERN size_t      ares_queue_active_queries(ares_channel channel);
+
+/* Wait up to timeout_ms milliseconds, or forever if -1, for the channel to
+ * have no queries in progress.  Only for ARES_FLAG_THREADSAFE channels, and
+ * needs another thread to process the channel. */
+CARES_EXTERN ares_status_t ares_queue_wait_empty(ares_channel channel,
+                                                 int          timeout_ms);
+
 /* These next 3 configure local binding for the out-going socket
  * connection.  Use these to specify source IP and/or network device
  * on multi-homed systems.
@@ -390,6 +436,9 @@ CARES_EXTERN void        ares_set_socket_callback(ares_channel              chan
 CARES_EXTERN void        ares_set_socket_configure_callback(
          ares_channel channel, ares_sock_config_callback callback, void *user_data);
 
+CARES_EXTERN void        ares_set_sock_change_callback(
+         ares_channel channel, ares_sock_change_callback callback, void *user_data);
+
 CARES_EXTERN int  ares_set_sortlist(ares_channel channel, const char *sortstr);
 
 CARES_EXTERN void ares_getaddrinfo(ares_channel channel, const char *node,
@@ -424,9 +473,90 @@ CARES_EXTERN void
                                             const struct ares_socket_functions *funcs,
                                             void                               *user_data);
 
+/* A single datagram for the batched socket functions.  On input data/data_len
+ * and from/from_len describe the buffers available, on output data_len and
+ * from_len are updated to the sizes actually received. */
+struct ares_socket_msg {
+  void            *data;
+  size_t           data_len;
+  struct sockaddr *from;
+  ares_socklen_t   from_len;
+};
+
+/* Optional batched counterparts to ares_socket_functions.  arecvmulti reads up
+ * to the given number of datagrams from a non-blocking UDP socket and returns
+ * how many were received, or -1 with the error in errno (EAGAIN/EWOULDBLOCK
+ * when nothing is pending).  asendmulti sends datagrams on a connected UDP
+ * socket (from is unused) and returns how many were sent, or -1 with errno
+ * set if none were. */
+struct ares_socket_batch_functions {
+  ares_ssize_t (*arecvmulti)(ares_socket_t, struct ares_socket_msg *, size_t,
+                             void *);
+  ares_ssize_t (*asendmulti)(ares_socket_t, const struct ares_socket_msg *,
+                             size_t, void *);
+};
+
+CARES_EXTERN void ares_set_socket_batch_functions(
+  ares_channel channel, const struct ares_socket_batch_functions *funcs,
+  void *user_data);
+
 CARES_EXTERN void ares_send(ares_channel channel, const unsigned char *qbuf,
                             int qlen, ares_callback callback, void *arg);
 
+/* Queue a request from any thread for the thread driving ares_process*() on
+ * a channel created with ARES_FLAG_SUBMITQ.  The request is started, and its
+ * callback invoked, by that thread.  The arguments are copied. */
+CARES_EXTERN ares_status_t ares_submit_send(ares_channel         channel,
+                                            const unsigned char *qbuf,
+                                            size_t qlen, ares_callback callback,
+                                            void *arg);
+
+CARES_EXTERN ares_status_t ares_submit_getaddrinfo(
+  ares_channel channel, const char *node, const char *service,
+  const struct ares_addrinfo_hints *hints, ares_addrinfo_callback callback,
+  void *arg);
+
+/* A set of channels ("shards") created from one configuration, each meant
+ * to be driven by its own thread.  Requests are routed to a shard by name so
+ * that per-name state such as the query cache stays on one shard. */
+typedef struct ares_pool ares_pool_t;
+
+struct ares_pool_stats {
+  size_t shards;
+  size_t active_queries;
+  size_t queries;
+  size_t cache_hits;
+  size_t timeouts;
+};
+
+CARES_EXTERN ares_status_t ares_pool_create(ares_pool_t        **pool,
+                                            size_t               nshards,
+                                            struct ares_options *options,
+                                            int                  optmask);
+
+CARES_EXTERN void          ares_pool_destroy(ares_pool_t *pool);
+
+CARES_EXTERN size_t        ares_pool_nshards(const ares_pool_t *pool);
+
+CARES_EXTERN ares_channel  ares_pool_shard(const ares_pool_t *pool,
+                                           size_t             idx);
+
+CARES_EXTERN ares_channel  ares_pool_route(const ares_pool_t *pool,
+                                           const char        *name);
+
+CARES_EXTERN ares_status_t ares_pool_getaddrinfo(
+  ares_pool_t *pool, const char *node, const char *service,
+  const struct ares_addrinfo_hints *hints, ares_addrinfo_callback callback,
+  void *arg);
+
+CARES_EXTERN ares_status_t ares_pool_send(ares_pool_t         *pool,
+                                          const unsigned char *qbuf,
+                                          size_t qlen, ares_callback callback,
+                                          void *arg);
+
+CARES_EXTERN void          ares_pool_stats(const ares_pool_t      *pool,
+                                           struct ares_pool_stats *stats);
+
 CARES_EXTERN void ares_query(ares_channel channel, const char *name,
                              int dnsclass, int type, ares_callback callback,
                              void *arg);
@@ -457,6 +587,21 @@ CARES_EXTERN int  ares_fds(ares_channel channel, fd_set *read_fds,
 CARES_EXTERN int  ares_getsock(ares_channel channel, ares_socket_t *socks,
                                int numsocks);
 
+struct ares_sock_info {
+  ares_socket_t fd;
+  int           events; /* ARES_SOCK_READ | ARES_SOCK_WRITE */
+};
+
+/* Like ares_getsock() but without a limit on the number of sockets.  Fills
+ * in up to max_socks entries and returns how many sockets there are in total,
+ * so callers can grow the array and retry if it was too small. */
+CARES_EXTERN size_t ares_getsock_all(ares_channel           channel,
+                                     struct ares_sock_info *socks,
+                                     size_t                 max_socks);
+
+/* Changes whenever the set returned by ares_getsock_all() may have changed */
+CARES_EXTERN size_t ares_getsock_generation(ares_channel channel);
+
 CARES_EXTERN struct timeval *
   ares_timeout(ares_channel channel, struct timeval *maxtv, struct timeval *tv);
 
@@ -466,6 +611,17 @@ CARES_EXTERN void ares_process(ares_channel channel, fd_set *read_fds,
 CARES_EXTERN void ares_process_fd(ares_channel channel, ares_socket_t read_fd,
                                   ares_socket_t write_fd);
 
+/* Built-in event engine.  Once enabled, the channel registers and
+ * deregisters its own sockets as connections come and go, and the
+ * integrator only needs to wait for ares_event_engine_fd() to become
+ * readable (or for ares_timeout() to expire) and then call
+ * ares_process_pending().  Currently only available on Linux (epoll). */
+CARES_EXTERN int           ares_event_engine_enable(ares_channel channel);
+
+CARES_EXTERN ares_socket_t ares_event_engine_fd(ares_channel channel);
+
+CARES_EXTERN void          ares_process_pending(ares_channel channel);
+
 CARES_EXTERN int  ares_create_query(const char *name, int dnsclass, int type,
                                     unsigned short id, int rd,
                                     unsigned char **buf, int *buflen,
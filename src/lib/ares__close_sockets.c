@@ -45,7 +45,7 @@ void ares__close_connection(struct server_connection *conn)
   }
 
 
-  SOCK_STATE_CALLBACK(channel, conn->fd, 0, 0);
+  ares__conn_sock_state(conn, 0);
   ares__close_socket(channel, conn->fd);
   ares__llist_node_claim(
     ares__htable_asvp_get_direct(channel->connnode_by_socket, conn->fd));
@@ -55,6 +55,8 @@ void ares__close_connection(struct server_connection *conn)
   assert(ares__llist_len(conn->queries_to_conn) == 0);
 #endif
   ares__llist_destroy(conn->queries_to_conn);
+  ares__llist_node_claim(conn->node_udp_send);
+  ares__buf_destroy(conn->udp_send);
   ares_free(conn);
 }
 
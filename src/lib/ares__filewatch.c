@@ -0,0 +1,391 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#  include <sys/inotify.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* Change detection for the hosts file and resolv.conf.
+ *
+ * Without a watch every hosts file lookup stat()s the file to see whether the
+ * cached parse is still current.  On Linux the directories holding the files
+ * are watched with inotify instead, the descriptor being reported along with
+ * the server sockets and watched by the io_uring transport, so lookups only
+ * look at a flag.  The directories rather
+ * than the files are watched as both are commonly replaced by renaming a new
+ * file over them.  Elsewhere, or if inotify can't be used, the files are
+ * stat()ed at most once every ARES_FILEWATCH_INTERVAL_MS.
+ *
+ * A change to resolv.conf re-reads the system configuration, other than the
+ * lookup order and whatever the user chose, see ares__reload_config().
+ * Queries in progress are moved over to the new servers.
+ */
+
+#define ARES_FILEWATCH_INTERVAL_MS 1000
+
+typedef struct {
+  char          *path;
+  /* Last component of path, points into path */
+  const char    *name;
+  /* inotify watch descriptor of the directory holding the file */
+  int            wd;
+  ares_bool_t    changed;
+  /* Stat fallback: when to look at the file next and what was seen last */
+  struct timeval next_check;
+  time_t         mtime;
+} ares__filewatch_file_t;
+
+struct ares__filewatch {
+  /* inotify descriptor, ARES_SOCKET_BAD when using the stat fallback */
+  ares_socket_t          fd;
+  ares__filewatch_file_t hosts;
+  ares__filewatch_file_t resolvconf;
+};
+
+static time_t filewatch_mtime(const char *path)
+{
+  time_t mod_ts = 0;
+
+  if (path == NULL) {
+    return 0;
+  }
+
+#ifdef HAVE_STAT
+  {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+      mod_ts = st.st_mtime;
+    }
+  }
+#elif defined(_WIN32)
+  {
+    struct _stat st;
+    if (_stat(path, &st) == 0) {
+      mod_ts = st.st_mtime;
+    }
+  }
+#endif
+
+  return mod_ts;
+}
+
+static void filewatch_file_init(ares__filewatch_file_t *file, char *path)
+{
+  const char *p;
+
+  file->path = path;
+  file->wd   = -1;
+  if (path == NULL) {
+    return;
+  }
+
+  file->name = path;
+  for (p = path; *p != '\0'; p++) {
+    if (*p == '/' || *p == '\\') {
+      file->name = p + 1;
+    }
+  }
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#  define ARES_FILEWATCH_EVENTS                                      \
+    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |     \
+     IN_DELETE | IN_ATTRIB)
+
+static ares_bool_t filewatch_add(ares__filewatch_t      *watch,
+                                 ares__filewatch_file_t *file)
+{
+  char  *dir;
+  size_t len;
+
+  if (file->path == NULL) {
+    return ARES_TRUE;
+  }
+
+  len = (size_t)(file->name - file->path);
+  if (len == 0) {
+    dir = ares_strdup(".");
+  } else {
+    /* Keep the slash for a file in the root directory */
+    if (len > 1) {
+      len--;
+    }
+    dir = ares_malloc(len + 1);
+    if (dir != NULL) {
+      memcpy(dir, file->path, len);
+      dir[len] = '\0';
+    }
+  }
+  if (dir == NULL) {
+    return ARES_FALSE;
+  }
+
+  file->wd = inotify_add_watch(watch->fd, dir, ARES_FILEWATCH_EVENTS);
+  ares_free(dir);
+  return (file->wd == -1) ? ARES_FALSE : ARES_TRUE;
+}
+
+static void filewatch_inotify(ares__filewatch_t *watch)
+{
+  watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch->fd == -1) {
+    watch->fd = ARES_SOCKET_BAD;
+    return;
+  }
+
+  if (!filewatch_add(watch, &watch->hosts) ||
+      !filewatch_add(watch, &watch->resolvconf)) {
+    close(watch->fd);
+    watch->fd = ARES_SOCKET_BAD;
+  }
+}
+
+static void filewatch_match(ares__filewatch_file_t     *file,
+                            const struct inotify_event *ev)
+{
+  if (file->path == NULL || ev->wd != file->wd) {
+    return;
+  }
+
+  /* The directory itself went away, or was moved */
+  if (ev->mask & IN_IGNORED) {
+    file->changed = ARES_TRUE;
+    return;
+  }
+
+  if (ev->len != 0 && strcmp(ev->name, file->name) == 0) {
+    file->changed = ARES_TRUE;
+  }
+}
+
+static void filewatch_read(ares__filewatch_t *watch)
+{
+  union {
+    struct inotify_event ev;
+    char                 buf[4096];
+  } u;
+
+  for (;;) {
+    ares_ssize_t len = (ares_ssize_t)read(watch->fd, u.buf, sizeof(u.buf));
+    size_t       off = 0;
+
+    if (len <= 0) {
+      return;
+    }
+
+    while (off + sizeof(struct inotify_event) <= (size_t)len) {
+      const struct inotify_event *ev =
+        (const struct inotify_event *)((const void *)(u.buf + off));
+
+      /* Events were lost, assume the worst */
+      if (ev->mask & IN_Q_OVERFLOW) {
+        watch->hosts.changed      = ARES_TRUE;
+        watch->resolvconf.changed = ARES_TRUE;
+      }
+
+      filewatch_match(&watch->hosts, ev);
+      filewatch_match(&watch->resolvconf, ev);
+      off += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+}
+
+#endif
+
+ares_status_t ares__filewatch_create(ares_channel channel)
+{
+  ares__filewatch_t *watch;
+  char              *hosts_path      = NULL;
+  char              *resolvconf_path = NULL;
+  const char        *resolvconf      = channel->resolvconf_path;
+  ares_status_t      status;
+  struct timeval     now;
+
+  watch = ares_malloc_zero(sizeof(*watch));
+  if (watch == NULL) {
+    return ARES_ENOMEM;
+  }
+  watch->fd = ARES_SOCKET_BAD;
+
+  /* Not every platform has a hosts file to watch */
+  status = ares__hosts_path(channel, ARES_FALSE, &hosts_path);
+  if (status == ARES_ENOMEM) {
+    ares_free(watch);
+    return status;
+  }
+
+#ifdef PATH_RESOLV_CONF
+  if (resolvconf == NULL) {
+    resolvconf = PATH_RESOLV_CONF;
+  }
+#endif
+  if (resolvconf != NULL) {
+    resolvconf_path = ares_strdup(resolvconf);
+    if (resolvconf_path == NULL) {
+      ares_free(hosts_path);
+      ares_free(watch);
+      return ARES_ENOMEM;
+    }
+  }
+
+  filewatch_file_init(&watch->hosts, hosts_path);
+  filewatch_file_init(&watch->resolvconf, resolvconf_path);
+  channel->filewatch = watch;
+
+#ifdef HAVE_SYS_INOTIFY_H
+  filewatch_inotify(watch);
+
+  /* Applications may only be waiting on the ring */
+  if (watch->fd != ARES_SOCKET_BAD &&
+      ares__uring_watch(channel, watch->fd) != ARES_SUCCESS) {
+    close(watch->fd);
+    watch->fd = ARES_SOCKET_BAD;
+  }
+#endif
+
+  if (watch->fd == ARES_SOCKET_BAD) {
+    now                          = ares__tvnow();
+    watch->resolvconf.mtime      = filewatch_mtime(watch->resolvconf.path);
+    watch->hosts.next_check      = now;
+    watch->resolvconf.next_check = now;
+    ares__timeadd(&watch->resolvconf.next_check, ARES_FILEWATCH_INTERVAL_MS);
+  } else {
+    channel->sock_generation++;
+    if (channel->sock_state_cb) {
+      channel->sock_state_cb(channel->sock_state_cb_data, watch->fd, 1, 0);
+    }
+  }
+
+  return ARES_SUCCESS;
+}
+
+void ares__filewatch_destroy(ares_channel channel)
+{
+  ares__filewatch_t *watch = channel->filewatch;
+
+  if (watch == NULL) {
+    return;
+  }
+
+#ifdef HAVE_SYS_INOTIFY_H
+  if (watch->fd != ARES_SOCKET_BAD) {
+    if (channel->sock_state_cb) {
+      channel->sock_state_cb(channel->sock_state_cb_data, watch->fd, 0, 0);
+    }
+    ares__uring_unwatch(channel, watch->fd);
+    close(watch->fd);
+  }
+#endif
+  ares_free(watch->hosts.path);
+  ares_free(watch->resolvconf.path);
+  ares_free(watch);
+  channel->filewatch = NULL;
+}
+
+ares_socket_t ares__filewatch_fd(const ares_channel channel)
+{
+  if (channel->filewatch == NULL) {
+    return ARES_SOCKET_BAD;
+  }
+  return channel->filewatch->fd;
+}
+
+void ares__filewatch_process(ares_channel channel, ares_bool_t woken,
+                             const struct timeval *now)
+{
+  ares__filewatch_t      *watch = channel->filewatch;
+  ares__filewatch_file_t *rc;
+
+  if (watch == NULL) {
+    return;
+  }
+  rc = &watch->resolvconf;
+
+  if (watch->fd != ARES_SOCKET_BAD) {
+#ifdef HAVE_SYS_INOTIFY_H
+    if (woken) {
+      filewatch_read(watch);
+    }
+#endif
+  } else if (rc->path != NULL && ares__timedout(now, &rc->next_check)) {
+    time_t mtime = filewatch_mtime(rc->path);
+
+    rc->next_check = *now;
+    ares__timeadd(&rc->next_check, ARES_FILEWATCH_INTERVAL_MS);
+    if (mtime != rc->mtime) {
+      rc->mtime   = mtime;
+      rc->changed = ARES_TRUE;
+    }
+  }
+
+  if (rc->changed) {
+    rc->changed = ARES_FALSE;
+    (void)ares__reload_config(channel);
+  }
+}
+
+ares_bool_t ares__filewatch_hosts_stale(ares_channel channel,
+                                        const char  *filename)
+{
+  ares__filewatch_t *watch = channel->filewatch;
+  struct timeval     now;
+
+  if (watch == NULL || watch->hosts.path == NULL ||
+      strcmp(watch->hosts.path, filename) != 0) {
+    return ARES_TRUE;
+  }
+
+  if (watch->fd != ARES_SOCKET_BAD) {
+    if (!watch->hosts.changed) {
+      return ARES_FALSE;
+    }
+    watch->hosts.changed = ARES_FALSE;
+    return ARES_TRUE;
+  }
+
+  now = ares__tvnow();
+  if (!ares__timedout(&now, &watch->hosts.next_check)) {
+    return ARES_FALSE;
+  }
+  watch->hosts.next_check = now;
+  ares__timeadd(&watch->hosts.next_check, ARES_FILEWATCH_INTERVAL_MS);
+  return ARES_TRUE;
+}
@@ -59,6 +59,14 @@
  * O(1) performance on lookup.  The file is cached until the file modification
  * timestamp changes.
  *
+ * A parsed file is never modified, so when thread support is available it is
+ * shared by every channel using the same path: the most recent parse of each
+ * path is kept on a process-wide list and channels hold a reference to it.
+ * The first channel to see a newer timestamp parses the file again and
+ * replaces the list entry, other channels then pick up the new parse rather
+ * than repeating it.  The list does not hold a reference of its own, a file
+ * is dropped from it when the last channel lets go.
+ *
  * The hosts file processing is quite unique. It has to merge all related hosts
  * and ips into a single entry due to file formatting requirements.  For
  * instance take the below:
@@ -82,6 +90,12 @@
 
 struct ares_hosts_file {
   time_t                ts;
+  /*! channels holding this file, under the process-wide lock if shared */
+  size_t                refcnt;
+  /*! whether the file is, or was, on the process-wide list */
+  ares_bool_t           shared;
+  /*! next file on the process-wide list */
+  ares_hosts_file_t    *next;
   /*! cache the filename so we know if the filename changes it automatically
    *  invalidates the cache */
   char                 *filename;
@@ -257,11 +271,54 @@ static void ares__hosts_entry_destroy_cb(void *entry)
   ares__hosts_entry_destroy(entry);
 }
 
+/* Most recent parse of each hosts file path, see the overview */
+static ares_hosts_file_t *ares__hosts_shared = NULL;
+
+static ares_hosts_file_t *ares__hosts_shared_find(const char *filename)
+{
+  ares_hosts_file_t *hf;
+
+  /* Paths are case sensitive on most systems, only share exact matches */
+  for (hf = ares__hosts_shared; hf != NULL; hf = hf->next) {
+    if (strcmp(hf->filename, filename) == 0)
+      return hf;
+  }
+  return NULL;
+}
+
+static void ares__hosts_shared_remove(const ares_hosts_file_t *hf)
+{
+  ares_hosts_file_t **prev;
+
+  for (prev = &ares__hosts_shared; *prev != NULL; prev = &(*prev)->next) {
+    if (*prev == hf) {
+      *prev = hf->next;
+      return;
+    }
+  }
+}
+
 void ares__hosts_file_destroy(ares_hosts_file_t *hf)
 {
+  size_t refcnt;
+
   if (hf == NULL)
     return;
 
+  /* Honor reference counting */
+  if (hf->shared)
+    ares__thread_global_lock();
+  if (hf->refcnt != 0)
+    hf->refcnt--;
+  refcnt = hf->refcnt;
+  if (hf->shared && refcnt == 0)
+    ares__hosts_shared_remove(hf);
+  if (hf->shared)
+    ares__thread_global_unlock();
+
+  if (refcnt > 0)
+    return;
+
   ares_free(hf->filename);
   ares__htable_strvp_destroy(hf->hosthash);
   ares__htable_strvp_destroy(hf->iphash);
@@ -275,7 +332,8 @@ static ares_hosts_file_t *ares__hosts_file_create(const char *filename)
     goto fail;
   }
 
-  hf->ts = time(NULL);
+  hf->ts     = time(NULL);
+  hf->refcnt = 1;
 
   hf->filename = ares_strdup(filename);
   if (hf->filename == NULL) {
@@ -658,8 +716,7 @@ done:
 }
 
 
-static ares_bool_t ares__hosts_expired(const char *filename,
-                                       const ares_hosts_file_t *hf)
+static time_t ares__hosts_mtime(const char *filename)
 {
   time_t mod_ts = 0;
 
@@ -677,6 +734,12 @@ static ares_bool_t ares__hosts_expired(const char *filename,
   (void)filename;
 #endif
 
+  return mod_ts;
+}
+
+static ares_bool_t ares__hosts_expired(const char *filename, time_t mod_ts,
+                                       const ares_hosts_file_t *hf)
+{
   if (hf == NULL)
     return ARES_TRUE;
 
@@ -696,8 +759,8 @@ static ares_bool_t ares__hosts_expired(const char *filename,
 }
 
 
-static ares_status_t ares__hosts_path(ares_channel channel, ares_bool_t use_env,
-                                      char **path)
+ares_status_t ares__hosts_path(ares_channel channel, ares_bool_t use_env,
+                               char **path)
 {
   char         *path_hosts = NULL;
 
@@ -770,22 +833,60 @@ static ares_status_t ares__hosts_path(ares_channel channel, ares_bool_t use_env,
 static ares_status_t ares__hosts_update(ares_channel channel,
                                         ares_bool_t use_env)
 {
-  ares_status_t status;
-  char *filename = NULL;
+  ares_status_t      status   = ARES_SUCCESS;
+  char              *filename = NULL;
+  time_t             mod_ts;
+  ares_hosts_file_t *hf = NULL;
+  ares_bool_t        shared;
 
   status = ares__hosts_path(channel, use_env, &filename);
   if (status != ARES_SUCCESS)
     return status;
 
-  if (!ares__hosts_expired(filename, channel->hf)) {
+  /* A watched file is only looked at again once it changed */
+  if (channel->hf != NULL &&
+      strcasecmp(channel->hf->filename, filename) == 0 &&
+      !ares__filewatch_hosts_stale(channel, filename)) {
     ares_free(filename);
     return ARES_SUCCESS;
   }
 
+  mod_ts = ares__hosts_mtime(filename);
+  if (!ares__hosts_expired(filename, mod_ts, channel->hf)) {
+    ares_free(filename);
+    return ARES_SUCCESS;
+  }
+
+  /* Another channel may already have parsed this version of the file.  The
+   * parse is done with the lock held so a change is only parsed once */
+  shared = ares__thread_global_lock();
+  if (shared) {
+    hf = ares__hosts_shared_find(filename);
+    if (hf != NULL && !ares__hosts_expired(filename, mod_ts, hf)) {
+      hf->refcnt++;
+    } else {
+      if (hf != NULL) {
+        ares__hosts_shared_remove(hf);
+      }
+      hf = NULL;
+    }
+  }
+
+  if (hf == NULL) {
+    status = ares__parse_hosts(filename, &hf);
+    if (shared && status == ARES_SUCCESS) {
+      hf->shared         = ARES_TRUE;
+      hf->next           = ares__hosts_shared;
+      ares__hosts_shared = hf;
+    }
+  }
+
+  if (shared)
+    ares__thread_global_unlock();
+
   ares__hosts_file_destroy(channel->hf);
-  channel->hf = NULL;
+  channel->hf = hf;
 
-  status = ares__parse_hosts(filename, &channel->hf);
   ares_free(filename);
   return status;
 }
@@ -47,13 +47,12 @@
 #include "ares.h"
 #include "ares_private.h"
 
-ares_status_t ares__parse_into_addrinfo(const unsigned char *abuf, size_t alen,
+ares_status_t ares__parse_into_addrinfo(const ares_dns_record_t *dnsrec,
                                         ares_bool_t    cname_only_is_enodata,
                                         unsigned short port,
                                         struct ares_addrinfo *ai)
 {
   ares_status_t               status;
-  ares_dns_record_t          *dnsrec = NULL;
   size_t                      i;
   size_t                      ancount;
   const char                 *hostname  = NULL;
@@ -63,11 +62,6 @@ ares_status_t ares__parse_into_addrinfo(const unsigned char *abuf, size_t alen,
   struct ares_addrinfo_cname *cnames    = NULL;
   struct ares_addrinfo_node  *nodes     = NULL;
 
-  status = ares_dns_parse(abuf, alen, 0, &dnsrec);
-  if (status != ARES_SUCCESS) {
-    goto done;
-  }
-
   /* Save question hostname */
   status = ares_dns_record_query_get(dnsrec, 0, &hostname, NULL, NULL);
   if (status != ARES_SUCCESS) {
@@ -84,7 +78,7 @@ ares_status_t ares__parse_into_addrinfo(const unsigned char *abuf, size_t alen,
     const char          *rname = NULL;
     ares_dns_rec_type_t  rtype;
     const ares_dns_rr_t *rr =
-      ares_dns_record_rr_get(dnsrec, ARES_SECTION_ANSWER, i);
+      ares_dns_record_rr_get_const(dnsrec, ARES_SECTION_ANSWER, i);
 
     if (ares_dns_rr_get_class(rr) != ARES_CLASS_IN) {
       continue;
@@ -173,7 +167,6 @@ ares_status_t ares__parse_into_addrinfo(const unsigned char *abuf, size_t alen,
 done:
   ares__freeaddrinfo_cnames(cnames);
   ares__freeaddrinfo_nodes(nodes);
-  ares_dns_record_destroy(dnsrec);
 
   /* compatibiltiy */
   if (status == ARES_EBADNAME) {
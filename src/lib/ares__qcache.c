@@ -0,0 +1,677 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ares_setup.h"
+
+#include "ares_nameser.h"
+
+#include "ares.h"
+#include "ares_dns.h"
+#include "ares_private.h"
+
+/* RFC 8767 Section 4: stale answers are handed out with a short TTL, and
+ * Section 5: once the servers have failed to refresh an answer, it is served
+ * for a while without asking them again */
+#define ARES_QCACHE_STALE_TTL     30
+#define ARES_QCACHE_STALE_RECHECK 30
+
+/* Responses are kept as the raw packet received from the server.  A cache
+ * hit hands out a copy with the query id of the new request and the TTLs
+ * reduced by the time the entry has spent in the cache.
+ *
+ * With serve-stale, positive answers are kept until stale_ts, past their
+ * expiry, for use when the servers can't be reached.  recheck_ts is the time
+ * until which a stale answer is served without asking the servers.
+ *
+ * With prefetch, the request is kept too, along with the number of hits.  An
+ * entry with enough hits is put on the prefetch list, ordered by the time at
+ * which it enters the last part of its TTL, and its request is handed out
+ * from there to be sent again. */
+typedef struct {
+  char               *key;
+  unsigned char      *abuf;
+  size_t              alen;
+  time_t              insert_ts;
+  time_t              expire_ts;
+  time_t              stale_ts;
+  time_t              recheck_ts;
+  ares__slist_node_t *node;
+  unsigned char      *qbuf;
+  size_t              qlen;
+  size_t              hits;
+  time_t              prefetch_ts;
+  ares__slist_node_t *prefetch_node;
+} ares__qcache_entry_t;
+
+struct ares__qcache {
+  ares__htable_strvp_t *cache;
+  ares__slist_t        *expire;
+  unsigned int          max_ttl;
+  unsigned int          stale_window;
+  ares__slist_t        *prefetch;
+  unsigned int          prefetch_pct;
+  unsigned int          prefetch_hits;
+};
+
+static int qcache_entry_cmp(const void *data1, const void *data2)
+{
+  const ares__qcache_entry_t *e1 = data1;
+  const ares__qcache_entry_t *e2 = data2;
+
+  if (e1->stale_ts < e2->stale_ts) {
+    return -1;
+  }
+  if (e1->stale_ts > e2->stale_ts) {
+    return 1;
+  }
+  return 0;
+}
+
+static int qcache_prefetch_cmp(const void *data1, const void *data2)
+{
+  const ares__qcache_entry_t *e1 = data1;
+  const ares__qcache_entry_t *e2 = data2;
+
+  if (e1->prefetch_ts < e2->prefetch_ts) {
+    return -1;
+  }
+  if (e1->prefetch_ts > e2->prefetch_ts) {
+    return 1;
+  }
+  return 0;
+}
+
+static void qcache_entry_free(void *arg)
+{
+  ares__qcache_entry_t *entry = arg;
+
+  if (entry == NULL) {
+    return;
+  }
+  ares_free(entry->key);
+  ares_free(entry->abuf);
+  ares_free(entry->qbuf);
+  ares_free(entry);
+}
+
+ares__qcache_t *ares__qcache_create(ares_rand_state *rand_state,
+                                    unsigned int     max_ttl,
+                                    unsigned int     stale_window,
+                                    unsigned int     prefetch_pct,
+                                    unsigned int     prefetch_hits)
+{
+  ares__qcache_t *cache = ares_malloc_zero(sizeof(*cache));
+
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->cache = ares__htable_strvp_create(NULL);
+  if (cache->cache == NULL) {
+    goto fail;
+  }
+
+  cache->expire =
+    ares__slist_create(rand_state, qcache_entry_cmp, qcache_entry_free);
+  if (cache->expire == NULL) {
+    goto fail;
+  }
+
+  if (prefetch_pct > 0) {
+    cache->prefetch =
+      ares__slist_create(rand_state, qcache_prefetch_cmp, NULL);
+    if (cache->prefetch == NULL) {
+      goto fail;
+    }
+  }
+
+  cache->max_ttl       = max_ttl;
+  cache->stale_window  = stale_window;
+  cache->prefetch_pct  = (prefetch_pct > 100) ? 100 : prefetch_pct;
+  cache->prefetch_hits = (prefetch_hits > 0) ? prefetch_hits : 1;
+  return cache;
+
+fail:
+  ares__qcache_destroy(cache);
+  return NULL;
+}
+
+void ares__qcache_destroy(ares__qcache_t *cache)
+{
+  if (cache == NULL) {
+    return;
+  }
+  ares__htable_strvp_destroy(cache->cache);
+  /* Entries are owned by the expire list, the prefetch list only refers to
+   * them */
+  ares__slist_destroy(cache->prefetch);
+  ares__slist_destroy(cache->expire);
+  ares_free(cache);
+}
+
+static void qcache_remove(ares__qcache_t *cache, ares__qcache_entry_t *entry)
+{
+  ares__htable_strvp_remove(cache->cache, entry->key);
+  ares__slist_node_destroy(entry->prefetch_node);
+  ares__slist_node_destroy(entry->node);
+}
+
+static void qcache_expire(ares__qcache_t *cache, const struct timeval *now)
+{
+  ares__qcache_entry_t *entry;
+
+  while ((entry = ares__slist_first_val(cache->expire)) != NULL &&
+         entry->stale_ts <= now->tv_sec) {
+    qcache_remove(cache, entry);
+  }
+}
+
+void ares__qcache_flush(ares__qcache_t *cache)
+{
+  ares__qcache_entry_t *entry;
+
+  if (cache == NULL) {
+    return;
+  }
+
+  while ((entry = ares__slist_first_val(cache->expire)) != NULL) {
+    qcache_remove(cache, entry);
+  }
+}
+
+size_t ares__qcache_len(const ares__qcache_t *cache)
+{
+  if (cache == NULL) {
+    return 0;
+  }
+  return ares__slist_len(cache->expire);
+}
+
+/* Only single-question queries are cached.  The key covers everything in the
+ * request that can change the answer: the question itself, whether
+ * recursion was desired, whether checking was disabled, whether EDNS was used
+ * and whether DNSSEC records were asked for.  It is worked out straight from
+ * the request so that a cache hit needn't set up a query at all. */
+char *ares__qcache_calc_key(const unsigned char *qbuf, size_t qlen)
+{
+  ares__buf_t   *buf;
+  char          *name = NULL;
+  char          *key  = NULL;
+  unsigned short qtype;
+  unsigned short qclass;
+  size_t         nrr;
+  size_t         i;
+  ares_bool_t    edns      = ARES_FALSE;
+  ares_bool_t    dnssec_ok = ARES_FALSE;
+  char           prefix[32];
+  size_t         plen;
+  size_t         nlen;
+
+  if (qlen < HFIXEDSZ || DNS_HEADER_QDCOUNT(qbuf) != 1) {
+    return NULL;
+  }
+
+  buf = ares__buf_create_const(qbuf, qlen);
+  if (buf == NULL) {
+    return NULL;
+  }
+
+  if (ares__buf_consume(buf, HFIXEDSZ) != ARES_SUCCESS ||
+      ares__buf_parse_dns_name(buf, &name, ARES_FALSE) != ARES_SUCCESS ||
+      ares__buf_fetch_be16(buf, &qtype) != ARES_SUCCESS ||
+      ares__buf_fetch_be16(buf, &qclass) != ARES_SUCCESS) {
+    goto done;
+  }
+
+  /* The DO bit lives in the flags carried in the OPT record's TTL field,
+   * RFC 3225 */
+  nrr = (size_t)DNS_HEADER_ANCOUNT(qbuf) + (size_t)DNS_HEADER_NSCOUNT(qbuf) +
+        (size_t)DNS_HEADER_ARCOUNT(qbuf);
+  for (i = 0; i < nrr; i++) {
+    char          *rname = NULL;
+    unsigned short rtype;
+    unsigned short rclass;
+    unsigned int   ttl;
+    unsigned short rdlen;
+
+    if (ares__buf_parse_dns_name(buf, &rname, ARES_FALSE) != ARES_SUCCESS) {
+      goto done;
+    }
+    ares_free(rname);
+    if (ares__buf_fetch_be16(buf, &rtype) != ARES_SUCCESS ||
+        ares__buf_fetch_be16(buf, &rclass) != ARES_SUCCESS ||
+        ares__buf_fetch_be32(buf, &ttl) != ARES_SUCCESS ||
+        ares__buf_fetch_be16(buf, &rdlen) != ARES_SUCCESS ||
+        ares__buf_consume(buf, rdlen) != ARES_SUCCESS) {
+      goto done;
+    }
+    if (rtype == T_OPT) {
+      edns      = ARES_TRUE;
+      dnssec_ok = (ttl & 0x8000) ? ARES_TRUE : ARES_FALSE;
+    }
+  }
+
+  for (i = 0; name[i] != 0; i++) {
+    name[i] = (char)TOLOWER(name[i]);
+  }
+
+  /* CD is the bit below AD in the fourth header byte */
+  snprintf(prefix, sizeof(prefix), "%d%d%d%d|%u|%u|",
+           DNS_HEADER_RD(qbuf) ? 1 : 0, (qbuf[3] & 0x10) ? 1 : 0,
+           edns ? 1 : 0, dnssec_ok ? 1 : 0, (unsigned int)qclass,
+           (unsigned int)qtype);
+  plen = ares_strlen(prefix);
+  nlen = ares_strlen(name);
+
+  key = ares_malloc(plen + nlen + 1);
+  if (key == NULL) {
+    goto done;
+  }
+  memcpy(key, prefix, plen);
+  memcpy(key + plen, name, nlen + 1);
+
+done:
+  ares_free(name);
+  ares__buf_destroy(buf);
+  return key;
+}
+
+/* RFC 2308 Section 5: negative answers are cached for the lesser of the SOA
+ * record's own TTL and its MINIMUM field.  Without an SOA there is nothing to
+ * say how long the answer is good for, so it isn't cached. */
+static ares_bool_t qcache_soa_ttl(const ares_dns_record_t *dnsrec,
+                                  unsigned int            *ttl)
+{
+  size_t i;
+  size_t cnt = ares_dns_record_rr_cnt(dnsrec, ARES_SECTION_AUTHORITY);
+
+  for (i = 0; i < cnt; i++) {
+    const ares_dns_rr_t *rr =
+      ares_dns_record_rr_get_const(dnsrec, ARES_SECTION_AUTHORITY, i);
+    unsigned int minimum;
+
+    if (ares_dns_rr_get_type(rr) != ARES_REC_TYPE_SOA) {
+      continue;
+    }
+
+    minimum = ares_dns_rr_get_u32(rr, ARES_RR_SOA_MINIMUM);
+    *ttl    = ares_dns_rr_get_ttl(rr);
+    if (minimum < *ttl) {
+      *ttl = minimum;
+    }
+    return ARES_TRUE;
+  }
+
+  return ARES_FALSE;
+}
+
+static ares_bool_t qcache_calc_ttl(const ares_dns_record_t *dnsrec,
+                                   unsigned int            *ttl)
+{
+  ares_dns_rcode_t rcode = ares_dns_record_get_rcode(dnsrec);
+  size_t           cnt;
+  size_t           i;
+
+  if (ares_dns_record_get_flags(dnsrec) & ARES_FLAG_TC) {
+    return ARES_FALSE;
+  }
+
+  if (rcode == ARES_RCODE_NAME_ERROR) {
+    return qcache_soa_ttl(dnsrec, ttl);
+  }
+
+  if (rcode != ARES_RCODE_NOERROR) {
+    return ARES_FALSE;
+  }
+
+  cnt = ares_dns_record_rr_cnt(dnsrec, ARES_SECTION_ANSWER);
+  if (cnt == 0) {
+    /* NODATA */
+    return qcache_soa_ttl(dnsrec, ttl);
+  }
+
+  /* The answer is only good for as long as its shortest lived record */
+  for (i = 0; i < cnt; i++) {
+    const ares_dns_rr_t *rr =
+      ares_dns_record_rr_get_const(dnsrec, ARES_SECTION_ANSWER, i);
+    unsigned int rr_ttl = ares_dns_rr_get_ttl(rr);
+
+    if (i == 0 || rr_ttl < *ttl) {
+      *ttl = rr_ttl;
+    }
+  }
+
+  return ARES_TRUE;
+}
+
+ares_status_t ares__qcache_insert(ares__qcache_t          *cache,
+                                  const struct timeval    *now,
+                                  const struct query      *query,
+                                  const unsigned char     *abuf,
+                                  size_t                   alen,
+                                  const ares_dns_record_t *dnsrec)
+{
+  ares__qcache_entry_t *entry;
+  ares__qcache_entry_t *old;
+  unsigned int          ttl   = 0;
+  unsigned int          stale = 0;
+
+  if (cache == NULL || query->key == NULL) {
+    return ARES_SUCCESS;
+  }
+
+  qcache_expire(cache, now);
+
+  if (!qcache_calc_ttl(dnsrec, &ttl)) {
+    return ARES_SUCCESS;
+  }
+
+  if (ttl > cache->max_ttl) {
+    ttl = cache->max_ttl;
+  }
+
+  /* Only positive answers are worth serving stale */
+  if (ares_dns_record_get_rcode(dnsrec) == ARES_RCODE_NOERROR &&
+      ares_dns_record_rr_cnt(dnsrec, ARES_SECTION_ANSWER) > 0) {
+    stale = cache->stale_window;
+  }
+
+  if (ttl == 0 && stale == 0) {
+    return ARES_SUCCESS;
+  }
+
+  entry = ares_malloc_zero(sizeof(*entry));
+  if (entry == NULL) {
+    goto fail;
+  }
+
+  entry->key = ares_strdup(query->key);
+  if (entry->key == NULL) {
+    goto fail;
+  }
+
+  entry->abuf = ares_malloc(alen);
+  if (entry->abuf == NULL) {
+    goto fail;
+  }
+  memcpy(entry->abuf, abuf, alen);
+  entry->alen      = alen;
+  entry->insert_ts = now->tv_sec;
+  entry->expire_ts = now->tv_sec + (time_t)ttl;
+  entry->stale_ts  = entry->expire_ts + (time_t)stale;
+
+  /* Keep the request to send again should the answer become popular, unless
+   * it expires too soon for that to be of any use */
+  if (cache->prefetch != NULL && ttl * cache->prefetch_pct / 100 > 0) {
+    entry->prefetch_ts =
+      entry->expire_ts - (time_t)(ttl * cache->prefetch_pct / 100);
+    entry->qbuf = ares_malloc(query->qlen);
+    if (entry->qbuf == NULL) {
+      goto fail;
+    }
+    memcpy(entry->qbuf, query->qbuf, query->qlen);
+    entry->qlen = query->qlen;
+  }
+
+  /* A newer answer for the same question replaces the old one */
+  old = ares__htable_strvp_get_direct(cache->cache, entry->key);
+  if (old != NULL) {
+    qcache_remove(cache, old);
+  }
+
+  entry->node = ares__slist_insert(cache->expire, entry);
+  if (entry->node == NULL) {
+    goto fail;
+  }
+
+  if (!ares__htable_strvp_insert(cache->cache, entry->key, entry)) {
+    /* Destroying the node frees the entry */
+    ares__slist_node_destroy(entry->node);
+    return ARES_ENOMEM;
+  }
+
+  return ARES_SUCCESS;
+
+fail:
+  qcache_entry_free(entry);
+  return ARES_ENOMEM;
+}
+
+/* Skip over a possibly compressed name */
+static ares_bool_t qcache_skip_name(const unsigned char *abuf, size_t alen,
+                                    size_t *pos)
+{
+  while (*pos < alen) {
+    unsigned char c = abuf[*pos];
+
+    if ((c & 0xC0) == 0xC0) {
+      *pos += 2;
+      return (*pos <= alen) ? ARES_TRUE : ARES_FALSE;
+    }
+    if (c & 0xC0) {
+      return ARES_FALSE;
+    }
+    *pos += (size_t)c + 1;
+    if (c == 0) {
+      return ARES_TRUE;
+    }
+  }
+  return ARES_FALSE;
+}
+
+/* Reduce every TTL in the packet by the given amount, or set them all to
+ * ARES_QCACHE_STALE_TTL for a stale answer, leaving OPT records (whose TTL
+ * field holds flags) alone. */
+static ares_bool_t qcache_age_ttls(unsigned char *abuf, size_t alen,
+                                   unsigned int elapsed, ares_bool_t stale)
+{
+  size_t pos = HFIXEDSZ;
+  size_t cnt;
+  size_t i;
+
+  cnt = DNS_HEADER_QDCOUNT(abuf);
+  for (i = 0; i < cnt; i++) {
+    if (!qcache_skip_name(abuf, alen, &pos) || pos + QFIXEDSZ > alen) {
+      return ARES_FALSE;
+    }
+    pos += QFIXEDSZ;
+  }
+
+  cnt = (size_t)DNS_HEADER_ANCOUNT(abuf) + (size_t)DNS_HEADER_NSCOUNT(abuf) +
+        (size_t)DNS_HEADER_ARCOUNT(abuf);
+  for (i = 0; i < cnt; i++) {
+    unsigned int ttl;
+
+    if (!qcache_skip_name(abuf, alen, &pos) || pos + RRFIXEDSZ > alen) {
+      return ARES_FALSE;
+    }
+
+    if (DNS_RR_TYPE(abuf + pos) != T_OPT) {
+      ttl = DNS_RR_TTL(abuf + pos);
+      ttl = (ttl > elapsed) ? ttl - elapsed : 0;
+      if (stale) {
+        ttl = ARES_QCACHE_STALE_TTL;
+      }
+      DNS__SET32BIT(abuf + pos + 4, ttl);
+    }
+
+    pos += RRFIXEDSZ + DNS_RR_LEN(abuf + pos);
+  }
+
+  return ARES_TRUE;
+}
+
+static ares__qcache_entry_t *qcache_lookup(ares__qcache_t       *cache,
+                                           const struct timeval *now,
+                                           const char           *key)
+{
+  if (cache == NULL || key == NULL) {
+    return NULL;
+  }
+
+  qcache_expire(cache, now);
+  return ares__htable_strvp_get_direct(cache->cache, key);
+}
+
+/* Hand out a copy of the entry rewritten for the given query */
+static ares_status_t qcache_copy(ares__qcache_t       *cache,
+                                 ares__qcache_entry_t *entry,
+                                 const struct timeval *now,
+                                 unsigned short qid, ares_bool_t parse,
+                                 unsigned char **abuf_out, size_t *alen_out,
+                                 ares_dns_record_t **dnsrec_out)
+{
+  unsigned char *abuf;
+  ares_status_t  status;
+
+  abuf = ares_malloc(entry->alen);
+  if (abuf == NULL) {
+    return ARES_ENOMEM;
+  }
+  memcpy(abuf, entry->abuf, entry->alen);
+  DNS_HEADER_SET_QID(abuf, qid);
+  if (!qcache_age_ttls(abuf, entry->alen,
+                       (unsigned int)(now->tv_sec - entry->insert_ts),
+                       entry->expire_ts <= now->tv_sec)) {
+    /* Can't happen, the packet was parsed before it was inserted */
+    ares_free(abuf);
+    qcache_remove(cache, entry);
+    return ARES_ENOTFOUND;
+  }
+
+  *dnsrec_out = NULL;
+  if (parse) {
+    status = ares_dns_parse(abuf, entry->alen, 0, dnsrec_out);
+    if (status != ARES_SUCCESS) {
+      ares_free(abuf);
+      return status;
+    }
+  }
+
+  *abuf_out = abuf;
+  *alen_out = entry->alen;
+  return ARES_SUCCESS;
+}
+
+ares_status_t ares__qcache_fetch(ares__qcache_t       *cache,
+                                 const struct timeval *now, const char *key,
+                                 unsigned short qid, ares_bool_t parse,
+                                 unsigned char **abuf_out, size_t *alen_out,
+                                 ares_dns_record_t **dnsrec_out)
+{
+  ares__qcache_entry_t *entry = qcache_lookup(cache, now, key);
+
+  if (entry == NULL || (entry->expire_ts <= now->tv_sec &&
+                        entry->recheck_ts <= now->tv_sec)) {
+    return ARES_ENOTFOUND;
+  }
+
+  /* Schedule popular answers for prefetch.  Best effort, on failure the
+   * answer simply expires as usual. */
+  entry->hits++;
+  if (entry->qbuf != NULL && entry->prefetch_node == NULL &&
+      entry->hits >= cache->prefetch_hits) {
+    entry->prefetch_node = ares__slist_insert(cache->prefetch, entry);
+  }
+
+  return qcache_copy(cache, entry, now, qid, parse, abuf_out, alen_out,
+                     dnsrec_out);
+}
+
+ares_bool_t ares__qcache_has_stale(ares__qcache_t       *cache,
+                                   const struct timeval *now,
+                                   const struct query   *query)
+{
+  return qcache_lookup(cache, now, query->key) != NULL
+           ? ARES_TRUE
+           : ARES_FALSE;
+}
+
+ares_status_t ares__qcache_fetch_stale(ares__qcache_t       *cache,
+                                       const struct timeval *now,
+                                       const struct query   *query,
+                                       unsigned char **abuf_out,
+                                       size_t *alen_out,
+                                       ares_dns_record_t **dnsrec_out)
+{
+  ares__qcache_entry_t *entry = qcache_lookup(cache, now, query->key);
+
+  if (entry == NULL) {
+    return ARES_ENOTFOUND;
+  }
+
+  entry->recheck_ts = now->tv_sec + ARES_QCACHE_STALE_RECHECK;
+
+  return qcache_copy(cache, entry, now, query->qid, ARES_TRUE, abuf_out,
+                     alen_out, dnsrec_out);
+}
+
+ares_bool_t ares__qcache_prefetch_next(const ares__qcache_t *cache,
+                                       struct timeval       *tv)
+{
+  const ares__qcache_entry_t *entry;
+
+  if (cache == NULL) {
+    return ARES_FALSE;
+  }
+
+  entry = ares__slist_first_val(cache->prefetch);
+  if (entry == NULL) {
+    return ARES_FALSE;
+  }
+
+  tv->tv_sec  = entry->prefetch_ts;
+  tv->tv_usec = 0;
+  return ARES_TRUE;
+}
+
+unsigned char *ares__qcache_prefetch_due(ares__qcache_t       *cache,
+                                         const struct timeval *now,
+                                         size_t               *qlen)
+{
+  ares__qcache_entry_t *entry;
+  unsigned char        *qbuf;
+
+  if (cache == NULL || cache->prefetch == NULL) {
+    return NULL;
+  }
+
+  qcache_expire(cache, now);
+
+  entry = ares__slist_first_val(cache->prefetch);
+  if (entry == NULL || entry->prefetch_ts > now->tv_sec) {
+    return NULL;
+  }
+
+  /* Without its request the entry won't be scheduled again */
+  ares__slist_node_destroy(entry->prefetch_node);
+  entry->prefetch_node = NULL;
+  qbuf                 = entry->qbuf;
+  *qlen                = entry->qlen;
+  entry->qbuf          = NULL;
+  entry->qlen          = 0;
+  return qbuf;
+}
@@ -0,0 +1,175 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ares_setup.h"
+
+#include "ares_nameser.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* Each query is a single block laid out as:
+ *
+ *   struct query | struct query_server_info[pool_nservers] | questions | tcpbuf
+ *
+ * where the trailing ARES_QUERY_POOL_BUFSZ bytes hold ARES_QUERY_POOL_QSZ
+ * for the parsed questions, enough for a single question, and a tcpbuf
+ * enough for any query that fits in a plain UDP packet.  Larger queries get
+ * a separately allocated tcpbuf or questions, and queries moved over to more
+ * servers than the block was carved for a separately allocated server_info.
+ * Released blocks are kept on a per-channel free list so the steady state
+ * performs no allocations for the query itself. */
+
+static size_t query_block_size(size_t nservers)
+{
+  return sizeof(struct query) + nservers * sizeof(struct query_server_info) +
+         ARES_QUERY_POOL_BUFSZ;
+}
+
+/* server_info as carved out of the query's own block */
+static struct query_server_info *query_inline_info(struct query *query)
+{
+  return (struct query_server_info *)((void *)(query + 1));
+}
+
+struct query *ares__query_alloc(ares_channel channel, size_t qlen)
+{
+  struct query *query    = NULL;
+  size_t        nservers = channel->nservers;
+
+  /* Blocks carved for fewer servers than the channel now has can't be
+   * reused, drop them as they are encountered */
+  while (channel->query_pool != NULL) {
+    query               = channel->query_pool;
+    channel->query_pool = query->pool_next;
+    channel->query_pool_len--;
+    if (query->pool_nservers >= channel->nservers) {
+      nservers = query->pool_nservers;
+      break;
+    }
+    ares_free(query);
+    query = NULL;
+  }
+
+  if (query == NULL) {
+    query = ares_malloc(query_block_size(nservers));
+    if (query == NULL) {
+      return NULL;
+    }
+  }
+
+  memset(query, 0, sizeof(*query));
+  query->channel       = channel;
+  query->pool_nservers = nservers;
+  query->server_info   = query_inline_info(query);
+
+  if (qlen + 2 <= ARES_QUERY_POOL_BUFSZ - ARES_QUERY_POOL_QSZ) {
+    query->tcpbuf = (unsigned char *)(query->server_info + nservers) +
+                    ARES_QUERY_POOL_QSZ;
+    query->tcpbuf_inline = ARES_TRUE;
+  } else {
+    query->tcpbuf = ares_malloc(qlen + 2);
+    if (query->tcpbuf == NULL) {
+      ares_free(query);
+      return NULL;
+    }
+  }
+
+  return query;
+}
+
+struct query_question *ares__query_alloc_questions(struct query *query,
+                                                   size_t        len)
+{
+  if (len > ARES_QUERY_POOL_QSZ) {
+    return ares_malloc(len);
+  }
+
+  /* Right after the server_info the block was carved for, which server_info
+   * may since have moved out of */
+  query->questions_inline = ARES_TRUE;
+  return (struct query_question *)((void *)(query_inline_info(query) +
+                                            query->pool_nservers));
+}
+
+ares_status_t ares__query_reset_servers(struct query *query)
+{
+  struct query_server_info *info     = query_inline_info(query);
+  size_t                    nservers = query->channel->nservers;
+
+  /* More servers than the block was carved for go on the heap */
+  if (nservers > query->pool_nservers) {
+    info = ares_malloc(nservers * sizeof(*info));
+    if (info == NULL) {
+      return ARES_ENOMEM;
+    }
+  }
+
+  if (query->server_info != query_inline_info(query)) {
+    ares_free(query->server_info);
+  }
+  query->server_info = info;
+  memset(info, 0, nservers * sizeof(*info));
+  return ARES_SUCCESS;
+}
+
+void ares__query_release(struct query *query)
+{
+  ares_channel channel = query->channel;
+
+  if (!query->tcpbuf_inline) {
+    ares_free(query->tcpbuf);
+  }
+  if (query->server_info != query_inline_info(query)) {
+    ares_free(query->server_info);
+  }
+  if (!query->questions_inline) {
+    ares_free(query->questions);
+  }
+  query->tcpbuf      = NULL;
+  query->server_info = NULL;
+  query->questions   = NULL;
+
+  if (channel->query_pool_len >= ARES_QUERY_POOL_MAX ||
+      query->pool_nservers < channel->nservers) {
+    ares_free(query);
+    return;
+  }
+
+  query->pool_next    = channel->query_pool;
+  channel->query_pool = query;
+  channel->query_pool_len++;
+}
+
+void ares__query_pool_destroy(ares_channel channel)
+{
+  while (channel->query_pool != NULL) {
+    struct query *query = channel->query_pool;
+    channel->query_pool = query->pool_next;
+    ares_free(query);
+  }
+  channel->query_pool_len = 0;
+}
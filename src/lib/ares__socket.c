@@ -24,7 +24,13 @@
  *
  * SPDX-License-Identifier: MIT
  */
- #include "ares_setup.h"
+
+/* recvmmsg() and sendmmsg() are only declared with _GNU_SOURCE */
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include "ares_setup.h"
 
 #ifdef HAVE_SYS_UIO_H
 #  include <sys/uio.h>
@@ -64,6 +70,10 @@ ares_ssize_t ares__socket_recvfrom(ares_channel channel, ares_socket_t s,
                                    struct sockaddr *from,
                                    ares_socklen_t  *from_len)
 {
+  if (ares__uring_has(channel, s)) {
+    return ares__uring_recv(channel, s, data, data_len, from, from_len);
+  }
+
   if (channel->sock_funcs && channel->sock_funcs->arecvfrom) {
     return channel->sock_funcs->arecvfrom(s, data, data_len, flags, from,
                                           from_len, channel->sock_func_cb_data);
@@ -76,9 +86,89 @@ ares_ssize_t ares__socket_recvfrom(ares_channel channel, ares_socket_t s,
 #endif
 }
 
+ares_ssize_t ares__socket_recvmulti(ares_channel channel, ares_socket_t s,
+                                    struct ares_socket_msg *msgs, size_t cnt)
+{
+  ares_ssize_t rv;
+
+  if (cnt == 0) {
+    return 0;
+  }
+
+  if (ares__uring_has(channel, s)) {
+    /* Already received by the ring, just hand out what is queued */
+    size_t i;
+
+    for (i = 0; i < cnt; i++) {
+      rv = ares__uring_recv(channel, s, msgs[i].data, msgs[i].data_len,
+                            msgs[i].from, &msgs[i].from_len);
+      if (rv < 0) {
+        break;
+      }
+      msgs[i].data_len = (size_t)rv;
+    }
+    return (i == 0) ? -1 : (ares_ssize_t)i;
+  }
+
+  if (channel->sock_batch_funcs && channel->sock_batch_funcs->arecvmulti) {
+    return channel->sock_batch_funcs->arecvmulti(
+      s, msgs, cnt, channel->sock_batch_func_cb_data);
+  }
+
+#ifdef HAVE_RECVMMSG
+  /* Custom socket functions without a batched variant must still see every
+   * read, so only go to the kernel directly when none are set */
+  if (channel->sock_funcs == NULL || channel->sock_funcs->arecvfrom == NULL) {
+    struct mmsghdr mmsgs[ARES_UDP_BATCH_MAX];
+    struct iovec   iovs[ARES_UDP_BATCH_MAX];
+    size_t         i;
+
+    if (cnt > ARES_UDP_BATCH_MAX) {
+      cnt = ARES_UDP_BATCH_MAX;
+    }
+
+    memset(mmsgs, 0, sizeof(mmsgs));
+    for (i = 0; i < cnt; i++) {
+      iovs[i].iov_base             = msgs[i].data;
+      iovs[i].iov_len              = msgs[i].data_len;
+      mmsgs[i].msg_hdr.msg_iov     = &iovs[i];
+      mmsgs[i].msg_hdr.msg_iovlen  = 1;
+      mmsgs[i].msg_hdr.msg_name    = msgs[i].from;
+      mmsgs[i].msg_hdr.msg_namelen = msgs[i].from_len;
+    }
+
+    /* The socket is non-blocking, so this returns whatever is queued */
+    rv = recvmmsg(s, mmsgs, (unsigned int)cnt, 0, NULL);
+    if (rv > 0) {
+      for (i = 0; i < (size_t)rv; i++) {
+        msgs[i].data_len = mmsgs[i].msg_len;
+        msgs[i].from_len = mmsgs[i].msg_hdr.msg_namelen;
+      }
+      return rv;
+    }
+    if (rv < 0 && SOCKERRNO != ENOSYS) {
+      return rv;
+    }
+    /* Kernel without recvmmsg(), fall through to a single read */
+  }
+#endif
+
+  rv = ares__socket_recvfrom(channel, s, msgs[0].data, msgs[0].data_len, 0,
+                             msgs[0].from, &msgs[0].from_len);
+  if (rv < 0) {
+    return rv;
+  }
+  msgs[0].data_len = (size_t)rv;
+  return 1;
+}
+
 ares_ssize_t ares__socket_recv(ares_channel channel, ares_socket_t s,
                                void *data, size_t data_len)
 {
+  if (ares__uring_has(channel, s)) {
+    return ares__uring_recv(channel, s, data, data_len, NULL, NULL);
+  }
+
   if (channel->sock_funcs && channel->sock_funcs->arecvfrom) {
     return channel->sock_funcs->arecvfrom(s, data, data_len, 0, 0, 0,
                                           channel->sock_func_cb_data);
@@ -249,6 +339,7 @@ ares_status_t ares__open_connection(ares_channel         channel,
   struct server_connection *conn;
   ares__llist_node_t       *node;
   int                       type = is_tcp ? SOCK_STREAM : SOCK_DGRAM;
+  ares_status_t             status;
 
   if (is_tcp) {
     port = server->addr.tcp_port ? server->addr.tcp_port : channel->tcp_port;
@@ -377,7 +468,18 @@ ares_status_t ares__open_connection(ares_channel         channel,
     return ARES_ENOMEM;
   }
 
-  SOCK_STATE_CALLBACK(channel, s, 1, 0);
+  /* Hand the socket over to the io_uring transport, if enabled */
+  status = ares__uring_add(channel, conn);
+  if (status != ARES_SUCCESS) {
+    ares__htable_asvp_remove(channel->connnode_by_socket, s);
+    ares__close_socket(channel, s);
+    ares__llist_destroy(conn->queries_to_conn);
+    ares__llist_node_claim(node);
+    ares_free(conn);
+    return status;
+  }
+
+  ares__conn_sock_state(conn, ARES_SOCK_READ);
 
   if (is_tcp) {
     server->tcp_connection_generation = ++channel->tcp_connection_generation;
@@ -411,6 +513,8 @@ int ares__connect_socket(ares_channel channel, ares_socket_t sockfd,
 
 void ares__close_socket(ares_channel channel, ares_socket_t s)
 {
+  ares__uring_remove(channel, s);
+
   if (channel->sock_funcs && channel->sock_funcs->aclose) {
     channel->sock_funcs->aclose(s, channel->sock_func_cb_data);
   } else {
@@ -429,6 +533,10 @@ struct iovec {
 ares_ssize_t ares__socket_write(ares_channel channel, ares_socket_t s,
                                 const void *data, size_t len)
 {
+  if (ares__uring_has(channel, s)) {
+    return ares__uring_send(channel, s, data, len);
+  }
+
   if (channel->sock_funcs && channel->sock_funcs->asendv) {
     struct iovec vec;
     vec.iov_base = (void *)data;
@@ -438,26 +546,145 @@ ares_ssize_t ares__socket_write(ares_channel channel, ares_socket_t s,
   return swrite(s, data, len);
 }
 
+ares_ssize_t ares__socket_sendmulti(ares_channel channel, ares_socket_t s,
+                                    const struct ares_socket_msg *msgs,
+                                    size_t                        cnt)
+{
+  size_t i;
+
+  if (cnt == 0) {
+    return 0;
+  }
+
+  /* The ring batches submissions by itself, so it only needs each datagram
+   * queued */
+  if (ares__uring_has(channel, s)) {
+    goto one_by_one;
+  }
+
+  if (channel->sock_batch_funcs && channel->sock_batch_funcs->asendmulti) {
+    return channel->sock_batch_funcs->asendmulti(
+      s, msgs, cnt, channel->sock_batch_func_cb_data);
+  }
+
+#ifdef HAVE_SENDMMSG
+  /* As with receiving, custom socket functions must see every write */
+  if (channel->sock_funcs == NULL || channel->sock_funcs->asendv == NULL) {
+    struct mmsghdr mmsgs[ARES_UDP_BATCH_MAX];
+    struct iovec   iovs[ARES_UDP_BATCH_MAX];
+    int            rv;
+
+    if (cnt > ARES_UDP_BATCH_MAX) {
+      cnt = ARES_UDP_BATCH_MAX;
+    }
+
+    memset(mmsgs, 0, sizeof(mmsgs));
+    for (i = 0; i < cnt; i++) {
+      iovs[i].iov_base            = msgs[i].data;
+      iovs[i].iov_len             = msgs[i].data_len;
+      mmsgs[i].msg_hdr.msg_iov    = &iovs[i];
+      mmsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    rv = sendmmsg(s, mmsgs, (unsigned int)cnt, 0);
+    if (rv >= 0 || SOCKERRNO != ENOSYS) {
+      return rv;
+    }
+    /* Kernel without sendmmsg(), fall through to one write per datagram */
+  }
+#endif
+
+one_by_one:
+  for (i = 0; i < cnt; i++) {
+    if (ares__socket_write(channel, s, msgs[i].data, msgs[i].data_len) == -1) {
+      break;
+    }
+  }
+
+  return (i == 0) ? -1 : (ares_ssize_t)i;
+}
+
+void ares__conn_sock_state(struct server_connection *conn, int events)
+{
+  ares_channel channel    = conn->server->channel;
+  int          old_events = conn->sock_state;
+  int          readable   = (events & ARES_SOCK_READ) ? 1 : 0;
+  int          writable   = (events & ARES_SOCK_WRITE) ? 1 : 0;
+
+  if (events == old_events) {
+    return;
+  }
+
+  conn->sock_state = events;
+  channel->sock_generation++;
+
+  /* Sockets owned by the io_uring transport are waited on through the ring
+   * descriptor, which reports its own state */
+  if (ares__uring_has(channel, conn->fd)) {
+    ares__uring_conn_state(channel, conn->fd, events);
+    return;
+  }
+
+  if (channel->event) {
+    (void)ares__event_update(channel, conn->fd, readable, writable);
+  }
+
+  if (channel->sock_state_cb) {
+    channel->sock_state_cb(channel->sock_state_cb_data, conn->fd, readable,
+                           writable);
+  }
+
+  if (channel->sock_change_cb) {
+    channel->sock_change_cb(channel->sock_change_cb_data, conn->fd, old_events,
+                            events);
+  }
+}
+
 void ares_set_socket_callback(ares_channel              channel,
                               ares_sock_create_callback cb, void *data)
 {
+  ares__channel_lock(channel);
   channel->sock_create_cb      = cb;
   channel->sock_create_cb_data = data;
+  ares__channel_unlock(channel);
 }
 
 void ares_set_socket_configure_callback(ares_channel              channel,
                                         ares_sock_config_callback cb,
                                         void                     *data)
 {
+  ares__channel_lock(channel);
   channel->sock_config_cb      = cb;
   channel->sock_config_cb_data = data;
+  ares__channel_unlock(channel);
+}
+
+void ares_set_sock_change_callback(ares_channel              channel,
+                                   ares_sock_change_callback cb, void *data)
+{
+  ares__channel_lock(channel);
+  channel->sock_change_cb      = cb;
+  channel->sock_change_cb_data = data;
+  ares__channel_unlock(channel);
 }
 
 void ares_set_socket_functions(ares_channel                        channel,
                                const struct ares_socket_functions *funcs,
                                void                               *data)
 {
+  ares__channel_lock(channel);
   channel->sock_funcs        = funcs;
   channel->sock_func_cb_data = data;
+  ares__channel_unlock(channel);
+}
+
+void ares_set_socket_batch_functions(
+  ares_channel channel, const struct ares_socket_batch_functions *funcs,
+  void *data)
+{
+  ares__channel_lock(channel);
+  channel->sock_batch_funcs        = funcs;
+  channel->sock_batch_func_cb_data = data;
+  ares__channel_unlock(channel);
 }
 
@@ -0,0 +1,510 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+#include <fcntl.h>
+
+#include "ares.h"
+#include "ares_nameser.h"
+#include "ares_private.h"
+
+#if defined(CARES_THREADS) && !defined(_WIN32) && \
+  (defined(__GNUC__) || defined(__clang__))
+#  define USE_SUBMITQ 1
+#endif
+
+#ifdef USE_SUBMITQ
+
+/* Cross-thread submission queue.
+ *
+ * Requests from other threads are linked onto an intrusive multi-producer,
+ * single-consumer queue: producers only swap the tail pointer, the thread
+ * processing the channel owns the head.  The processing thread is woken
+ * through an eventfd (or a pipe) which is reported along with the server
+ * sockets.  Only the producer which finds no wake up outstanding writes to
+ * it, so a burst of submissions costs a single system call.
+ */
+
+#  define ARES_SUBMITQ_BATCH 64
+
+typedef enum {
+  ARES__SUBMIT_SEND,
+  ARES__SUBMIT_GETADDRINFO
+} ares__submit_type_t;
+
+typedef struct ares__submit {
+  struct ares__submit       *next;
+  ares__submit_type_t        type;
+  void                      *arg;
+
+  /* ARES__SUBMIT_SEND */
+  unsigned char             *qbuf;
+  size_t                     qlen;
+  ares_callback              callback;
+
+  /* ARES__SUBMIT_GETADDRINFO */
+  char                      *name;
+  char                      *service;
+  struct ares_addrinfo_hints hints;
+  ares_bool_t                has_hints;
+  ares_addrinfo_callback     ai_callback;
+} ares__submit_t;
+
+struct ares__submitq {
+  /* Owned by the processing thread */
+  ares__submit_t *head;
+  /* Swapped by producers */
+  ares__submit_t *tail;
+  /* Keeps the queue non-empty so producers never touch the head */
+  ares__submit_t  stub;
+  /* Set while a wake up has been written but not yet consumed */
+  int             wake_pending;
+  /* Read and write ends, the same eventfd twice if available */
+  int             fds[2];
+};
+
+static void submitq_push(ares__submitq_t *q, ares__submit_t *s)
+{
+  ares__submit_t *prev;
+
+  __atomic_store_n(&s->next, NULL, __ATOMIC_SEQ_CST);
+  prev = __atomic_exchange_n(&q->tail, s, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&prev->next, s, __ATOMIC_SEQ_CST);
+}
+
+/* Returns NULL when empty, or when a producer is between swapping the tail
+ * and linking its entry, in which case it will wake the consumer again. */
+static ares__submit_t *submitq_pop(ares__submitq_t *q)
+{
+  ares__submit_t *head = q->head;
+  ares__submit_t *next = __atomic_load_n(&head->next, __ATOMIC_SEQ_CST);
+
+  if (head == &q->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    q->head = next;
+    head    = next;
+    next    = __atomic_load_n(&head->next, __ATOMIC_SEQ_CST);
+  }
+
+  if (next != NULL) {
+    q->head = next;
+    return head;
+  }
+
+  if (head != __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST)) {
+    return NULL;
+  }
+
+  /* head is the last entry, put the stub behind it so it can be unlinked */
+  submitq_push(q, &q->stub);
+  next = __atomic_load_n(&head->next, __ATOMIC_SEQ_CST);
+  if (next != NULL) {
+    q->head = next;
+    return head;
+  }
+
+  return NULL;
+}
+
+static void submitq_wake(ares__submitq_t *q)
+{
+  int expected = 0;
+
+  if (!__atomic_compare_exchange_n(&q->wake_pending, &expected, 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+
+#  ifdef HAVE_SYS_EVENTFD_H
+  (void)eventfd_write(q->fds[1], 1);
+#  else
+  {
+    unsigned char one = 1;
+    ssize_t       rv  = write(q->fds[1], &one, sizeof(one));
+    (void)rv;
+  }
+#  endif
+}
+
+static void submitq_wake_consume(ares__submitq_t *q)
+{
+#  ifdef HAVE_SYS_EVENTFD_H
+  eventfd_t cnt;
+  (void)eventfd_read(q->fds[0], &cnt);
+#  else
+  unsigned char buf[64];
+  while (read(q->fds[0], buf, sizeof(buf)) > 0)
+    ;
+#  endif
+
+  /* Anything pushed before this is seen by the pops that follow, anything
+   * after gets a fresh wake up */
+  __atomic_store_n(&q->wake_pending, 0, __ATOMIC_SEQ_CST);
+}
+
+static void submit_free(ares__submit_t *s)
+{
+  ares_free(s->qbuf);
+  ares_free(s->name);
+  ares_free(s->service);
+  ares_free(s);
+}
+
+static void submit_run(ares_channel channel, ares__submit_t *s)
+{
+  if (s->type == ARES__SUBMIT_SEND) {
+    ares_send_ex(channel, s->qbuf, s->qlen, s->callback, s->arg);
+  } else {
+    ares_getaddrinfo(channel, s->name, s->service,
+                     s->has_hints ? &s->hints : NULL, s->ai_callback, s->arg);
+  }
+  submit_free(s);
+}
+
+static void submit_fail(ares__submit_t *s, ares_status_t status)
+{
+  if (s->type == ARES__SUBMIT_SEND) {
+    s->callback(s->arg, (int)status, 0, NULL, 0);
+  } else {
+    s->ai_callback(s->arg, (int)status, 0, NULL);
+  }
+  submit_free(s);
+}
+
+#  ifndef HAVE_SYS_EVENTFD_H
+static int submitq_set_nonblock(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    return -1;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+#  endif
+
+ares_status_t ares__submitq_create(ares_channel channel)
+{
+  ares__submitq_t *q;
+
+  if (channel->submitq != NULL) {
+    return ARES_SUCCESS;
+  }
+
+  q = ares_malloc_zero(sizeof(*q));
+  if (q == NULL) {
+    return ARES_ENOMEM;
+  }
+
+  q->head = &q->stub;
+  q->tail = &q->stub;
+
+#  ifdef HAVE_SYS_EVENTFD_H
+  q->fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  q->fds[1] = q->fds[0];
+  if (q->fds[0] == -1) {
+    ares_free(q);
+    return ARES_ENOMEM;
+  }
+#  else
+  if (pipe(q->fds) != 0) {
+    ares_free(q);
+    return ARES_ENOMEM;
+  }
+  if (submitq_set_nonblock(q->fds[0]) != 0 ||
+      submitq_set_nonblock(q->fds[1]) != 0) {
+    close(q->fds[0]);
+    close(q->fds[1]);
+    ares_free(q);
+    return ARES_ENOMEM;
+  }
+#  endif
+
+  if (ares__uring_watch(channel, q->fds[0]) != ARES_SUCCESS) {
+    close(q->fds[0]);
+    if (q->fds[1] != q->fds[0]) {
+      close(q->fds[1]);
+    }
+    ares_free(q);
+    return ARES_ENOMEM;
+  }
+
+  channel->submitq = q;
+  channel->sock_generation++;
+
+  if (channel->sock_state_cb) {
+    channel->sock_state_cb(channel->sock_state_cb_data, q->fds[0], 1, 0);
+  }
+
+  return ARES_SUCCESS;
+}
+
+void ares__submitq_destroy(ares_channel channel)
+{
+  ares__submitq_t *q = channel->submitq;
+  ares__submit_t  *s;
+
+  if (q == NULL) {
+    return;
+  }
+
+  /* Failing a request may submit another, keep going until none are left */
+  while ((s = submitq_pop(q)) != NULL) {
+    submit_fail(s, ARES_EDESTRUCTION);
+  }
+
+  if (channel->sock_state_cb) {
+    channel->sock_state_cb(channel->sock_state_cb_data, q->fds[0], 0, 0);
+  }
+
+  ares__uring_unwatch(channel, q->fds[0]);
+  close(q->fds[0]);
+  if (q->fds[1] != q->fds[0]) {
+    close(q->fds[1]);
+  }
+  ares_free(q);
+  channel->submitq = NULL;
+}
+
+ares_socket_t ares__submitq_fd(const ares_channel channel)
+{
+  if (channel->submitq == NULL) {
+    return ARES_SOCKET_BAD;
+  }
+  return (ares_socket_t)channel->submitq->fds[0];
+}
+
+void ares__submitq_process(ares_channel channel, ares_bool_t woken)
+{
+  ares__submitq_t *q = channel->submitq;
+  ares__submit_t  *s = NULL;
+  size_t           i;
+
+  if (q == NULL) {
+    return;
+  }
+
+  if (woken) {
+    submitq_wake_consume(q);
+  }
+
+  for (i = 0; i < ARES_SUBMITQ_BATCH; i++) {
+    s = submitq_pop(q);
+    if (s == NULL) {
+      break;
+    }
+    submit_run(channel, s);
+  }
+
+  /* Leave the rest for the next pass, but make sure there is one */
+  if (s != NULL) {
+    submitq_wake(q);
+  }
+}
+
+void ares__submitq_cancel(ares_channel channel, ares_status_t status)
+{
+  ares__submitq_t *q    = channel->submitq;
+  ares__submit_t  *list = NULL;
+  ares__submit_t  *last = NULL;
+  ares__submit_t  *s;
+
+  if (q == NULL) {
+    return;
+  }
+
+  /* Only fail what was queued on entry, callbacks may submit new requests */
+  while ((s = submitq_pop(q)) != NULL) {
+    s->next = NULL;
+    if (last == NULL) {
+      list = s;
+    } else {
+      last->next = s;
+    }
+    last = s;
+  }
+
+  while (list != NULL) {
+    s    = list;
+    list = s->next;
+    submit_fail(s, status);
+  }
+}
+
+static ares_status_t submit_check(ares_channel channel)
+{
+  if (channel == NULL) {
+    return ARES_EFORMERR;
+  }
+  if (channel->submitq == NULL) {
+    return ARES_ENOTIMP;
+  }
+  return ARES_SUCCESS;
+}
+
+ares_status_t ares_submit_send(ares_channel channel, const unsigned char *qbuf,
+                               size_t qlen, ares_callback callback, void *arg)
+{
+  ares__submit_t *s;
+  ares_status_t   status;
+
+  status = submit_check(channel);
+  if (status != ARES_SUCCESS) {
+    return status;
+  }
+  if (qbuf == NULL || callback == NULL) {
+    return ARES_EFORMERR;
+  }
+  if (qlen < HFIXEDSZ || qlen >= (1 << 16)) {
+    return ARES_EBADQUERY;
+  }
+
+  s = ares_malloc_zero(sizeof(*s));
+  if (s == NULL) {
+    return ARES_ENOMEM;
+  }
+  s->qbuf = ares_malloc(qlen);
+  if (s->qbuf == NULL) {
+    ares_free(s);
+    return ARES_ENOMEM;
+  }
+  memcpy(s->qbuf, qbuf, qlen);
+  s->type     = ARES__SUBMIT_SEND;
+  s->qlen     = qlen;
+  s->callback = callback;
+  s->arg      = arg;
+
+  submitq_push(channel->submitq, s);
+  submitq_wake(channel->submitq);
+  return ARES_SUCCESS;
+}
+
+ares_status_t ares_submit_getaddrinfo(ares_channel channel, const char *node,
+                                      const char                       *service,
+                                      const struct ares_addrinfo_hints *hints,
+                                      ares_addrinfo_callback callback,
+                                      void                  *arg)
+{
+  ares__submit_t *s;
+  ares_status_t   status;
+
+  status = submit_check(channel);
+  if (status != ARES_SUCCESS) {
+    return status;
+  }
+  if (callback == NULL) {
+    return ARES_EFORMERR;
+  }
+
+  s = ares_malloc_zero(sizeof(*s));
+  if (s == NULL) {
+    return ARES_ENOMEM;
+  }
+  if ((node != NULL && (s->name = ares_strdup(node)) == NULL) ||
+      (service != NULL && (s->service = ares_strdup(service)) == NULL)) {
+    submit_free(s);
+    return ARES_ENOMEM;
+  }
+  if (hints != NULL) {
+    s->hints     = *hints;
+    s->has_hints = ARES_TRUE;
+  }
+  s->type        = ARES__SUBMIT_GETADDRINFO;
+  s->ai_callback = callback;
+  s->arg         = arg;
+
+  submitq_push(channel->submitq, s);
+  submitq_wake(channel->submitq);
+  return ARES_SUCCESS;
+}
+
+#else
+
+ares_status_t ares__submitq_create(ares_channel channel)
+{
+  (void)channel;
+  return ARES_ENOTIMP;
+}
+
+void ares__submitq_destroy(ares_channel channel)
+{
+  (void)channel;
+}
+
+ares_socket_t ares__submitq_fd(const ares_channel channel)
+{
+  (void)channel;
+  return ARES_SOCKET_BAD;
+}
+
+void ares__submitq_process(ares_channel channel, ares_bool_t woken)
+{
+  (void)channel;
+  (void)woken;
+}
+
+void ares__submitq_cancel(ares_channel channel, ares_status_t status)
+{
+  (void)channel;
+  (void)status;
+}
+
+ares_status_t ares_submit_send(ares_channel channel, const unsigned char *qbuf,
+                               size_t qlen, ares_callback callback, void *arg)
+{
+  (void)qbuf;
+  (void)qlen;
+  (void)callback;
+  (void)arg;
+  return channel == NULL ? ARES_EFORMERR : ARES_ENOTIMP;
+}
+
+ares_status_t ares_submit_getaddrinfo(ares_channel channel, const char *node,
+                                      const char                       *service,
+                                      const struct ares_addrinfo_hints *hints,
+                                      ares_addrinfo_callback callback,
+                                      void                  *arg)
+{
+  (void)node;
+  (void)service;
+  (void)hints;
+  (void)callback;
+  (void)arg;
+  return channel == NULL ? ARES_EFORMERR : ARES_ENOTIMP;
+}
+
+#endif
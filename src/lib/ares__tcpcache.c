@@ -0,0 +1,221 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* How long a question is sent over TCP after last needing it, in seconds */
+#define ARES_TCPCACHE_TTL 600
+
+/* How many questions are remembered if not told otherwise */
+#define ARES_TCPCACHE_DEFAULT_MAX 256
+
+/* Questions whose answers recently didn't fit in a UDP response, so are sent
+ * straight over TCP rather than costing a truncated UDP round trip first.
+ * Keyed like the query cache, and forgotten ARES_TCPCACHE_TTL seconds after
+ * an answer last showed TCP to be needed.  Once max_entries questions are
+ * known, the one due to expire first makes room for a new one. */
+typedef struct {
+  char               *key;
+  time_t              expire_ts;
+  ares__slist_node_t *node;
+} ares__tcpcache_entry_t;
+
+struct ares__tcpcache {
+  ares__htable_strvp_t *cache;
+  ares__slist_t        *expire;
+  size_t                max_entries;
+};
+
+static int tcpcache_entry_cmp(const void *data1, const void *data2)
+{
+  const ares__tcpcache_entry_t *e1 = data1;
+  const ares__tcpcache_entry_t *e2 = data2;
+
+  if (e1->expire_ts < e2->expire_ts) {
+    return -1;
+  }
+  if (e1->expire_ts > e2->expire_ts) {
+    return 1;
+  }
+  return 0;
+}
+
+static void tcpcache_entry_free(void *arg)
+{
+  ares__tcpcache_entry_t *entry = arg;
+
+  if (entry == NULL) {
+    return;
+  }
+  ares_free(entry->key);
+  ares_free(entry);
+}
+
+ares__tcpcache_t *ares__tcpcache_create(ares_rand_state *rand_state,
+                                        size_t           max_entries)
+{
+  ares__tcpcache_t *cache = ares_malloc_zero(sizeof(*cache));
+
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->cache = ares__htable_strvp_create(NULL);
+  if (cache->cache == NULL) {
+    goto fail;
+  }
+
+  cache->expire =
+    ares__slist_create(rand_state, tcpcache_entry_cmp, tcpcache_entry_free);
+  if (cache->expire == NULL) {
+    goto fail;
+  }
+
+  cache->max_entries =
+    max_entries == 0 ? ARES_TCPCACHE_DEFAULT_MAX : max_entries;
+
+  return cache;
+
+fail:
+  ares__tcpcache_destroy(cache);
+  return NULL;
+}
+
+void ares__tcpcache_destroy(ares__tcpcache_t *cache)
+{
+  if (cache == NULL) {
+    return;
+  }
+  ares__htable_strvp_destroy(cache->cache);
+  ares__slist_destroy(cache->expire);
+  ares_free(cache);
+}
+
+static void tcpcache_remove(ares__tcpcache_t       *cache,
+                            ares__tcpcache_entry_t *entry)
+{
+  ares__htable_strvp_remove(cache->cache, entry->key);
+  ares__slist_node_destroy(entry->node);
+}
+
+static void tcpcache_expire(ares__tcpcache_t *cache, const struct timeval *now)
+{
+  ares__tcpcache_entry_t *entry;
+
+  while ((entry = ares__slist_first_val(cache->expire)) != NULL &&
+         entry->expire_ts <= now->tv_sec) {
+    tcpcache_remove(cache, entry);
+  }
+}
+
+void ares__tcpcache_flush(ares__tcpcache_t *cache)
+{
+  ares__tcpcache_entry_t *entry;
+
+  if (cache == NULL) {
+    return;
+  }
+
+  while ((entry = ares__slist_first_val(cache->expire)) != NULL) {
+    tcpcache_remove(cache, entry);
+  }
+}
+
+ares_status_t ares__tcpcache_insert(ares__tcpcache_t     *cache,
+                                    const struct timeval *now,
+                                    const struct query   *query)
+{
+  ares__tcpcache_entry_t *entry;
+  char                   *key;
+
+  if (cache == NULL || query->key == NULL) {
+    return ARES_SUCCESS;
+  }
+
+  /* Already known, only push back its expiry */
+  entry = ares__htable_strvp_get_direct(cache->cache, query->key);
+  if (entry != NULL) {
+    ares__slist_node_claim(entry->node);
+    entry->expire_ts = now->tv_sec + ARES_TCPCACHE_TTL;
+    entry->node      = ares__slist_insert(cache->expire, entry);
+    if (entry->node == NULL) {
+      ares__htable_strvp_remove(cache->cache, entry->key);
+      tcpcache_entry_free(entry);
+      return ARES_ENOMEM;
+    }
+    return ARES_SUCCESS;
+  }
+
+  /* Make room by forgetting the question due to expire first */
+  tcpcache_expire(cache, now);
+  if (ares__slist_len(cache->expire) >= cache->max_entries) {
+    tcpcache_remove(cache, ares__slist_first_val(cache->expire));
+  }
+
+  key = ares_strdup(query->key);
+  if (key == NULL) {
+    return ARES_ENOMEM;
+  }
+
+  entry = ares_malloc_zero(sizeof(*entry));
+  if (entry == NULL) {
+    ares_free(key);
+    return ARES_ENOMEM;
+  }
+  entry->key       = key;
+  entry->expire_ts = now->tv_sec + ARES_TCPCACHE_TTL;
+
+  if (!ares__htable_strvp_insert(cache->cache, key, entry)) {
+    tcpcache_entry_free(entry);
+    return ARES_ENOMEM;
+  }
+
+  entry->node = ares__slist_insert(cache->expire, entry);
+  if (entry->node == NULL) {
+    ares__htable_strvp_remove(cache->cache, key);
+    tcpcache_entry_free(entry);
+    return ARES_ENOMEM;
+  }
+
+  return ARES_SUCCESS;
+}
+
+ares_bool_t ares__tcpcache_fetch(ares__tcpcache_t     *cache,
+                                 const struct timeval *now,
+                                 const struct query   *query)
+{
+  if (cache == NULL || query->key == NULL) {
+    return ARES_FALSE;
+  }
+
+  tcpcache_expire(cache, now);
+  return ares__htable_strvp_get_direct(cache->cache, query->key) != NULL
+           ? ARES_TRUE
+           : ARES_FALSE;
+}
@@ -0,0 +1,459 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+#ifdef CARES_THREADS
+#  ifdef _WIN32
+
+struct ares__thread_mutex {
+  CRITICAL_SECTION mutex;
+  /* Times locked by the thread holding it, only touched with it held */
+  size_t           depth;
+};
+
+ares__thread_mutex_t *ares__thread_mutex_create(void)
+{
+  ares__thread_mutex_t *mut = ares_malloc_zero(sizeof(*mut));
+
+  if (mut == NULL) {
+    return NULL;
+  }
+
+  InitializeCriticalSection(&mut->mutex);
+  return mut;
+}
+
+void ares__thread_mutex_destroy(ares__thread_mutex_t *mut)
+{
+  if (mut == NULL) {
+    return;
+  }
+  DeleteCriticalSection(&mut->mutex);
+  ares_free(mut);
+}
+
+void ares__thread_mutex_lock(ares__thread_mutex_t *mut)
+{
+  if (mut == NULL) {
+    return;
+  }
+  EnterCriticalSection(&mut->mutex);
+  mut->depth++;
+}
+
+void ares__thread_mutex_unlock(ares__thread_mutex_t *mut)
+{
+  if (mut == NULL) {
+    return;
+  }
+  mut->depth--;
+  LeaveCriticalSection(&mut->mutex);
+}
+
+struct ares__thread_cond {
+  CONDITION_VARIABLE cond;
+};
+
+ares__thread_cond_t *ares__thread_cond_create(void)
+{
+  ares__thread_cond_t *cond = ares_malloc_zero(sizeof(*cond));
+
+  if (cond == NULL) {
+    return NULL;
+  }
+
+  InitializeConditionVariable(&cond->cond);
+  return cond;
+}
+
+void ares__thread_cond_destroy(ares__thread_cond_t *cond)
+{
+  /* Windows condition variables need no cleanup */
+  ares_free(cond);
+}
+
+void ares__thread_cond_broadcast(ares__thread_cond_t *cond)
+{
+  if (cond == NULL) {
+    return;
+  }
+  WakeAllConditionVariable(&cond->cond);
+}
+
+ares_status_t ares__thread_cond_timedwait(ares__thread_cond_t  *cond,
+                                          ares__thread_mutex_t *mut,
+                                          int                   timeout_ms)
+{
+  DWORD       ms = (timeout_ms < 0) ? INFINITE : (DWORD)timeout_ms;
+  ares_bool_t woken;
+
+  if (cond == NULL || mut == NULL) {
+    return ARES_EFORMERR;
+  }
+
+  /* Other threads get to lock the mutex while this one waits */
+  mut->depth = 0;
+  woken      = SleepConditionVariableCS(&cond->cond, &mut->mutex, ms)
+                 ? ARES_TRUE
+                 : ARES_FALSE;
+  mut->depth = 1;
+
+  return woken ? ARES_SUCCESS : ARES_ETIMEOUT;
+}
+
+static SRWLOCK ares__global_lock = SRWLOCK_INIT;
+
+ares_bool_t ares__thread_global_lock(void)
+{
+  AcquireSRWLockExclusive(&ares__global_lock);
+  return ARES_TRUE;
+}
+
+void ares__thread_global_unlock(void)
+{
+  ReleaseSRWLockExclusive(&ares__global_lock);
+}
+
+#  else /* !_WIN32 */
+
+#    include <pthread.h>
+
+struct ares__thread_mutex {
+  pthread_mutex_t mutex;
+  /* Times locked by the thread holding it, only touched with it held */
+  size_t          depth;
+};
+
+ares__thread_mutex_t *ares__thread_mutex_create(void)
+{
+  pthread_mutexattr_t   attr;
+  ares__thread_mutex_t *mut = ares_malloc_zero(sizeof(*mut));
+
+  if (mut == NULL) {
+    return NULL;
+  }
+
+  if (pthread_mutexattr_init(&attr) != 0) {
+    ares_free(mut);
+    return NULL;
+  }
+
+  if (pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) != 0 ||
+      pthread_mutex_init(&mut->mutex, &attr) != 0) {
+    pthread_mutexattr_destroy(&attr);
+    ares_free(mut);
+    return NULL;
+  }
+
+  pthread_mutexattr_destroy(&attr);
+  return mut;
+}
+
+void ares__thread_mutex_destroy(ares__thread_mutex_t *mut)
+{
+  if (mut == NULL) {
+    return;
+  }
+  pthread_mutex_destroy(&mut->mutex);
+  ares_free(mut);
+}
+
+void ares__thread_mutex_lock(ares__thread_mutex_t *mut)
+{
+  if (mut == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&mut->mutex);
+  mut->depth++;
+}
+
+void ares__thread_mutex_unlock(ares__thread_mutex_t *mut)
+{
+  if (mut == NULL) {
+    return;
+  }
+  mut->depth--;
+  pthread_mutex_unlock(&mut->mutex);
+}
+
+struct ares__thread_cond {
+  pthread_cond_t cond;
+};
+
+ares__thread_cond_t *ares__thread_cond_create(void)
+{
+  ares__thread_cond_t *cond = ares_malloc_zero(sizeof(*cond));
+
+  if (cond == NULL) {
+    return NULL;
+  }
+
+  if (pthread_cond_init(&cond->cond, NULL) != 0) {
+    ares_free(cond);
+    return NULL;
+  }
+  return cond;
+}
+
+void ares__thread_cond_destroy(ares__thread_cond_t *cond)
+{
+  if (cond == NULL) {
+    return;
+  }
+  pthread_cond_destroy(&cond->cond);
+  ares_free(cond);
+}
+
+void ares__thread_cond_broadcast(ares__thread_cond_t *cond)
+{
+  if (cond == NULL) {
+    return;
+  }
+  pthread_cond_broadcast(&cond->cond);
+}
+
+ares_status_t ares__thread_cond_timedwait(ares__thread_cond_t  *cond,
+                                          ares__thread_mutex_t *mut,
+                                          int                   timeout_ms)
+{
+  struct timeval  tv;
+  struct timespec ts;
+  int             rv;
+
+  if (cond == NULL || mut == NULL) {
+    return ARES_EFORMERR;
+  }
+
+  /* Other threads get to lock the mutex while this one waits */
+  mut->depth = 0;
+
+  if (timeout_ms < 0) {
+    rv = pthread_cond_wait(&cond->cond, &mut->mutex);
+  } else {
+    /* The deadline is against the realtime clock, pthread_cond_init()'s
+     * default */
+    gettimeofday(&tv, NULL);
+    ts.tv_sec  = tv.tv_sec + timeout_ms / 1000;
+    ts.tv_nsec = (tv.tv_usec + (timeout_ms % 1000) * 1000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    rv = pthread_cond_timedwait(&cond->cond, &mut->mutex, &ts);
+  }
+
+  mut->depth = 1;
+  return (rv == 0) ? ARES_SUCCESS : ARES_ETIMEOUT;
+}
+
+static pthread_mutex_t ares__global_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ares_bool_t ares__thread_global_lock(void)
+{
+  pthread_mutex_lock(&ares__global_mutex);
+  return ARES_TRUE;
+}
+
+void ares__thread_global_unlock(void)
+{
+  pthread_mutex_unlock(&ares__global_mutex);
+}
+
+#  endif
+
+ares_bool_t ares__thread_mutex_held(ares__thread_mutex_t *mut)
+{
+  ares_bool_t held;
+
+  if (mut == NULL) {
+    return ARES_FALSE;
+  }
+
+  /* Taking it once more is sure to succeed for the holder, and makes depth
+   * safe to read for everyone else */
+  ares__thread_mutex_lock(mut);
+  held = (mut->depth > 1) ? ARES_TRUE : ARES_FALSE;
+  ares__thread_mutex_unlock(mut);
+  return held;
+}
+
+ares_bool_t ares_threadsafety(void)
+{
+  return ARES_TRUE;
+}
+
+#else /* !CARES_THREADS */
+
+ares__thread_mutex_t *ares__thread_mutex_create(void)
+{
+  return NULL;
+}
+
+void ares__thread_mutex_destroy(ares__thread_mutex_t *mut)
+{
+  (void)mut;
+}
+
+void ares__thread_mutex_lock(ares__thread_mutex_t *mut)
+{
+  (void)mut;
+}
+
+void ares__thread_mutex_unlock(ares__thread_mutex_t *mut)
+{
+  (void)mut;
+}
+
+ares_bool_t ares__thread_mutex_held(ares__thread_mutex_t *mut)
+{
+  (void)mut;
+  return ARES_FALSE;
+}
+
+ares__thread_cond_t *ares__thread_cond_create(void)
+{
+  return NULL;
+}
+
+void ares__thread_cond_destroy(ares__thread_cond_t *cond)
+{
+  (void)cond;
+}
+
+void ares__thread_cond_broadcast(ares__thread_cond_t *cond)
+{
+  (void)cond;
+}
+
+ares_status_t ares__thread_cond_timedwait(ares__thread_cond_t  *cond,
+                                          ares__thread_mutex_t *mut,
+                                          int                   timeout_ms)
+{
+  (void)cond;
+  (void)mut;
+  (void)timeout_ms;
+  return ARES_ENOTIMP;
+}
+
+ares_bool_t ares__thread_global_lock(void)
+{
+  return ARES_FALSE;
+}
+
+void ares__thread_global_unlock(void)
+{
+}
+
+ares_bool_t ares_threadsafety(void)
+{
+  return ARES_FALSE;
+}
+
+#endif
+
+void ares__channel_lock(ares_channel channel)
+{
+  if (channel == NULL) {
+    return;
+  }
+  ares__thread_mutex_lock(channel->lock);
+}
+
+void ares__channel_unlock(ares_channel channel)
+{
+  if (channel == NULL) {
+    return;
+  }
+  ares__thread_mutex_unlock(channel->lock);
+}
+
+size_t ares_queue_active_queries(ares_channel channel)
+{
+  size_t len;
+
+  if (channel == NULL) {
+    return 0;
+  }
+
+  ares__channel_lock(channel);
+  len = ares__llist_len(channel->all_queries);
+  ares__channel_unlock(channel);
+
+  return len;
+}
+
+ares_status_t ares_queue_wait_empty(ares_channel channel, int timeout_ms)
+{
+  ares_status_t  status = ARES_SUCCESS;
+  struct timeval deadline;
+
+  if (channel == NULL) {
+    return ARES_EFORMERR;
+  }
+
+  if (channel->lock == NULL) {
+    return ARES_ENOTIMP;
+  }
+
+  /* The lock is only let go of once while waiting, so if the caller already
+   * holds it, e.g. from within a callback, nothing else could ever run */
+  if (ares__thread_mutex_held(channel->lock)) {
+    return ARES_EFORMERR;
+  }
+
+  deadline = ares__tvnow();
+  if (timeout_ms > 0) {
+    ares__timeadd(&deadline, (size_t)timeout_ms);
+  }
+
+  ares__channel_lock(channel);
+  while (ares__llist_len(channel->all_queries) > 0) {
+    int remaining = -1;
+
+    if (timeout_ms >= 0) {
+      struct timeval now = ares__tvnow();
+
+      if (ares__timedout(&now, &deadline)) {
+        status = ARES_ETIMEOUT;
+        break;
+      }
+      remaining = (int)((deadline.tv_sec - now.tv_sec) * 1000 +
+                        (deadline.tv_usec - now.tv_usec) / 1000);
+    }
+
+    /* Spurious wakeups and timeouts alike are sorted out by the checks
+     * above */
+    (void)ares__thread_cond_timedwait(channel->cond_empty, channel->lock,
+                                      remaining);
+  }
+  ares__channel_unlock(channel);
+
+  return status;
+}
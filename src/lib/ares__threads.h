@@ -0,0 +1,131 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef __ARES__THREADS_H
+#define __ARES__THREADS_H
+
+/*! \addtogroup ares__threads Threading Primitives
+ *
+ * Thin wrappers around the platform's mutexes and condition variables,
+ * pthreads or Win32, used to make a channel created with
+ * ARES_FLAG_THREADSAFE safe to share between threads.
+ *
+ * Mutexes are recursive, as callbacks run with the channel locked may call
+ * back into the library.  Every function accepts NULL and then does nothing,
+ * so callers needn't check whether locking is in use.  Without CARES_THREADS
+ * nothing can be created and ares_threadsafety() returns ARES_FALSE.
+ *
+ * @{
+ */
+struct ares__thread_mutex;
+
+/*! Recursive mutex, opaque */
+typedef struct ares__thread_mutex ares__thread_mutex_t;
+
+/*! Create a mutex
+ *
+ *  \return Mutex or NULL on out of memory or without thread support
+ */
+ares__thread_mutex_t *ares__thread_mutex_create(void);
+
+/*! Destroy a mutex, which must not be locked
+ *
+ *  \param[in] mut  Mutex to destroy
+ */
+void ares__thread_mutex_destroy(ares__thread_mutex_t *mut);
+
+/*! Lock a mutex, waiting for other threads to unlock it
+ *
+ *  \param[in] mut  Mutex to lock
+ */
+void ares__thread_mutex_lock(ares__thread_mutex_t *mut);
+
+/*! Unlock a mutex, once for each time it was locked
+ *
+ *  \param[in] mut  Mutex to unlock
+ */
+void ares__thread_mutex_unlock(ares__thread_mutex_t *mut);
+
+/*! Whether the calling thread already holds a mutex.  Waits for any other
+ *  thread holding it to let go first.
+ *
+ *  \param[in] mut  Mutex
+ *  \return ARES_TRUE if the caller has it locked, ARES_FALSE otherwise or if
+ *          mut is NULL
+ */
+ares_bool_t ares__thread_mutex_held(ares__thread_mutex_t *mut);
+
+struct ares__thread_cond;
+
+/*! Condition variable, opaque */
+typedef struct ares__thread_cond ares__thread_cond_t;
+
+/*! Create a condition variable
+ *
+ *  \return Condition variable or NULL on out of memory or without thread
+ *          support
+ */
+ares__thread_cond_t *ares__thread_cond_create(void);
+
+/*! Destroy a condition variable, which no thread may be waiting on
+ *
+ *  \param[in] cond  Condition variable to destroy
+ */
+void ares__thread_cond_destroy(ares__thread_cond_t *cond);
+
+/*! Wake every thread waiting on a condition variable
+ *
+ *  \param[in] cond  Condition variable
+ */
+void ares__thread_cond_broadcast(ares__thread_cond_t *cond);
+
+/*! Wait on a condition variable.  The mutex, locked exactly once by the
+ *  caller, is unlocked while waiting and locked again before returning.
+ *  Wakeups may be spurious, so the condition must be checked again.
+ *
+ *  \param[in] cond        Condition variable
+ *  \param[in] mut         Mutex protecting the condition
+ *  \param[in] timeout_ms  How long to wait at most, or -1 to wait forever
+ *  \return ARES_SUCCESS when woken, ARES_ETIMEOUT when the time is up
+ */
+ares_status_t ares__thread_cond_timedwait(ares__thread_cond_t  *cond,
+                                          ares__thread_mutex_t *mut,
+                                          int                   timeout_ms);
+
+/*! Lock the library's process-wide mutex, which guards state shared by all
+ *  channels.  It needs no setup and is not recursive.
+ *
+ *  \return ARES_TRUE if locked, ARES_FALSE without thread support, in which
+ *          case nothing may be shared between channels
+ */
+ares_bool_t ares__thread_global_lock(void);
+
+/*! Unlock the process-wide mutex locked by ares__thread_global_lock()
+ */
+void ares__thread_global_unlock(void);
+
+/*! @} */
+
+#endif /* __ARES__THREADS_H */
@@ -0,0 +1,458 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include "ares_setup.h"
+#include "ares.h"
+#include "ares_private.h"
+#include "ares__timerwheel.h"
+
+/* Hierarchical timer wheel implementation.
+ *
+ * Time is measured in milliseconds ("ticks") since the wheel was created.
+ * Level L has 64 slots each covering 64^L ticks.  An entry lives on the
+ * lowest level whose next-higher slot it shares with the current tick, so
+ * within a level entries are ordered by slot and every slot in use lies
+ * ahead of the current position.  Whenever the current tick crosses into a
+ * new slot of a higher level, that slot is redistributed to the levels
+ * below.  Entries too far out for the top level wait on an overflow list.
+ */
+
+#define ARES__TW_BITS     6
+#define ARES__TW_SLOTS    (1 << ARES__TW_BITS)
+#define ARES__TW_MASK     ((size_t)ARES__TW_SLOTS - 1)
+#define ARES__TW_LEVELS   4
+#define ARES__TW_OVERFLOW ARES__TW_LEVELS
+#define ARES__TW_DUE      (ARES__TW_LEVELS + 1)
+
+typedef struct {
+  ares__timerwheel_entry_t *head;
+  ares__timerwheel_entry_t *tail;
+} ares__tw_list_t;
+
+struct ares__timerwheel {
+  struct timeval  base;
+  size_t          cur;
+  ares__tw_list_t slots[ARES__TW_LEVELS][ARES__TW_SLOTS];
+  size_t          level_cnt[ARES__TW_LEVELS];
+  ares__tw_list_t overflow;
+  ares__tw_list_t due;
+  size_t          cnt;
+
+  /* Earliest expiry, recomputed lazily after it is cancelled or fires */
+  ares_bool_t     next_valid;
+  size_t          next;
+};
+
+/* Tick comparison tolerant of wraparound of the tick counter */
+static ares_bool_t tick_le(size_t a, size_t b)
+{
+  return (b - a) <= (((size_t)-1) >> 1) ? ARES_TRUE : ARES_FALSE;
+}
+
+static size_t tv_to_tick(const ares__timerwheel_t *wheel,
+                         const struct timeval *tv, ares_bool_t roundup)
+{
+  size_t secs;
+  size_t usecs;
+  size_t ms;
+
+  if (tv->tv_sec < wheel->base.tv_sec ||
+      (tv->tv_sec == wheel->base.tv_sec &&
+       tv->tv_usec <= wheel->base.tv_usec)) {
+    return 0;
+  }
+
+  secs = (size_t)(tv->tv_sec - wheel->base.tv_sec);
+  if (tv->tv_usec >= wheel->base.tv_usec) {
+    usecs = (size_t)(tv->tv_usec - wheel->base.tv_usec);
+  } else {
+    secs--;
+    usecs = (size_t)(tv->tv_usec + 1000000 - wheel->base.tv_usec);
+  }
+
+  ms = secs * 1000 + usecs / 1000;
+  /* Timers are rounded up so a timer never fires before its time */
+  if (roundup && usecs % 1000 != 0) {
+    ms++;
+  }
+  return ms;
+}
+
+static void tick_to_tv(const ares__timerwheel_t *wheel, size_t tick,
+                       struct timeval *tv)
+{
+  tv->tv_sec  = wheel->base.tv_sec + (time_t)(tick / 1000);
+  tv->tv_usec = wheel->base.tv_usec + (long)((tick % 1000) * 1000);
+  if (tv->tv_usec >= 1000000) {
+    tv->tv_sec++;
+    tv->tv_usec -= 1000000;
+  }
+}
+
+static ares__tw_list_t *tw_list(ares__timerwheel_t             *wheel,
+                                const ares__timerwheel_entry_t *entry)
+{
+  if (entry->level == ARES__TW_DUE) {
+    return &wheel->due;
+  }
+  if (entry->level == ARES__TW_OVERFLOW) {
+    return &wheel->overflow;
+  }
+  return &wheel->slots[entry->level][entry->slot];
+}
+
+static void tw_link(ares__timerwheel_t *wheel, ares__timerwheel_entry_t *entry)
+{
+  ares__tw_list_t *list = tw_list(wheel, entry);
+
+  entry->next = NULL;
+  entry->prev = list->tail;
+  if (list->tail != NULL) {
+    list->tail->next = entry;
+  } else {
+    list->head = entry;
+  }
+  list->tail = entry;
+
+  if (entry->level < ARES__TW_LEVELS) {
+    wheel->level_cnt[entry->level]++;
+  }
+}
+
+static void tw_unlink(ares__timerwheel_t *wheel, ares__timerwheel_entry_t *entry)
+{
+  ares__tw_list_t *list = tw_list(wheel, entry);
+
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    list->head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    list->tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+
+  if (entry->level < ARES__TW_LEVELS) {
+    wheel->level_cnt[entry->level]--;
+  }
+}
+
+/* Put the entry on the lowest level that still shares the next-higher slot
+ * with the current tick */
+static void tw_place(ares__timerwheel_t *wheel, ares__timerwheel_entry_t *entry)
+{
+  unsigned char level;
+
+  if (tick_le(entry->expire, wheel->cur)) {
+    entry->level = ARES__TW_DUE;
+    entry->slot  = 0;
+    tw_link(wheel, entry);
+    return;
+  }
+
+  for (level = 0; level < ARES__TW_LEVELS; level++) {
+    unsigned int shift = (unsigned int)(level + 1) * ARES__TW_BITS;
+
+    if ((entry->expire >> shift) == (wheel->cur >> shift)) {
+      entry->level = level;
+      entry->slot  = (unsigned char)((entry->expire >>
+                                     (shift - ARES__TW_BITS)) &
+                                    ARES__TW_MASK);
+      tw_link(wheel, entry);
+      return;
+    }
+  }
+
+  entry->level = ARES__TW_OVERFLOW;
+  entry->slot  = 0;
+  tw_link(wheel, entry);
+}
+
+/* Re-place every entry of a list relative to the current tick */
+static void tw_redistribute(ares__timerwheel_t *wheel, ares__tw_list_t *list,
+                            unsigned char level)
+{
+  ares__timerwheel_entry_t *entry = list->head;
+
+  list->head = NULL;
+  list->tail = NULL;
+
+  while (entry != NULL) {
+    ares__timerwheel_entry_t *next = entry->next;
+
+    if (level < ARES__TW_LEVELS) {
+      wheel->level_cnt[level]--;
+    }
+    tw_place(wheel, entry);
+    entry = next;
+  }
+}
+
+/* The current tick just moved to the start of a new level 0 rotation;
+ * pull down the slots we have moved into, from the top down. */
+static void tw_cascade(ares__timerwheel_t *wheel)
+{
+  unsigned char level = 1;
+
+  while (level < ARES__TW_LEVELS &&
+         ((wheel->cur >> (level * ARES__TW_BITS)) & ARES__TW_MASK) == 0) {
+    level++;
+  }
+
+  if (level == ARES__TW_LEVELS) {
+    tw_redistribute(wheel, &wheel->overflow, ARES__TW_OVERFLOW);
+    level--;
+  }
+
+  for (; level >= 1; level--) {
+    size_t slot = (wheel->cur >> (level * ARES__TW_BITS)) & ARES__TW_MASK;
+    tw_redistribute(wheel, &wheel->slots[level][slot], level);
+  }
+}
+
+static void tw_due_slot(ares__timerwheel_t *wheel, size_t slot)
+{
+  ares__tw_list_t          *list  = &wheel->slots[0][slot];
+  ares__timerwheel_entry_t *entry = list->head;
+
+  while (entry != NULL) {
+    ares__timerwheel_entry_t *next = entry->next;
+    tw_unlink(wheel, entry);
+    entry->level = ARES__TW_DUE;
+    entry->slot  = 0;
+    tw_link(wheel, entry);
+    entry = next;
+  }
+}
+
+/* Lowest level with armed timers, ARES__TW_LEVELS if only the overflow list
+ * has any, or -1 if none are waiting on the wheel */
+static int tw_lowest_level(const ares__timerwheel_t *wheel)
+{
+  int level;
+
+  for (level = 0; level < ARES__TW_LEVELS; level++) {
+    if (wheel->level_cnt[level] != 0) {
+      return level;
+    }
+  }
+
+  return wheel->overflow.head != NULL ? ARES__TW_LEVELS : -1;
+}
+
+static void tw_advance(ares__timerwheel_t *wheel, size_t now)
+{
+  while (!tick_le(now, wheel->cur)) {
+    int    level = tw_lowest_level(wheel);
+    size_t next;
+
+    if (level < 0) {
+      wheel->cur = now;
+      return;
+    }
+
+    if (level == 0) {
+      size_t slot;
+      size_t end = ARES__TW_MASK;
+
+      if ((wheel->cur >> ARES__TW_BITS) == (now >> ARES__TW_BITS)) {
+        end = now & ARES__TW_MASK;
+      }
+
+      for (slot = (wheel->cur & ARES__TW_MASK) + 1; slot <= end; slot++) {
+        tw_due_slot(wheel, slot);
+      }
+
+      if ((wheel->cur >> ARES__TW_BITS) == (now >> ARES__TW_BITS)) {
+        wheel->cur = now;
+        return;
+      }
+    }
+
+    /* Nothing is armed below this level, so skip straight to the next slot
+     * boundary of the level that has something to redistribute */
+    next = ((wheel->cur >> ((unsigned int)level * ARES__TW_BITS)) + 1)
+           << ((unsigned int)level * ARES__TW_BITS);
+    if (!tick_le(next, now)) {
+      wheel->cur = now;
+      return;
+    }
+
+    wheel->cur = next;
+    tw_cascade(wheel);
+  }
+}
+
+ares__timerwheel_t *ares__timerwheel_create(const struct timeval *now)
+{
+  ares__timerwheel_t *wheel = ares_malloc_zero(sizeof(*wheel));
+
+  if (wheel == NULL) {
+    return NULL;
+  }
+
+  wheel->base = *now;
+  return wheel;
+}
+
+void ares__timerwheel_add(ares__timerwheel_t *wheel,
+                          ares__timerwheel_entry_t *entry, void *val,
+                          const struct timeval *expire)
+{
+  if (wheel == NULL || entry == NULL) {
+    return;
+  }
+
+  ares__timerwheel_remove(wheel, entry);
+
+  entry->val    = val;
+  entry->expire = tv_to_tick(wheel, expire, ARES_TRUE);
+  entry->linked = ARES_TRUE;
+  tw_place(wheel, entry);
+  wheel->cnt++;
+
+  if (wheel->next_valid && !tick_le(wheel->next, entry->expire)) {
+    wheel->next = entry->expire;
+  }
+  if (wheel->cnt == 1) {
+    wheel->next       = entry->expire;
+    wheel->next_valid = ARES_TRUE;
+  }
+}
+
+void ares__timerwheel_remove(ares__timerwheel_t       *wheel,
+                             ares__timerwheel_entry_t *entry)
+{
+  if (wheel == NULL || entry == NULL || !entry->linked) {
+    return;
+  }
+
+  tw_unlink(wheel, entry);
+  entry->linked = ARES_FALSE;
+  wheel->cnt--;
+
+  if (entry->expire == wheel->next) {
+    wheel->next_valid = ARES_FALSE;
+  }
+}
+
+void *ares__timerwheel_expire(ares__timerwheel_t   *wheel,
+                              const struct timeval *now)
+{
+  ares__timerwheel_entry_t *entry;
+
+  if (wheel == NULL) {
+    return NULL;
+  }
+
+  tw_advance(wheel, tv_to_tick(wheel, now, ARES_FALSE));
+
+  entry = wheel->due.head;
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  ares__timerwheel_remove(wheel, entry);
+  return entry->val;
+}
+
+static ares_bool_t tw_list_min(const ares__tw_list_t *list, size_t *tick)
+{
+  const ares__timerwheel_entry_t *entry;
+  ares_bool_t                     found = ARES_FALSE;
+
+  for (entry = list->head; entry != NULL; entry = entry->next) {
+    if (!found || !tick_le(*tick, entry->expire)) {
+      *tick = entry->expire;
+      found = ARES_TRUE;
+    }
+  }
+
+  return found;
+}
+
+/* Levels are strictly ordered, and so are the slots within a level, so the
+ * earliest timer is in the first occupied slot of the lowest occupied
+ * level */
+static size_t tw_next(const ares__timerwheel_t *wheel)
+{
+  size_t        tick = wheel->cur;
+  unsigned char level;
+
+  if (tw_list_min(&wheel->due, &tick)) {
+    return tick;
+  }
+
+  for (level = 0; level < ARES__TW_LEVELS; level++) {
+    size_t slot;
+
+    if (wheel->level_cnt[level] == 0) {
+      continue;
+    }
+
+    slot = ((wheel->cur >> (level * ARES__TW_BITS)) & ARES__TW_MASK) + 1;
+    for (; slot < ARES__TW_SLOTS; slot++) {
+      if (tw_list_min(&wheel->slots[level][slot], &tick)) {
+        return tick;
+      }
+    }
+  }
+
+  tw_list_min(&wheel->overflow, &tick);
+  return tick;
+}
+
+ares_bool_t ares__timerwheel_next(ares__timerwheel_t *wheel,
+                                  struct timeval     *expire)
+{
+  if (wheel == NULL || wheel->cnt == 0) {
+    return ARES_FALSE;
+  }
+
+  if (!wheel->next_valid) {
+    wheel->next       = tw_next(wheel);
+    wheel->next_valid = ARES_TRUE;
+  }
+
+  tick_to_tv(wheel, wheel->next, expire);
+  return ARES_TRUE;
+}
+
+size_t ares__timerwheel_len(const ares__timerwheel_t *wheel)
+{
+  if (wheel == NULL) {
+    return 0;
+  }
+  return wheel->cnt;
+}
+
+void ares__timerwheel_destroy(ares__timerwheel_t *wheel)
+{
+  ares_free(wheel);
+}
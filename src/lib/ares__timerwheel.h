@@ -0,0 +1,129 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef __ARES__TIMERWHEEL_H
+#define __ARES__TIMERWHEEL_H
+
+
+/*! \addtogroup ares__timerwheel Hierarchical Timer Wheel
+ *
+ * A hierarchical timer wheel with millisecond resolution.  Timers are kept
+ * in unsorted buckets covering progressively larger ranges of time, and are
+ * moved down a level as their expiry draws near, so only the lowest level
+ * ever needs to be exact.
+ *
+ * Entries are embedded in the object being timed, so no memory is allocated
+ * when a timer is armed or cancelled.
+ *
+ * Time complexity:
+ *  - Insert: O(1)
+ *  - Delete: O(1)
+ *  - Expire: O(1) amortized per entry
+ *  - Next expiry: O(1) when cached, otherwise bounded by one bucket scan
+ *
+ * @{
+ */
+struct ares__timerwheel;
+
+/*! Timer Wheel Object, opaque */
+typedef struct ares__timerwheel ares__timerwheel_t;
+
+/*! Timer Wheel Entry.  Embedded in the object being timed, its members are
+ *  private to the timer wheel implementation and must be zero-initialized
+ *  before first use. */
+typedef struct ares__timerwheel_entry {
+  struct ares__timerwheel_entry *prev;
+  struct ares__timerwheel_entry *next;
+  void                          *val;
+  size_t                         expire;
+  unsigned char                  level;
+  unsigned char                  slot;
+  ares_bool_t                    linked;
+} ares__timerwheel_entry_t;
+
+/*! Create a Timer Wheel
+ *
+ *  \param[in] now  Current time, used as the wheel's epoch
+ *  \return Timer Wheel Object or NULL on out of memory
+ */
+ares__timerwheel_t *ares__timerwheel_create(const struct timeval *now);
+
+/*! Arm a timer.  If the entry is already armed it is moved to the new
+ *  expiration time.
+ *
+ *  \param[in] wheel   Initialized Timer Wheel Object
+ *  \param[in] entry   Entry embedded in the timed object
+ *  \param[in] val     User-defined value returned on expiry
+ *  \param[in] expire  Time at which the timer expires
+ */
+void                ares__timerwheel_add(ares__timerwheel_t       *wheel,
+                                         ares__timerwheel_entry_t *entry,
+                                         void                     *val,
+                                         const struct timeval     *expire);
+
+/*! Cancel a timer.  Does nothing if the entry is not armed.
+ *
+ *  \param[in] wheel  Initialized Timer Wheel Object
+ *  \param[in] entry  Entry embedded in the timed object
+ */
+void                ares__timerwheel_remove(ares__timerwheel_t       *wheel,
+                                            ares__timerwheel_entry_t *entry);
+
+/*! Advance the wheel to the given time and disarm one expired timer.  Call
+ *  repeatedly until it returns NULL to process all expired timers; timers
+ *  may be armed and cancelled between calls.
+ *
+ *  \param[in] wheel  Initialized Timer Wheel Object
+ *  \param[in] now    Current time
+ *  \return user defined value of an expired timer or NULL if none
+ */
+void               *ares__timerwheel_expire(ares__timerwheel_t   *wheel,
+                                            const struct timeval *now);
+
+/*! Retrieve the expiration time of the earliest armed timer.
+ *
+ *  \param[in]  wheel   Initialized Timer Wheel Object
+ *  \param[out] expire  Earliest expiration time
+ *  \return ARES_TRUE if a timer is armed, ARES_FALSE otherwise
+ */
+ares_bool_t         ares__timerwheel_next(ares__timerwheel_t *wheel,
+                                          struct timeval     *expire);
+
+/*! Number of armed timers
+ *
+ *  \param[in] wheel  Initialized Timer Wheel Object
+ *  \return number of armed timers
+ */
+size_t              ares__timerwheel_len(const ares__timerwheel_t *wheel);
+
+/*! Destroy a Timer Wheel.  Any armed entries are simply forgotten.
+ *
+ *  \param[in] wheel  Initialized Timer Wheel Object
+ */
+void                ares__timerwheel_destroy(ares__timerwheel_t *wheel);
+
+/*! @} */
+
+#endif /* __ARES__TIMERWHEEL_H */
@@ -0,0 +1,1193 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#  include <linux/io_uring.h>
+#  include <poll.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+#include <fcntl.h>
+
+#include "ares.h"
+#include "ares_private.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT) && \
+  defined(__NR_io_uring_setup)
+#  define USE_IO_URING 1
+#endif
+
+#ifdef USE_IO_URING
+
+/* io_uring transport.
+ *
+ * Every connection gets a multishot receive armed on it which lands data in
+ * buffers from a provided buffer ring.  Completions are copied into a
+ * per-socket receive queue which the ares__socket_*() wrappers read from, so
+ * the rest of the library sees the same non-blocking semantics as with plain
+ * sockets.  Sends are queued as SQEs and submitted in one io_uring_enter()
+ * per processing pass.  The channel exposes the ring descriptor in place of
+ * the individual sockets.  Other descriptors the channel waits on, like the
+ * submission queue's wake up, get a poll armed on the ring so that waiting
+ * on the ring descriptor alone is enough.
+ */
+
+#  define ARES_URING_ENTRIES 256
+#  define ARES_URING_NBUFS   128 /* Must be a power of 2 */
+#  define ARES_URING_BUFSZ   (MAXENDSSZ + 1)
+#  define ARES_URING_BGID    0
+
+/* user_data tagging.  Send requests carry a pointer to their buffer (low bits
+ * clear), receives carry the socket and registration generation, polls carry
+ * the watched descriptor. */
+#  define ARES_URING_TAG_RECV   1
+#  define ARES_URING_TAG_POLL   2
+#  define ARES_URING_TAG_IGNORE 3
+#  define ARES_URING_TAG_MASK   3
+
+typedef struct {
+  ares_socket_t       fd;
+  ares_bool_t         is_tcp;
+  unsigned int        gen;
+  /* UDP: datagrams each prefixed by a 16-bit length.  TCP: the byte stream */
+  ares__buf_t        *rx;
+  int                 err;
+  ares_bool_t         eof;
+  ares_bool_t         armed;
+  /* Being removed, a terminated receive must not be re-armed */
+  ares_bool_t         closing;
+  /* ARES_SOCK_* interest the library has for this socket */
+  int                 events;
+
+  union {
+    struct sockaddr     sa;
+    struct sockaddr_in  sa4;
+    struct sockaddr_in6 sa6;
+  } peer;
+
+  ares_socklen_t      peer_len;
+  ares__llist_node_t *node;
+} ares__uring_sock_t;
+
+/* Descriptor that isn't a connection, but still needs to wake the
+ * application waiting on the ring */
+typedef struct {
+  ares_socket_t       fd;
+  ares_bool_t         armed;
+  ares_bool_t         closing;
+  /* Became readable since last reported by ares__uring_poll() */
+  ares_bool_t         fired;
+  ares__llist_node_t *node;
+} ares__uring_watch_t;
+
+typedef struct {
+  ares_socket_t       fd;
+  unsigned int        gen;
+  size_t              len;
+  ares__llist_node_t *node;
+  unsigned char       data[1];
+} ares__uring_send_t;
+
+struct ares__uring {
+  int                       fd;
+
+  unsigned int             *sq_head;
+  unsigned int             *sq_tail;
+  unsigned int             *sq_array;
+  unsigned int              sq_mask;
+  unsigned int              sq_entries;
+  struct io_uring_sqe      *sqes;
+  unsigned int              to_submit;
+
+  unsigned int             *cq_head;
+  unsigned int             *cq_tail;
+  unsigned int              cq_mask;
+  struct io_uring_cqe      *cqes;
+
+  void                     *sq_ptr;
+  size_t                    sq_len;
+  void                     *cq_ptr;
+  size_t                    cq_len;
+  size_t                    sqes_len;
+
+  struct io_uring_buf_ring *br;
+  size_t                    br_len;
+  unsigned short            br_tail;
+  unsigned char            *bufs;
+
+  unsigned int              gen;
+  ares__htable_asvp_t      *socks_by_fd;
+  ares__llist_t            *socks;
+  ares__llist_t            *sends;
+  ares__llist_t            *watches;
+
+  /* Interest last reported for the ring descriptor */
+  int                       sock_state;
+};
+
+static ares__uring_sock_t *uring_sock(const ares_channel channel,
+                                      ares_socket_t      fd)
+{
+  if (channel->uring == NULL) {
+    return NULL;
+  }
+  return ares__htable_asvp_get_direct(channel->uring->socks_by_fd, fd);
+}
+
+static int uring_enter(ares__uring_t *uring, unsigned int to_submit)
+{
+  return (int)syscall(__NR_io_uring_enter, uring->fd, to_submit, 0, 0, NULL,
+                      0);
+}
+
+/* Submit whatever is queued and block until at least one completion is
+ * available */
+static ares_bool_t uring_wait(ares__uring_t *uring)
+{
+  int rv;
+
+  do {
+    rv = (int)syscall(__NR_io_uring_enter, uring->fd, uring->to_submit, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+  } while (rv < 0 && SOCKERRNO == EINTR);
+
+  if (rv < 0) {
+    return ARES_FALSE;
+  }
+  uring->to_submit -= (unsigned int)rv;
+  return ARES_TRUE;
+}
+
+static void uring_reap(ares__uring_t *uring);
+
+static void uring_submit(ares__uring_t *uring)
+{
+  while (uring->to_submit > 0) {
+    int rv = uring_enter(uring, uring->to_submit);
+    if (rv < 0) {
+      if (SOCKERRNO == EINTR) {
+        continue;
+      }
+      if (SOCKERRNO == EBUSY || SOCKERRNO == EAGAIN) {
+        /* Completion queue is backed up, drain it and try once more */
+        uring_reap(uring);
+        rv = uring_enter(uring, uring->to_submit);
+      }
+      if (rv <= 0) {
+        return;
+      }
+    }
+    if (rv == 0) {
+      return;
+    }
+    uring->to_submit -= (unsigned int)rv;
+  }
+}
+
+/* Copy the prepared SQE into the submission ring.  It is not handed to the
+ * kernel until the next uring_submit(). */
+static ares_bool_t uring_queue(ares__uring_t             *uring,
+                               const struct io_uring_sqe *sqe)
+{
+  unsigned int head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned int tail = *uring->sq_tail;
+  unsigned int idx;
+
+  if (tail - head >= uring->sq_entries) {
+    uring_submit(uring);
+    head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= uring->sq_entries) {
+      return ARES_FALSE;
+    }
+  }
+
+  idx = tail & uring->sq_mask;
+  memcpy(&uring->sqes[idx], sqe, sizeof(*sqe));
+  uring->sq_array[idx] = idx;
+  __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  uring->to_submit++;
+  return ARES_TRUE;
+}
+
+static unsigned long long uring_recv_tag(const ares__uring_sock_t *sock)
+{
+  return ((unsigned long long)sock->gen << 32) |
+         ((unsigned long long)(unsigned int)sock->fd << 2) |
+         ARES_URING_TAG_RECV;
+}
+
+static void uring_arm(ares__uring_t *uring, ares__uring_sock_t *sock)
+{
+  struct io_uring_sqe sqe;
+
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode    = IORING_OP_RECV;
+  sqe.fd        = sock->fd;
+  sqe.ioprio    = IORING_RECV_MULTISHOT;
+  sqe.flags     = IOSQE_BUFFER_SELECT;
+  sqe.buf_group = ARES_URING_BGID;
+  sqe.user_data = uring_recv_tag(sock);
+
+  if (uring_queue(uring, &sqe)) {
+    sock->armed = ARES_TRUE;
+  } else {
+    sock->err = ENOMEM;
+  }
+}
+
+static void uring_buf_recycle(ares__uring_t *uring, unsigned short bid)
+{
+  struct io_uring_buf *buf =
+    &uring->br->bufs[uring->br_tail & (ARES_URING_NBUFS - 1)];
+
+  buf->addr =
+    (unsigned long long)(size_t)(uring->bufs + (size_t)bid * ARES_URING_BUFSZ);
+  buf->len = ARES_URING_BUFSZ;
+  buf->bid = bid;
+  uring->br_tail++;
+  __atomic_store_n(&uring->br->tail, uring->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_handle_recv(ares__uring_t             *uring,
+                              const struct io_uring_cqe *cqe)
+{
+  ares__uring_sock_t *sock;
+  ares_socket_t       fd  = (ares_socket_t)((cqe->user_data >> 2) & 0x3FFFFFFF);
+  unsigned int        gen = (unsigned int)(cqe->user_data >> 32);
+  const unsigned char *data = NULL;
+  unsigned short       bid  = 0;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    bid  = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    data = uring->bufs + (size_t)bid * ARES_URING_BUFSZ;
+  }
+
+  sock = ares__htable_asvp_get_direct(uring->socks_by_fd, fd);
+  if (sock != NULL && sock->gen != gen) {
+    /* Completion for an earlier socket that had the same descriptor */
+    sock = NULL;
+  }
+
+  if (sock != NULL && cqe->res > 0 && data != NULL) {
+    unsigned char len[2];
+    ares_status_t status = ARES_SUCCESS;
+
+    if (!sock->is_tcp) {
+      len[0] = (unsigned char)((cqe->res >> 8) & 0xFF);
+      len[1] = (unsigned char)(cqe->res & 0xFF);
+      status = ares__buf_append(sock->rx, len, sizeof(len));
+    }
+    if (status == ARES_SUCCESS) {
+      status = ares__buf_append(sock->rx, data, (size_t)cqe->res);
+    }
+    if (status != ARES_SUCCESS) {
+      sock->err = ENOMEM;
+    }
+  }
+
+  if (data != NULL) {
+    uring_buf_recycle(uring, bid);
+  }
+
+  if (sock == NULL || (cqe->flags & IORING_CQE_F_MORE)) {
+    return;
+  }
+
+  /* The multishot receive terminated */
+  sock->armed = ARES_FALSE;
+  if (sock->closing) {
+    return;
+  }
+  if (cqe->res == 0 && sock->is_tcp) {
+    sock->eof = ARES_TRUE;
+  } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EAGAIN &&
+             cqe->res != -ECANCELED) {
+    sock->err = -cqe->res;
+  } else if (cqe->res != -ECANCELED) {
+    uring_arm(uring, sock);
+  }
+}
+
+static void uring_handle_send(ares__uring_t *uring, const struct io_uring_cqe *cqe)
+{
+  ares__uring_send_t *req = (ares__uring_send_t *)((size_t)cqe->user_data);
+  ares__uring_sock_t *sock;
+
+  sock = ares__htable_asvp_get_direct(uring->socks_by_fd, req->fd);
+  if (sock != NULL && sock->gen == req->gen) {
+    if (cqe->res < 0) {
+      sock->err = -cqe->res;
+    } else if ((size_t)cqe->res < req->len) {
+      sock->err = EPIPE;
+    }
+  }
+
+  ares__llist_node_destroy(req->node);
+}
+
+static unsigned long long uring_poll_tag(const ares__uring_watch_t *watch)
+{
+  return ((unsigned long long)(unsigned int)watch->fd << 2) |
+         ARES_URING_TAG_POLL;
+}
+
+static void uring_arm_watch(ares__uring_t *uring, ares__uring_watch_t *watch)
+{
+  struct io_uring_sqe sqe;
+
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode        = IORING_OP_POLL_ADD;
+  sqe.fd            = watch->fd;
+  sqe.poll32_events = POLLIN;
+#  ifdef IORING_POLL_ADD_MULTI
+  sqe.len = IORING_POLL_ADD_MULTI;
+#  endif
+  sqe.user_data = uring_poll_tag(watch);
+
+  if (uring_queue(uring, &sqe)) {
+    watch->armed = ARES_TRUE;
+  }
+}
+
+static ares__uring_watch_t *uring_watch(const ares__uring_t *uring,
+                                        ares_socket_t        fd)
+{
+  ares__llist_node_t *node;
+
+  for (node = ares__llist_node_first(uring->watches); node != NULL;
+       node = ares__llist_node_next(node)) {
+    ares__uring_watch_t *watch = ares__llist_node_val(node);
+    if (watch->fd == fd) {
+      return watch;
+    }
+  }
+  return NULL;
+}
+
+static void uring_handle_poll(ares__uring_t             *uring,
+                              const struct io_uring_cqe *cqe)
+{
+  ares_socket_t        fd = (ares_socket_t)((cqe->user_data >> 2) & 0x3FFFFFFF);
+  ares__uring_watch_t *watch = uring_watch(uring, fd);
+
+  if (watch == NULL) {
+    return;
+  }
+
+  if (cqe->res > 0) {
+    watch->fired = ARES_TRUE;
+  }
+
+  if (cqe->flags & IORING_CQE_F_MORE) {
+    return;
+  }
+
+  /* Single shot, or the multishot poll terminated */
+  watch->armed = ARES_FALSE;
+  if (!watch->closing && cqe->res >= 0) {
+    uring_arm_watch(uring, watch);
+  }
+}
+
+static void uring_reap(ares__uring_t *uring)
+{
+  unsigned int head = *uring->cq_head;
+  unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    const struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+
+    switch (cqe->user_data & ARES_URING_TAG_MASK) {
+      case 0:
+        uring_handle_send(uring, cqe);
+        break;
+      case ARES_URING_TAG_RECV:
+        uring_handle_recv(uring, cqe);
+        break;
+      case ARES_URING_TAG_POLL:
+        uring_handle_poll(uring, cqe);
+        break;
+      default:
+        break;
+    }
+  }
+
+  __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Ask the kernel to cancel the request tagged with user_data.  The cancelled
+ * request still posts its own completion, which has to be waited for before
+ * anything it refers to is released. */
+static void uring_cancel(ares__uring_t *uring, unsigned long long user_data)
+{
+  struct io_uring_sqe sqe;
+
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe.addr      = user_data;
+  sqe.user_data = ARES_URING_TAG_IGNORE;
+  (void)uring_queue(uring, &sqe);
+}
+
+/* Whether a send for the given socket, or any socket if NULL, is still in
+ * flight */
+static ares_bool_t uring_sends_pending(const ares__uring_t      *uring,
+                                       const ares__uring_sock_t *sock)
+{
+  ares__llist_node_t *node;
+
+  for (node = ares__llist_node_first(uring->sends); node != NULL;
+       node = ares__llist_node_next(node)) {
+    const ares__uring_send_t *req = ares__llist_node_val(node);
+    if (sock == NULL || (req->fd == sock->fd && req->gen == sock->gen)) {
+      return ARES_TRUE;
+    }
+  }
+  return ARES_FALSE;
+}
+
+/* Cancel the receive and sends in flight for the given socket, or for every
+ * socket and watched descriptor if NULL, and reap completions until the
+ * kernel has let go of all of them */
+static void uring_quiesce(ares__uring_t *uring, ares__uring_sock_t *sock)
+{
+  ares__llist_node_t *node;
+  ares_bool_t         armed = ARES_FALSE;
+
+  for (node = ares__llist_node_first(uring->watches);
+       node != NULL && sock == NULL; node = ares__llist_node_next(node)) {
+    ares__uring_watch_t *watch = ares__llist_node_val(node);
+    watch->closing             = ARES_TRUE;
+    if (watch->armed) {
+      uring_cancel(uring, uring_poll_tag(watch));
+    }
+  }
+
+  for (node = ares__llist_node_first(uring->socks); node != NULL;
+       node = ares__llist_node_next(node)) {
+    ares__uring_sock_t *s = ares__llist_node_val(node);
+    if (sock != NULL && s != sock) {
+      continue;
+    }
+    s->closing = ARES_TRUE;
+    if (s->armed) {
+      uring_cancel(uring, uring_recv_tag(s));
+    }
+  }
+
+  for (node = ares__llist_node_first(uring->sends); node != NULL;
+       node = ares__llist_node_next(node)) {
+    const ares__uring_send_t *req = ares__llist_node_val(node);
+    if (sock == NULL || (req->fd == sock->fd && req->gen == sock->gen)) {
+      uring_cancel(uring, (unsigned long long)(size_t)req);
+    }
+  }
+
+  for (;;) {
+    uring_reap(uring);
+
+    armed = ARES_FALSE;
+    for (node = ares__llist_node_first(uring->socks); node != NULL && !armed;
+         node = ares__llist_node_next(node)) {
+      const ares__uring_sock_t *s = ares__llist_node_val(node);
+      if (s->closing && s->armed) {
+        armed = ARES_TRUE;
+      }
+    }
+    for (node = ares__llist_node_first(uring->watches); node != NULL && !armed;
+         node = ares__llist_node_next(node)) {
+      const ares__uring_watch_t *watch = ares__llist_node_val(node);
+      if (watch->closing && watch->armed) {
+        armed = ARES_TRUE;
+      }
+    }
+
+    if (!armed && !uring_sends_pending(uring, sock)) {
+      break;
+    }
+
+    if (!uring_wait(uring)) {
+      break;
+    }
+  }
+}
+
+static void uring_sock_free(void *arg)
+{
+  ares__uring_sock_t *sock = arg;
+  ares__buf_destroy(sock->rx);
+  ares_free(sock);
+}
+
+static void uring_update_state(ares_channel channel)
+{
+  ares__uring_t *uring  = channel->uring;
+  int            events = 0;
+  int            old_events;
+
+  ares__llist_node_t *node;
+
+  if (ares__llist_len(uring->socks) > 0) {
+    events |= ARES_SOCK_READ;
+  }
+  if (uring->to_submit > 0) {
+    events |= ARES_SOCK_WRITE;
+  }
+
+  /* Data queued for a socket is only handed to the ring during a processing
+   * pass, so the application needs to be told to run one */
+  for (node = ares__llist_node_first(uring->socks);
+       node != NULL && !(events & ARES_SOCK_WRITE);
+       node = ares__llist_node_next(node)) {
+    const ares__uring_sock_t *sock = ares__llist_node_val(node);
+    if (sock->events & ARES_SOCK_WRITE) {
+      events |= ARES_SOCK_WRITE;
+    }
+  }
+
+  if (events == uring->sock_state) {
+    return;
+  }
+
+  old_events        = uring->sock_state;
+  uring->sock_state = events;
+  channel->sock_generation++;
+
+  if (channel->sock_state_cb) {
+    channel->sock_state_cb(channel->sock_state_cb_data, uring->fd,
+                           (events & ARES_SOCK_READ) ? 1 : 0,
+                           (events & ARES_SOCK_WRITE) ? 1 : 0);
+  }
+
+  if (channel->sock_change_cb) {
+    channel->sock_change_cb(channel->sock_change_cb_data, uring->fd,
+                            old_events, events);
+  }
+}
+
+ares_status_t ares__uring_create(ares_channel channel)
+{
+  ares__uring_t         *uring;
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  unsigned short          i;
+
+  if (channel->uring != NULL) {
+    return ARES_SUCCESS;
+  }
+
+  uring = ares_malloc_zero(sizeof(*uring));
+  if (uring == NULL) {
+    return ARES_ENOMEM;
+  }
+  uring->fd     = -1;
+  uring->sq_ptr = MAP_FAILED;
+  uring->cq_ptr = MAP_FAILED;
+  uring->br     = MAP_FAILED;
+  uring->sqes   = MAP_FAILED;
+
+  uring->socks_by_fd = ares__htable_asvp_create(uring_sock_free);
+  uring->socks       = ares__llist_create(NULL);
+  uring->sends       = ares__llist_create(ares_free);
+  uring->watches     = ares__llist_create(ares_free);
+  uring->bufs = ares_malloc((size_t)ARES_URING_NBUFS * ARES_URING_BUFSZ);
+  if (uring->socks_by_fd == NULL || uring->socks == NULL ||
+      uring->sends == NULL || uring->watches == NULL || uring->bufs == NULL) {
+    goto fail;
+  }
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CLAMP;
+  uring->fd = (int)syscall(__NR_io_uring_setup, ARES_URING_ENTRIES, &params);
+  if (uring->fd < 0) {
+    goto fail;
+  }
+  (void)fcntl(uring->fd, F_SETFD, FD_CLOEXEC);
+
+  uring->sq_len =
+    params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  uring->cq_len =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_len > uring->sq_len) {
+      uring->sq_len = uring->cq_len;
+    }
+    uring->cq_len = uring->sq_len;
+  }
+
+  uring->sq_ptr = mmap(NULL, uring->sq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  if (uring->sq_ptr == MAP_FAILED) {
+    goto fail;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    uring->cq_ptr = uring->sq_ptr;
+  } else {
+    uring->cq_ptr = mmap(NULL, uring->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring->fd,
+                         IORING_OFF_CQ_RING);
+    if (uring->cq_ptr == MAP_FAILED) {
+      goto fail;
+    }
+  }
+
+  uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    goto fail;
+  }
+
+  uring->sq_head    = (unsigned int *)((unsigned char *)uring->sq_ptr +
+                                    params.sq_off.head);
+  uring->sq_tail    = (unsigned int *)((unsigned char *)uring->sq_ptr +
+                                    params.sq_off.tail);
+  uring->sq_array   = (unsigned int *)((unsigned char *)uring->sq_ptr +
+                                     params.sq_off.array);
+  uring->sq_mask    = *(unsigned int *)((unsigned char *)uring->sq_ptr +
+                                     params.sq_off.ring_mask);
+  uring->sq_entries = params.sq_entries;
+  uring->cq_head    = (unsigned int *)((unsigned char *)uring->cq_ptr +
+                                    params.cq_off.head);
+  uring->cq_tail    = (unsigned int *)((unsigned char *)uring->cq_ptr +
+                                    params.cq_off.tail);
+  uring->cq_mask    = *(unsigned int *)((unsigned char *)uring->cq_ptr +
+                                     params.cq_off.ring_mask);
+  uring->cqes       = (struct io_uring_cqe *)((unsigned char *)uring->cq_ptr +
+                                        params.cq_off.cqes);
+
+  /* The provided buffer ring has to be page aligned */
+  uring->br_len = ARES_URING_NBUFS * sizeof(struct io_uring_buf);
+  uring->br     = mmap(NULL, uring->br_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (uring->br == MAP_FAILED) {
+    goto fail;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (unsigned long long)(size_t)uring->br;
+  reg.ring_entries = ARES_URING_NBUFS;
+  reg.bgid         = ARES_URING_BGID;
+  if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) != 0) {
+    goto fail;
+  }
+
+  for (i = 0; i < ARES_URING_NBUFS; i++) {
+    uring_buf_recycle(uring, i);
+  }
+
+  channel->uring = uring;
+  return ARES_SUCCESS;
+
+fail:
+  channel->uring = uring;
+  ares__uring_destroy(channel);
+  return ARES_ENOTIMP;
+}
+
+void ares__uring_destroy(ares_channel channel)
+{
+  ares__uring_t *uring = channel->uring;
+
+  if (uring == NULL) {
+    return;
+  }
+
+  /* The kernel may still write into the receive buffers and read from the
+   * send buffers, so wait for it to finish with them before freeing */
+  if (uring->fd >= 0 && uring->sqes != MAP_FAILED &&
+      uring->cq_ptr != MAP_FAILED) {
+    uring_quiesce(uring, NULL);
+  }
+
+  if (uring->br != MAP_FAILED) {
+    munmap(uring->br, uring->br_len);
+  }
+  if (uring->sqes != MAP_FAILED) {
+    munmap(uring->sqes, uring->sqes_len);
+  }
+  if (uring->cq_ptr != MAP_FAILED && uring->cq_ptr != uring->sq_ptr) {
+    munmap(uring->cq_ptr, uring->cq_len);
+  }
+  if (uring->sq_ptr != MAP_FAILED) {
+    munmap(uring->sq_ptr, uring->sq_len);
+  }
+  if (uring->fd >= 0) {
+    close(uring->fd);
+  }
+
+  ares__llist_destroy(uring->watches);
+  ares__llist_destroy(uring->sends);
+  ares__llist_destroy(uring->socks);
+  ares__htable_asvp_destroy(uring->socks_by_fd);
+  ares_free(uring->bufs);
+  ares_free(uring);
+  channel->uring = NULL;
+}
+
+ares_socket_t ares__uring_fd(const ares_channel channel)
+{
+  if (channel->uring == NULL) {
+    return ARES_SOCKET_BAD;
+  }
+  return channel->uring->fd;
+}
+
+int ares__uring_sock_state(const ares_channel channel)
+{
+  if (channel->uring == NULL) {
+    return 0;
+  }
+  return channel->uring->sock_state;
+}
+
+ares_bool_t ares__uring_has(const ares_channel channel, ares_socket_t fd)
+{
+  return uring_sock(channel, fd) != NULL ? ARES_TRUE : ARES_FALSE;
+}
+
+void ares__uring_conn_state(ares_channel channel, ares_socket_t fd,
+                            int events)
+{
+  ares__uring_sock_t *sock = uring_sock(channel, fd);
+
+  if (sock == NULL) {
+    return;
+  }
+
+  sock->events = events;
+  uring_update_state(channel);
+}
+
+ares_status_t ares__uring_add(ares_channel              channel,
+                              struct server_connection *conn)
+{
+  ares__uring_t      *uring = channel->uring;
+  ares__uring_sock_t *sock;
+
+  /* Custom socket functions may not even hand us real sockets, and batch
+   * hooks expect to see every read and write */
+  if (uring == NULL || channel->sock_funcs != NULL ||
+      channel->sock_batch_funcs != NULL) {
+    return ARES_SUCCESS;
+  }
+
+  sock = ares_malloc_zero(sizeof(*sock));
+  if (sock == NULL) {
+    return ARES_ENOMEM;
+  }
+
+  sock->fd     = conn->fd;
+  sock->is_tcp = conn->is_tcp;
+  sock->gen    = ++uring->gen;
+  sock->rx     = ares__buf_create();
+  if (sock->rx == NULL) {
+    ares_free(sock);
+    return ARES_ENOMEM;
+  }
+
+  /* Used to report where datagrams came from.  UDP sockets are connected,
+   * so the kernel only ever delivers datagrams from this address */
+  sock->peer_len = sizeof(sock->peer);
+  if (!sock->is_tcp &&
+      getpeername(sock->fd, &sock->peer.sa, &sock->peer_len) != 0) {
+    sock->peer_len = 0;
+  }
+
+  sock->node = ares__llist_insert_last(uring->socks, sock);
+  if (sock->node == NULL) {
+    uring_sock_free(sock);
+    return ARES_ENOMEM;
+  }
+
+  if (!ares__htable_asvp_insert(uring->socks_by_fd, sock->fd, sock)) {
+    ares__llist_node_claim(sock->node);
+    uring_sock_free(sock);
+    return ARES_ENOMEM;
+  }
+
+  uring_arm(uring, sock);
+  uring_update_state(channel);
+  return ARES_SUCCESS;
+}
+
+void ares__uring_remove(ares_channel channel, ares_socket_t fd)
+{
+  ares__uring_t      *uring = channel->uring;
+  ares__uring_sock_t *sock  = uring_sock(channel, fd);
+
+  if (sock == NULL) {
+    return;
+  }
+
+  /* The ring holds a reference to the socket while a request on it is in
+   * flight, so they have to be cancelled for the close to take effect */
+  uring_quiesce(uring, sock);
+
+  ares__llist_node_claim(sock->node);
+  ares__htable_asvp_remove(uring->socks_by_fd, fd);
+  uring_update_state(channel);
+}
+
+ares_status_t ares__uring_watch(ares_channel channel, ares_socket_t fd)
+{
+  ares__uring_t       *uring = channel->uring;
+  ares__uring_watch_t *watch;
+
+  if (uring == NULL) {
+    return ARES_SUCCESS;
+  }
+
+  watch = ares_malloc_zero(sizeof(*watch));
+  if (watch == NULL) {
+    return ARES_ENOMEM;
+  }
+  watch->fd = fd;
+
+  watch->node = ares__llist_insert_last(uring->watches, watch);
+  if (watch->node == NULL) {
+    ares_free(watch);
+    return ARES_ENOMEM;
+  }
+
+  /* The application may start waiting on the ring straight away */
+  uring_arm_watch(uring, watch);
+  uring_submit(uring);
+  return ARES_SUCCESS;
+}
+
+void ares__uring_unwatch(ares_channel channel, ares_socket_t fd)
+{
+  ares__uring_t       *uring = channel->uring;
+  ares__uring_watch_t *watch;
+
+  if (uring == NULL) {
+    return;
+  }
+
+  watch = uring_watch(uring, fd);
+  if (watch == NULL) {
+    return;
+  }
+
+  /* The poll refers to the descriptor, which is about to be closed */
+  watch->closing = ARES_TRUE;
+  if (watch->armed) {
+    uring_cancel(uring, uring_poll_tag(watch));
+  }
+  for (;;) {
+    uring_reap(uring);
+    if (!watch->armed || !uring_wait(uring)) {
+      break;
+    }
+  }
+
+  ares__llist_node_destroy(watch->node);
+}
+
+ares_ssize_t ares__uring_recv(ares_channel channel, ares_socket_t fd,
+                              void *data, size_t data_len,
+                              struct sockaddr *from, ares_socklen_t *from_len)
+{
+  ares__uring_sock_t *sock = uring_sock(channel, fd);
+  size_t              len;
+
+  if (sock == NULL) {
+    SET_SOCKERRNO(EBADF);
+    return -1;
+  }
+
+  if (ares__buf_len(sock->rx) == 0) {
+    uring_reap(channel->uring);
+  }
+
+  if (ares__buf_len(sock->rx) == 0) {
+    if (sock->err != 0) {
+      SET_SOCKERRNO(sock->err);
+      return -1;
+    }
+    if (sock->eof) {
+      return 0;
+    }
+    SET_SOCKERRNO(EAGAIN);
+    return -1;
+  }
+
+  if (sock->is_tcp) {
+    len = ares__buf_len(sock->rx);
+    if (len > data_len) {
+      len = data_len;
+    }
+    ares__buf_fetch_bytes(sock->rx, (unsigned char *)data, len);
+    return (ares_ssize_t)len;
+  }
+
+  {
+    unsigned short dlen = 0;
+    ares__buf_fetch_be16(sock->rx, &dlen);
+    len = dlen;
+  }
+
+  if (len > data_len) {
+    /* Truncate like recvfrom() does */
+    ares__buf_fetch_bytes(sock->rx, (unsigned char *)data, data_len);
+    ares__buf_consume(sock->rx, len - data_len);
+    len = data_len;
+  } else {
+    ares__buf_fetch_bytes(sock->rx, (unsigned char *)data, len);
+  }
+
+  if (from != NULL && from_len != NULL) {
+    if (*from_len > sock->peer_len) {
+      *from_len = sock->peer_len;
+    }
+    memcpy(from, &sock->peer, *from_len);
+  }
+
+  return (ares_ssize_t)len;
+}
+
+ares_ssize_t ares__uring_send(ares_channel channel, ares_socket_t fd,
+                              const void *data, size_t len)
+{
+  ares__uring_t      *uring = channel->uring;
+  ares__uring_sock_t *sock  = uring_sock(channel, fd);
+  ares__uring_send_t *req;
+  struct io_uring_sqe sqe;
+
+  if (sock == NULL) {
+    SET_SOCKERRNO(EBADF);
+    return -1;
+  }
+
+  if (sock->err != 0) {
+    SET_SOCKERRNO(sock->err);
+    return -1;
+  }
+
+  /* The data has to stay around until the kernel is done with it */
+  req = ares_malloc(sizeof(*req) + len);
+  if (req == NULL) {
+    SET_SOCKERRNO(ENOMEM);
+    return -1;
+  }
+  req->fd  = fd;
+  req->gen = sock->gen;
+  req->len = len;
+  memcpy(req->data, data, len);
+
+  req->node = ares__llist_insert_last(uring->sends, req);
+  if (req->node == NULL) {
+    ares_free(req);
+    SET_SOCKERRNO(ENOMEM);
+    return -1;
+  }
+
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode    = IORING_OP_SEND;
+  sqe.fd        = fd;
+  sqe.addr      = (unsigned long long)(size_t)req->data;
+  sqe.len       = (unsigned int)len;
+  sqe.msg_flags = sock->is_tcp ? MSG_WAITALL : 0;
+  sqe.user_data = (unsigned long long)(size_t)req;
+
+  if (!uring_queue(uring, &sqe)) {
+    ares__llist_node_destroy(req->node);
+    SET_SOCKERRNO(EAGAIN);
+    return -1;
+  }
+
+  uring_update_state(channel);
+  return (ares_ssize_t)len;
+}
+
+size_t ares__uring_poll(ares_channel channel, ares_event_ready_t *ready,
+                        size_t max_ready)
+{
+  ares__llist_node_t *node;
+  size_t              cnt = 0;
+
+  if (channel->uring == NULL) {
+    return 0;
+  }
+
+  uring_reap(channel->uring);
+
+  for (node = ares__llist_node_first(channel->uring->watches);
+       node != NULL && cnt < max_ready; node = ares__llist_node_next(node)) {
+    ares__uring_watch_t *watch = ares__llist_node_val(node);
+
+    if (!watch->fired) {
+      continue;
+    }
+
+    watch->fired        = ARES_FALSE;
+    ready[cnt].fd       = watch->fd;
+    ready[cnt].readable = ARES_TRUE;
+    ready[cnt].writable = ARES_FALSE;
+    cnt++;
+  }
+
+  for (node = ares__llist_node_first(channel->uring->socks);
+       node != NULL && cnt < max_ready; node = ares__llist_node_next(node)) {
+    const ares__uring_sock_t *sock = ares__llist_node_val(node);
+
+    if (ares__buf_len(sock->rx) == 0 && sock->err == 0 && !sock->eof) {
+      continue;
+    }
+
+    ready[cnt].fd       = sock->fd;
+    ready[cnt].readable = ARES_TRUE;
+    ready[cnt].writable = ARES_FALSE;
+    cnt++;
+  }
+
+  return cnt;
+}
+
+void ares__uring_submit(ares_channel channel)
+{
+  if (channel->uring == NULL) {
+    return;
+  }
+
+  uring_submit(channel->uring);
+  uring_update_state(channel);
+}
+
+#else
+
+ares_status_t ares__uring_create(ares_channel channel)
+{
+  (void)channel;
+  return ARES_ENOTIMP;
+}
+
+void ares__uring_destroy(ares_channel channel)
+{
+  (void)channel;
+}
+
+ares_socket_t ares__uring_fd(const ares_channel channel)
+{
+  (void)channel;
+  return ARES_SOCKET_BAD;
+}
+
+int ares__uring_sock_state(const ares_channel channel)
+{
+  (void)channel;
+  return 0;
+}
+
+ares_bool_t ares__uring_has(const ares_channel channel, ares_socket_t fd)
+{
+  (void)channel;
+  (void)fd;
+  return ARES_FALSE;
+}
+
+void ares__uring_conn_state(ares_channel channel, ares_socket_t fd,
+                            int events)
+{
+  (void)channel;
+  (void)fd;
+  (void)events;
+}
+
+ares_status_t ares__uring_add(ares_channel              channel,
+                              struct server_connection *conn)
+{
+  (void)channel;
+  (void)conn;
+  return ARES_SUCCESS;
+}
+
+void ares__uring_remove(ares_channel channel, ares_socket_t fd)
+{
+  (void)channel;
+  (void)fd;
+}
+
+ares_status_t ares__uring_watch(ares_channel channel, ares_socket_t fd)
+{
+  (void)channel;
+  (void)fd;
+  return ARES_SUCCESS;
+}
+
+void ares__uring_unwatch(ares_channel channel, ares_socket_t fd)
+{
+  (void)channel;
+  (void)fd;
+}
+
+ares_ssize_t ares__uring_recv(ares_channel channel, ares_socket_t fd,
+                              void *data, size_t data_len,
+                              struct sockaddr *from, ares_socklen_t *from_len)
+{
+  (void)channel;
+  (void)fd;
+  (void)data;
+  (void)data_len;
+  (void)from;
+  (void)from_len;
+  SET_SOCKERRNO(EBADF);
+  return -1;
+}
+
+ares_ssize_t ares__uring_send(ares_channel channel, ares_socket_t fd,
+                              const void *data, size_t len)
+{
+  (void)channel;
+  (void)fd;
+  (void)data;
+  (void)len;
+  SET_SOCKERRNO(EBADF);
+  return -1;
+}
+
+size_t ares__uring_poll(ares_channel channel, ares_event_ready_t *ready,
+                        size_t max_ready)
+{
+  (void)channel;
+  (void)ready;
+  (void)max_ready;
+  return 0;
+}
+
+void ares__uring_submit(ares_channel channel)
+{
+  (void)channel;
+}
+
+#endif
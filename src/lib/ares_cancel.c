@@ -35,8 +35,10 @@
  * on the given channel. It does NOT kill the channel, use ares_destroy() for
  * that.
  */
-void ares_cancel(ares_channel channel)
+static void ares_cancel_int(ares_channel channel)
 {
+  ares__submitq_cancel(channel, ARES_ECANCELLED);
+
   if (ares__llist_len(channel->all_queries) > 0) {
     ares__llist_node_t *node = NULL;
     ares__llist_node_t *next = NULL;
@@ -55,10 +57,18 @@ void ares_cancel(ares_channel channel)
       return;
     }
 
+    /* Queries issued by the callbacks below must not wait on a query that
+     * is about to be cancelled */
+    for (node = ares__llist_node_first(list_copy); node != NULL;
+         node = ares__llist_node_next(node)) {
+      ares__query_coalesce_close(ares__llist_node_val(node));
+    }
+
     node = ares__llist_node_first(list_copy);
     while (node != NULL) {
       struct query *query;
-      ares_socket_t fd = ARES_SOCKET_BAD;
+      ares_socket_t fd       = ARES_SOCKET_BAD;
+      ares_socket_t hedge_fd = ARES_SOCKET_BAD;
 
       /* Cache next since this node is being deleted */
       next = ares__llist_node_next(node);
@@ -70,15 +80,21 @@ void ares_cancel(ares_channel channel)
       if (query->conn) {
         fd = query->conn->fd;
       }
+      if (query->hedge_conn) {
+        hedge_fd = query->hedge_conn->fd;
+      }
 
       /* NOTE: its possible this may enqueue new queries */
-      query->callback(query->arg, ARES_ECANCELLED, 0, NULL, 0);
+      ares__query_notify(query, ARES_ECANCELLED, 0, NULL, 0, NULL);
       ares__free_query(query);
 
       /* See if the connection should be cleaned up */
       if (fd != ARES_SOCKET_BAD) {
         ares__check_cleanup_conn(channel, fd);
       }
+      if (hedge_fd != ARES_SOCKET_BAD) {
+        ares__check_cleanup_conn(channel, hedge_fd);
+      }
 
       node = next;
     }
@@ -86,3 +102,10 @@ void ares_cancel(ares_channel channel)
     ares__llist_destroy(list_copy);
   }
 }
+
+void ares_cancel(ares_channel channel)
+{
+  ares__channel_lock(channel);
+  ares_cancel_int(channel);
+  ares__channel_unlock(channel);
+}
@@ -25,6 +25,9 @@
 /* Use resolver library to configure cares */
 #cmakedefine CARES_USE_LIBRESOLV
 
+/* Defined for build with thread-safety support */
+#cmakedefine CARES_THREADS
+
 /* if a /etc/inet dir is being used */
 #undef ETC_INET
 
@@ -91,6 +94,9 @@
 /* Define to 1 if you have the <dlfcn.h> header file. */
 #cmakedefine HAVE_DLFCN_H
 
+/* Define to 1 if you have the epoll_create1 function. */
+#cmakedefine HAVE_EPOLL
+
 /* Define to 1 if you have the <errno.h> header file. */
 #cmakedefine HAVE_ERRNO_H
 
@@ -221,9 +227,15 @@
 /* Define to 1 if you have the recvfrom function. */
 #cmakedefine HAVE_RECVFROM
 
+/* Define to 1 if you have the recvmmsg function. */
+#cmakedefine HAVE_RECVMMSG
+
 /* Define to 1 if you have the send function. */
 #cmakedefine HAVE_SEND
 
+/* Define to 1 if you have the sendmmsg function. */
+#cmakedefine HAVE_SENDMMSG
+
 /* Define to 1 if you have the setsockopt function. */
 #cmakedefine HAVE_SETSOCKOPT
 
@@ -302,6 +314,18 @@
 /* Define to 1 if you have the timeval struct. */
 #cmakedefine HAVE_STRUCT_TIMEVAL
 
+/* Define to 1 if you have the <sys/epoll.h> header file. */
+#cmakedefine HAVE_SYS_EPOLL_H
+
+/* Define to 1 if you have the <sys/eventfd.h> header file. */
+#cmakedefine HAVE_SYS_EVENTFD_H
+
+/* Define to 1 if you have the <sys/inotify.h> header file. */
+#cmakedefine HAVE_SYS_INOTIFY_H
+
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+#cmakedefine HAVE_LINUX_IO_URING_H
+
 /* Define to 1 if you have the <sys/ioctl.h> header file. */
 #cmakedefine HAVE_SYS_IOCTL_H
 
@@ -69,18 +69,21 @@ void ares_destroy(ares_channel channel)
   }
 
   /* Destroy all queries */
+  ares__channel_lock(channel);
   node = ares__llist_node_first(channel->all_queries);
   while (node != NULL) {
     ares__llist_node_t *next  = ares__llist_node_next(node);
     struct query       *query = ares__llist_node_claim(node);
 
     query->node_all_queries = NULL;
-    query->callback(query->arg, ARES_EDESTRUCTION, 0, NULL, 0);
+    ares__query_notify(query, ARES_EDESTRUCTION, 0, NULL, 0, NULL);
     ares__free_query(query);
 
     node = next;
   }
-
+  ares__submitq_destroy(channel);
+  ares__filewatch_destroy(channel);
+  ares__channel_unlock(channel);
 
 #ifndef NDEBUG
   /* Freeing the query should remove it from all the lists in which it sits,
@@ -89,6 +92,9 @@ void ares_destroy(ares_channel channel)
   assert(ares__llist_len(channel->all_queries) == 0);
   assert(ares__htable_szvp_num_keys(channel->queries_by_qid) == 0);
   assert(ares__slist_len(channel->queries_by_timeout) == 0);
+  assert(ares__slist_len(channel->queries_by_stale) == 0);
+  assert(ares__timerwheel_len(channel->timerwheel) == 0);
+  assert(ares__htable_strvp_num_keys(channel->queries_by_question) == 0);
 #endif
 
   ares__destroy_servers_state(channel);
@@ -97,6 +103,10 @@ void ares_destroy(ares_channel channel)
   assert(ares__htable_asvp_num_keys(channel->connnode_by_socket) == 0);
 #endif
 
+  ares__event_destroy(channel);
+  ares__uring_destroy(channel);
+  ares_free(channel->udp_rbuf);
+
   if (channel->domains) {
     for (i = 0; i < channel->ndomains; i++) {
       ares_free(channel->domains[i]);
@@ -106,8 +116,15 @@ void ares_destroy(ares_channel channel)
 
   ares__llist_destroy(channel->all_queries);
   ares__slist_destroy(channel->queries_by_timeout);
+  ares__timerwheel_destroy(channel->timerwheel);
+  ares__query_pool_destroy(channel);
+  ares__qcache_destroy(channel->qcache);
+  ares__tcpcache_destroy(channel->tcpcache);
+  ares__slist_destroy(channel->queries_by_stale);
+  ares__htable_strvp_destroy(channel->queries_by_question);
   ares__htable_szvp_destroy(channel->queries_by_qid);
   ares__htable_asvp_destroy(channel->connnode_by_socket);
+  ares__llist_destroy(channel->udp_send_conns);
 
   if (channel->sortlist) {
     ares_free(channel->sortlist);
@@ -131,6 +148,9 @@ void ares_destroy(ares_channel channel)
 
   ares__hosts_file_destroy(channel->hf);
 
+  ares__thread_cond_destroy(channel->cond_empty);
+  ares__thread_mutex_destroy(channel->lock);
+
   ares_free(channel);
 }
 
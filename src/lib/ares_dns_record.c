@@ -69,6 +69,14 @@ unsigned short ares_dns_record_get_id(const ares_dns_record_t *dnsrec)
   return dnsrec->id;
 }
 
+void ares_dns_record_set_id(ares_dns_record_t *dnsrec, unsigned short id)
+{
+  if (dnsrec == NULL) {
+    return;
+  }
+  dnsrec->id = id;
+}
+
 unsigned short ares_dns_record_get_flags(const ares_dns_record_t *dnsrec)
 {
   if (dnsrec == NULL) {
@@ -446,6 +454,13 @@ ares_dns_rr_t *ares_dns_record_rr_get(ares_dns_record_t *dnsrec,
   return &rr_ptr[idx];
 }
 
+const ares_dns_rr_t *
+  ares_dns_record_rr_get_const(const ares_dns_record_t *dnsrec,
+                               ares_dns_section_t sect, size_t idx)
+{
+  return ares_dns_record_rr_get((void *)((size_t)dnsrec), sect, idx);
+}
+
 const char *ares_dns_rr_get_name(const ares_dns_rr_t *rr)
 {
   if (rr == NULL) {
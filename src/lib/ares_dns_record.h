@@ -313,6 +313,14 @@ void              ares_dns_record_destroy(ares_dns_record_t *dnsrec);
  */
 unsigned short    ares_dns_record_get_id(const ares_dns_record_t *dnsrec);
 
+/*! Set the DNS Query ID
+ *
+ *  \param[in] dnsrec  Initialized record object
+ *  \param[in] id      DNS query id
+ */
+void              ares_dns_record_set_id(ares_dns_record_t *dnsrec,
+                                         unsigned short     id);
+
 /*! Get the DNS Record Flags
  *
  *  \param[in] dnsrec  Initialized record object
@@ -408,6 +416,17 @@ ares_status_t     ares_dns_record_rr_add(ares_dns_rr_t    **rr_out,
 ares_dns_rr_t    *ares_dns_record_rr_get(ares_dns_record_t *dnsrec,
                                          ares_dns_section_t sect, size_t idx);
 
+/*! Fetch a read-only resource record based on the section and index.
+ *
+ *  \param[in]  dnsrec   Initialized record object
+ *  \param[in]  sect     Section for resource record
+ *  \param[in]  idx      Index of resource record in section
+ *  \param NULL on misuse, otherwise a const pointer to the resource record
+ */
+const ares_dns_rr_t *
+  ares_dns_record_rr_get_const(const ares_dns_record_t *dnsrec,
+                               ares_dns_section_t sect, size_t idx);
+
 
 /*! Retrieve a list of Resource Record keys that can be set or retrieved for
  *  the Resource record type.
@@ -0,0 +1,312 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#  include <sys/epoll.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#include "ares.h"
+#include "ares_private.h"
+
+#if defined(HAVE_EPOLL) && defined(HAVE_SYS_EPOLL_H)
+#  define USE_EPOLL 1
+#endif
+
+/* Interest currently registered for a connection, kept in
+ * server_connection::event_flags so updates only hit the kernel when the
+ * interest actually changes */
+#define ARES_EVENT_READ  (1 << 0)
+#define ARES_EVENT_WRITE (1 << 1)
+
+struct ares_event {
+  int epfd;
+};
+
+#ifdef USE_EPOLL
+
+ares_status_t ares__event_update(ares_channel channel, ares_socket_t fd,
+                                 int readable, int writable)
+{
+  ares__llist_node_t       *node;
+  struct server_connection *conn;
+  unsigned int              flags = 0;
+  int                       op;
+  struct epoll_event        ev;
+
+  if (channel->event == NULL) {
+    return ARES_SUCCESS;
+  }
+
+  node = ares__htable_asvp_get_direct(channel->connnode_by_socket, fd);
+  if (node == NULL) {
+    return ARES_SUCCESS;
+  }
+  conn = ares__llist_node_val(node);
+
+  if (readable) {
+    flags |= ARES_EVENT_READ;
+  }
+  if (writable) {
+    flags |= ARES_EVENT_WRITE;
+  }
+
+  if (flags == conn->event_flags) {
+    return ARES_SUCCESS;
+  }
+
+  if (flags == 0) {
+    op = EPOLL_CTL_DEL;
+  } else if (conn->event_flags == 0) {
+    op = EPOLL_CTL_ADD;
+  } else {
+    op = EPOLL_CTL_MOD;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  if (flags & ARES_EVENT_READ) {
+    ev.events |= EPOLLIN;
+  }
+  if (flags & ARES_EVENT_WRITE) {
+    ev.events |= EPOLLOUT;
+  }
+  ev.data.fd = fd;
+
+  if (epoll_ctl(channel->event->epfd, op, fd, &ev) != 0) {
+    return ARES_ECONNREFUSED;
+  }
+
+  conn->event_flags = flags;
+  return ARES_SUCCESS;
+}
+
+size_t ares__event_poll(ares_event_t *event, ares_event_ready_t *ready,
+                        size_t max_ready)
+{
+  struct epoll_event evs[ARES_EVENT_MAX_READY];
+  int                rv;
+  size_t             i;
+
+  if (event == NULL || ready == NULL || max_ready == 0) {
+    return 0;
+  }
+
+  if (max_ready > ARES_EVENT_MAX_READY) {
+    max_ready = ARES_EVENT_MAX_READY;
+  }
+
+  rv = epoll_wait(event->epfd, evs, (int)max_ready, 0);
+  if (rv <= 0) {
+    return 0;
+  }
+
+  for (i = 0; i < (size_t)rv; i++) {
+    ready[i].fd = evs[i].data.fd;
+    /* Errors and hangups are reported via the read path so the connection
+     * gets torn down and its queries requeued */
+    ready[i].readable = (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                          ? ARES_TRUE
+                          : ARES_FALSE;
+    ready[i].writable = (evs[i].events & EPOLLOUT) ? ARES_TRUE : ARES_FALSE;
+  }
+
+  return (size_t)rv;
+}
+
+static ares_status_t ares_event_engine_enable_int(ares_channel channel)
+{
+  ares_event_t *event;
+  size_t        i;
+
+  /* The io_uring descriptor already covers every socket of the channel */
+  if (channel->event != NULL || channel->uring != NULL) {
+    return ARES_SUCCESS;
+  }
+
+  event = ares_malloc_zero(sizeof(*event));
+  if (event == NULL) {
+    return ARES_ENOMEM;
+  }
+
+  event->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (event->epfd == -1) {
+    ares_free(event);
+    return ARES_ENOMEM;
+  }
+
+  channel->event = event;
+
+  /* The submission queue's wake ups are watched for as long as it exists */
+  if (channel->submitq != NULL) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN;
+    ev.data.fd = ares__submitq_fd(channel);
+    if (epoll_ctl(event->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) != 0) {
+      ares__event_destroy(channel);
+      return ARES_ENOMEM;
+    }
+  }
+
+  /* As are changes to the hosts file and resolv.conf */
+  if (ares__filewatch_fd(channel) != ARES_SOCKET_BAD) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN;
+    ev.data.fd = ares__filewatch_fd(channel);
+    if (epoll_ctl(event->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) != 0) {
+      ares__event_destroy(channel);
+      return ARES_ENOMEM;
+    }
+  }
+
+  /* Pick up any connections that were opened before the engine existed */
+  for (i = 0; i < channel->nservers; i++) {
+    ares__llist_node_t *node;
+
+    for (node = ares__llist_node_first(channel->servers[i].connections);
+         node != NULL; node = ares__llist_node_next(node)) {
+      const struct server_connection *conn = ares__llist_node_val(node);
+      int writable = (conn->sock_state & ARES_SOCK_WRITE) ? 1 : 0;
+
+      if (ares__event_update(channel, conn->fd, 1, writable) != ARES_SUCCESS) {
+        ares__event_destroy(channel);
+        return ARES_ENOMEM;
+      }
+    }
+  }
+
+  return ARES_SUCCESS;
+}
+
+int ares_event_engine_enable(ares_channel channel)
+{
+  ares_status_t status;
+
+  if (channel == NULL) {
+    return ARES_EFORMERR;
+  }
+
+  ares__channel_lock(channel);
+  status = ares_event_engine_enable_int(channel);
+  ares__channel_unlock(channel);
+  return (int)status;
+}
+
+ares_socket_t ares_event_engine_fd(ares_channel channel)
+{
+  ares_socket_t fd = ARES_SOCKET_BAD;
+
+  if (channel == NULL) {
+    return ARES_SOCKET_BAD;
+  }
+
+  ares__channel_lock(channel);
+  if (channel->uring != NULL) {
+    fd = ares__uring_fd(channel);
+  } else if (channel->event != NULL) {
+    fd = channel->event->epfd;
+  }
+  ares__channel_unlock(channel);
+  return fd;
+}
+
+void ares__event_destroy(ares_channel channel)
+{
+  size_t i;
+
+  if (channel->event == NULL) {
+    return;
+  }
+
+  /* Forget what was registered so a later re-enable starts clean */
+  for (i = 0; i < channel->nservers; i++) {
+    ares__llist_node_t *node;
+
+    for (node = ares__llist_node_first(channel->servers[i].connections);
+         node != NULL; node = ares__llist_node_next(node)) {
+      struct server_connection *conn = ares__llist_node_val(node);
+      conn->event_flags              = 0;
+    }
+  }
+
+  close(channel->event->epfd);
+  ares_free(channel->event);
+  channel->event = NULL;
+}
+
+#else
+
+ares_status_t ares__event_update(ares_channel channel, ares_socket_t fd,
+                                 int readable, int writable)
+{
+  (void)channel;
+  (void)fd;
+  (void)readable;
+  (void)writable;
+  return ARES_SUCCESS;
+}
+
+size_t ares__event_poll(ares_event_t *event, ares_event_ready_t *ready,
+                        size_t max_ready)
+{
+  (void)event;
+  (void)ready;
+  (void)max_ready;
+  return 0;
+}
+
+int ares_event_engine_enable(ares_channel channel)
+{
+  if (channel == NULL) {
+    return ARES_EFORMERR;
+  }
+  if (channel->uring != NULL) {
+    return ARES_SUCCESS;
+  }
+  return ARES_ENOTIMP;
+}
+
+ares_socket_t ares_event_engine_fd(ares_channel channel)
+{
+  if (channel == NULL) {
+    return ARES_SOCKET_BAD;
+  }
+  return ares__uring_fd(channel);
+}
+
+void ares__event_destroy(ares_channel channel)
+{
+  (void)channel;
+}
+
+#endif
@@ -30,7 +30,8 @@
 #include "ares.h"
 #include "ares_private.h"
 
-int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
+static int ares_fds_int(ares_channel channel, fd_set *read_fds,
+                        fd_set *write_fds)
 {
   struct server_state *server;
   ares_socket_t        nfds;
@@ -40,6 +41,42 @@ int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
   size_t               active_queries = ares__llist_len(channel->all_queries);
 
   nfds = 0;
+
+  /* The io_uring descriptor stands in for all the sockets it owns */
+  if (channel->uring != NULL) {
+    ares_socket_t fd    = ares__uring_fd(channel);
+    int           state = ares__uring_sock_state(channel);
+
+    if (state & ARES_SOCK_READ) {
+      FD_SET(fd, read_fds);
+      nfds = fd + 1;
+    }
+    if (state & ARES_SOCK_WRITE) {
+      FD_SET(fd, write_fds);
+      nfds = fd + 1;
+    }
+  }
+
+  /* Wake ups for requests queued by other threads */
+  if (channel->submitq != NULL) {
+    ares_socket_t fd = ares__submitq_fd(channel);
+
+    FD_SET(fd, read_fds);
+    if (fd >= nfds) {
+      nfds = fd + 1;
+    }
+  }
+
+  /* Changes to the hosts file and resolv.conf */
+  if (ares__filewatch_fd(channel) != ARES_SOCKET_BAD) {
+    ares_socket_t fd = ares__filewatch_fd(channel);
+
+    FD_SET(fd, read_fds);
+    if (fd >= nfds) {
+      nfds = fd + 1;
+    }
+  }
+
   for (i = 0; i < channel->nservers; i++) {
     ares__llist_node_t *node;
     server = &channel->servers[i];
@@ -48,6 +85,10 @@ int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
          node = ares__llist_node_next(node)) {
       const struct server_connection *conn = ares__llist_node_val(node);
 
+      if (ares__uring_has(channel, conn->fd)) {
+        continue;
+      }
+
       /* We only need to register interest in UDP sockets if we have
        * outstanding queries.
        */
@@ -61,8 +102,23 @@ int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
       if (conn->is_tcp && ares__buf_len(server->tcp_send)) {
         FD_SET(conn->fd, write_fds);
       }
+
+      /* UDP datagrams queued for sending */
+      if (!conn->is_tcp && ares__buf_len(conn->udp_send)) {
+        FD_SET(conn->fd, write_fds);
+      }
     }
   }
 
   return (int)nfds;
 }
+
+int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
+{
+  int nfds;
+
+  ares__channel_lock(channel);
+  nfds = ares_fds_int(channel, read_fds, write_fds);
+  ares__channel_unlock(channel);
+  return nfds;
+}
@@ -96,8 +96,9 @@ static const struct ares_addrinfo_hints default_hints = {
 };
 
 /* forward declarations */
-static void        host_callback(void *arg, int status, int timeouts,
-                                 unsigned char *abuf, int alen);
+static void        host_callback(void *arg, ares_status_t status,
+                                 size_t                   timeouts,
+                                 const ares_dns_record_t *dnsrec);
 static ares_bool_t as_is_first(const struct host_query *hquery);
 static ares_bool_t as_is_only(const struct host_query *hquery);
 static ares_bool_t next_dns_lookup(struct host_query *hquery);
@@ -471,25 +472,19 @@ static void terminate_retries(struct host_query *hquery, unsigned short qid)
   query->no_retries = ARES_TRUE;
 }
 
-static void host_callback(void *arg, int status, int timeouts,
-                          unsigned char *abuf, int alen)
+static void host_callback(void *arg, ares_status_t status, size_t timeouts,
+                          const ares_dns_record_t *dnsrec)
 {
   struct host_query *hquery         = (struct host_query *)arg;
   ares_status_t      addinfostatus  = ARES_SUCCESS;
-  unsigned short     qid            = 0;
-  hquery->timeouts                 += (size_t)timeouts;
+  hquery->timeouts                 += timeouts;
   hquery->remaining--;
 
   if (status == ARES_SUCCESS) {
-    if (alen < 0) {
-      addinfostatus = ARES_EBADRESP;
-    } else {
-      addinfostatus = ares__parse_into_addrinfo(abuf, (size_t)alen, ARES_TRUE,
-                                                hquery->port, hquery->ai);
-    }
-    if (addinfostatus == ARES_SUCCESS && alen >= HFIXEDSZ) {
-      qid = DNS_HEADER_QID(abuf); /* Converts to host byte order */
-      terminate_retries(hquery, qid);
+    addinfostatus = ares__parse_into_addrinfo(dnsrec, ARES_TRUE, hquery->port,
+                                              hquery->ai);
+    if (addinfostatus == ARES_SUCCESS) {
+      terminate_retries(hquery, ares_dns_record_get_id(dnsrec));
     }
   }
 
@@ -508,26 +503,25 @@ static void host_callback(void *arg, int status, int timeouts,
       end_hquery(hquery, ARES_SUCCESS);
     } else if (status == ARES_EDESTRUCTION || status == ARES_ECANCELLED) {
       /* must make sure we don't do next_lookup() on destroy or cancel */
-      end_hquery(hquery, (ares_status_t)status);
+      end_hquery(hquery, status);
     } else if (status == ARES_ENOTFOUND || status == ARES_ENODATA ||
                addinfostatus == ARES_ENODATA) {
       if (status == ARES_ENODATA || addinfostatus == ARES_ENODATA) {
         hquery->nodata_cnt++;
       }
-      next_lookup(hquery,
-                  hquery->nodata_cnt ? ARES_ENODATA : (ares_status_t)status);
+      next_lookup(hquery, hquery->nodata_cnt ? ARES_ENODATA : status);
     } else {
-      end_hquery(hquery, (ares_status_t)status);
+      end_hquery(hquery, status);
     }
   }
 
   /* at this point we keep on waiting for the next query to finish */
 }
 
-void ares_getaddrinfo(ares_channel channel, const char *name,
-                      const char                       *service,
-                      const struct ares_addrinfo_hints *hints,
-                      ares_addrinfo_callback callback, void *arg)
+static void ares_getaddrinfo_int(ares_channel channel, const char *name,
+                                 const char                       *service,
+                                 const struct ares_addrinfo_hints *hints,
+                                 ares_addrinfo_callback callback, void *arg)
 {
   struct host_query    *hquery;
   unsigned short        port = 0;
@@ -637,6 +631,16 @@ void ares_getaddrinfo(ares_channel channel, const char *name,
   next_lookup(hquery, ARES_ECONNREFUSED /* initial error code */);
 }
 
+void ares_getaddrinfo(ares_channel channel, const char *name,
+                      const char                       *service,
+                      const struct ares_addrinfo_hints *hints,
+                      ares_addrinfo_callback callback, void *arg)
+{
+  ares__channel_lock(channel);
+  ares_getaddrinfo_int(channel, name, service, hints, callback, arg);
+  ares__channel_unlock(channel);
+}
+
 static ares_bool_t next_dns_lookup(struct host_query *hquery)
 {
   char         *s              = NULL;
@@ -669,25 +673,25 @@ static ares_bool_t next_dns_lookup(struct host_query *hquery)
   }
 
   if (s) {
-    /* NOTE: hquery may be invalidated during the call to ares_query_qid(),
+    /* NOTE: hquery may be invalidated during the call to ares_query_dnsrec(),
      *       so should not be referenced after this point */
     switch (hquery->hints.ai_family) {
       case AF_INET:
         hquery->remaining += 1;
-        ares_query_qid(hquery->channel, s, C_IN, T_A, host_callback, hquery,
-                       &hquery->qid_a);
+        ares_query_dnsrec(hquery->channel, s, C_IN, T_A, host_callback,
+                          hquery, &hquery->qid_a);
         break;
       case AF_INET6:
         hquery->remaining += 1;
-        ares_query_qid(hquery->channel, s, C_IN, T_AAAA, host_callback, hquery,
-                       &hquery->qid_aaaa);
+        ares_query_dnsrec(hquery->channel, s, C_IN, T_AAAA, host_callback,
+                          hquery, &hquery->qid_aaaa);
         break;
       case AF_UNSPEC:
         hquery->remaining += 2;
-        ares_query_qid(hquery->channel, s, C_IN, T_A, host_callback, hquery,
-                       &hquery->qid_a);
-        ares_query_qid(hquery->channel, s, C_IN, T_AAAA, host_callback, hquery,
-                       &hquery->qid_aaaa);
+        ares_query_dnsrec(hquery->channel, s, C_IN, T_A, host_callback,
+                          hquery, &hquery->qid_a);
+        ares_query_dnsrec(hquery->channel, s, C_IN, T_AAAA, host_callback,
+                          hquery, &hquery->qid_aaaa);
         break;
       default:
         break;
@@ -60,8 +60,9 @@ struct addr_query {
 };
 
 static void          next_lookup(struct addr_query *aquery);
-static void          addr_callback(void *arg, int status, int timeouts,
-                                   unsigned char *abuf, int alen);
+static void          addr_callback(void *arg, ares_status_t status,
+                                   size_t                   timeouts,
+                                   const ares_dns_record_t *dnsrec);
 static void          end_aquery(struct addr_query *aquery, ares_status_t status,
                                 struct hostent *host);
 static ares_status_t file_lookup(ares_channel            channel,
@@ -70,8 +71,9 @@ static ares_status_t file_lookup(ares_channel            channel,
 static void          ptr_rr_name(char *name, size_t name_size,
                                  const struct ares_addr *addr);
 
-void ares_gethostbyaddr(ares_channel channel, const void *addr, int addrlen,
-                        int family, ares_host_callback callback, void *arg)
+static void ares_gethostbyaddr_int(ares_channel channel, const void *addr,
+                                   int addrlen, int family,
+                                   ares_host_callback callback, void *arg)
 {
   struct addr_query *aquery;
 
@@ -106,6 +108,14 @@ void ares_gethostbyaddr(ares_channel channel, const void *addr, int addrlen,
   next_lookup(aquery);
 }
 
+void ares_gethostbyaddr(ares_channel channel, const void *addr, int addrlen,
+                        int family, ares_host_callback callback, void *arg)
+{
+  ares__channel_lock(channel);
+  ares_gethostbyaddr_int(channel, addr, addrlen, family, callback, arg);
+  ares__channel_unlock(channel);
+}
+
 static void next_lookup(struct addr_query *aquery)
 {
   const char     *p;
@@ -118,7 +128,8 @@ static void next_lookup(struct addr_query *aquery)
       case 'b':
         ptr_rr_name(name, sizeof(name), &aquery->addr);
         aquery->remaining_lookups = p + 1;
-        ares_query(aquery->channel, name, C_IN, T_PTR, addr_callback, aquery);
+        ares_query_dnsrec(aquery->channel, name, C_IN, T_PTR, addr_callback,
+                          aquery, NULL);
         return;
       case 'f':
         status = file_lookup(aquery->channel, &aquery->addr, &host);
@@ -138,27 +149,27 @@ static void next_lookup(struct addr_query *aquery)
   end_aquery(aquery, ARES_ENOTFOUND, NULL);
 }
 
-static void addr_callback(void *arg, int status, int timeouts,
-                          unsigned char *abuf, int alen)
+static void addr_callback(void *arg, ares_status_t status, size_t timeouts,
+                          const ares_dns_record_t *dnsrec)
 {
   struct addr_query *aquery = (struct addr_query *)arg;
   struct hostent    *host;
   size_t             addrlen;
 
-  aquery->timeouts += (size_t)timeouts;
+  aquery->timeouts += timeouts;
   if (status == ARES_SUCCESS) {
     if (aquery->addr.family == AF_INET) {
       addrlen = sizeof(aquery->addr.addrV4);
-      status  = ares_parse_ptr_reply(abuf, alen, &aquery->addr.addrV4,
-                                     (int)addrlen, AF_INET, &host);
+      status  = ares__parse_ptr_reply(dnsrec, &aquery->addr.addrV4,
+                                      (int)addrlen, AF_INET, &host);
     } else {
       addrlen = sizeof(aquery->addr.addrV6);
-      status  = ares_parse_ptr_reply(abuf, alen, &aquery->addr.addrV6,
-                                     (int)addrlen, AF_INET6, &host);
+      status  = ares__parse_ptr_reply(dnsrec, &aquery->addr.addrV6,
+                                      (int)addrlen, AF_INET6, &host);
     }
-    end_aquery(aquery, (ares_status_t)status, host);
+    end_aquery(aquery, status, host);
   } else if (status == ARES_EDESTRUCTION || status == ARES_ECANCELLED) {
-    end_aquery(aquery, (ares_status_t)status, NULL);
+    end_aquery(aquery, status, NULL);
   } else {
     next_lookup(aquery);
   }
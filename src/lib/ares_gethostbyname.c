@@ -100,8 +100,9 @@ static void ares_gethostbyname_callback(void *arg, int status, int timeouts,
   ares_free_hostent(hostent);
 }
 
-void ares_gethostbyname(ares_channel channel, const char *name, int family,
-                        ares_host_callback callback, void *arg)
+static void ares_gethostbyname_int(ares_channel channel, const char *name,
+                                   int family, ares_host_callback callback,
+                                   void *arg)
 {
   const struct ares_addrinfo_hints hints = { ARES_AI_CANONNAME, family, 0, 0 };
   struct host_query               *ghbn_arg;
@@ -124,6 +125,14 @@ void ares_gethostbyname(ares_channel channel, const char *name, int family,
                    ghbn_arg);
 }
 
+void ares_gethostbyname(ares_channel channel, const char *name, int family,
+                        ares_host_callback callback, void *arg)
+{
+  ares__channel_lock(channel);
+  ares_gethostbyname_int(channel, name, family, callback, arg);
+  ares__channel_unlock(channel);
+}
+
 static void sort_addresses(const struct hostent  *host,
                            const struct apattern *sortlist, size_t nsort)
 {
@@ -285,12 +294,12 @@ int ares_gethostbyname_file(ares_channel channel, const char *name, int family,
     return ARES_ENOTFOUND;
   }
 
+  ares__channel_lock(channel);
   status = ares__hosts_search_host(channel, ARES_FALSE, name, &entry);
-  if (status != ARES_SUCCESS) {
-    goto done;
+  if (status == ARES_SUCCESS) {
+    status = ares__hosts_entry_to_hostent(entry, family, host);
   }
-
-  status = ares__hosts_entry_to_hostent(entry, family, host);
+  ares__channel_unlock(channel);
   if (status != ARES_SUCCESS) {
     goto done;
   }
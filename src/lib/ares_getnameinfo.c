@@ -86,9 +86,10 @@ static void append_scopeid(const struct sockaddr_in6 *addr6,
 #endif
 STATIC_TESTABLE char *ares_striendstr(const char *s1, const char *s2);
 
-void ares_getnameinfo(ares_channel channel, const struct sockaddr *sa,
-                      ares_socklen_t salen, int flags_int,
-                      ares_nameinfo_callback callback, void *arg)
+static void ares_getnameinfo_int(ares_channel           channel,
+                                 const struct sockaddr *sa,
+                                 ares_socklen_t salen, int flags_int,
+                                 ares_nameinfo_callback callback, void *arg)
 {
   const struct sockaddr_in *addr  = NULL;
   struct sockaddr_in6      *addr6 = NULL;
@@ -185,6 +186,15 @@ void ares_getnameinfo(ares_channel channel, const struct sockaddr *sa,
   }
 }
 
+void ares_getnameinfo(ares_channel channel, const struct sockaddr *sa,
+                      ares_socklen_t salen, int flags_int,
+                      ares_nameinfo_callback callback, void *arg)
+{
+  ares__channel_lock(channel);
+  ares_getnameinfo_int(channel, sa, salen, flags_int, callback, arg);
+  ares__channel_unlock(channel);
+}
+
 static void nameinfo_callback(void *arg, int status, int timeouts,
                               struct hostent *host)
 {
@@ -29,8 +29,8 @@
 #include "ares.h"
 #include "ares_private.h"
 
-int ares_getsock(ares_channel channel, ares_socket_t *socks,
-                 int numsocks) /* size of the 'socks' array */
+static int ares_getsock_int(ares_channel channel, ares_socket_t *socks,
+                            int numsocks) /* size of the 'socks' array */
 {
   struct server_state *server;
   size_t               i;
@@ -45,6 +45,36 @@ int ares_getsock(ares_channel channel, ares_socket_t *socks,
     return 0;
   }
 
+  /* The io_uring descriptor stands in for all the sockets it owns */
+  if (channel->uring != NULL && ares__uring_sock_state(channel) != 0) {
+    int state = ares__uring_sock_state(channel);
+
+    socks[sockindex] = ares__uring_fd(channel);
+    if (state & ARES_SOCK_READ) {
+      bitmap |= ARES_GETSOCK_READABLE(setbits, sockindex);
+    }
+    if (state & ARES_SOCK_WRITE) {
+      bitmap |= ARES_GETSOCK_WRITABLE(setbits, sockindex);
+    }
+    sockindex++;
+  }
+
+  /* Wake ups for requests queued by other threads */
+  if (channel->submitq != NULL && sockindex < (size_t)numsocks &&
+      sockindex < ARES_GETSOCK_MAXNUM) {
+    socks[sockindex] = ares__submitq_fd(channel);
+    bitmap          |= ARES_GETSOCK_READABLE(setbits, sockindex);
+    sockindex++;
+  }
+
+  /* Changes to the hosts file and resolv.conf */
+  if (ares__filewatch_fd(channel) != ARES_SOCKET_BAD &&
+      sockindex < (size_t)numsocks && sockindex < ARES_GETSOCK_MAXNUM) {
+    socks[sockindex] = ares__filewatch_fd(channel);
+    bitmap          |= ARES_GETSOCK_READABLE(setbits, sockindex);
+    sockindex++;
+  }
+
   for (i = 0; i < channel->nservers; i++) {
     ares__llist_node_t *node;
     server = &channel->servers[i];
@@ -57,6 +87,10 @@ int ares_getsock(ares_channel channel, ares_socket_t *socks,
         break;
       }
 
+      if (ares__uring_has(channel, conn->fd)) {
+        continue;
+      }
+
       /* We only need to register interest in UDP sockets if we have
        * outstanding queries.
        */
@@ -75,8 +109,107 @@ int ares_getsock(ares_channel channel, ares_socket_t *socks,
         bitmap |= ARES_GETSOCK_WRITABLE(setbits, sockindex);
       }
 
+      if (!conn->is_tcp && ares__buf_len(conn->udp_send)) {
+        /* queued datagrams waiting to go out */
+        bitmap |= ARES_GETSOCK_WRITABLE(setbits, sockindex);
+      }
+
       sockindex++;
     }
   }
   return (int)bitmap;
 }
+
+int ares_getsock(ares_channel channel, ares_socket_t *socks, int numsocks)
+{
+  int bitmap;
+
+  ares__channel_lock(channel);
+  bitmap = ares_getsock_int(channel, socks, numsocks);
+  ares__channel_unlock(channel);
+  return bitmap;
+}
+
+static size_t ares_getsock_all_int(ares_channel           channel,
+                                   struct ares_sock_info *socks,
+                                   size_t                 max_socks)
+{
+  size_t cnt = 0;
+  size_t i;
+
+  if (channel == NULL) {
+    return 0;
+  }
+
+  if (channel->uring != NULL && ares__uring_sock_state(channel) != 0) {
+    if (socks != NULL && cnt < max_socks) {
+      socks[cnt].fd     = ares__uring_fd(channel);
+      socks[cnt].events = ares__uring_sock_state(channel);
+    }
+    cnt++;
+  }
+
+  if (channel->submitq != NULL) {
+    if (socks != NULL && cnt < max_socks) {
+      socks[cnt].fd     = ares__submitq_fd(channel);
+      socks[cnt].events = ARES_SOCK_READ;
+    }
+    cnt++;
+  }
+
+  if (ares__filewatch_fd(channel) != ARES_SOCKET_BAD) {
+    if (socks != NULL && cnt < max_socks) {
+      socks[cnt].fd     = ares__filewatch_fd(channel);
+      socks[cnt].events = ARES_SOCK_READ;
+    }
+    cnt++;
+  }
+
+  for (i = 0; i < channel->nservers; i++) {
+    ares__llist_node_t *node;
+
+    for (node = ares__llist_node_first(channel->servers[i].connections);
+         node != NULL; node = ares__llist_node_next(node)) {
+      const struct server_connection *conn = ares__llist_node_val(node);
+
+      if (ares__uring_has(channel, conn->fd)) {
+        continue;
+      }
+
+      /* Unlike ares_getsock(), idle UDP sockets are reported as well so the
+       * set only changes along with ares_getsock_generation() */
+      if (socks != NULL && cnt < max_socks) {
+        socks[cnt].fd     = conn->fd;
+        socks[cnt].events = conn->sock_state;
+      }
+
+      cnt++;
+    }
+  }
+
+  return cnt;
+}
+
+size_t ares_getsock_all(ares_channel channel, struct ares_sock_info *socks,
+                        size_t max_socks)
+{
+  size_t cnt;
+
+  ares__channel_lock(channel);
+  cnt = ares_getsock_all_int(channel, socks, max_socks);
+  ares__channel_unlock(channel);
+  return cnt;
+}
+
+size_t ares_getsock_generation(ares_channel channel)
+{
+  size_t generation;
+
+  if (channel == NULL) {
+    return 0;
+  }
+  ares__channel_lock(channel);
+  generation = channel->sock_generation;
+  ares__channel_unlock(channel);
+  return generation;
+}
@@ -105,30 +105,46 @@ int ares_init(ares_channel *channelptr)
   return ares_init_options(channelptr, NULL, 0);
 }
 
-static int ares_query_timeout_cmp_cb(const void *arg1, const void *arg2)
+static int ares_timeval_cmp(const struct timeval *t1, const struct timeval *t2)
 {
-  const struct query *q1 = arg1;
-  const struct query *q2 = arg2;
-
-  if (q1->timeout.tv_sec > q2->timeout.tv_sec) {
+  if (t1->tv_sec > t2->tv_sec) {
     return 1;
   }
-  if (q1->timeout.tv_sec < q2->timeout.tv_sec) {
+  if (t1->tv_sec < t2->tv_sec) {
     return -1;
   }
 
-  if (q1->timeout.tv_usec > q2->timeout.tv_usec) {
+  if (t1->tv_usec > t2->tv_usec) {
     return 1;
   }
-  if (q1->timeout.tv_usec < q2->timeout.tv_usec) {
+  if (t1->tv_usec < t2->tv_usec) {
     return -1;
   }
 
   return 0;
 }
 
-int ares_init_options(ares_channel *channelptr, struct ares_options *options,
-                      int optmask)
+static int ares_query_timeout_cmp_cb(const void *arg1, const void *arg2)
+{
+  const struct query *q1 = arg1;
+  const struct query *q2 = arg2;
+
+  return ares_timeval_cmp(&q1->timeout, &q2->timeout);
+}
+
+static int ares_query_stale_cmp_cb(const void *arg1, const void *arg2)
+{
+  const struct query *q1 = arg1;
+  const struct query *q2 = arg2;
+
+  return ares_timeval_cmp(&q1->stale_timeout, &q2->stale_timeout);
+}
+
+/* sysconfig is false when the options already hold a complete configuration,
+ * so the environment and system files need not be read again */
+static ares_status_t init_options(ares_channel        *channelptr,
+                                  struct ares_options *options, int optmask,
+                                  ares_bool_t sysconfig)
 {
   ares_channel  channel;
   ares_status_t status = ARES_SUCCESS;
@@ -181,6 +197,12 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
     goto done;
   }
 
+  channel->udp_send_conns = ares__llist_create(NULL);
+  if (channel->udp_send_conns == NULL) {
+    status = ARES_ENOMEM;
+    goto done;
+  }
+
   /* Initialize configuration by each of the four sources, from highest
    * precedence to lowest.
    */
@@ -193,17 +215,79 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
      */
     goto done;
   }
-  status = init_by_environment(channel);
-  if (status != ARES_SUCCESS) {
-    DEBUGF(fprintf(stderr, "Error: init_by_environment failed: %s\n",
-                   ares_strerror(status)));
+
+  if (channel->flags & ARES_FLAG_TIMERWHEEL) {
+    struct timeval now = ares__tvnow();
+
+    channel->timerwheel = ares__timerwheel_create(&now);
+    if (channel->timerwheel == NULL) {
+      status = ARES_ENOMEM;
+      goto done;
+    }
   }
-  if (status == ARES_SUCCESS) {
-    status = init_by_resolv_conf(channel);
+
+  if (channel->flags & ARES_FLAG_THREADSAFE) {
+    if (!ares_threadsafety()) {
+      status = ARES_ENOTIMP;
+      goto done;
+    }
+    channel->lock       = ares__thread_mutex_create();
+    channel->cond_empty = ares__thread_cond_create();
+    if (channel->lock == NULL || channel->cond_empty == NULL) {
+      status = ARES_ENOMEM;
+      goto done;
+    }
+  }
+
+  if (channel->flags & ARES_FLAG_COALESCE) {
+    channel->queries_by_question = ares__htable_strvp_create(NULL);
+    if (channel->queries_by_question == NULL) {
+      status = ARES_ENOMEM;
+      goto done;
+    }
+  }
+
+  if (channel->qcache_max_ttl > 0 || channel->stale_window > 0) {
+    channel->qcache = ares__qcache_create(
+      channel->rand_state, channel->qcache_max_ttl, channel->stale_window,
+      channel->prefetch_pct, channel->prefetch_hits);
+    if (channel->qcache == NULL) {
+      status = ARES_ENOMEM;
+      goto done;
+    }
+  }
+
+  if (channel->optmask & ARES_OPT_TCP_CACHE) {
+    channel->tcpcache = ares__tcpcache_create(channel->rand_state,
+                                              channel->tcpcache_max_entries);
+    if (channel->tcpcache == NULL) {
+      status = ARES_ENOMEM;
+      goto done;
+    }
+  }
+
+  if (channel->stale_window > 0 && channel->stale_timeout > 0) {
+    channel->queries_by_stale =
+      ares__slist_create(channel->rand_state, ares_query_stale_cmp_cb, NULL);
+    if (channel->queries_by_stale == NULL) {
+      status = ARES_ENOMEM;
+      goto done;
+    }
+  }
+
+  if (sysconfig) {
+    status = init_by_environment(channel);
     if (status != ARES_SUCCESS) {
-      DEBUGF(fprintf(stderr, "Error: init_by_resolv_conf failed: %s\n",
+      DEBUGF(fprintf(stderr, "Error: init_by_environment failed: %s\n",
                      ares_strerror(status)));
     }
+    if (status == ARES_SUCCESS) {
+      status = init_by_resolv_conf(channel);
+      if (status != ARES_SUCCESS) {
+        DEBUGF(fprintf(stderr, "Error: init_by_resolv_conf failed: %s\n",
+                       ares_strerror(status)));
+      }
+    }
   }
 
   /*
@@ -226,6 +310,26 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
     goto done;
   }
 
+  /* io_uring is an optimization only, fall back to plain sockets if the
+   * kernel doesn't support it or it has been disabled */
+  if (channel->flags & ARES_FLAG_IOURING) {
+    (void)ares__uring_create(channel);
+  }
+
+  if (channel->flags & ARES_FLAG_FILEWATCH) {
+    status = ares__filewatch_create(channel);
+    if (status != ARES_SUCCESS) {
+      goto done;
+    }
+  }
+
+  if (channel->flags & ARES_FLAG_SUBMITQ) {
+    status = ares__submitq_create(channel);
+    if (status != ARES_SUCCESS) {
+      goto done;
+    }
+  }
+
 done:
   if (status != ARES_SUCCESS) {
     /* Something failed; clean up memory we may have allocated. */
@@ -251,21 +355,38 @@ done:
       ares__destroy_rand_state(channel->rand_state);
     }
 
+    ares__uring_destroy(channel);
     ares__htable_szvp_destroy(channel->queries_by_qid);
     ares__llist_destroy(channel->all_queries);
     ares__slist_destroy(channel->queries_by_timeout);
+    ares__timerwheel_destroy(channel->timerwheel);
+    ares__qcache_destroy(channel->qcache);
+    ares__tcpcache_destroy(channel->tcpcache);
+    ares__filewatch_destroy(channel);
+    ares__thread_cond_destroy(channel->cond_empty);
+    ares__thread_mutex_destroy(channel->lock);
+    ares__slist_destroy(channel->queries_by_stale);
+    ares__htable_strvp_destroy(channel->queries_by_question);
     ares__htable_asvp_destroy(channel->connnode_by_socket);
+    ares__llist_destroy(channel->udp_send_conns);
     ares_free(channel);
-    return (int)status;
+    return status;
   }
 
   *channelptr = channel;
   return ARES_SUCCESS;
 }
 
+int ares_init_options(ares_channel *channelptr, struct ares_options *options,
+                      int optmask)
+{
+  return (int)init_options(channelptr, options, optmask, ARES_TRUE);
+}
+
 /* ares_dup() duplicates a channel handle with all its options and returns a
    new channel handle */
-int ares_dup(ares_channel *dest, ares_channel src)
+static int ares_dup_int(ares_channel *dest, ares_channel src,
+                        ares_bool_t sysconfig)
 {
   struct ares_options         opts;
   struct ares_addr_port_node *servers;
@@ -285,7 +406,7 @@ int ares_dup(ares_channel *dest, ares_channel src)
   }
 
   /* Then create the new channel with those options */
-  rc = (ares_status_t)ares_init_options(dest, &opts, optmask);
+  rc = init_options(dest, &opts, optmask, sysconfig);
 
   /* destroy the options copy to not leak any memory */
   ares_destroy_options(&opts);
@@ -295,18 +416,31 @@ int ares_dup(ares_channel *dest, ares_channel src)
   }
 
   /* Now clone the options that ares_save_options() doesn't support. */
-  (*dest)->sock_create_cb      = src->sock_create_cb;
-  (*dest)->sock_create_cb_data = src->sock_create_cb_data;
-  (*dest)->sock_config_cb      = src->sock_config_cb;
-  (*dest)->sock_config_cb_data = src->sock_config_cb_data;
-  (*dest)->sock_funcs          = src->sock_funcs;
-  (*dest)->sock_func_cb_data   = src->sock_func_cb_data;
+  (*dest)->sock_create_cb          = src->sock_create_cb;
+  (*dest)->sock_create_cb_data     = src->sock_create_cb_data;
+  (*dest)->sock_config_cb          = src->sock_config_cb;
+  (*dest)->sock_config_cb_data     = src->sock_config_cb_data;
+  (*dest)->sock_change_cb          = src->sock_change_cb;
+  (*dest)->sock_change_cb_data     = src->sock_change_cb_data;
+  (*dest)->sock_funcs              = src->sock_funcs;
+  (*dest)->sock_func_cb_data       = src->sock_func_cb_data;
+  (*dest)->sock_batch_funcs        = src->sock_batch_funcs;
+  (*dest)->sock_batch_func_cb_data = src->sock_batch_func_cb_data;
 
   ares_strcpy((*dest)->local_dev_name, src->local_dev_name,
               sizeof((*dest)->local_dev_name));
   (*dest)->local_ip4 = src->local_ip4;
   memcpy((*dest)->local_ip6, src->local_ip6, sizeof(src->local_ip6));
 
+  if (src->event != NULL) {
+    rc = (ares_status_t)ares_event_engine_enable(*dest);
+    if (rc != ARES_SUCCESS) {
+      ares_destroy(*dest);
+      *dest = NULL;
+      return (int)rc;
+    }
+  }
+
   /* Full name server cloning required if there is a non-IPv4, or non-default
    * port, nameserver */
   for (i = 0; i < src->nservers; i++) {
@@ -324,7 +458,7 @@ int ares_dup(ares_channel *dest, ares_channel src)
       *dest = NULL;
       return (int)rc;
     }
-    rc = (ares_status_t)ares_set_servers_ports(*dest, servers);
+    rc = ares__set_servers_ports(*dest, servers);
     ares_free_data(servers);
     if (rc != ARES_SUCCESS) {
       ares_destroy(*dest);
@@ -333,9 +467,143 @@ int ares_dup(ares_channel *dest, ares_channel src)
     }
   }
 
+  /* The saved options always carry the servers and most other options,
+   * whoever chose them.  Keep track of which the user did, as those stay put
+   * when resolv.conf changes. */
+  (*dest)->servers_by_user = src->servers_by_user;
+  (*dest)->optmask         = src->optmask;
+
   return ARES_SUCCESS; /* everything went fine */
 }
 
+int ares_dup(ares_channel *dest, ares_channel src)
+{
+  int status;
+
+  ares__channel_lock(src);
+  status = ares_dup_int(dest, src, ARES_TRUE);
+  ares__channel_unlock(src);
+  return status;
+}
+
+ares_status_t ares__dup_config(ares_channel *dest, ares_channel src)
+{
+  ares_status_t status;
+
+  ares__channel_lock(src);
+  status = (ares_status_t)ares_dup_int(dest, src, ARES_FALSE);
+  ares__channel_unlock(src);
+  return status;
+}
+
+
+static ares_bool_t servers_equal(const struct ares_addr_port_node *a,
+                                 const struct ares_addr_port_node *b)
+{
+  for (; a != NULL && b != NULL; a = a->next, b = b->next) {
+    if (a->family != b->family || a->udp_port != b->udp_port ||
+        a->tcp_port != b->tcp_port) {
+      return ARES_FALSE;
+    }
+    if (a->family == AF_INET &&
+        memcmp(&a->addr.addr4, &b->addr.addr4, sizeof(a->addr.addr4)) != 0) {
+      return ARES_FALSE;
+    }
+    if (a->family == AF_INET6 &&
+        memcmp(&a->addr.addr6, &b->addr.addr6, sizeof(a->addr.addr6)) != 0) {
+      return ARES_FALSE;
+    }
+  }
+  return (a == NULL && b == NULL) ? ARES_TRUE : ARES_FALSE;
+}
+
+/* Take over the options the system configuration gives from sys, other than
+ * those the user chose.  The lists are swapped rather than copied, so the old
+ * ones go with sys.  The lookup order is left alone, as lookups in progress
+ * point into it. */
+static void reload_options(ares_channel channel, ares_channel sys)
+{
+  unsigned int user = channel->optmask;
+
+  if (!(user & ARES_OPT_DOMAINS)) {
+    char  **domains  = channel->domains;
+    size_t  ndomains = channel->ndomains;
+
+    channel->domains  = sys->domains;
+    channel->ndomains = sys->ndomains;
+    sys->domains      = domains;
+    sys->ndomains     = ndomains;
+  }
+
+  if (!(user & ARES_OPT_SORTLIST)) {
+    struct apattern *sortlist = channel->sortlist;
+    size_t           nsort    = channel->nsort;
+
+    channel->sortlist = sys->sortlist;
+    channel->nsort    = sys->nsort;
+    sys->sortlist     = sortlist;
+    sys->nsort        = nsort;
+  }
+
+  if (!(user & ARES_OPT_NDOTS)) {
+    channel->ndots = sys->ndots;
+  }
+  if (!(user & ARES_OPT_TRIES)) {
+    channel->tries = sys->tries;
+  }
+  if (!(user & (ARES_OPT_TIMEOUT | ARES_OPT_TIMEOUTMS))) {
+    channel->timeout = sys->timeout;
+  }
+  if (!(user & (ARES_OPT_ROTATE | ARES_OPT_NOROTATE))) {
+    channel->rotate = sys->rotate;
+  }
+}
+
+/* Read the system configuration again after resolv.conf changed, and switch
+ * the channel over to it.  Queries in progress are sent again to the new name
+ * servers. */
+ares_status_t ares__reload_config(ares_channel channel)
+{
+  struct ares_options         opts;
+  int                         optmask = 0;
+  ares_channel                sys     = NULL;
+  struct ares_addr_port_node *servers = NULL;
+  struct ares_addr_port_node *current = NULL;
+  ares_status_t               status;
+
+  memset(&opts, 0, sizeof(opts));
+  if (channel->resolvconf_path != NULL) {
+    opts.resolvconf_path = channel->resolvconf_path;
+    optmask             |= ARES_OPT_RESOLVCONF;
+  }
+
+  status = init_options(&sys, &opts, optmask, ARES_TRUE);
+  if (status != ARES_SUCCESS) {
+    return status;
+  }
+
+  reload_options(channel, sys);
+  if (channel->servers_by_user) {
+    ares_destroy(sys);
+    return ARES_SUCCESS;
+  }
+
+  status = (ares_status_t)ares_get_servers_ports(sys, &servers);
+  ares_destroy(sys);
+  if (status != ARES_SUCCESS) {
+    return status;
+  }
+
+  /* Replacing the servers throws away their state and the cached answers,
+   * which is pointless if resolv.conf changed in some other way */
+  status = (ares_status_t)ares_get_servers_ports(channel, &current);
+  if (status == ARES_SUCCESS && !servers_equal(servers, current)) {
+    status = ares__replace_servers(channel, servers);
+  }
+  ares_free_data(current);
+  ares_free_data(servers);
+  return status;
+}
 
 static ares_status_t init_by_environment(ares_channel channel)
 {
@@ -2154,21 +2422,27 @@ static ares_bool_t sortlist_alloc(struct apattern **sortlist, size_t *nsort,
 
 void ares_set_local_ip4(ares_channel channel, unsigned int local_ip)
 {
+  ares__channel_lock(channel);
   channel->local_ip4 = local_ip;
+  ares__channel_unlock(channel);
 }
 
 /* local_ip6 should be 16 bytes in length */
 void ares_set_local_ip6(ares_channel channel, const unsigned char *local_ip6)
 {
+  ares__channel_lock(channel);
   memcpy(&channel->local_ip6, local_ip6, sizeof(channel->local_ip6));
+  ares__channel_unlock(channel);
 }
 
 /* local_dev_name should be null terminated. */
 void ares_set_local_dev(ares_channel channel, const char *local_dev_name)
 {
+  ares__channel_lock(channel);
   ares_strcpy(channel->local_dev_name, local_dev_name,
               sizeof(channel->local_dev_name));
   channel->local_dev_name[sizeof(channel->local_dev_name) - 1] = 0;
+  ares__channel_unlock(channel);
 }
 
 
@@ -2184,11 +2458,14 @@ int ares_set_sortlist(ares_channel channel, const char *sortstr)
 
   status = config_sortlist(&sortlist, &nsort, sortstr);
   if (status == ARES_SUCCESS && sortlist) {
+    ares__channel_lock(channel);
     if (channel->sortlist) {
       ares_free(channel->sortlist);
     }
     channel->sortlist = sortlist;
     channel->nsort    = nsort;
+    channel->optmask |= ARES_OPT_SORTLIST;
+    ares__channel_unlock(channel);
   }
   return (int)status;
 }
@@ -2223,6 +2500,14 @@ ares_status_t ares__init_servers_state(ares_channel channel)
     }
 
     server->tcp_connection_generation = ++channel->tcp_connection_generation;
+    server->srtt                      = 0;
+    server->rttvar                    = 0;
+    server->rto_backoff               = 0;
+    server->consec_failures           = 0;
+    server->backoff_until.tv_sec      = 0;
+    server->backoff_until.tv_usec     = 0;
+    server->edns_unsupported          = ARES_FALSE;
+    server->edns_psz_max              = 0;
     server->channel                   = channel;
   }
   return ARES_SUCCESS;
@@ -36,7 +36,8 @@
 #include "ares_inet_net_pton.h"
 #include "ares_private.h"
 
-int ares_get_servers(ares_channel channel, struct ares_addr_node **servers)
+static int ares_get_servers_int(ares_channel            channel,
+                                struct ares_addr_node **servers)
 {
   struct ares_addr_node *srvr_head = NULL;
   struct ares_addr_node *srvr_last = NULL;
@@ -85,8 +86,18 @@ int ares_get_servers(ares_channel channel, struct ares_addr_node **servers)
   return (int)status;
 }
 
-int ares_get_servers_ports(ares_channel                 channel,
-                           struct ares_addr_port_node **servers)
+int ares_get_servers(ares_channel channel, struct ares_addr_node **servers)
+{
+  int status;
+
+  ares__channel_lock(channel);
+  status = ares_get_servers_int(channel, servers);
+  ares__channel_unlock(channel);
+  return status;
+}
+
+static int ares_get_servers_ports_int(ares_channel                 channel,
+                                      struct ares_addr_port_node **servers)
 {
   struct ares_addr_port_node *srvr_head = NULL;
   struct ares_addr_port_node *srvr_last = NULL;
@@ -139,7 +150,19 @@ int ares_get_servers_ports(ares_channel                 channel,
   return (int)status;
 }
 
-int ares_set_servers(ares_channel channel, struct ares_addr_node *servers)
+int ares_get_servers_ports(ares_channel                 channel,
+                           struct ares_addr_port_node **servers)
+{
+  int status;
+
+  ares__channel_lock(channel);
+  status = ares_get_servers_ports_int(channel, servers);
+  ares__channel_unlock(channel);
+  return status;
+}
+
+static int ares_set_servers_int(ares_channel           channel,
+                                struct ares_addr_node *servers)
 {
   struct ares_addr_node *srvr;
   size_t                 num_srvrs = 0;
@@ -157,6 +180,9 @@ int ares_set_servers(ares_channel channel, struct ares_addr_node *servers)
     return ARES_ENOTIMP;
   }
 
+  /* Answers from the old servers no longer apply */
+  ares__qcache_flush(channel->qcache);
+  ares__tcpcache_flush(channel->tcpcache);
   ares__destroy_servers_state(channel);
 
   for (srvr = servers; srvr; srvr = srvr->next) {
@@ -191,26 +217,33 @@ int ares_set_servers(ares_channel channel, struct ares_addr_node *servers)
   return ARES_SUCCESS;
 }
 
-int ares_set_servers_ports(ares_channel                channel,
-                           struct ares_addr_port_node *servers)
+int ares_set_servers(ares_channel channel, struct ares_addr_node *servers)
 {
-  struct ares_addr_port_node *srvr;
-  size_t                      num_srvrs = 0;
-  size_t                      i;
+  int status;
 
-  if (ares_library_initialized() != ARES_SUCCESS) {
-    return ARES_ENOTINITIALIZED; /* LCOV_EXCL_LINE: n/a on non-WinSock */
-  }
-
-  if (!channel) {
-    return ARES_ENODATA;
+  ares__channel_lock(channel);
+  status = ares_set_servers_int(channel, servers);
+  if (status == ARES_SUCCESS) {
+    channel->servers_by_user = ARES_TRUE;
   }
+  ares__channel_unlock(channel);
+  return status;
+}
 
-  if (ares__llist_len(channel->all_queries) != 0) {
-    return ARES_ENOTIMP;
-  }
+/* ares_set_servers_ports() without marking the servers as set by the user.
+ * Any queries in flight must have been taken off the old servers. */
+ares_status_t ares__set_servers_ports(ares_channel                channel,
+                                      struct ares_addr_port_node *servers)
+{
+  struct ares_addr_port_node *srvr;
+  size_t                      num_srvrs = 0;
+  size_t                      i;
 
+  /* Answers from the old servers no longer apply */
+  ares__qcache_flush(channel->qcache);
+  ares__tcpcache_flush(channel->tcpcache);
   ares__destroy_servers_state(channel);
+  channel->last_server = 0;
 
   for (srvr = servers; srvr; srvr = srvr->next) {
     num_srvrs++;
@@ -244,6 +277,38 @@ int ares_set_servers_ports(ares_channel                channel,
   return ARES_SUCCESS;
 }
 
+static int ares_set_servers_ports_int(ares_channel                channel,
+                                      struct ares_addr_port_node *servers)
+{
+  if (ares_library_initialized() != ARES_SUCCESS) {
+    return ARES_ENOTINITIALIZED; /* LCOV_EXCL_LINE: n/a on non-WinSock */
+  }
+
+  if (!channel) {
+    return ARES_ENODATA;
+  }
+
+  if (ares__llist_len(channel->all_queries) != 0) {
+    return ARES_ENOTIMP;
+  }
+
+  return (int)ares__set_servers_ports(channel, servers);
+}
+
+int ares_set_servers_ports(ares_channel                channel,
+                           struct ares_addr_port_node *servers)
+{
+  int status;
+
+  ares__channel_lock(channel);
+  status = ares_set_servers_ports_int(channel, servers);
+  if (status == ARES_SUCCESS) {
+    channel->servers_by_user = ARES_TRUE;
+  }
+  ares__channel_unlock(channel);
+  return status;
+}
+
 /* Incomming string format: host[:port][,host[:port]]... */
 /* IPv6 addresses with ports require square brackets [fe80::1%lo0]:53 */
 static ares_status_t set_servers_csv(ares_channel channel, const char *_csv,
@@ -396,17 +461,27 @@ out:
 
 int ares_set_servers_csv(ares_channel channel, const char *_csv)
 {
-  return (int)set_servers_csv(channel, _csv, FALSE);
+  ares_status_t status;
+
+  ares__channel_lock(channel);
+  status = set_servers_csv(channel, _csv, FALSE);
+  ares__channel_unlock(channel);
+  return (int)status;
 }
 
 int ares_set_servers_ports_csv(ares_channel channel, const char *_csv)
 {
-  return (int)set_servers_csv(channel, _csv, TRUE);
+  ares_status_t status;
+
+  ares__channel_lock(channel);
+  status = set_servers_csv(channel, _csv, TRUE);
+  ares__channel_unlock(channel);
+  return (int)status;
 }
 
 /* Save options from initialized channel */
-int ares_save_options(ares_channel channel, struct ares_options *options,
-                      int *optmask)
+static int ares_save_options_int(ares_channel         channel,
+                                 struct ares_options *options, int *optmask)
 {
   size_t i;
   size_t j;
@@ -534,9 +609,53 @@ int ares_save_options(ares_channel channel, struct ares_options *options,
     options->udp_max_queries  = (int)channel->udp_max_queries;
   }
 
+  if (channel->optmask & ARES_OPT_QUERY_CACHE) {
+    (*optmask)              |= ARES_OPT_QUERY_CACHE;
+    options->qcache_max_ttl  = channel->qcache_max_ttl;
+  }
+
+  if (channel->optmask & ARES_OPT_SERVE_STALE) {
+    (*optmask)             |= ARES_OPT_SERVE_STALE;
+    options->stale_window   = channel->stale_window;
+    options->stale_timeout  = (unsigned int)channel->stale_timeout;
+  }
+
+  if (channel->optmask & ARES_OPT_PREFETCH) {
+    (*optmask)             |= ARES_OPT_PREFETCH;
+    options->prefetch_pct   = channel->prefetch_pct;
+    options->prefetch_hits  = channel->prefetch_hits;
+  }
+
+  if (channel->optmask & ARES_OPT_SERVER_BACKOFF) {
+    (*optmask)              |= ARES_OPT_SERVER_BACKOFF;
+    options->server_backoff  = (unsigned int)channel->server_backoff;
+  }
+
+  if (channel->optmask & ARES_OPT_HEDGE) {
+    (*optmask)           |= ARES_OPT_HEDGE;
+    options->hedge_delay  = (unsigned int)channel->hedge_delay;
+  }
+
+  if (channel->optmask & ARES_OPT_TCP_CACHE) {
+    (*optmask)                    |= ARES_OPT_TCP_CACHE;
+    options->tcpcache_max_entries  = (unsigned int)
+      channel->tcpcache_max_entries;
+  }
+
   return ARES_SUCCESS;
 }
 
+int ares_save_options(ares_channel channel, struct ares_options *options,
+                      int *optmask)
+{
+  int status;
+
+  ares__channel_lock(channel);
+  status = ares_save_options_int(channel, options, optmask);
+  ares__channel_unlock(channel);
+  return status;
+}
+
 ares_status_t ares__init_by_options(ares_channel               channel,
                                     const struct ares_options *options,
                                     int                        optmask)
@@ -598,6 +717,7 @@ ares_status_t ares__init_by_options(ares_channel               channel,
 
   /* Copy the IPv4 servers, if given. */
   if (optmask & ARES_OPT_SERVERS) {
+    channel->servers_by_user = ARES_TRUE;
     /* Avoid zero size allocations at any cost */
     if (options->nservers > 0) {
       channel->servers =
@@ -680,6 +800,33 @@ ares_status_t ares__init_by_options(ares_channel               channel,
     channel->udp_max_queries = (size_t)options->udp_max_queries;
   }
 
+  if (optmask & ARES_OPT_QUERY_CACHE) {
+    channel->qcache_max_ttl = options->qcache_max_ttl;
+  }
+
+  if (optmask & ARES_OPT_SERVE_STALE) {
+    channel->stale_window  = options->stale_window;
+    channel->stale_timeout = options->stale_timeout;
+  }
+
+  if (optmask & ARES_OPT_PREFETCH) {
+    channel->prefetch_pct  = options->prefetch_pct;
+    channel->prefetch_hits = options->prefetch_hits;
+  }
+
+  if (optmask & ARES_OPT_SERVER_BACKOFF) {
+    channel->server_backoff = options->server_backoff;
+  }
+
+  if (optmask & ARES_OPT_HEDGE) {
+    channel->hedge       = ARES_TRUE;
+    channel->hedge_delay = options->hedge_delay;
+  }
+
+  if (optmask & ARES_OPT_TCP_CACHE) {
+    channel->tcpcache_max_entries = options->tcpcache_max_entries;
+  }
+
   channel->optmask = (unsigned int)optmask;
 
   return ARES_SUCCESS;
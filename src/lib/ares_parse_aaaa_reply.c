@@ -58,6 +58,7 @@ int ares_parse_aaaa_reply(const unsigned char *abuf, int alen,
                           int *naddrttls)
 {
   struct ares_addrinfo ai;
+  ares_dns_record_t   *dnsrec            = NULL;
   char                *question_hostname = NULL;
   ares_status_t        status;
   size_t               req_naddrttls = 0;
@@ -73,7 +74,16 @@ int ares_parse_aaaa_reply(const unsigned char *abuf, int alen,
 
   memset(&ai, 0, sizeof(ai));
 
-  status = ares__parse_into_addrinfo(abuf, (size_t)alen, 0, 0, &ai);
+  status = ares_dns_parse(abuf, (size_t)alen, 0, &dnsrec);
+  if (status != ARES_SUCCESS) {
+    /* compatibility */
+    if (status == ARES_EBADNAME) {
+      status = ARES_EBADRESP;
+    }
+    goto fail;
+  }
+
+  status = ares__parse_into_addrinfo(dnsrec, 0, 0, &ai);
   if (status != ARES_SUCCESS && status != ARES_ENODATA) {
     goto fail;
   }
@@ -96,6 +106,7 @@ fail:
   ares__freeaddrinfo_cnames(ai.cnames);
   ares__freeaddrinfo_nodes(ai.nodes);
   ares_free(question_hostname);
+  ares_dns_record_destroy(dnsrec);
   ares_free(ai.name);
 
   return (int)status;
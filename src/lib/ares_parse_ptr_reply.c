@@ -36,33 +36,20 @@
 #include "ares.h"
 #include "ares_private.h"
 
-int ares_parse_ptr_reply(const unsigned char *abuf, int alen_int,
-                         const void *addr, int addrlen, int family,
-                         struct hostent **host)
+ares_status_t ares__parse_ptr_reply(const ares_dns_record_t *dnsrec,
+                                    const void *addr, int addrlen, int family,
+                                    struct hostent **host)
 {
-  ares_status_t      status;
-  size_t             alen;
-  size_t             ptrcount = 0;
-  struct hostent    *hostent  = NULL;
-  const char        *hostname = NULL;
-  const char        *ptrname  = NULL;
-  ares_dns_record_t *dnsrec   = NULL;
-  size_t             i;
-  size_t             ancount;
+  ares_status_t   status;
+  size_t          ptrcount = 0;
+  struct hostent *hostent  = NULL;
+  const char     *hostname = NULL;
+  const char     *ptrname  = NULL;
+  size_t          i;
+  size_t          ancount;
 
   *host = NULL;
 
-  if (alen_int < 0) {
-    return ARES_EBADRESP;
-  }
-
-  alen = (size_t)alen_int;
-
-  status = ares_dns_parse(abuf, alen, 0, &dnsrec);
-  if (status != ARES_SUCCESS) {
-    goto done;
-  }
-
   /* Fetch name from query as we will use it to compare later on.  Old code
    * did this check, so we'll retain it. */
   status = ares_dns_record_query_get(dnsrec, 0, &ptrname, NULL, NULL);
@@ -115,7 +102,7 @@ int ares_parse_ptr_reply(const unsigned char *abuf, int alen_int,
   for (i = 0; i < ancount; i++) {
     const char          *rname = NULL;
     const ares_dns_rr_t *rr =
-      ares_dns_record_rr_get(dnsrec, ARES_SECTION_ANSWER, i);
+      ares_dns_record_rr_get_const(dnsrec, ARES_SECTION_ANSWER, i);
 
     if (rr == NULL) {
       /* Shouldn't be possible */
@@ -193,6 +180,30 @@ done:
   } else {
     *host = hostent;
   }
+  return status;
+}
+
+int ares_parse_ptr_reply(const unsigned char *abuf, int alen_int,
+                         const void *addr, int addrlen, int family,
+                         struct hostent **host)
+{
+  ares_status_t      status;
+  ares_dns_record_t *dnsrec = NULL;
+
+  *host = NULL;
+
+  if (alen_int < 0) {
+    return ARES_EBADRESP;
+  }
+
+  status = ares_dns_parse(abuf, (size_t)alen_int, 0, &dnsrec);
+  if (status == ARES_SUCCESS) {
+    status = ares__parse_ptr_reply(dnsrec, addr, addrlen, family, host);
+  } else if (status == ARES_EBADNAME) {
+    /* Compatibility */
+    status = ARES_EBADRESP;
+  }
+
   ares_dns_record_destroy(dnsrec);
   return (int)status;
 }
@@ -0,0 +1,254 @@
+/* MIT License
+ *
+ * Copyright (c) The c-ares project and its contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#include "ares_nameser.h"
+
+#include "ares.h"
+#include "ares_private.h"
+#include "ares__htable.h"
+
+/* The first shard is initialized normally, reading the system configuration
+ * once.  Every other shard is a copy of its configuration made without going
+ * back to resolv.conf or the environment, so all shards agree on servers,
+ * search domains and options even if the files change while the pool is
+ * being built.  Each shard keeps its own sockets, query lists and cache, so
+ * shards never contend with each other; the caller drives each shard (usually
+ * one per thread) with the normal per-channel event loop functions. */
+struct ares_pool {
+  ares_channel *shards;
+  size_t        nshards;
+  unsigned int  seed;
+};
+
+static size_t pool_default_nshards(void)
+{
+#if defined(WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  if (info.dwNumberOfProcessors > 0) {
+    return (size_t)info.dwNumberOfProcessors;
+  }
+#elif defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu > 0) {
+    return (size_t)ncpu;
+  }
+#endif
+  return 1;
+}
+
+ares_status_t ares_pool_create(ares_pool_t **pool, size_t nshards,
+                               struct ares_options *options, int optmask)
+{
+  ares_pool_t  *p;
+  ares_status_t status;
+  size_t        i;
+
+  if (pool == NULL) {
+    return ARES_EFORMERR;
+  }
+  *pool = NULL;
+
+  if (nshards == 0) {
+    nshards = pool_default_nshards();
+  }
+
+  p = ares_malloc_zero(sizeof(*p));
+  if (p == NULL) {
+    return ARES_ENOMEM;
+  }
+
+  p->shards = ares_malloc_zero(nshards * sizeof(*p->shards));
+  if (p->shards == NULL) {
+    ares_free(p);
+    return ARES_ENOMEM;
+  }
+
+  status = (ares_status_t)ares_init_options(&p->shards[0], options, optmask);
+  if (status != ARES_SUCCESS) {
+    goto fail;
+  }
+  p->nshards = 1;
+
+  for (i = 1; i < nshards; i++) {
+    status = ares__dup_config(&p->shards[i], p->shards[0]);
+    if (status != ARES_SUCCESS) {
+      goto fail;
+    }
+    p->nshards++;
+  }
+
+  ares__rand_bytes(p->shards[0]->rand_state, (unsigned char *)&p->seed,
+                   sizeof(p->seed));
+
+  *pool = p;
+  return ARES_SUCCESS;
+
+fail:
+  ares_pool_destroy(p);
+  return status;
+}
+
+void ares_pool_destroy(ares_pool_t *pool)
+{
+  size_t i;
+
+  if (pool == NULL) {
+    return;
+  }
+
+  for (i = 0; i < pool->nshards; i++) {
+    ares_destroy(pool->shards[i]);
+  }
+  ares_free(pool->shards);
+  ares_free(pool);
+}
+
+size_t ares_pool_nshards(const ares_pool_t *pool)
+{
+  if (pool == NULL) {
+    return 0;
+  }
+  return pool->nshards;
+}
+
+ares_channel ares_pool_shard(const ares_pool_t *pool, size_t idx)
+{
+  if (pool == NULL || idx >= pool->nshards) {
+    return NULL;
+  }
+  return pool->shards[idx];
+}
+
+ares_channel ares_pool_route(const ares_pool_t *pool, const char *name)
+{
+  size_t       len;
+  unsigned int hash;
+
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  if (name == NULL || pool->nshards == 1) {
+    return pool->shards[0];
+  }
+
+  /* "example.com" and "Example.COM." are the same name */
+  len = ares_strlen(name);
+  if (len > 0 && name[len - 1] == '.') {
+    len--;
+  }
+
+  hash = ares__htable_hash_FNV1a_casecmp((const unsigned char *)name, len,
+                                         pool->seed);
+  return pool->shards[hash % pool->nshards];
+}
+
+ares_status_t ares_pool_getaddrinfo(ares_pool_t *pool, const char *node,
+                                    const char                       *service,
+                                    const struct ares_addrinfo_hints *hints,
+                                    ares_addrinfo_callback callback, void *arg)
+{
+  ares_channel channel;
+
+  if (pool == NULL || callback == NULL) {
+    return ARES_EFORMERR;
+  }
+
+  channel = ares_pool_route(pool, node);
+
+  /* Hand the request over to the thread driving the shard if we can, else
+   * the caller is expected to be that thread or to have made the shards
+   * thread-safe */
+  if (channel->submitq != NULL) {
+    return ares_submit_getaddrinfo(channel, node, service, hints, callback,
+                                   arg);
+  }
+
+  ares_getaddrinfo(channel, node, service, hints, callback, arg);
+  return ARES_SUCCESS;
+}
+
+ares_status_t ares_pool_send(ares_pool_t *pool, const unsigned char *qbuf,
+                             size_t qlen, ares_callback callback, void *arg)
+{
+  ares_channel channel;
+  char        *name = NULL;
+  long         enclen;
+
+  if (pool == NULL || qbuf == NULL || callback == NULL) {
+    return ARES_EFORMERR;
+  }
+
+  /* Route on the question name.  A query we can't read the name out of goes
+   * to the first shard, which rejects it the same way ares_send() would */
+  if (qlen > HFIXEDSZ && qlen < (1 << 16) &&
+      ares_expand_name(qbuf + HFIXEDSZ, qbuf, (int)qlen, &name, &enclen) ==
+        ARES_SUCCESS) {
+    channel = ares_pool_route(pool, name);
+    ares_free_string(name);
+  } else {
+    channel = pool->shards[0];
+  }
+
+  if (channel->submitq != NULL) {
+    return ares_submit_send(channel, qbuf, qlen, callback, arg);
+  }
+
+  return ares_send_ex(channel, qbuf, qlen, callback, arg);
+}
+
+void ares_pool_stats(const ares_pool_t *pool, struct ares_pool_stats *stats)
+{
+  size_t i;
+
+  if (stats == NULL) {
+    return;
+  }
+
+  memset(stats, 0, sizeof(*stats));
+  if (pool == NULL) {
+    return;
+  }
+
+  stats->shards = pool->nshards;
+  for (i = 0; i < pool->nshards; i++) {
+    ares_channel channel = pool->shards[i];
+
+    ares__channel_lock(channel);
+    stats->active_queries += ares__llist_len(channel->all_queries);
+    stats->queries        += channel->stat_queries;
+    stats->cache_hits     += channel->stat_cache_hits;
+    stats->timeouts       += channel->stat_timeouts;
+    ares__channel_unlock(channel);
+  }
+}
@@ -117,10 +117,12 @@ typedef struct ares_rand_state ares_rand_state;
 
 #include "ares__llist.h"
 #include "ares__slist.h"
+#include "ares__timerwheel.h"
 #include "ares__htable_strvp.h"
 #include "ares__htable_szvp.h"
 #include "ares__htable_asvp.h"
 #include "ares__buf.h"
+#include "ares__threads.h"
 #include "ares_dns_record.h"
 
 #ifndef HAVE_GETENV
@@ -147,9 +149,14 @@ typedef struct ares_rand_state ares_rand_state;
                             in RFC2671 */
 #define MAXENDSSZ   4096 /* Maximum (local) limit for edns packet size */
 #define EDNSFIXEDSZ 11   /* Size of EDNS header */
+#define EDNSSAFEPSZ 1232 /* UDP payload size unlikely to need fragmenting,
+                            as agreed for DNS flag day 2020 */
 
 /********* EDNS defines section ******/
 
+/* Maximum number of datagrams read from a UDP socket in one go */
+#define ARES_UDP_BATCH_MAX 16
+
 struct ares_addr {
   int family;
 
@@ -177,6 +184,16 @@ struct server_connection {
   size_t               total_queries;
   /* list of outstanding queries to this connection */
   ares__llist_t       *queries_to_conn;
+  /* interest last reported for this socket, ARES_SOCK_READ/ARES_SOCK_WRITE */
+  int                  sock_state;
+  /* interest currently registered with the built-in event engine */
+  unsigned int         event_flags;
+  /* UDP datagrams waiting to be sent, each prefixed by its 16-bit length as
+   * on TCP.  Only used with ARES_FLAG_BATCHSEND or when the socket buffer was
+   * full, NULL until first needed */
+  ares__buf_t         *udp_send;
+  /* Entry in the channel's udp_send_conns while udp_send isn't empty */
+  ares__llist_node_t  *node_udp_send;
 };
 
 struct server_state {
@@ -199,15 +216,53 @@ struct server_state {
    * re-send. */
   size_t                    tcp_connection_generation;
 
+  /* Smoothed round trip time and its variance as per RFC 6298, in
+   * microseconds, both 0 until the first sample */
+  size_t                    srtt;
+  size_t                    rttvar;
+
+  /* Times the retransmission timeout derived from the above is doubled, as
+   * queries timed out since the last sample, see ARES_FLAG_AUTOTIMEOUT */
+  size_t                    rto_backoff;
+
+  /* Number of queries in a row which failed on this server */
+  size_t                    consec_failures;
+
+  /* Until when the server is avoided after failing, and after which it gets
+   * a single probe query, see ARES_OPT_SERVER_BACKOFF */
+  struct timeval            backoff_until;
+
+  /* With ARES_FLAG_EDNS, whether the server rejected a query for its OPT RR,
+   * after which it is sent none, and the largest UDP payload size to
+   * advertise to it, 0 until a smaller one than the channel's is needed */
+  ares_bool_t               edns_unsupported;
+  size_t                    edns_psz_max;
+
   /* Link back to owning channel */
   ares_channel              channel;
 };
 
+/* Callback delivering the response already parsed by the library, so it
+ * doesn't have to be parsed again by the consumer.  dnsrec is only valid for
+ * the duration of the callback, and is NULL unless status is ARES_SUCCESS. */
+typedef void (*ares_callback_dnsrec)(void *arg, ares_status_t status,
+                                     size_t                   timeouts,
+                                     const ares_dns_record_t *dnsrec);
+
+/* Question of a query, kept so responses can be matched without parsing the
+ * request again.  The name is lowercased. */
+struct query_question {
+  const char         *name;
+  ares_dns_rec_type_t qtype;
+  ares_dns_class_t    qclass;
+};
+
 /* State to represent a DNS query */
 struct query {
   /* Query ID from qbuf, for faster lookup, and current timeout */
   unsigned short                  qid; /* host byte order */
   struct timeval                  timeout;
+  struct timeval                  ts; /* when the query was last sent */
   ares_channel                    channel;
 
   /*
@@ -215,6 +270,8 @@ struct query {
    * make removal operations O(1).
    */
   ares__slist_node_t             *node_queries_by_timeout;
+  ares__slist_node_t             *node_queries_by_stale;
+  ares__timerwheel_entry_t        node_timerwheel;
   ares__llist_node_t             *node_queries_to_conn;
   ares__llist_node_t             *node_all_queries;
 
@@ -225,12 +282,25 @@ struct query {
   unsigned char                  *tcpbuf;
   size_t                          tcplen;
 
-  /* Arguments passed to ares_send() (qbuf points into tcpbuf) */
+  /* Arguments passed to ares_send() (qbuf points into tcpbuf).  Only one of
+   * callback and callback_dnsrec is set. */
   const unsigned char            *qbuf;
   size_t                          qlen;
   ares_callback                   callback;
+  ares_callback_dnsrec            callback_dnsrec;
   void                           *arg;
 
+  /* ares__qcache_calc_key() of qbuf, worked out once for the query cache,
+   * the TCP question cache and coalescing.  NULL if qbuf can't be keyed. */
+  char                           *key;
+
+  /* Questions parsed from qbuf, in a single block along with the names.
+   * questions_valid is false if qbuf could not be parsed, in which case no
+   * response can match. */
+  struct query_question          *questions;
+  size_t                          nquestions;
+  ares_bool_t                     questions_valid;
+
   /* Query status */
   size_t try_count; /* Number of times we tried this query already. */
   size_t server;    /* Server this query has last been sent to. */
@@ -240,12 +310,51 @@ struct query {
   size_t      timeouts;   /* number of timeouts we saw for this request */
   ares_bool_t no_retries; /* do not perform any additional retries, this is set
                            * when a query is to be canceled */
+
+  /* Serve-stale.  stale_timeout is when the query stops waiting on the
+   * servers and answers from the stale cache.  Once it has, stale_served is
+   * set and the query carries on only to refresh the cache. */
+  struct timeval            stale_timeout;
+  ares_bool_t               stale_served;
+
+  /* Hedging (ARES_OPT_HEDGE).  hedge_pending is set while the timeout is
+   * when to hedge rather than to give up on the server.  Once hedged, the
+   * send to the previous server stays linked to its connection through
+   * hedge_conn, sent at hedge_ts, so its answer is still taken. */
+  ares_bool_t                     hedge_pending;
+  ares_bool_t                     hedged;
+  const struct server_connection *hedge_conn;
+  ares__llist_node_t             *node_hedge_to_conn;
+  struct timeval                  hedge_ts;
+
+  /* The query's length and UDP payload size if it ends in an OPT RR which
+   * can be fitted to each server, else 0.  See query_fit_edns(). */
+  size_t                          edns_qlen;
+  size_t                          edns_psz;
+
+  /* In-flight coalescing (ARES_FLAG_COALESCE).  A leader is the only one of
+   * a set of identical queries actually sent, and holds the others as
+   * followers until its answer arrives.  coalescing is set while a leader
+   * still accepts followers, registered under its key. */
+  ares_bool_t                coalescing;
+  ares__llist_t             *followers;
+  struct query              *leader;
+  ares__llist_node_t        *node_followers;
+
+  /* Query pool bookkeeping, see ares__query_pool.c.  server_info (and tcpbuf
+   * and questions when flagged inline) live in the same block as the query. */
+  size_t        pool_nservers; /* server_info slots in this block */
+  ares_bool_t   tcpbuf_inline;
+  ares_bool_t   questions_inline;
+  struct query *pool_next;     /* next free block while pooled */
 };
 
 /* Per-server state for a query */
 struct query_server_info {
   ares_bool_t skip_server; /* should we skip server, due to errors, etc? */
   size_t tcp_connection_generation; /* into which TCP connection did we send? */
+  size_t sends; /* times the query was sent to this server */
+  size_t edns_timeouts; /* timeouts asking for more than EDNSSAFEPSZ */
 };
 
 /* An IP address pattern; matches an IP address X if X & mask == addr */
@@ -271,6 +380,25 @@ struct apattern {
 struct ares_hosts_file;
 typedef struct ares_hosts_file ares_hosts_file_t;
 
+struct ares_event;
+typedef struct ares_event ares_event_t;
+typedef struct ares__uring ares__uring_t;
+typedef struct ares__qcache ares__qcache_t;
+typedef struct ares__tcpcache ares__tcpcache_t;
+
+typedef struct ares__submitq ares__submitq_t;
+typedef struct ares__filewatch ares__filewatch_t;
+
+/* Socket readiness as reported by the built-in event engine */
+typedef struct {
+  ares_socket_t fd;
+  ares_bool_t   readable;
+  ares_bool_t   writable;
+} ares_event_ready_t;
+
+/* Maximum number of ready sockets fetched from the event engine per poll */
+#define ARES_EVENT_MAX_READY 64
+
 struct ares_channeldata {
   /* Configuration data */
   unsigned int         flags;
@@ -300,6 +428,9 @@ struct ares_channeldata {
   /* Server addresses and communications state */
   struct server_state *servers;
   size_t               nservers;
+  /* Servers were given with ARES_OPT_SERVERS or ares_set_servers*() rather
+   * than read from the system configuration, so they aren't reloaded */
+  ares_bool_t          servers_by_user;
 
   /* random state to use when generating new ids */
   ares_rand_state     *rand_state;
@@ -307,9 +438,24 @@ struct ares_channeldata {
   /* Generation number to use for the next TCP socket open/close */
   size_t               tcp_connection_generation;
 
+  /* Bumped on every socket open/close or interest change, see
+   * ares_getsock_generation() */
+  size_t               sock_generation;
+
+  /* Running totals for ares_pool_stats(): queries started, those answered
+   * from the query cache, and timeouts waiting on a server */
+  size_t               stat_queries;
+  size_t               stat_cache_hits;
+  size_t               stat_timeouts;
+
   /* Last server we sent a query to. */
   size_t               last_server;
 
+  /* With ARES_FLAG_SRTT, queries chosen so far and the server to be probed
+   * next */
+  size_t               srtt_queries;
+  size_t               srtt_probe;
+
   /* All active queries in a single list */
   ares__llist_t       *all_queries;
   /* Queries bucketed by qid, for quickly dispatching DNS responses: */
@@ -318,15 +464,75 @@ struct ares_channeldata {
   /* Queries bucketed by timeout, for quickly handling timeouts: */
   ares__slist_t       *queries_by_timeout;
 
+  /* Used instead of queries_by_timeout when ARES_FLAG_TIMERWHEEL is set */
+  ares__timerwheel_t  *timerwheel;
+
+  /* Queries accepting followers, keyed by question, when ARES_FLAG_COALESCE
+   * is set */
+  ares__htable_strvp_t *queries_by_question;
+
+  /* Released query blocks kept for reuse */
+  struct query        *query_pool;
+  size_t               query_pool_len;
+
+  /* Response cache, NULL unless ARES_OPT_QUERY_CACHE was given with a
+   * non-zero qcache_max_ttl */
+  ares__qcache_t      *qcache;
+  unsigned int         qcache_max_ttl;
+
+  /* Serve-stale (ARES_OPT_SERVE_STALE).  Positive answers are kept in qcache
+   * for stale_window seconds past their TTL.  Queries that could be answered
+   * from such an answer are also kept in queries_by_stale, ordered by the time
+   * at which they give up waiting and serve it, when stale_timeout is set. */
+  unsigned int         stale_window;
+  size_t               stale_timeout; /* in milliseconds */
+  ares__slist_t       *queries_by_stale;
+
+  /* Prefetch (ARES_OPT_PREFETCH).  Answers served from qcache at least
+   * prefetch_hits times are queried again once they enter the last
+   * prefetch_pct percent of their TTL. */
+  unsigned int         prefetch_pct;
+  unsigned int         prefetch_hits;
+
+  /* Questions recently needing TCP, which are sent over it right away */
+  ares__tcpcache_t    *tcpcache;
+
+  /* With ARES_FLAG_THREADSAFE, held by every public entry point using the
+   * channel, and signalled through cond_empty when all_queries empties */
+  ares__thread_mutex_t *lock;
+  ares__thread_cond_t  *cond_empty;
+
+  /* Server backoff (ARES_OPT_SERVER_BACKOFF).  A failing server is avoided
+   * for server_backoff milliseconds, doubled for each further consecutive
+   * failure up to ARES_SERVER_BACKOFF_SHIFT times. */
+  size_t               server_backoff;
+
+  /* Hedging (ARES_OPT_HEDGE).  A query not answered within hedge_delay
+   * milliseconds, or about the server's 95th percentile RTT if 0, is also
+   * sent to the next server. */
+  ares_bool_t          hedge;
+  size_t               hedge_delay;
+
+  /* Questions recently needing TCP (ARES_OPT_TCP_CACHE), at most
+   * tcpcache_max_entries of them, or a default number if 0. */
+  size_t               tcpcache_max_entries;
+
   /* Map linked list node member for connection to file descriptor.  We use
    * the node instead of the connection object itself so we can quickly look
    * up a connection and remove it if necessary (as otherwise we'd have to
    * scan all connections) */
   ares__htable_asvp_t *connnode_by_socket;
 
+  /* UDP connections with datagrams queued to be sent, so that processing
+   * passes needn't look at every connection to find them */
+  ares__llist_t       *udp_send_conns;
+
   ares_sock_state_cb   sock_state_cb;
   void                *sock_state_cb_data;
 
+  ares_sock_change_callback           sock_change_cb;
+  void                               *sock_change_cb_data;
+
   ares_sock_create_callback           sock_create_cb;
   void                               *sock_create_cb_data;
 
@@ -336,6 +542,9 @@ struct ares_channeldata {
   const struct ares_socket_functions *sock_funcs;
   void                               *sock_func_cb_data;
 
+  const struct ares_socket_batch_functions *sock_batch_funcs;
+  void                                     *sock_batch_func_cb_data;
+
   /* Path for resolv.conf file, configurable via ares_options */
   char                               *resolvconf_path;
 
@@ -347,6 +556,23 @@ struct ares_channeldata {
 
   /* Cache of local hosts file */
   ares_hosts_file_t                  *hf;
+
+  /* Built-in event engine, NULL unless ares_event_engine_enable() was
+   * called */
+  ares_event_t                       *event;
+
+  /* io_uring transport, NULL unless ARES_FLAG_IOURING was given and the
+   * kernel supports it */
+  ares__uring_t                      *uring;
+
+  /* Requests queued by other threads, NULL unless ARES_FLAG_SUBMITQ */
+  ares__submitq_t                    *submitq;
+
+  /* Watches the hosts file and resolv.conf, NULL unless ARES_FLAG_FILEWATCH */
+  ares__filewatch_t                  *filewatch;
+
+  /* Receive buffer for batched UDP reads, allocated on first use */
+  struct ares__udp_rbuf              *udp_rbuf;
 };
 
 /* Does the domain end in ".onion" or ".onion."? Case-insensitive. */
@@ -362,14 +588,23 @@ void         *ares_realloc_zero(void *ptr, size_t orig_size, size_t new_size);
 /* return true if now is exactly check time or later */
 ares_bool_t   ares__timedout(const struct timeval *now,
                              const struct timeval *check);
+/* add the specific number of milliseconds to the given time */
+void          ares__timeadd(struct timeval *now, size_t millisecs);
+void          ares__server_backoff(ares_channel channel,
+                                   struct server_state  *server,
+                                   const struct timeval *now);
 
 /* Returns one of the normal ares status codes like ARES_SUCCESS */
 ares_status_t ares__send_query(ares_channel channel, struct query *query,
                                struct timeval *now);
 
+/* Server a new query is sent to first */
+size_t        ares__choose_server(ares_channel          channel,
+                                  const struct timeval *now);
+
 /* Identical to ares_query, but returns a normal ares return code like
  * ARES_SUCCESS, and can be passed the qid by reference which will be
- * filled in on ARES_SUCCESS */
+ * filled in before the query is sent */
 ares_status_t ares_query_qid(ares_channel channel, const char *name,
                              int dnsclass, int type, ares_callback callback,
                              void *arg, unsigned short *qid);
@@ -377,18 +612,131 @@ ares_status_t ares_query_qid(ares_channel channel, const char *name,
  * ARES_SUCCESS */
 ares_status_t ares_send_ex(ares_channel channel, const unsigned char *qbuf,
                            size_t qlen, ares_callback callback, void *arg);
+/* Send a prefetch for an answer in the response cache, bypassing the cache.
+ * qbuf is given a new query id.  Nobody is notified of the result, the answer
+ * only updates the cache. */
+ares_status_t ares__send_prefetch(ares_channel channel, unsigned char *qbuf,
+                                  size_t qlen);
+
+/* Variants of ares_send() and ares_query() which hand the callback the
+ * response as parsed while matching it to the query, rather than the raw
+ * bytes */
+ares_status_t ares_send_dnsrec(ares_channel channel, const unsigned char *qbuf,
+                               size_t qlen, ares_callback_dnsrec callback,
+                               void *arg);
+ares_status_t ares_query_dnsrec(ares_channel channel, const char *name,
+                                int dnsclass, int type,
+                                ares_callback_dnsrec callback, void *arg,
+                                unsigned short *qid);
+
+/* Hand a query's result to whichever kind of callback it was created with */
+void          ares__query_notify(struct query *query, ares_status_t status,
+                                 size_t timeouts, const unsigned char *abuf,
+                                 size_t alen, const ares_dns_record_t *dnsrec);
 void          ares__close_connection(struct server_connection *conn);
 void          ares__close_sockets(struct server_state *server);
 void          ares__check_cleanup_conn(ares_channel channel, ares_socket_t fd);
 ares_status_t ares__read_line(FILE *fp, char **buf, size_t *bufsize);
 void          ares__free_query(struct query *query);
+/* Stop a query from accepting followers (ARES_FLAG_COALESCE) */
+void          ares__query_coalesce_close(struct query *query);
+
+/* Per-channel query allocator.  ares__query_alloc() returns a zeroed query
+ * with server_info and tcpbuf (sized for qlen) already attached,
+ * ares__query_alloc_questions() the room for len bytes of its parsed
+ * questions, and ares__query_release() gives it back once detached from all
+ * lists.  The block's trailing area holds a single question with a name of
+ * up to 255 characters, followed by the tcpbuf of a plain UDP sized query. */
+#define ARES_QUERY_POOL_QSZ   (sizeof(struct query_question) + 256)
+#define ARES_QUERY_POOL_BUFSZ (ARES_QUERY_POOL_QSZ + 2 + PACKETSZ)
+#define ARES_QUERY_POOL_MAX   64
+struct query *ares__query_alloc(ares_channel channel, size_t qlen);
+struct query_question *ares__query_alloc_questions(struct query *query,
+                                                   size_t        len);
+void                   ares__query_release(struct query *query);
+/* Fresh server_info for the channel's current servers, after they were
+ * replaced under the query */
+ares_status_t ares__query_reset_servers(struct query *query);
+void          ares__query_pool_destroy(ares_channel channel);
+
+/* Response cache, see ares__qcache.c.  ares__qcache_insert() is given every
+ * answer delivered to a query and keeps the ones that may be cached.
+ * ares__qcache_fetch() returns ARES_SUCCESS with a copy of the answer cached
+ * under the request's key, rewritten with its query id and parsed if asked
+ * to, or ARES_ENOTFOUND on a miss */
+ares__qcache_t *ares__qcache_create(ares_rand_state *rand_state,
+                                    unsigned int     max_ttl,
+                                    unsigned int     stale_window,
+                                    unsigned int     prefetch_pct,
+                                    unsigned int     prefetch_hits);
+void            ares__qcache_destroy(ares__qcache_t *cache);
+void            ares__qcache_flush(ares__qcache_t *cache);
+/* Key identifying the question of a request, also used for coalescing.  NULL
+ * if the request can't be keyed. */
+char           *ares__qcache_calc_key(const unsigned char *qbuf, size_t qlen);
+size_t          ares__qcache_len(const ares__qcache_t *cache);
+ares_status_t   ares__qcache_insert(ares__qcache_t          *cache,
+                                    const struct timeval    *now,
+                                    const struct query      *query,
+                                    const unsigned char     *abuf,
+                                    size_t                   alen,
+                                    const ares_dns_record_t *dnsrec);
+ares_status_t   ares__qcache_fetch(ares__qcache_t       *cache,
+                                   const struct timeval *now, const char *key,
+                                   unsigned short qid, ares_bool_t parse,
+                                   unsigned char **abuf, size_t *alen,
+                                   ares_dns_record_t **dnsrec);
+/* Serve-stale, RFC 8767.  ares__qcache_has_stale() reports whether an answer,
+ * fresh or stale, is retained for the query.  ares__qcache_fetch_stale()
+ * returns it like ares__qcache_fetch(), always parsed, and has
+ * ares__qcache_fetch() serve it without asking the servers for a while. */
+ares_bool_t     ares__qcache_has_stale(ares__qcache_t       *cache,
+                                       const struct timeval *now,
+                                       const struct query   *query);
+ares_status_t   ares__qcache_fetch_stale(ares__qcache_t       *cache,
+                                         const struct timeval *now,
+                                         const struct query   *query,
+                                         unsigned char **abuf, size_t *alen,
+                                         ares_dns_record_t **dnsrec);
+/* Prefetch.  ares__qcache_prefetch_next() gives the time at which the next
+ * popular answer is due to be queried again, if any.
+ * ares__qcache_prefetch_due() returns the request, owned by the caller, for
+ * one answer that is due, or NULL if none are.  Each answer is prefetched at
+ * most once. */
+ares_bool_t     ares__qcache_prefetch_next(const ares__qcache_t *cache,
+                                           struct timeval       *tv);
+unsigned char  *ares__qcache_prefetch_due(ares__qcache_t       *cache,
+                                          const struct timeval *now,
+                                          size_t               *qlen);
+
+/* Questions which need TCP, see ares__tcpcache.c.  ares__tcpcache_insert()
+ * is given queries whose answer didn't fit in UDP, and
+ * ares__tcpcache_fetch() tells whether a query should go over TCP from the
+ * start as its question recently did. */
+ares__tcpcache_t *ares__tcpcache_create(ares_rand_state *rand_state,
+                                        size_t           max_entries);
+void              ares__tcpcache_destroy(ares__tcpcache_t *cache);
+void              ares__tcpcache_flush(ares__tcpcache_t *cache);
+ares_status_t     ares__tcpcache_insert(ares__tcpcache_t     *cache,
+                                        const struct timeval *now,
+                                        const struct query   *query);
+ares_bool_t       ares__tcpcache_fetch(ares__tcpcache_t     *cache,
+                                       const struct timeval *now,
+                                       const struct query   *query);
 
 ares_rand_state *ares__init_rand_state(void);
 void             ares__destroy_rand_state(ares_rand_state *state);
 void ares__rand_bytes(ares_rand_state *state, unsigned char *buf, size_t len);
 
 unsigned short ares__generate_new_id(ares_rand_state *state);
+/* A query id not in use by any query on the channel */
+unsigned short ares__generate_unique_qid(ares_channel channel);
 struct timeval ares__tvnow(void);
+
+/* Lock and unlock the channel, which does nothing unless it was created with
+ * ARES_FLAG_THREADSAFE.  Locks nest. */
+void ares__channel_lock(ares_channel channel);
+void ares__channel_unlock(ares_channel channel);
 ares_status_t  ares__expand_name_validated(const unsigned char *encoded,
                                            const unsigned char *abuf,
                                            size_t alen, char **s, size_t *enclen,
@@ -405,6 +753,14 @@ ares_status_t  ares__init_servers_state(ares_channel channel);
 ares_status_t  ares__init_by_options(ares_channel               channel,
                                      const struct ares_options *options,
                                      int                        optmask);
+ares_status_t  ares__dup_config(ares_channel *dest, ares_channel src);
+/* ares_set_servers_ports() without marking the servers as set by the user,
+ * or checking for queries in flight.  ares__replace_servers() also moves
+ * those over to the new servers. */
+ares_status_t  ares__set_servers_ports(ares_channel                channel,
+                                       struct ares_addr_port_node *servers);
+ares_status_t  ares__replace_servers(ares_channel                channel,
+                                     struct ares_addr_port_node *servers);
 void           ares__destroy_servers_state(ares_channel channel);
 ares_status_t  ares__single_domain(ares_channel channel, const char *name,
                                    char **s);
@@ -432,10 +788,13 @@ ares_status_t ares_append_ai_node(int aftype, unsigned short port,
 void          ares__addrinfo_cat_cnames(struct ares_addrinfo_cname **head,
                                         struct ares_addrinfo_cname  *tail);
 
-ares_status_t ares__parse_into_addrinfo(const unsigned char *abuf, size_t alen,
+ares_status_t ares__parse_into_addrinfo(const ares_dns_record_t *dnsrec,
                                         ares_bool_t    cname_only_is_enodata,
                                         unsigned short port,
                                         struct ares_addrinfo *ai);
+ares_status_t ares__parse_ptr_reply(const ares_dns_record_t *dnsrec,
+                                    const void *addr, int addrlen, int family,
+                                    struct hostent **host);
 
 ares_status_t ares__addrinfo2hostent(const struct ares_addrinfo *ai, int family,
                                      struct hostent **host);
@@ -460,7 +819,15 @@ ares_ssize_t ares__socket_recvfrom(ares_channel channel, ares_socket_t s,
                                    ares_socklen_t  *from_len);
 ares_ssize_t ares__socket_recv(ares_channel channel, ares_socket_t s,
                                void *data, size_t data_len);
+ares_ssize_t ares__socket_recvmulti(ares_channel channel, ares_socket_t s,
+                                    struct ares_socket_msg *msgs, size_t cnt);
+ares_ssize_t ares__socket_sendmulti(ares_channel channel, ares_socket_t s,
+                                    const struct ares_socket_msg *msgs,
+                                    size_t                        cnt);
 void          ares__close_socket(ares_channel, ares_socket_t);
+/* Set the interest (ARES_SOCK_READ/ARES_SOCK_WRITE) for a connection's socket,
+ * notifying the event engine and callbacks only if it actually changed */
+void          ares__conn_sock_state(struct server_connection *conn, int events);
 int           ares__connect_socket(ares_channel channel, ares_socket_t sockfd,
                                    const struct sockaddr *addr,
                                    ares_socklen_t addrlen);
@@ -471,6 +838,8 @@ struct ares_hosts_entry;
 typedef struct ares_hosts_entry ares_hosts_entry_t;
 
 void ares__hosts_file_destroy(ares_hosts_file_t *hf);
+ares_status_t ares__hosts_path(ares_channel channel, ares_bool_t use_env,
+                               char **path);
 ares_status_t ares__hosts_search_ipaddr(ares_channel channel,
                                         ares_bool_t use_env, const char *ipaddr,
                                         const ares_hosts_entry_t **entry);
@@ -487,6 +856,65 @@ ares_status_t ares__hosts_entry_to_addrinfo(const ares_hosts_entry_t *entry,
                                             ares_bool_t want_cnames,
                                             struct ares_addrinfo *ai);
 
+ares_status_t ares__event_update(ares_channel channel, ares_socket_t fd,
+                                 int readable, int writable);
+size_t        ares__event_poll(ares_event_t *event, ares_event_ready_t *ready,
+                               size_t max_ready);
+void          ares__event_destroy(ares_channel channel);
+
+/* io_uring transport, see ares__uring.c.  Socket I/O goes through
+ * ares__socket.c, but the transport can't be confined to it: the kernel reads
+ * the sockets it owns into the ring, so those sockets would never become
+ * readable to the application.  ares_fds(), ares_getsock(),
+ * ares_getsock_all() and the event engine therefore report the ring's
+ * descriptor in their place, and each processing pass (processfds() and
+ * ares_process_pending()) reaps the completions and submits what was queued
+ * through process_uring(). */
+ares_status_t ares__uring_create(ares_channel channel);
+void          ares__uring_destroy(ares_channel channel);
+ares_socket_t ares__uring_fd(const ares_channel channel);
+int           ares__uring_sock_state(const ares_channel channel);
+ares_bool_t   ares__uring_has(const ares_channel channel, ares_socket_t fd);
+void          ares__uring_conn_state(ares_channel channel, ares_socket_t fd,
+                                     int events);
+ares_status_t ares__uring_add(ares_channel              channel,
+                              struct server_connection *conn);
+void          ares__uring_remove(ares_channel channel, ares_socket_t fd);
+ares_status_t ares__uring_watch(ares_channel channel, ares_socket_t fd);
+void          ares__uring_unwatch(ares_channel channel, ares_socket_t fd);
+ares_ssize_t  ares__uring_recv(ares_channel channel, ares_socket_t fd,
+                               void *data, size_t data_len,
+                               struct sockaddr *from, ares_socklen_t *from_len);
+ares_ssize_t  ares__uring_send(ares_channel channel, ares_socket_t fd,
+                               const void *data, size_t len);
+size_t        ares__uring_poll(ares_channel channel, ares_event_ready_t *ready,
+                               size_t max_ready);
+void          ares__uring_submit(ares_channel channel);
+
+/* Cross-thread submission queue, see ares__submitq.c.  The queue's wake up
+ * descriptor is reported as readable alongside the server sockets, and
+ * watched by the event engine or io_uring transport.  Passing woken runs the
+ * requests after consuming the wake up. */
+ares_status_t ares__submitq_create(ares_channel channel);
+void          ares__submitq_destroy(ares_channel channel);
+ares_socket_t ares__submitq_fd(const ares_channel channel);
+void          ares__submitq_process(ares_channel channel, ares_bool_t woken);
+void          ares__submitq_cancel(ares_channel channel, ares_status_t status);
+
+/* Hosts file and resolv.conf change detection, see ares__filewatch.c.  With
+ * inotify the descriptor is reported as readable alongside the server
+ * sockets, and watched by the event engine or io_uring transport.  Passing
+ * woken reads the pending events. */
+ares_status_t ares__filewatch_create(ares_channel channel);
+void          ares__filewatch_destroy(ares_channel channel);
+ares_socket_t ares__filewatch_fd(const ares_channel channel);
+void          ares__filewatch_process(ares_channel          channel,
+                                      ares_bool_t           woken,
+                                      const struct timeval *now);
+ares_bool_t   ares__filewatch_hosts_stale(ares_channel channel,
+                                          const char  *filename);
+ares_status_t ares__reload_config(ares_channel channel);
+
 #define ARES_SWAP_BYTE(a, b)           \
   do {                                 \
     unsigned char swapByte = *(a);     \
@@ -494,13 +922,6 @@ ares_status_t ares__hosts_entry_to_addrinfo(const ares_hosts_entry_t *entry,
     *(b)                   = swapByte; \
   } while (0)
 
-#define SOCK_STATE_CALLBACK(c, s, r, w)                           \
-  do {                                                            \
-    if ((c)->sock_state_cb) {                                     \
-      (c)->sock_state_cb((c)->sock_state_cb_data, (s), (r), (w)); \
-    }                                                             \
-  } while (0)
-
 #define ARES_CONFIG_CHECK(x)                                          \
   (x->lookups && x->nservers > 0 && x->ndots > 0 && x->timeout > 0 && \
    x->tries > 0)
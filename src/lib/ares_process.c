@@ -47,28 +47,41 @@
 #include "ares_nameser.h"
 #include "ares_dns.h"
 
+/* Timeouts of a query asking a server for more than EDNSSAFEPSZ, before the
+ * query falls back to that.  One is as likely a lost packet. */
+#define ARES_EDNS_FALLBACK_TIMEOUTS 2
+
 static ares_bool_t try_again(int errnum);
 static void        write_tcp_data(ares_channel channel, fd_set *write_fds,
                                   ares_socket_t write_fd, struct timeval *now);
 static void        read_packets(ares_channel channel, fd_set *read_fds,
                                 ares_socket_t read_fd, struct timeval *now);
 static void        process_timeouts(ares_channel channel, struct timeval *now);
+static void        write_udp_data(ares_channel channel, struct timeval *now);
+static void        process_uring(ares_channel channel, struct timeval *now);
 static void process_answer(ares_channel channel, const unsigned char *abuf,
                            size_t alen, struct server_connection *conn,
                            ares_bool_t tcp, struct timeval *now);
 static void handle_error(struct server_connection *conn, struct timeval *now);
 static void skip_server(ares_channel channel, struct query *query,
-                        const struct server_state *server);
+                        struct server_state *server,
+                        const struct timeval *now);
 static ares_status_t next_server(ares_channel channel, struct query *query,
                                  struct timeval *now);
-static ares_bool_t   same_questions(const unsigned char *qbuf, size_t qlen,
+static ares_bool_t   same_questions(const struct query      *query,
                                     const ares_dns_record_t *arec);
 static ares_bool_t   same_address(const struct sockaddr *sa,
                                   const struct ares_addr *aa);
 static ares_bool_t   has_opt_rr(ares_dns_record_t *arec);
+static size_t        query_edns_psz(const struct query        *query,
+                                    const struct server_state *server);
 static void          end_query(ares_channel channel, struct query *query,
                                ares_status_t status, const unsigned char *abuf,
-                               size_t alen);
+                               size_t alen, ares_dns_record_t *dnsrec);
+static void          end_followers(ares__llist_t *followers,
+                                   ares_status_t status, size_t timeouts,
+                                   const unsigned char *abuf, size_t alen,
+                                   ares_dns_record_t *dnsrec);
 
 
 /* return true if now is exactly check time or later */
@@ -88,7 +101,7 @@ ares_bool_t ares__timedout(const struct timeval *now, const struct timeval *chec
 }
 
 /* add the specific number of milliseconds to the time in the first argument */
-static void timeadd(struct timeval *now, size_t millisecs)
+void ares__timeadd(struct timeval *now, size_t millisecs)
 {
   now->tv_sec  += (time_t)millisecs / 1000;
   now->tv_usec += (time_t)((millisecs % 1000) * 1000);
@@ -106,11 +119,80 @@ static void processfds(ares_channel channel, fd_set *read_fds,
                        ares_socket_t read_fd, fd_set *write_fds,
                        ares_socket_t write_fd)
 {
-  struct timeval now = ares__tvnow();
+  struct timeval now     = ares__tvnow();
+  ares_socket_t  wakefd  = ares__submitq_fd(channel);
+  ares_socket_t  watchfd = ares__filewatch_fd(channel);
+
+  /* Pick up changes to the hosts file and resolv.conf */
+  if (channel->filewatch != NULL) {
+    ares_bool_t woken = ARES_FALSE;
+
+    if (watchfd != ARES_SOCKET_BAD &&
+        (read_fd == watchfd ||
+         (read_fds != NULL && FD_ISSET(watchfd, read_fds)))) {
+      woken = ARES_TRUE;
+    }
+    ares__filewatch_process(channel, woken, &now);
+  }
 
+  /* Start whatever other threads have queued up */
+  if (wakefd != ARES_SOCKET_BAD) {
+    ares__submitq_process(channel,
+                          (read_fd == wakefd ||
+                           (read_fds != NULL && FD_ISSET(wakefd, read_fds)))
+                            ? ARES_TRUE
+                            : ARES_FALSE);
+  }
+
+  write_udp_data(channel, &now);
   write_tcp_data(channel, write_fds, write_fd, &now);
   read_packets(channel, read_fds, read_fd, &now);
+  process_uring(channel, &now);
   process_timeouts(channel, &now);
+  /* Send out anything queued by retries or callbacks during this pass */
+  write_udp_data(channel, &now);
+  process_uring(channel, &now);
+}
+
+/* Sockets owned by the io_uring transport are never reported individually,
+ * so whenever the channel is processed hand any queued TCP data to the ring,
+ * drain whatever completed, and submit everything in one go.  The ring also
+ * reports the submission queue's wake ups and changes to the watched files,
+ * for applications only waiting on the ring descriptor.
+ */
+static void process_uring(ares_channel channel, struct timeval *now)
+{
+  ares_event_ready_t ready[ARES_EVENT_MAX_READY];
+  size_t             cnt;
+  size_t             i;
+
+  if (channel->uring == NULL) {
+    return;
+  }
+
+  for (i = 0; i < channel->nservers; i++) {
+    const struct server_state *server = &channel->servers[i];
+
+    if (server->tcp_conn != NULL && ares__buf_len(server->tcp_send) != 0 &&
+        ares__uring_has(channel, server->tcp_conn->fd)) {
+      write_tcp_data(channel, NULL, server->tcp_conn->fd, now);
+    }
+  }
+
+  cnt = ares__uring_poll(channel, ready, ARES_EVENT_MAX_READY);
+  for (i = 0; i < cnt; i++) {
+    if (ready[i].fd == ares__submitq_fd(channel)) {
+      ares__submitq_process(channel, ARES_TRUE);
+      continue;
+    }
+    if (ready[i].fd == ares__filewatch_fd(channel)) {
+      ares__filewatch_process(channel, ARES_TRUE, now);
+      continue;
+    }
+    read_packets(channel, NULL, ready[i].fd, now);
+  }
+
+  ares__uring_submit(channel);
 }
 
 /* Something interesting happened on the wire, or there was a timeout.
@@ -118,7 +200,9 @@ static void processfds(ares_channel channel, fd_set *read_fds,
  */
 void ares_process(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
 {
+  ares__channel_lock(channel);
   processfds(channel, read_fds, ARES_SOCKET_BAD, write_fds, ARES_SOCKET_BAD);
+  ares__channel_unlock(channel);
 }
 
 /* Something interesting happened on the wire, or there was a timeout.
@@ -129,7 +213,56 @@ void ares_process_fd(ares_channel  channel,
                                                file descriptors */
                      ares_socket_t write_fd)
 {
+  ares__channel_lock(channel);
   processfds(channel, NULL, read_fd, NULL, write_fd);
+  ares__channel_unlock(channel);
+}
+
+/* Drain whatever the built-in event engine reports as ready, then handle any
+ * timeouts.  Sockets are level-triggered, so anything left unprocessed after
+ * a single batch will simply be reported again on the next call.
+ */
+void ares_process_pending(ares_channel channel)
+{
+  ares_event_ready_t ready[ARES_EVENT_MAX_READY];
+  size_t             cnt;
+  size_t             i;
+  struct timeval     now;
+
+  if (channel == NULL) {
+    return;
+  }
+
+  ares__channel_lock(channel);
+  now = ares__tvnow();
+
+  ares__filewatch_process(channel, ARES_FALSE, &now);
+  ares__submitq_process(channel, ARES_FALSE);
+  write_udp_data(channel, &now);
+  process_uring(channel, &now);
+
+  cnt = ares__event_poll(channel->event, ready, ARES_EVENT_MAX_READY);
+  for (i = 0; i < cnt; i++) {
+    if (ready[i].fd == ares__submitq_fd(channel)) {
+      ares__submitq_process(channel, ARES_TRUE);
+      continue;
+    }
+    if (ready[i].fd == ares__filewatch_fd(channel)) {
+      ares__filewatch_process(channel, ARES_TRUE, &now);
+      continue;
+    }
+    if (ready[i].writable) {
+      write_tcp_data(channel, NULL, ready[i].fd, &now);
+    }
+    if (ready[i].readable) {
+      read_packets(channel, NULL, ready[i].fd, &now);
+    }
+  }
+
+  process_timeouts(channel, &now);
+  write_udp_data(channel, &now);
+  process_uring(channel, &now);
+  ares__channel_unlock(channel);
 }
 
 /* Return 1 if the specified error number describes a readiness error, or 0
@@ -217,7 +350,7 @@ static void write_tcp_data(ares_channel channel, fd_set *write_fds,
 
     /* Notify state callback all data is written */
     if (ares__buf_len(server->tcp_send) == 0) {
-      SOCK_STATE_CALLBACK(channel, server->tcp_conn->fd, 1, 0);
+      ares__conn_sock_state(server->tcp_conn, ARES_SOCK_READ);
     }
   }
 }
@@ -303,7 +436,7 @@ static int socket_list_append(ares_socket_t **socketlist, ares_socket_t fd,
     /* Grow by powers of 2 */
     size_t         new_alloc = (*alloc_cnt) << 1;
     ares_socket_t *new_list =
-      ares_realloc(socketlist, new_alloc * sizeof(*new_list));
+      ares_realloc(*socketlist, new_alloc * sizeof(*new_list));
     if (new_list == NULL) {
       return 0;
     }
@@ -351,69 +484,125 @@ fail:
   return NULL;
 }
 
-/* If any UDP sockets select true for reading, process them. */
-static void read_udp_packets_fd(ares_channel              channel,
-                                struct server_connection *conn,
-                                struct timeval           *now)
-{
-  ares_ssize_t  read_len;
-  unsigned char buf[MAXENDSSZ + 1];
-  ares_socket_t fd = conn->fd; /* Cache for validation */
-
-#ifdef HAVE_RECVFROM
-  ares_socklen_t fromlen;
+/* Scratch space for batched UDP reads.  It is kept on the channel so the
+ * read path doesn't need a large stack frame per call, in_use guards against
+ * a callback re-entering the read path while a batch is being processed. */
+struct ares__udp_rbuf {
+  ares_bool_t            in_use;
+  struct ares_socket_msg msgs[ARES_UDP_BATCH_MAX];
 
   union {
     struct sockaddr     sa;
     struct sockaddr_in  sa4;
     struct sockaddr_in6 sa6;
-  } from;
+  } from[ARES_UDP_BATCH_MAX];
 
-  memset(&from, 0, sizeof(from));
-#endif
+  unsigned char buf[ARES_UDP_BATCH_MAX][MAXENDSSZ + 1];
+};
+
+static ares_bool_t conn_is_valid(ares_channel channel, ares_socket_t fd,
+                                 const struct server_connection *conn)
+{
+  ares__llist_node_t *node =
+    ares__htable_asvp_get_direct(channel->connnode_by_socket, fd);
+  return (node != NULL && ares__llist_node_val(node) == conn) ? ARES_TRUE
+                                                             : ARES_FALSE;
+}
+
+/* If any UDP sockets select true for reading, process them. */
+static void read_udp_packets_fd(ares_channel              channel,
+                                struct server_connection *conn,
+                                struct timeval           *now)
+{
+  ares_socket_t          fd    = conn->fd; /* Cache for validation */
+  struct ares__udp_rbuf *rbuf  = channel->udp_rbuf;
+  ares_bool_t            owned = ARES_FALSE;
+
+  if (rbuf == NULL || rbuf->in_use) {
+    /* First read on this channel, or re-entered from a callback while the
+     * channel buffer holds an unprocessed batch */
+    rbuf = ares_malloc(sizeof(*rbuf));
+    if (rbuf == NULL) {
+      /* Leave the data queued, it will be picked up on the next pass */
+      return;
+    }
+    rbuf->in_use = ARES_FALSE;
+    if (channel->udp_rbuf == NULL) {
+      channel->udp_rbuf = rbuf;
+    } else {
+      owned = ARES_TRUE;
+    }
+  }
+  rbuf->in_use = ARES_TRUE;
 
   /* To reduce event loop overhead, read and process as many
    * packets as we can. */
-  do {
+  for (;;) {
+    ares_ssize_t cnt;
+    size_t       i;
+
     if (conn->fd == ARES_SOCKET_BAD) {
-      read_len = -1;
-    } else {
-      if (conn->server->addr.family == AF_INET) {
-        fromlen = sizeof(from.sa4);
-      } else {
-        fromlen = sizeof(from.sa6);
+      handle_error(conn, now);
+      break;
+    }
+
+    for (i = 0; i < ARES_UDP_BATCH_MAX; i++) {
+      rbuf->msgs[i].data     = rbuf->buf[i];
+      rbuf->msgs[i].data_len = sizeof(rbuf->buf[i]);
+      rbuf->msgs[i].from     = &rbuf->from[i].sa;
+      rbuf->msgs[i].from_len = (conn->server->addr.family == AF_INET)
+                                 ? sizeof(rbuf->from[i].sa4)
+                                 : sizeof(rbuf->from[i].sa6);
+      memset(&rbuf->from[i], 0, sizeof(rbuf->from[i]));
+    }
+
+    cnt = ares__socket_recvmulti(channel, fd, rbuf->msgs, ARES_UDP_BATCH_MAX);
+    if (cnt < 0) {
+      if (!try_again(SOCKERRNO)) {
+        handle_error(conn, now);
       }
-      read_len = ares__socket_recvfrom(channel, conn->fd, (void *)buf,
-                                       sizeof(buf), 0, &from.sa, &fromlen);
+      break;
+    }
+    if (cnt == 0) {
+      break;
+    }
+    if (cnt > ARES_UDP_BATCH_MAX) {
+      cnt = ARES_UDP_BATCH_MAX;
     }
 
-    if (read_len == 0) {
-      /* UDP is connectionless, so result code of 0 is a 0-length UDP
-       * packet, and not an indication the connection is closed like on
-       * tcp */
-      continue;
-    } else if (read_len < 0) {
-      if (try_again(SOCKERRNO)) {
+    for (i = 0; i < (size_t)cnt; i++) {
+      if (rbuf->msgs[i].data_len == 0) {
+        /* UDP is connectionless, so result code of 0 is a 0-length UDP
+         * packet, and not an indication the connection is closed like on
+         * tcp */
         continue;
       }
 
-      handle_error(conn, now);
-      return;
 #ifdef HAVE_RECVFROM
-    } else if (!same_address(&from.sa, &conn->server->addr)) {
-      /* The address the response comes from does not match the address we
-       * sent the request to. Someone may be attempting to perform a cache
-       * poisoning attack. */
-      continue;
+      if (!same_address(rbuf->msgs[i].from, &conn->server->addr)) {
+        /* The address the response comes from does not match the address we
+         * sent the request to. Someone may be attempting to perform a cache
+         * poisoning attack. */
+        continue;
+      }
 #endif
 
-    } else {
-      process_answer(channel, buf, (size_t)read_len, conn, ARES_FALSE, now);
+      process_answer(channel, rbuf->msgs[i].data, rbuf->msgs[i].data_len, conn,
+                     ARES_FALSE, now);
+
+      /* process_answer may invalidate "conn" and close the file descriptor,
+       * so check to see if it is still valid before going any further! */
+      if (!conn_is_valid(channel, fd, conn)) {
+        goto done;
+      }
     }
-    /* process_answer may invalidate "conn" and close the file descriptor, so
-     * check to see if file descriptor is still valid before looping! */
-  } while (read_len >= 0 && ares__htable_asvp_get_direct(
-                              channel->connnode_by_socket, fd) != NULL);
+  }
+
+done:
+  rbuf->in_use = ARES_FALSE;
+  if (owned) {
+    ares_free(rbuf);
+  }
 }
 
 static void read_packets(ares_channel channel, fd_set *read_fds,
@@ -483,16 +672,282 @@ static void read_packets(ares_channel channel, fd_set *read_fds,
   ares_free(socketlist);
 }
 
+/* Send as many queued datagrams on a UDP connection as the socket will take.
+ * Whatever doesn't fit stays queued with write interest registered, so a full
+ * socket buffer delays queries rather than failing them over. */
+static void write_udp_conn(ares_channel channel, struct server_connection *conn,
+                           struct timeval *now)
+{
+  while (ares__buf_len(conn->udp_send) > 0) {
+    struct ares_socket_msg msgs[ARES_UDP_BATCH_MAX];
+    const unsigned char   *data;
+    size_t                 data_len;
+    size_t                 offset = 0;
+    size_t                 cnt    = 0;
+    size_t                 i;
+    ares_ssize_t           sent;
+
+    data = ares__buf_peek(conn->udp_send, &data_len);
+    while (cnt < ARES_UDP_BATCH_MAX && offset + 2 <= data_len) {
+      size_t len = ((size_t)data[offset] << 8) | (size_t)data[offset + 1];
+
+      memset(&msgs[cnt], 0, sizeof(msgs[cnt]));
+      msgs[cnt].data      = (void *)(data + offset + 2);
+      msgs[cnt].data_len  = len;
+      offset             += 2 + len;
+      cnt++;
+    }
+
+    sent = ares__socket_sendmulti(channel, conn->fd, msgs, cnt);
+    if (sent <= 0) {
+      if (!try_again(SOCKERRNO)) {
+        handle_error(conn, now);
+      }
+      return;
+    }
+
+    offset = 0;
+    for (i = 0; i < (size_t)sent && i < cnt; i++) {
+      offset += 2 + msgs[i].data_len;
+    }
+    ares__buf_consume(conn->udp_send, offset);
+
+    if ((size_t)sent < cnt) {
+      /* Socket buffer is full, wait for it to become writable */
+      return;
+    }
+  }
+
+  ares__llist_node_claim(conn->node_udp_send);
+  conn->node_udp_send = NULL;
+
+  /* Notify state callback all data is written */
+  ares__conn_sock_state(conn, ARES_SOCK_READ);
+}
+
+/* Flush the datagrams queued on any UDP connection. */
+static void write_udp_data(ares_channel channel, struct timeval *now)
+{
+  ares_socket_t      *socketlist;
+  size_t              num_sockets = ares__llist_len(channel->udp_send_conns);
+  size_t              i           = 0;
+  ares__llist_node_t *node;
+
+  if (num_sockets == 0) {
+    return;
+  }
+
+  /* A write error requeues queries which may open or close other
+   * connections, so work from a snapshot of the sockets */
+  socketlist = ares_malloc(num_sockets * sizeof(*socketlist));
+  if (socketlist == NULL) {
+    return;
+  }
+  for (node = ares__llist_node_first(channel->udp_send_conns); node != NULL;
+       node = ares__llist_node_next(node)) {
+    const struct server_connection *conn = ares__llist_node_val(node);
+    socketlist[i++]                      = conn->fd;
+  }
+
+  for (i = 0; i < num_sockets; i++) {
+    struct server_connection *conn;
+
+    node =
+      ares__htable_asvp_get_direct(channel->connnode_by_socket, socketlist[i]);
+    if (node == NULL) {
+      continue;
+    }
+
+    conn = ares__llist_node_val(node);
+    if (conn->is_tcp || ares__buf_len(conn->udp_send) == 0) {
+      continue;
+    }
+
+    write_udp_conn(channel, conn, now);
+  }
+
+  ares_free(socketlist);
+}
+
+/* Queue a UDP query on the connection to be sent by write_udp_data() */
+static ares_status_t queue_udp_query(struct server_connection *conn,
+                                     const struct query       *query)
+{
+  ares_status_t status;
+
+  if (conn->udp_send == NULL) {
+    conn->udp_send = ares__buf_create();
+    if (conn->udp_send == NULL) {
+      return ARES_ENOMEM;
+    }
+  }
+
+  /* tcpbuf is the query prefixed with its length, which is exactly the
+   * framing used for the queue */
+  if (conn->node_udp_send == NULL) {
+    conn->node_udp_send =
+      ares__llist_insert_last(conn->server->channel->udp_send_conns, conn);
+    if (conn->node_udp_send == NULL) {
+      return ARES_ENOMEM;
+    }
+  }
+
+  status = ares__buf_append(conn->udp_send, query->tcpbuf, query->tcplen);
+  if (status != ARES_SUCCESS) {
+    return status;
+  }
+
+  ares__conn_sock_state(conn, ARES_SOCK_READ | ARES_SOCK_WRITE);
+  return ARES_SUCCESS;
+}
+
+/* The query took long enough that it is worth also asking the next server.
+ * Whichever answers first is taken, and this is no failure of the server it
+ * is waiting on. */
+static void hedge_query(ares_channel channel, struct query *query,
+                        struct timeval *now)
+{
+  query->hedge_pending        = ARES_FALSE;
+  query->hedged               = ARES_TRUE;
+  query->hedge_conn           = query->conn;
+  query->node_hedge_to_conn   = query->node_queries_to_conn;
+  query->hedge_ts             = query->ts;
+  query->node_queries_to_conn = NULL;
+
+  next_server(channel, query, now);
+}
+
+static void timeout_query(ares_channel channel, struct query *query,
+                          struct timeval *now)
+{
+  ares_socket_t fd;
+  ares_socket_t hedge_fd;
+
+  if (query->hedge_pending) {
+    hedge_query(channel, query, now);
+    return;
+  }
+
+  query->error_status = ARES_ETIMEOUT;
+  query->timeouts++;
+  channel->stat_timeouts++;
+
+  /* Large EDNS answers over UDP are lost to fragmentation with some paths,
+   * though a timeout may just as well be a lost packet.  Count the ones when
+   * asking for more than is generally safe, see query_fit_edns(). */
+  if (!query->using_tcp &&
+      query_edns_psz(query, &channel->servers[query->server]) > EDNSSAFEPSZ) {
+    query->server_info[query->server].edns_timeouts++;
+  }
+  channel->servers[query->server].consec_failures++;
+  channel->servers[query->server].rto_backoff++;
+  ares__server_backoff(channel, &channel->servers[query->server], now);
+
+  fd       = query->conn->fd;
+  hedge_fd = query->hedge_conn != NULL ? query->hedge_conn->fd
+                                       : ARES_SOCKET_BAD;
+  next_server(channel, query, now);
+  /* A timeout is a special case where we need to possibly cleanup a
+   * a connection */
+  ares__check_cleanup_conn(channel, fd);
+  if (hedge_fd != ARES_SOCKET_BAD) {
+    ares__check_cleanup_conn(channel, hedge_fd);
+  }
+}
+
+/* RFC 8767 Section 5: the query has waited long enough, answer it from the
+ * stale cache.  The query itself carries on as a background refresh, and its
+ * answer, if any, only updates the cache. */
+static void stale_timeout_query(ares_channel channel, struct query *query,
+                                const struct timeval *now)
+{
+  ares_callback        callback        = query->callback;
+  ares_callback_dnsrec callback_dnsrec = query->callback_dnsrec;
+  void                *arg             = query->arg;
+  size_t               timeouts        = query->timeouts;
+  ares__llist_t       *followers;
+  unsigned char       *abuf   = NULL;
+  size_t               alen   = 0;
+  ares_dns_record_t   *dnsrec = NULL;
+
+  /* The answer may have been flushed since the query was sent */
+  if (ares__qcache_fetch_stale(channel->qcache, now, query, &abuf, &alen,
+                               &dnsrec) != ARES_SUCCESS) {
+    return;
+  }
+
+  /* Detach the callback before invoking it, so the query is never notified
+   * again, whether it is cancelled by the callback or completes later */
+  followers              = query->followers;
+  query->followers       = NULL;
+  query->stale_served    = ARES_TRUE;
+  query->callback        = NULL;
+  query->callback_dnsrec = NULL;
+  query->arg             = NULL;
+  ares__query_coalesce_close(query);
+
+  if (callback_dnsrec != NULL) {
+    callback_dnsrec(arg, ARES_SUCCESS, timeouts, dnsrec);
+  } else {
+    callback(arg, ARES_SUCCESS, (int)timeouts, abuf, (int)alen);
+  }
+
+  /* The query may be gone by now */
+  end_followers(followers, ARES_SUCCESS, timeouts, abuf, alen, dnsrec);
+
+  ares_dns_record_destroy(dnsrec);
+  ares_free(abuf);
+}
+
+static void process_stale(ares_channel channel, const struct timeval *now)
+{
+  struct query *query;
+
+  while ((query = ares__slist_first_val(channel->queries_by_stale)) != NULL &&
+         ares__timedout(now, &query->stale_timeout)) {
+    ares__slist_node_destroy(query->node_queries_by_stale);
+    query->node_queries_by_stale = NULL;
+    stale_timeout_query(channel, query, now);
+  }
+}
+
+/* Query popular answers again as they near expiry, so they are refreshed in
+ * the cache before anyone has to wait on them */
+static void process_prefetch(ares_channel channel, const struct timeval *now)
+{
+  unsigned char *qbuf;
+  size_t         qlen;
+
+  while ((qbuf = ares__qcache_prefetch_due(channel->qcache, now, &qlen)) !=
+         NULL) {
+    ares__send_prefetch(channel, qbuf, qlen);
+    ares_free(qbuf);
+  }
+}
+
 /* If any queries have timed out, note the timeout and move them on. */
 static void process_timeouts(ares_channel channel, struct timeval *now)
 {
-  ares__slist_node_t *node =
-    ares__slist_node_first(channel->queries_by_timeout);
+  ares__slist_node_t *node;
+
+  process_stale(channel, now);
+  process_prefetch(channel, now);
+
+  if (channel->timerwheel != NULL) {
+    struct query *query;
+
+    while ((query = ares__timerwheel_expire(channel->timerwheel, now)) !=
+           NULL) {
+      timeout_query(channel, query, now);
+    }
+    return;
+  }
+
+  node = ares__slist_node_first(channel->queries_by_timeout);
   while (node != NULL) {
     struct query       *query = ares__slist_node_val(node);
     /* Node might be removed, cache next */
     ares__slist_node_t *next = ares__slist_node_next(node);
-    ares_socket_t       fd;
 
     /* Since this is sorted, as soon as we hit a query that isn't timed out,
      * break */
@@ -500,18 +955,43 @@ static void process_timeouts(ares_channel channel, struct timeval *now)
       break;
     }
 
-    query->error_status = ARES_ETIMEOUT;
-    query->timeouts++;
+    timeout_query(channel, query, now);
 
+    node = next;
+  }
+}
 
-    fd = query->conn->fd;
-    next_server(channel, query, now);
-    /* A timeout is a special case where we need to possibly cleanup a
-     * a connection */
-    ares__check_cleanup_conn(channel, fd);
+/* Fold a round trip time measurement into the server's smoothed RTT and
+ * variance as per RFC 6298 Section 2 */
+static void server_rtt_sample(struct server_state  *server,
+                              const struct timeval *sent,
+                              const struct timeval *now)
+{
+  size_t rtt;
+  size_t delta;
 
-    node = next;
+  if (now->tv_sec < sent->tv_sec ||
+      (now->tv_sec == sent->tv_sec && now->tv_usec < sent->tv_usec)) {
+    return;
+  }
+  rtt = (size_t)(now->tv_sec - sent->tv_sec) * 1000000 +
+        (size_t)now->tv_usec - (size_t)sent->tv_usec;
+  /* Distinguish a measured server from one never measured */
+  if (rtt == 0) {
+    rtt = 1;
   }
+
+  server->rto_backoff = 0;
+
+  if (server->srtt == 0) {
+    server->srtt   = rtt;
+    server->rttvar = rtt / 2;
+    return;
+  }
+
+  delta = (server->srtt > rtt) ? server->srtt - rtt : rtt - server->srtt;
+  server->rttvar = (3 * server->rttvar + delta) / 4;
+  server->srtt   = (7 * server->srtt + rtt) / 8;
 }
 
 /* Handle an answer from a server. */
@@ -525,7 +1005,8 @@ static void process_answer(ares_channel channel, const unsigned char *abuf,
    * invalidating the connection all-together */
   struct server_state *server = conn->server;
   ares_socket_t        fd     = conn->fd;
-  ares_dns_record_t   *dnsrec = NULL;
+  ares_socket_t        other_fd = ARES_SOCKET_BAD;
+  ares_dns_record_t   *dnsrec   = NULL;
   ares_status_t        status;
 
   /* Parse the response */
@@ -539,40 +1020,62 @@ static void process_answer(ares_channel channel, const unsigned char *abuf,
    */
   query = ares__htable_szvp_get_direct(channel->queries_by_qid,
                                        ares_dns_record_get_id(dnsrec));
-  if (!query) {
+  /* Followers of a coalesced query are never sent, so can't be answered */
+  if (!query || query->leader != NULL) {
     goto cleanup;
   }
 
   /* Both the query id and the questions must be the same. We will drop any
    * replies that aren't for the same query as this is considered invalid. */
-  if (!same_questions(query->qbuf, query->qlen, dnsrec)) {
+  if (!same_questions(query, dnsrec)) {
     goto cleanup;
   }
 
+  /* Only an answer to the one time the query was sent to this server tells
+   * how long the server took (Karn's algorithm) */
+  if (query->server_info[server->idx].sends == 1) {
+    if (query->hedge_conn == conn) {
+      server_rtt_sample(server, &query->hedge_ts, now);
+    } else if (query->conn == conn) {
+      server_rtt_sample(server, &query->ts, now);
+    }
+  }
+
   /* At this point we know we've received an answer for this query, so we should
    * remove it from the connection's queue so we can possibly invalidate the
    * connection. Delay cleaning up the connection though as we may enqueue
-   * something new.  */
-  ares__llist_node_destroy(query->node_queries_to_conn);
-  query->node_queries_to_conn = NULL;
+   * something new.  An answer to the send the query was hedged from leaves
+   * the later send in place. */
+  if (query->hedge_conn == conn) {
+    ares__llist_node_destroy(query->node_hedge_to_conn);
+    query->node_hedge_to_conn = NULL;
+    query->hedge_conn         = NULL;
+  } else if (query->conn == conn) {
+    ares__llist_node_destroy(query->node_queries_to_conn);
+    query->node_queries_to_conn = NULL;
+  }
+
+  /* An answer at the safe payload size, after timeouts asking for more, is
+   * what tells a path that loses large answers from lost packets */
+  if (!tcp && server->edns_psz_max == 0 &&
+      query->server_info[server->idx].edns_timeouts >=
+        ARES_EDNS_FALLBACK_TIMEOUTS) {
+    server->edns_psz_max = EDNSSAFEPSZ;
+  }
 
   packetsz = PACKETSZ;
   /* If we use EDNS and server answers with FORMERR without an OPT RR, the
    * protocol extension is not understood by the responder. We must retry the
-   * query without EDNS enabled. */
-  if (channel->flags & ARES_FLAG_EDNS) {
+   * query without EDNS enabled, and leave EDNS out of anything else sent to
+   * this server. */
+  if (channel->flags & ARES_FLAG_EDNS && !server->edns_unsupported) {
     packetsz = channel->ednspsz;
+    if (server->edns_psz_max > 0 && packetsz > server->edns_psz_max) {
+      packetsz = server->edns_psz_max;
+    }
     if (ares_dns_record_get_rcode(dnsrec) == ARES_RCODE_FORMAT_ERROR &&
-        !has_opt_rr(dnsrec)) {
-      size_t qlen       = (query->tcplen - 2) - EDNSFIXEDSZ;
-      channel->flags   ^= ARES_FLAG_EDNS;
-      query->tcplen    -= EDNSFIXEDSZ;
-      query->qlen      -= EDNSFIXEDSZ;
-      query->tcpbuf[0]  = (unsigned char)((qlen >> 8) & 0xff);
-      query->tcpbuf[1]  = (unsigned char)(qlen & 0xff);
-      DNS_HEADER_SET_ARCOUNT(query->tcpbuf + 2, 0);
-      query->tcpbuf = ares_realloc(query->tcpbuf, query->tcplen);
-      query->qbuf   = query->tcpbuf + 2;
+        !has_opt_rr(dnsrec) && query->edns_qlen > 0) {
+      server->edns_unsupported = ARES_TRUE;
       ares__send_query(channel, query, now);
       ares__check_cleanup_conn(channel, fd);
       goto cleanup;
@@ -586,6 +1089,8 @@ static void process_answer(ares_channel channel, const unsigned char *abuf,
   if ((ares_dns_record_get_flags(dnsrec) & ARES_FLAG_TC || alen > packetsz) &&
       !tcp && !(channel->flags & ARES_FLAG_IGNTC)) {
     if (!query->using_tcp) {
+      /* Best effort, the question is only sent over UDP again if not kept */
+      (void)ares__tcpcache_insert(channel->tcpcache, now, query);
       query->using_tcp = ARES_TRUE;
       ares__send_query(channel, query, now);
     }
@@ -613,7 +1118,7 @@ static void process_answer(ares_channel channel, const unsigned char *abuf,
         default:
           break;
       }
-      skip_server(channel, query, server);
+      skip_server(channel, query, server, now);
       if (query->server == server->idx) { /* Is this ever not true? */
         next_server(channel, query, now);
       }
@@ -622,9 +1127,31 @@ static void process_answer(ares_channel channel, const unsigned char *abuf,
     }
   }
 
-  end_query(channel, query, ARES_SUCCESS, abuf, alen);
+  server->consec_failures = 0;
+
+  /* An answer over TCP which wouldn't have fit in UDP shows the question
+   * still needs TCP */
+  if (tcp && alen > packetsz &&
+      !(channel->flags & (ARES_FLAG_IGNTC | ARES_FLAG_USEVC))) {
+    (void)ares__tcpcache_insert(channel->tcpcache, now, query);
+  }
+
+  /* Any other send still outstanding ends along with the query */
+  if (query->conn != conn) {
+    other_fd = query->conn->fd;
+  } else if (query->hedge_conn != NULL) {
+    other_fd = query->hedge_conn->fd;
+  }
+
+  /* Caching is best effort, a failure here doesn't affect the query */
+  (void)ares__qcache_insert(channel->qcache, now, query, abuf, alen, dnsrec);
+
+  end_query(channel, query, ARES_SUCCESS, abuf, alen, dnsrec);
 
   ares__check_cleanup_conn(channel, fd);
+  if (other_fd != ARES_SOCKET_BAD) {
+    ares__check_cleanup_conn(channel, other_fd);
+  }
 
 cleanup:
   ares_dns_record_destroy(dnsrec);
@@ -648,8 +1175,16 @@ static void handle_error(struct server_connection *conn, struct timeval *now)
   while ((node = ares__llist_node_first(list_copy)) != NULL) {
     struct query *query = ares__llist_node_val(node);
 
+    /* Only the send the query was hedged from is lost */
+    if (query->node_hedge_to_conn == node) {
+      ares__llist_node_destroy(query->node_hedge_to_conn);
+      query->node_hedge_to_conn = NULL;
+      query->hedge_conn         = NULL;
+      continue;
+    }
+
     assert(query->server == server->idx);
-    skip_server(channel, query, server);
+    skip_server(channel, query, server, now);
     /* next_server will remove the current node from the list */
     next_server(channel, query, now);
   }
@@ -657,9 +1192,105 @@ static void handle_error(struct server_connection *conn, struct timeval *now)
   ares__llist_destroy(list_copy);
 }
 
+/* Switch the channel over to other servers while queries are in flight, as
+ * when resolv.conf changed.  Much like handle_error(), the queries are stolen
+ * off the old servers' connections before those are closed, then sent again
+ * from scratch to the new servers rather than left to time out. */
+ares_status_t ares__replace_servers(ares_channel                channel,
+                                    struct ares_addr_port_node *servers)
+{
+  ares__llist_t      *requeue;
+  ares__llist_node_t *node;
+  struct timeval      now;
+  ares_status_t       status;
+
+  requeue = ares__llist_create(NULL);
+  if (requeue == NULL) {
+    return ARES_ENOMEM;
+  }
+
+  /* Followers are never sent themselves, so aren't linked to a connection */
+  for (node = ares__llist_node_first(channel->all_queries); node != NULL;
+       node = ares__llist_node_next(node)) {
+    struct query *query = ares__llist_node_val(node);
+
+    if (query->node_queries_to_conn != NULL &&
+        ares__llist_insert_last(requeue, query) == NULL) {
+      ares__llist_destroy(requeue);
+      return ARES_ENOMEM;
+    }
+  }
+
+  for (node = ares__llist_node_first(requeue); node != NULL;
+       node = ares__llist_node_next(node)) {
+    struct query *query = ares__llist_node_val(node);
+
+    ares__slist_node_destroy(query->node_queries_by_timeout);
+    ares__timerwheel_remove(channel->timerwheel, &query->node_timerwheel);
+    ares__llist_node_destroy(query->node_queries_to_conn);
+    ares__llist_node_destroy(query->node_hedge_to_conn);
+    query->node_queries_by_timeout = NULL;
+    query->node_queries_to_conn    = node;
+    query->node_hedge_to_conn      = NULL;
+    query->hedge_conn              = NULL;
+    query->conn                    = NULL;
+  }
+
+  status = ares__set_servers_ports(channel, servers);
+
+  /* ares__send_query() moves each query off the list, or ends it */
+  now = ares__tvnow();
+  while ((node = ares__llist_node_first(requeue)) != NULL) {
+    struct query *query = ares__llist_node_val(node);
+
+    if (status != ARES_SUCCESS || channel->nservers == 0) {
+      end_query(channel, query, ARES_ESERVFAIL, NULL, 0, NULL);
+      continue;
+    }
+    if (ares__query_reset_servers(query) != ARES_SUCCESS) {
+      end_query(channel, query, ARES_ENOMEM, NULL, 0, NULL);
+      continue;
+    }
+
+    query->try_count     = 0;
+    query->server        = ares__choose_server(channel, &now);
+    query->error_status  = ARES_ECONNREFUSED;
+    query->hedge_pending = ARES_FALSE;
+    query->hedged        = ARES_FALSE;
+    ares__send_query(channel, query, &now);
+  }
+
+  ares__llist_destroy(requeue);
+  return status;
+}
+
+/* Upper bound on the doublings of the server backoff interval */
+#define ARES_SERVER_BACKOFF_SHIFT 5
+
+/* Avoid the server for a while, longer the more queries in a row it failed.
+ * Also used to hold off further probes while one is outstanding. */
+void ares__server_backoff(ares_channel channel, struct server_state *server,
+                          const struct timeval *now)
+{
+  size_t shift = server->consec_failures;
+
+  if (channel->server_backoff == 0 || shift == 0) {
+    return;
+  }
+  if (--shift > ARES_SERVER_BACKOFF_SHIFT) {
+    shift = ARES_SERVER_BACKOFF_SHIFT;
+  }
+  server->backoff_until = *now;
+  ares__timeadd(&server->backoff_until, channel->server_backoff << shift);
+}
+
 static void skip_server(ares_channel channel, struct query *query,
-                        const struct server_state *server)
+                        struct server_state *server,
+                        const struct timeval *now)
 {
+  server->consec_failures++;
+  ares__server_backoff(channel, server, now);
+
   /* The given server gave us problems with this query, so if we have the
    * luxury of using other servers, then let's skip the potentially broken
    * server and just use the others. If we only have one server and we need to
@@ -682,9 +1313,9 @@ static ares_status_t next_server(ares_channel channel, struct query *query,
    * attempts. Use query->try to remember how many times we already attempted
    * this query. Use modular arithmetic to find the next server to try.
    * A query can be requested be terminated at the next interval by setting
-   * query->no_retries */
+   * query->no_retries, unless other queries are waiting on its answer */
   while (++(query->try_count) < (channel->nservers * channel->tries) &&
-         !query->no_retries) {
+         (!query->no_retries || ares__llist_len(query->followers) > 0)) {
     const struct server_state *server;
 
     /* Move on to the next server. */
@@ -712,10 +1343,114 @@ static ares_status_t next_server(ares_channel channel, struct query *query,
 
   /* If we are here, all attempts to perform query failed. */
   status = query->error_status;
-  end_query(channel, query, query->error_status, NULL, 0);
+  end_query(channel, query, query->error_status, NULL, 0, NULL);
   return status;
 }
 
+/* With ARES_FLAG_AUTOTIMEOUT, the retransmission timeout of a measured server
+ * as per RFC 6298 Section 2, using a clock granularity of 1ms, and backed off
+ * as per Section 5.5 while queries time out without a new measurement.  The
+ * configured timeout is used as the upper bound. */
+#define ARES_RTO_MIN 10 /* in milliseconds */
+
+static size_t server_timeout(ares_channel               channel,
+                             const struct server_state *server)
+{
+  size_t rto;
+  size_t i;
+
+  if (!(channel->flags & ARES_FLAG_AUTOTIMEOUT) || server->srtt == 0) {
+    return channel->timeout;
+  }
+
+  /* srtt and rttvar are in microseconds */
+  rto = 4 * server->rttvar;
+  if (rto < 1000) {
+    rto = 1000;
+  }
+  rto = (server->srtt + rto + 999) / 1000;
+  if (rto < ARES_RTO_MIN) {
+    rto = ARES_RTO_MIN;
+  }
+
+  for (i = 0; i < server->rto_backoff && rto < channel->timeout; i++) {
+    rto <<= 1;
+  }
+
+  return (rto < channel->timeout) ? rto : channel->timeout;
+}
+
+/* The UDP payload size the query advertises to the server, or 0 if it
+ * carries no OPT RR there.  That is at most what the server is known to
+ * handle, and after repeated timeouts asking for more than is generally safe
+ * the query settles for that.  An answer then caps the server for good, see
+ * process_answer(). */
+static size_t query_edns_psz(const struct query        *query,
+                             const struct server_state *server)
+{
+  size_t psz = query->edns_psz;
+
+  if (query->edns_qlen == 0 || server->edns_unsupported) {
+    return 0;
+  }
+  if (server->edns_psz_max > 0 && psz > server->edns_psz_max) {
+    psz = server->edns_psz_max;
+  }
+  if (query->server_info[server->idx].edns_timeouts >=
+        ARES_EDNS_FALLBACK_TIMEOUTS &&
+      psz > EDNSSAFEPSZ) {
+    psz = EDNSSAFEPSZ;
+  }
+  return psz;
+}
+
+/* Fit the query's OPT RR to what the server is known to handle, advertising
+ * no more than its UDP payload size and leaving the RR out altogether if it
+ * doesn't support EDNS.  With a NULL server, the query is put back as it was
+ * created, so the query itself never changes. */
+static void query_fit_edns(struct query              *query,
+                           const struct server_state *server)
+{
+  size_t         qlen = query->edns_qlen;
+  size_t         psz  = query->edns_psz;
+  unsigned char *qbuf = query->tcpbuf + 2;
+
+  if (qlen == 0) {
+    return;
+  }
+
+  if (server != NULL) {
+    psz = query_edns_psz(query, server);
+    if (psz == 0) {
+      qlen -= EDNSFIXEDSZ;
+      psz   = query->edns_psz;
+    }
+  }
+
+  /* The OPT RR's class is the payload size */
+  DNS__SET16BIT(qbuf + query->edns_qlen - EDNSFIXEDSZ + 3, psz);
+  DNS_HEADER_SET_ARCOUNT(qbuf, qlen == query->edns_qlen ? 1 : 0);
+  DNS__SET16BIT(query->tcpbuf, qlen);
+  query->qlen   = qlen;
+  query->tcplen = qlen + 2;
+}
+
+/* How long to wait on the server before hedging, or 0 not to.  Without a
+ * fixed delay, srtt + 2 * rttvar approximates the 95th percentile of the
+ * server's RTT, as rttvar is a mean deviation.  Not knowing the server's RTT
+ * yet, it isn't hedged. */
+static size_t hedge_delay(ares_channel               channel,
+                          const struct server_state *server)
+{
+  if (channel->hedge_delay > 0) {
+    return channel->hedge_delay;
+  }
+  if (server->srtt == 0) {
+    return 0;
+  }
+  return (server->srtt + 2 * server->rttvar + 999) / 1000;
+}
+
 ares_status_t ares__send_query(ares_channel channel, struct query *query,
                                struct timeval *now)
 {
@@ -726,7 +1461,6 @@ ares_status_t ares__send_query(ares_channel channel, struct query *query,
 
   server = &channel->servers[query->server];
   if (query->using_tcp) {
-    size_t prior_len = 0;
     /* Make sure the TCP socket for this server is set up and queue
      * a send request.
      */
@@ -741,29 +1475,27 @@ ares_status_t ares__send_query(ares_channel channel, struct query *query,
          * error codes */
         case ARES_ECONNREFUSED:
         case ARES_EBADFAMILY:
-          skip_server(channel, query, server);
+          skip_server(channel, query, server, now);
           return next_server(channel, query, now);
 
         /* Anything else is not retryable, likely ENOMEM */
         default:
-          end_query(channel, query, status, NULL, 0);
+          end_query(channel, query, status, NULL, 0, NULL);
           return status;
       }
     }
 
     conn = server->tcp_conn;
 
-    prior_len = ares__buf_len(server->tcp_send);
-
+    query_fit_edns(query, server);
     status = ares__buf_append(server->tcp_send, query->tcpbuf, query->tcplen);
+    query_fit_edns(query, NULL);
     if (status != ARES_SUCCESS) {
-      end_query(channel, query, status, NULL, 0);
+      end_query(channel, query, status, NULL, 0, NULL);
       return ARES_ENOMEM;
     }
 
-    if (prior_len == 0) {
-      SOCK_STATE_CALLBACK(channel, conn->fd, 1, 1);
-    }
+    ares__conn_sock_state(conn, ARES_SOCK_READ | ARES_SOCK_WRITE);
 
     query->server_info[query->server].tcp_connection_generation =
       server->tcp_connection_generation;
@@ -794,30 +1526,50 @@ ares_status_t ares__send_query(ares_channel channel, struct query *query,
          * error codes */
         case ARES_ECONNREFUSED:
         case ARES_EBADFAMILY:
-          skip_server(channel, query, server);
+          skip_server(channel, query, server, now);
           return next_server(channel, query, now);
 
         /* Anything else is not retryable, likely ENOMEM */
         default:
-          end_query(channel, query, status, NULL, 0);
+          end_query(channel, query, status, NULL, 0, NULL);
           return status;
       }
       node = ares__llist_node_first(server->connections);
     }
 
     conn = ares__llist_node_val(node);
-    if (ares__socket_write(channel, conn->fd, query->qbuf, query->qlen) == -1) {
-      /* FIXME: Handle EAGAIN here since it likely can happen. */
-      skip_server(channel, query, server);
-      return next_server(channel, query, now);
+
+    /* Queue rather than send when batching, or when earlier datagrams are
+     * still waiting so the order is kept */
+    query_fit_edns(query, server);
+    if (channel->flags & ARES_FLAG_BATCHSEND ||
+        ares__buf_len(conn->udp_send) > 0) {
+      status = queue_udp_query(conn, query);
+    } else if (ares__socket_write(channel, conn->fd, query->qbuf,
+                                  query->qlen) == -1) {
+      if (!try_again(SOCKERRNO)) {
+        query_fit_edns(query, NULL);
+        skip_server(channel, query, server, now);
+        return next_server(channel, query, now);
+      }
+      /* Socket buffer is full, send it once there is room */
+      status = queue_udp_query(conn, query);
+    } else {
+      status = ARES_SUCCESS;
+    }
+    query_fit_edns(query, NULL);
+
+    if (status != ARES_SUCCESS) {
+      end_query(channel, query, status, NULL, 0, NULL);
+      return status;
     }
   }
 
-  /* For each trip through the entire server list, double the channel's
-   * assigned timeout, avoiding overflow.  If channel->timeout is negative,
+  /* For each trip through the entire server list, double the server's
+   * timeout, avoiding overflow.  If channel->timeout is negative,
    * leave it as-is, even though that should be impossible here.
    */
-  timeplus = channel->timeout;
+  timeplus = server_timeout(channel, server);
   {
     /* How many times do we want to double it?  Presume sane values here. */
     const size_t shift = query->try_count / channel->nservers;
@@ -837,17 +1589,34 @@ ares_status_t ares__send_query(ares_channel channel, struct query *query,
     }
   }
 
+  /* Hedge once, if there is another attempt left to hedge with */
+  query->hedge_pending = ARES_FALSE;
+  if (channel->hedge && !query->hedged && channel->nservers > 1 &&
+      query->try_count + 1 < channel->nservers * channel->tries) {
+    size_t delay = hedge_delay(channel, server);
+    if (delay > 0 && delay < timeplus) {
+      timeplus             = delay;
+      query->hedge_pending = ARES_TRUE;
+    }
+  }
+
   /* Keep track of queries bucketed by timeout, so we can process
    * timeout events quickly.
    */
   ares__slist_node_destroy(query->node_queries_by_timeout);
-  query->timeout = *now;
-  timeadd(&query->timeout, timeplus);
-  query->node_queries_by_timeout =
-    ares__slist_insert(channel->queries_by_timeout, query);
-  if (!query->node_queries_by_timeout) {
-    end_query(channel, query, ARES_ENOMEM, NULL, 0);
-    return ARES_ENOMEM;
+  query->node_queries_by_timeout = NULL;
+  query->timeout                 = *now;
+  ares__timeadd(&query->timeout, timeplus);
+  if (channel->timerwheel != NULL) {
+    ares__timerwheel_add(channel->timerwheel, &query->node_timerwheel, query,
+                         &query->timeout);
+  } else {
+    query->node_queries_by_timeout =
+      ares__slist_insert(channel->queries_by_timeout, query);
+    if (!query->node_queries_by_timeout) {
+      end_query(channel, query, ARES_ENOMEM, NULL, 0, NULL);
+      return ARES_ENOMEM;
+    }
   }
 
   /* Keep track of queries bucketed by connection, so we can process errors
@@ -857,55 +1626,57 @@ ares_status_t ares__send_query(ares_channel channel, struct query *query,
     ares__llist_insert_last(conn->queries_to_conn, query);
   query->conn = conn;
   conn->total_queries++;
+
+  query->ts = *now;
+  query->server_info[query->server].sends++;
   return ARES_SUCCESS;
 }
 
 
 
-static ares_bool_t same_questions(const unsigned char *qbuf, size_t qlen,
-                                  const ares_dns_record_t *arec)
+/* Compare a name from a response to the lowercased name from the request */
+static ares_bool_t same_name(const char *qname, const char *aname)
 {
-  ares_dns_record_t *qrec = NULL;
-  size_t             i;
-  ares_bool_t        rv = ARES_FALSE;
+  size_t i;
 
-  if (ares_dns_parse(qbuf, qlen, 0, &qrec) != ARES_SUCCESS) {
-    goto done;
+  for (i = 0; qname[i] != 0; i++) {
+    if (qname[i] != (char)TOLOWER(aname[i])) {
+      return ARES_FALSE;
+    }
   }
 
-  if (ares_dns_record_query_cnt(qrec) != ares_dns_record_query_cnt(arec)) {
-    goto done;
-  }
+  return aname[i] == 0 ? ARES_TRUE : ARES_FALSE;
+}
+
+static ares_bool_t same_questions(const struct query      *query,
+                                  const ares_dns_record_t *arec)
+{
+  size_t i;
 
-  for (i = 0; i < ares_dns_record_query_cnt(qrec); i++) {
-    const char         *qname = NULL;
-    const char         *aname = NULL;
-    ares_dns_rec_type_t qtype;
-    ares_dns_rec_type_t atype;
-    ares_dns_class_t    qclass;
-    ares_dns_class_t    aclass;
+  if (!query->questions_valid ||
+      query->nquestions != ares_dns_record_query_cnt(arec)) {
+    return ARES_FALSE;
+  }
 
-    if (ares_dns_record_query_get(qrec, i, &qname, &qtype, &qclass) !=
-          ARES_SUCCESS ||
-        qname == NULL) {
-      goto done;
-    }
+  for (i = 0; i < query->nquestions; i++) {
+    const struct query_question *q     = &query->questions[i];
+    const char                  *aname = NULL;
+    ares_dns_rec_type_t          atype;
+    ares_dns_class_t             aclass;
 
     if (ares_dns_record_query_get(arec, i, &aname, &atype, &aclass) !=
           ARES_SUCCESS ||
         aname == NULL) {
-      goto done;
+      return ARES_FALSE;
     }
-    if (strcasecmp(qname, aname) != 0 || qtype != atype || qclass != aclass) {
-      goto done;
+
+    if (q->qtype != atype || q->qclass != aclass ||
+        !same_name(q->name, aname)) {
+      return ARES_FALSE;
     }
   }
 
-  rv = ARES_TRUE;
-
-done:
-  ares_dns_record_destroy(qrec);
-  return rv;
+  return ARES_TRUE;
 }
 
 static ares_bool_t same_address(const struct sockaddr *sa,
@@ -952,44 +1723,186 @@ static ares_bool_t has_opt_rr(ares_dns_record_t *arec)
   return ARES_FALSE;
 }
 
+void ares__query_coalesce_close(struct query *query)
+{
+  if (!query->coalescing) {
+    return;
+  }
+  ares__htable_strvp_remove(query->channel->queries_by_question, query->key);
+  query->coalescing = ARES_FALSE;
+}
+
 static void ares_detach_query(struct query *query)
 {
   /* Remove the query from all the lists in which it is linked */
+  ares__query_coalesce_close(query);
   ares__htable_szvp_remove(query->channel->queries_by_qid, query->qid);
   ares__slist_node_destroy(query->node_queries_by_timeout);
+  ares__slist_node_destroy(query->node_queries_by_stale);
+  ares__timerwheel_remove(query->channel->timerwheel, &query->node_timerwheel);
   ares__llist_node_destroy(query->node_queries_to_conn);
+  ares__llist_node_destroy(query->node_hedge_to_conn);
   ares__llist_node_destroy(query->node_all_queries);
   query->node_queries_by_timeout = NULL;
+  query->node_queries_by_stale   = NULL;
   query->node_queries_to_conn    = NULL;
+  query->node_hedge_to_conn      = NULL;
+  query->hedge_conn              = NULL;
   query->node_all_queries        = NULL;
 }
 
+void ares__query_notify(struct query *query, ares_status_t status,
+                        size_t timeouts, const unsigned char *abuf,
+                        size_t alen, const ares_dns_record_t *dnsrec)
+{
+  /* The callback may issue the same query again, which must not end up
+   * waiting on this one */
+  ares__query_coalesce_close(query);
+
+  /* Already answered from the stale cache */
+  if (query->stale_served) {
+    return;
+  }
+
+  if (query->callback_dnsrec != NULL) {
+    query->callback_dnsrec(query->arg, status, timeouts,
+                           status == ARES_SUCCESS ? dnsrec : NULL);
+    return;
+  }
+
+  query->callback(query->arg, (int)status, (int)timeouts,
+                  /* due to prior design flaws, abuf isn't meant to be modified,
+                   * but bad prototypes, ugh.  Lets cast off constfor compat. */
+                  (unsigned char *)((void *)((size_t)abuf)), (int)alen);
+}
+
+/* Hand the leader's result to each of its followers, with the answer
+ * rewritten to carry the follower's own query id.  Followers may be cancelled
+ * or the channel destroyed by any callback, in which case they remove
+ * themselves from the list. */
+static void end_followers(ares__llist_t *followers, ares_status_t status,
+                          size_t timeouts, const unsigned char *abuf,
+                          size_t alen, ares_dns_record_t *dnsrec)
+{
+  struct query  *query;
+  unsigned char *fbuf = NULL;
+
+  if (followers == NULL) {
+    return;
+  }
+
+  if (abuf != NULL) {
+    fbuf = ares_malloc(alen);
+    if (fbuf == NULL) {
+      status = ARES_ENOMEM;
+      dnsrec = NULL;
+      alen   = 0;
+    } else {
+      memcpy(fbuf, abuf, alen);
+    }
+  }
+
+  while ((query = ares__llist_first_val(followers)) != NULL) {
+    ares__llist_node_destroy(query->node_followers);
+    query->node_followers = NULL;
+    query->leader         = NULL;
+    ares_detach_query(query);
+
+    if (fbuf != NULL) {
+      DNS_HEADER_SET_QID(fbuf, query->qid);
+    }
+    ares_dns_record_set_id(dnsrec, query->qid);
+
+    ares__query_notify(query, status, timeouts, fbuf, alen, dnsrec);
+    ares__free_query(query);
+  }
+
+  ares_free(fbuf);
+  ares__llist_destroy(followers);
+}
+
+/* Failures of the servers themselves, which a stale answer can paper over */
+static ares_bool_t stale_on_failure(ares_status_t status)
+{
+  switch (status) {
+    case ARES_ETIMEOUT:
+    case ARES_ECONNREFUSED:
+    case ARES_ESERVFAIL:
+    case ARES_EREFUSED:
+      return ARES_TRUE;
+    default:
+      break;
+  }
+  return ARES_FALSE;
+}
+
 static void end_query(ares_channel channel, struct query *query,
                       ares_status_t status, const unsigned char *abuf,
-                      size_t alen)
+                      size_t alen, ares_dns_record_t *dnsrec)
 {
-  (void)channel;
+  ares__llist_t     *followers = query->followers;
+  size_t             timeouts  = query->timeouts;
+  unsigned char     *sbuf      = NULL;
+  ares_dns_record_t *srec      = NULL;
+
+  /* RFC 8767: rather than fail, answer from the stale cache if we can */
+  if (channel->stale_window > 0 && !query->stale_served &&
+      stale_on_failure(status)) {
+    struct timeval now = ares__tvnow();
+
+    if (ares__qcache_fetch_stale(channel->qcache, &now, query, &sbuf, &alen,
+                                 &srec) == ARES_SUCCESS) {
+      status = ARES_SUCCESS;
+      abuf   = sbuf;
+      dnsrec = srec;
+    }
+  }
 
+  query->followers = NULL;
   ares_detach_query(query);
 
   /* Invoke the callback. */
-  query->callback(query->arg, (int)status, (int)query->timeouts,
-                  /* due to prior design flaws, abuf isn't meant to be modified,
-                   * but bad prototypes, ugh.  Lets cast off constfor compat. */
-                  (unsigned char *)((void *)((size_t)abuf)), (int)alen);
+  ares__query_notify(query, status, timeouts, abuf, alen, dnsrec);
   ares__free_query(query);
+
+  end_followers(followers, status, timeouts, abuf, alen, dnsrec);
+
+  ares_dns_record_destroy(srec);
+  ares_free(sbuf);
 }
 
 void ares__free_query(struct query *query)
 {
+  ares_channel  channel = query->channel;
+  struct query *follower;
+
   ares_detach_query(query);
+
+  /* A leader going away without an answer (cancelled or destroyed) leaves
+   * its followers to be cancelled along with it */
+  while ((follower = ares__llist_first_val(query->followers)) != NULL) {
+    ares__llist_node_destroy(follower->node_followers);
+    follower->node_followers = NULL;
+    follower->leader         = NULL;
+  }
+  ares__llist_destroy(query->followers);
+  query->followers = NULL;
+  ares__llist_node_destroy(query->node_followers);
+  query->node_followers = NULL;
+  query->leader         = NULL;
+
   /* Zero out some important stuff, to help catch bugs */
-  query->callback = NULL;
-  query->arg      = NULL;
+  query->callback        = NULL;
+  query->callback_dnsrec = NULL;
+  query->arg             = NULL;
   /* Deallocate the memory associated with the query */
-  ares_free(query->tcpbuf);
-  ares_free(query->server_info);
-  ares_free(query);
+  ares_free(query->key);
+  ares__query_release(query);
+
+  /* Wake anyone blocked in ares_queue_wait_empty() */
+  if (ares__llist_len(channel->all_queries) == 0) {
+    ares__thread_cond_broadcast(channel->cond_empty);
+  }
 }
 
 
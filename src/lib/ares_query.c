@@ -38,19 +38,22 @@
 #include "ares_private.h"
 
 struct qquery {
-  ares_callback callback;
-  void         *arg;
+  ares_callback        callback;
+  ares_callback_dnsrec callback_dnsrec;
+  void                *arg;
 };
 
 static void qcallback(void *arg, int status, int timeouts, unsigned char *abuf,
                       int alen);
+static void qcallback_dnsrec(void *arg, ares_status_t status, size_t timeouts,
+                             const ares_dns_record_t *dnsrec);
 
 /* a unique query id is generated using an rc4 key. Since the id may already
    be used by a running query (as infrequent as it may be), a lookup is
    performed per id generation. In practice this search should happen only
    once per newly generated id
 */
-static unsigned short generate_unique_id(ares_channel channel)
+unsigned short ares__generate_unique_qid(ares_channel channel)
 {
   unsigned short id;
 
@@ -61,16 +64,29 @@ static unsigned short generate_unique_id(ares_channel channel)
   return (unsigned short)id;
 }
 
-ares_status_t ares_query_qid(ares_channel channel, const char *name,
-                             int dnsclass, int type, ares_callback callback,
-                             void *arg, unsigned short *qid)
+static void qquery_fail(ares_callback        callback,
+                        ares_callback_dnsrec callback_dnsrec, void *arg,
+                        ares_status_t status)
+{
+  if (callback_dnsrec != NULL) {
+    callback_dnsrec(arg, status, 0, NULL);
+  } else {
+    callback(arg, (int)status, 0, NULL, 0);
+  }
+}
+
+static ares_status_t ares_query_int(ares_channel channel, const char *name,
+                                    int dnsclass, int type,
+                                    ares_callback        callback,
+                                    ares_callback_dnsrec callback_dnsrec,
+                                    void *arg, unsigned short *qid)
 {
   struct qquery *qquery;
   unsigned char *qbuf;
   int            qlen;
   int            rd;
   ares_status_t  status;
-  unsigned short id = generate_unique_id(channel);
+  unsigned short id = ares__generate_unique_qid(channel);
 
   /* Compose the query. */
   rd     = !(channel->flags & ARES_FLAG_NORECURSE);
@@ -81,7 +97,7 @@ ares_status_t ares_query_qid(ares_channel channel, const char *name,
     if (qbuf != NULL) {
       ares_free(qbuf);
     }
-    callback(arg, (int)status, 0, NULL, 0);
+    qquery_fail(callback, callback_dnsrec, arg, status);
     return status;
   }
 
@@ -89,20 +105,56 @@ ares_status_t ares_query_qid(ares_channel channel, const char *name,
   qquery = ares_malloc(sizeof(struct qquery));
   if (!qquery) {
     ares_free_string(qbuf);
-    callback(arg, ARES_ENOMEM, 0, NULL, 0);
+    qquery_fail(callback, callback_dnsrec, arg, ARES_ENOMEM);
     return ARES_ENOMEM;
   }
-  qquery->callback = callback;
-  qquery->arg      = arg;
+  qquery->callback        = callback;
+  qquery->callback_dnsrec = callback_dnsrec;
+  qquery->arg             = arg;
+
+  /* The answer may come straight from the cache, in which case the callback
+   * runs before the send returns and may free whatever qid points into, so
+   * hand out the id first */
+  if (qid) {
+    *qid = id;
+  }
 
   /* Send it off.  qcallback will be called when we get an answer. */
-  status = ares_send_ex(channel, qbuf, (size_t)qlen, qcallback, qquery);
+  if (callback_dnsrec != NULL) {
+    status = ares_send_dnsrec(channel, qbuf, (size_t)qlen, qcallback_dnsrec,
+                              qquery);
+  } else {
+    status = ares_send_ex(channel, qbuf, (size_t)qlen, qcallback, qquery);
+  }
   ares_free_string(qbuf);
 
-  if (status == ARES_SUCCESS && qid) {
-    *qid = id;
-  }
+  return status;
+}
+
+ares_status_t ares_query_qid(ares_channel channel, const char *name,
+                             int dnsclass, int type, ares_callback callback,
+                             void *arg, unsigned short *qid)
+{
+  ares_status_t status;
 
+  ares__channel_lock(channel);
+  status =
+    ares_query_int(channel, name, dnsclass, type, callback, NULL, arg, qid);
+  ares__channel_unlock(channel);
+  return status;
+}
+
+ares_status_t ares_query_dnsrec(ares_channel channel, const char *name,
+                                int dnsclass, int type,
+                                ares_callback_dnsrec callback, void *arg,
+                                unsigned short *qid)
+{
+  ares_status_t status;
+
+  ares__channel_lock(channel);
+  status =
+    ares_query_int(channel, name, dnsclass, type, NULL, callback, arg, qid);
+  ares__channel_unlock(channel);
   return status;
 }
 
@@ -112,42 +164,52 @@ void ares_query(ares_channel channel, const char *name, int dnsclass, int type,
   ares_query_qid(channel, name, dnsclass, type, callback, arg, NULL);
 }
 
+/* Convert the response code of a successfully received answer into a status */
+static ares_status_t rcode_to_status(int rcode, size_t ancount)
+{
+  switch (rcode) {
+    case NOERROR:
+      return (ancount > 0) ? ARES_SUCCESS : ARES_ENODATA;
+    case FORMERR:
+      return ARES_EFORMERR;
+    case SERVFAIL:
+      return ARES_ESERVFAIL;
+    case NXDOMAIN:
+      return ARES_ENOTFOUND;
+    case NOTIMP:
+      return ARES_ENOTIMP;
+    case REFUSED:
+      return ARES_EREFUSED;
+    default:
+      break;
+  }
+  return ARES_SUCCESS;
+}
+
 static void qcallback(void *arg, int status, int timeouts, unsigned char *abuf,
                       int alen)
 {
   struct qquery *qquery = (struct qquery *)arg;
-  size_t         ancount;
-  int            rcode;
 
-  if (status != ARES_SUCCESS) {
-    qquery->callback(qquery->arg, status, timeouts, abuf, alen);
-  } else {
+  if (status == ARES_SUCCESS) {
     /* Pull the response code and answer count from the packet. */
-    rcode   = DNS_HEADER_RCODE(abuf);
-    ancount = DNS_HEADER_ANCOUNT(abuf);
-
-    /* Convert errors. */
-    switch (rcode) {
-      case NOERROR:
-        status = (ancount > 0) ? ARES_SUCCESS : ARES_ENODATA;
-        break;
-      case FORMERR:
-        status = ARES_EFORMERR;
-        break;
-      case SERVFAIL:
-        status = ARES_ESERVFAIL;
-        break;
-      case NXDOMAIN:
-        status = ARES_ENOTFOUND;
-        break;
-      case NOTIMP:
-        status = ARES_ENOTIMP;
-        break;
-      case REFUSED:
-        status = ARES_EREFUSED;
-        break;
-    }
-    qquery->callback(qquery->arg, status, timeouts, abuf, alen);
+    status = (int)rcode_to_status(DNS_HEADER_RCODE(abuf),
+                                  (size_t)DNS_HEADER_ANCOUNT(abuf));
+  }
+  qquery->callback(qquery->arg, status, timeouts, abuf, alen);
+  ares_free(qquery);
+}
+
+static void qcallback_dnsrec(void *arg, ares_status_t status, size_t timeouts,
+                             const ares_dns_record_t *dnsrec)
+{
+  struct qquery *qquery = (struct qquery *)arg;
+
+  if (status == ARES_SUCCESS) {
+    status = rcode_to_status(
+      (int)ares_dns_record_get_rcode(dnsrec),
+      ares_dns_record_rr_cnt(dnsrec, ARES_SECTION_ANSWER));
   }
+  qquery->callback_dnsrec(qquery->arg, status, timeouts, dnsrec);
   ares_free(qquery);
 }
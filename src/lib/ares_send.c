@@ -37,45 +37,272 @@
 #include "ares_dns.h"
 #include "ares_private.h"
 
-ares_status_t ares_send_ex(ares_channel channel, const unsigned char *qbuf,
-                           size_t qlen, ares_callback callback, void *arg)
+/* Parse the questions out of the request once, so that matching responses
+ * against it doesn't require parsing it again for every response */
+static ares_status_t query_parse_questions(struct query *query)
+{
+  ares_dns_record_t *qrec = NULL;
+  ares_status_t      status;
+  size_t             cnt;
+  size_t             len;
+  size_t             i;
+  char              *names;
+
+  status = ares_dns_parse(query->qbuf, query->qlen, 0, &qrec);
+  if (status != ARES_SUCCESS) {
+    /* Not fatal, but nothing will ever match */
+    return ARES_SUCCESS;
+  }
+
+  cnt = ares_dns_record_query_cnt(qrec);
+  len = sizeof(*query->questions) * cnt;
+  for (i = 0; i < cnt; i++) {
+    const char *name = NULL;
+    ares_dns_record_query_get(qrec, i, &name, NULL, NULL);
+    len += ares_strlen(name) + 1;
+  }
+
+  query->questions = ares__query_alloc_questions(query, len);
+  if (query->questions == NULL) {
+    ares_dns_record_destroy(qrec);
+    return ARES_ENOMEM;
+  }
+
+  names = (char *)(query->questions + cnt);
+  for (i = 0; i < cnt; i++) {
+    const char *name = NULL;
+    size_t      j;
+
+    ares_dns_record_query_get(qrec, i, &name, &query->questions[i].qtype,
+                              &query->questions[i].qclass);
+    query->questions[i].name = names;
+    for (j = 0; name != NULL && name[j] != 0; j++) {
+      names[j] = (char)TOLOWER(name[j]);
+    }
+    names[j]  = 0;
+    names    += j + 1;
+  }
+
+  query->nquestions      = cnt;
+  query->questions_valid = ARES_TRUE;
+  ares_dns_record_destroy(qrec);
+  return ARES_SUCCESS;
+}
+
+/* With ARES_FLAG_COALESCE, attach the query as a follower of an identical
+ * one in flight and return ARES_TRUE, or otherwise register it as the query
+ * later identical ones will follow.  Coalescing is best effort, so errors
+ * just result in the query being sent on its own. */
+static ares_bool_t query_coalesce(ares_channel channel, struct query *query)
+{
+  struct query *leader;
+
+  if (query->key == NULL) {
+    return ARES_FALSE;
+  }
+
+  leader =
+    ares__htable_strvp_get_direct(channel->queries_by_question, query->key);
+  if (leader == NULL) {
+    if (ares__htable_strvp_insert(channel->queries_by_question, query->key,
+                                  query)) {
+      query->coalescing = ARES_TRUE;
+    }
+    return ARES_FALSE;
+  }
+
+  if (leader->followers == NULL) {
+    leader->followers = ares__llist_create(NULL);
+    if (leader->followers == NULL) {
+      return ARES_FALSE;
+    }
+  }
+
+  query->node_followers = ares__llist_insert_last(leader->followers, query);
+  if (query->node_followers == NULL) {
+    return ARES_FALSE;
+  }
+  query->leader = leader;
+  return ARES_TRUE;
+}
+
+/* Report a failure to queue a query to whichever callback the caller
+ * supplied. */
+static void send_fail(ares_callback        callback,
+                      ares_callback_dnsrec callback_dnsrec, void *arg,
+                      ares_status_t status)
+{
+  if (callback_dnsrec != NULL) {
+    callback_dnsrec(arg, status, 0, NULL);
+  } else {
+    callback(arg, (int)status, 0, NULL, 0);
+  }
+}
+
+/* Note an OPT RR ending the query, which can then be fitted to each server
+ * it is sent to.  Only a bare one as the library adds is recognised. */
+static void query_find_edns(struct query *query)
+{
+  const unsigned char *opt;
+
+  if (query->qlen < HFIXEDSZ + EDNSFIXEDSZ ||
+      DNS_HEADER_ARCOUNT(query->qbuf) != 1) {
+    return;
+  }
+
+  /* Root name, type OPT, and no options */
+  opt = query->qbuf + query->qlen - EDNSFIXEDSZ;
+  if (opt[0] != 0 || DNS__16BIT(opt + 1) != T_OPT ||
+      DNS__16BIT(opt + 9) != 0) {
+    return;
+  }
+
+  query->edns_qlen = query->qlen;
+  query->edns_psz  = DNS__16BIT(opt + 3);
+}
+
+/* With ARES_FLAG_SRTT, every this many queries go to the next server in turn
+ * rather than the fastest, so the measurements of the others stay current */
+#define ARES_SRTT_PROBE_INTERVAL 16
+
+/* Is the server worth sending a query to?  That is if it didn't fail its
+ * last query or, with ARES_OPT_SERVER_BACKOFF, it is due a probe. */
+static ares_bool_t server_usable(ares_channel               channel,
+                                 const struct server_state *server,
+                                 const struct timeval      *now)
+{
+  if (server->consec_failures == 0) {
+    return ARES_TRUE;
+  }
+  if (channel->server_backoff == 0) {
+    return ARES_FALSE;
+  }
+  return ares__timedout(now, &server->backoff_until);
+}
+
+/* Is server a a better choice than server b?  Usable servers come first,
+ * then those not yet measured, then the fastest.  Ties go to the server
+ * listed first. */
+static ares_bool_t server_better(ares_channel               channel,
+                                 const struct server_state *a,
+                                 const struct server_state *b,
+                                 const struct timeval      *now)
+{
+  ares_bool_t a_usable = server_usable(channel, a, now);
+
+  if (a_usable != server_usable(channel, b, now)) {
+    return a_usable;
+  }
+  return a->srtt < b->srtt ? ARES_TRUE : ARES_FALSE;
+}
+
+size_t ares__choose_server(ares_channel channel, const struct timeval *now)
+{
+  size_t best;
+  size_t i;
+
+  if (!(channel->flags & ARES_FLAG_SRTT)) {
+    /* If rotation is enabled, keep track of the next server we want to use. */
+    best = channel->last_server;
+    if (channel->rotate == 1) {
+      channel->last_server =
+        (channel->last_server + 1) % (size_t)channel->nservers;
+    }
+    if (channel->server_backoff == 0) {
+      return best;
+    }
+
+    /* Go on to the next server in line if this one is backing off */
+    for (i = 0; i < channel->nservers; i++) {
+      size_t idx = (best + i) % channel->nservers;
+      if (server_usable(channel, &channel->servers[idx], now)) {
+        return idx;
+      }
+    }
+    return best;
+  }
+
+  /* The server list may have changed since the last probe */
+  if (++channel->srtt_queries % ARES_SRTT_PROBE_INTERVAL == 0) {
+    best                = channel->srtt_probe % channel->nservers;
+    channel->srtt_probe = best + 1;
+    return best;
+  }
+
+  best = 0;
+  for (i = 1; i < channel->nservers; i++) {
+    if (server_better(channel, &channel->servers[i], &channel->servers[best],
+                      now)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+static ares_status_t ares_send_int(ares_channel channel,
+                                   const unsigned char *qbuf, size_t qlen,
+                                   ares_callback        callback,
+                                   ares_callback_dnsrec callback_dnsrec,
+                                   void *arg, ares_bool_t prefetch)
 {
   struct query  *query;
+  char          *key = NULL;
   size_t         i;
   size_t         packetsz;
   struct timeval now;
 
   /* Verify that the query is at least long enough to hold the header. */
   if (qlen < HFIXEDSZ || qlen >= (1 << 16)) {
-    callback(arg, ARES_EBADQUERY, 0, NULL, 0);
+    send_fail(callback, callback_dnsrec, arg, ARES_EBADQUERY);
     return ARES_EBADQUERY;
   }
   if (channel->nservers < 1) {
-    callback(arg, ARES_ESERVFAIL, 0, NULL, 0);
+    send_fail(callback, callback_dnsrec, arg, ARES_ESERVFAIL);
     return ARES_ESERVFAIL;
   }
-  /* Allocate space for query and allocated fields. */
-  query = ares_malloc(sizeof(struct query));
-  if (!query) {
-    callback(arg, ARES_ENOMEM, 0, NULL, 0);
-    return ARES_ENOMEM;
+
+  if (!prefetch) {
+    channel->stat_queries++;
   }
-  memset(query, 0, sizeof(*query));
-  query->channel = channel;
-  query->tcpbuf  = ares_malloc(qlen + 2);
-  if (!query->tcpbuf) {
-    ares_free(query);
-    callback(arg, ARES_ENOMEM, 0, NULL, 0);
-    return ARES_ENOMEM;
+
+  /* The caches and coalescing all go by the question, worked out just once.
+   * Best effort, a query without a key is merely never matched. */
+  if (channel->qcache != NULL || channel->tcpcache != NULL ||
+      channel->queries_by_question != NULL) {
+    key = ares__qcache_calc_key(qbuf, qlen);
+  }
+
+  /* Answer straight from the cache if we can, before setting up the query */
+  if (channel->qcache != NULL && !prefetch) {
+    unsigned char     *abuf   = NULL;
+    size_t             alen   = 0;
+    ares_dns_record_t *dnsrec = NULL;
+
+    now = ares__tvnow();
+    if (ares__qcache_fetch(channel->qcache, &now, key, DNS_HEADER_QID(qbuf),
+                           callback_dnsrec != NULL ? ARES_TRUE : ARES_FALSE,
+                           &abuf, &alen, &dnsrec) == ARES_SUCCESS) {
+      channel->stat_cache_hits++;
+      if (callback_dnsrec != NULL) {
+        callback_dnsrec(arg, ARES_SUCCESS, 0, dnsrec);
+      } else {
+        callback(arg, ARES_SUCCESS, 0, abuf, (int)alen);
+      }
+      ares_dns_record_destroy(dnsrec);
+      ares_free(abuf);
+      ares_free(key);
+      return ARES_SUCCESS;
+    }
   }
-  query->server_info =
-    ares_malloc((size_t)channel->nservers * sizeof(query->server_info[0]));
-  if (!query->server_info) {
-    ares_free(query->tcpbuf);
-    ares_free(query);
-    callback(arg, ARES_ENOMEM, 0, NULL, 0);
+
+  /* Allocate the query along with its per-server state and buffer. */
+  query = ares__query_alloc(channel, qlen);
+  if (!query) {
+    ares_free(key);
+    send_fail(callback, callback_dnsrec, arg, ARES_ENOMEM);
     return ARES_ENOMEM;
   }
+  query->key = key;
 
   /* Compute the query ID.  Start with no timeout. */
   query->qid             = DNS_HEADER_QID(qbuf);
@@ -93,27 +320,38 @@ ares_status_t ares_send_ex(ares_channel channel, const unsigned char *qbuf,
   /* Fill in query arguments. */
   query->qbuf     = query->tcpbuf + 2;
   query->qlen     = qlen;
-  query->callback = callback;
-  query->arg      = arg;
+  query->callback        = callback;
+  query->callback_dnsrec = callback_dnsrec;
+  query->arg             = arg;
+
+  if (channel->flags & ARES_FLAG_EDNS) {
+    query_find_edns(query);
+  }
+
+  if (query_parse_questions(query) != ARES_SUCCESS) {
+    ares_free(query->key);
+    ares__query_release(query);
+    send_fail(callback, callback_dnsrec, arg, ARES_ENOMEM);
+    return ARES_ENOMEM;
+  }
 
   /* Initialize query status. */
   query->try_count = 0;
 
-  /* Choose the server to send the query to. If rotation is enabled, keep track
-   * of the next server we want to use. */
-  query->server = channel->last_server;
-  if (channel->rotate == 1) {
-    channel->last_server =
-      (channel->last_server + 1) % (size_t)channel->nservers;
-  }
+  /* Choose the server to send the query to. */
+  now           = ares__tvnow();
+  query->server = ares__choose_server(channel, &now);
 
   for (i = 0; i < (size_t)channel->nservers; i++) {
     query->server_info[i].skip_server               = ARES_FALSE;
     query->server_info[i].tcp_connection_generation = 0;
+    query->server_info[i].sends                     = 0;
+    query->server_info[i].edns_timeouts             = 0;
   }
 
   packetsz = (channel->flags & ARES_FLAG_EDNS) ? channel->ednspsz : PACKETSZ;
-  query->using_tcp = (channel->flags & ARES_FLAG_USEVC) || qlen > packetsz;
+  query->using_tcp = (channel->flags & ARES_FLAG_USEVC) || qlen > packetsz ||
+                     ares__tcpcache_fetch(channel->tcpcache, &now, query);
 
   query->error_status = ARES_ECONNREFUSED;
   query->timeouts     = 0;
@@ -126,7 +364,7 @@ ares_status_t ares_send_ex(ares_channel channel, const unsigned char *qbuf,
   query->node_all_queries =
     ares__llist_insert_last(channel->all_queries, query);
   if (query->node_all_queries == NULL) {
-    callback(arg, ARES_ENOMEM, 0, NULL, 0);
+    send_fail(callback, callback_dnsrec, arg, ARES_ENOMEM);
     ares__free_query(query);
     return ARES_ENOMEM;
   }
@@ -135,16 +373,88 @@ ares_status_t ares_send_ex(ares_channel channel, const unsigned char *qbuf,
    * responses quickly.
    */
   if (!ares__htable_szvp_insert(channel->queries_by_qid, query->qid, query)) {
-    callback(arg, ARES_ENOMEM, 0, NULL, 0);
+    send_fail(callback, callback_dnsrec, arg, ARES_ENOMEM);
     ares__free_query(query);
     return ARES_ENOMEM;
   }
 
+  /* Wait on an identical query already in flight rather than sending this
+   * one too */
+  if (channel->queries_by_question != NULL && query_coalesce(channel, query)) {
+    return ARES_SUCCESS;
+  }
+
+  /* Leave the servers which are backing off alone while the chosen one is
+   * usable.  If it is usable as it is due a probe, hold off other queries
+   * from probing it too until this one has its answer. */
+  if (channel->server_backoff > 0 &&
+      server_usable(channel, &channel->servers[query->server], &now)) {
+    for (i = 0; i < channel->nservers; i++) {
+      if (i != query->server &&
+          !server_usable(channel, &channel->servers[i], &now)) {
+        query->server_info[i].skip_server = ARES_TRUE;
+      }
+    }
+    ares__server_backoff(channel, &channel->servers[query->server], &now);
+  }
+
+  /* With an answer to fall back on, only wait so long for the servers.
+   * This is best effort, the stale answer is still served on failure. */
+  if (channel->queries_by_stale != NULL && !prefetch &&
+      ares__qcache_has_stale(channel->qcache, &now, query)) {
+    query->stale_timeout = now;
+    ares__timeadd(&query->stale_timeout, channel->stale_timeout);
+    query->node_queries_by_stale =
+      ares__slist_insert(channel->queries_by_stale, query);
+  }
+
   /* Perform the first query action. */
-  now = ares__tvnow();
   return ares__send_query(channel, query, &now);
 }
 
+ares_status_t ares_send_ex(ares_channel channel, const unsigned char *qbuf,
+                           size_t qlen, ares_callback callback, void *arg)
+{
+  ares_status_t status;
+
+  ares__channel_lock(channel);
+  status =
+    ares_send_int(channel, qbuf, qlen, callback, NULL, arg, ARES_FALSE);
+  ares__channel_unlock(channel);
+  return status;
+}
+
+ares_status_t ares_send_dnsrec(ares_channel channel, const unsigned char *qbuf,
+                               size_t qlen, ares_callback_dnsrec callback,
+                               void *arg)
+{
+  ares_status_t status;
+
+  ares__channel_lock(channel);
+  status =
+    ares_send_int(channel, qbuf, qlen, NULL, callback, arg, ARES_FALSE);
+  ares__channel_unlock(channel);
+  return status;
+}
+
+static void prefetch_callback(void *arg, int status, int timeouts,
+                              unsigned char *abuf, int alen)
+{
+  (void)arg;
+  (void)status;
+  (void)timeouts;
+  (void)abuf;
+  (void)alen;
+}
+
+ares_status_t ares__send_prefetch(ares_channel channel, unsigned char *qbuf,
+                                  size_t qlen)
+{
+  DNS_HEADER_SET_QID(qbuf, ares__generate_unique_qid(channel));
+  return ares_send_int(channel, qbuf, qlen, prefetch_callback, NULL, NULL,
+                       ARES_TRUE);
+}
+
 void ares_send(ares_channel channel, const unsigned char *qbuf, int qlen,
                ares_callback callback, void *arg)
 {
@@ -41,27 +41,55 @@ static long timeoffset(struct timeval *now, struct timeval *check)
          (check->tv_usec - now->tv_usec) / 1000;
 }
 
-struct timeval *ares_timeout(ares_channel channel, struct timeval *maxtv,
-                             struct timeval *tvbuf)
+static struct timeval *ares_timeout_int(ares_channel    channel,
+                                        struct timeval *maxtv,
+                                        struct timeval *tvbuf)
 {
-  struct query       *query;
+  const struct query *query;
   ares__slist_node_t *node;
   struct timeval      now;
+  struct timeval      next;
+  struct timeval      prefetch;
+  ares_bool_t         have_next = ARES_FALSE;
   long                offset;
 
-  /* The minimum timeout of all queries is always the first entry in
-   * channel->queries_by_timeout */
-  node = ares__slist_node_first(channel->queries_by_timeout);
+  if (channel->timerwheel != NULL) {
+    have_next = ares__timerwheel_next(channel->timerwheel, &next);
+  } else {
+    /* The minimum timeout of all queries is always the first entry in
+     * channel->queries_by_timeout */
+    node = ares__slist_node_first(channel->queries_by_timeout);
+    if (node != NULL) {
+      query     = ares__slist_node_val(node);
+      next      = query->timeout;
+      have_next = ARES_TRUE;
+    }
+  }
+
+  /* A query may give up on the servers and serve a stale answer before
+   * anything times out */
+  query = ares__slist_first_val(channel->queries_by_stale);
+  if (query != NULL &&
+      (!have_next || ares__timedout(&next, &query->stale_timeout))) {
+    next      = query->stale_timeout;
+    have_next = ARES_TRUE;
+  }
+
+  /* Popular answers in the cache may be due to be queried again */
+  if (ares__qcache_prefetch_next(channel->qcache, &prefetch) &&
+      (!have_next || ares__timedout(&next, &prefetch))) {
+    next      = prefetch;
+    have_next = ARES_TRUE;
+  }
+
   /* no queries/timeout */
-  if (node == NULL) {
+  if (!have_next) {
     return maxtv; /* <-- maxtv can be null though, hrm */
   }
 
-  query = ares__slist_node_val(node);
-
   now = ares__tvnow();
 
-  offset = timeoffset(&now, &query->timeout);
+  offset = timeoffset(&now, &next);
   if (offset < 0) {
     offset = 0;
   }
@@ -91,3 +119,14 @@ struct timeval *ares_timeout(ares_channel channel, struct timeval *maxtv,
 
   return tvbuf;
 }
+
+struct timeval *ares_timeout(ares_channel channel, struct timeval *maxtv,
+                             struct timeval *tvbuf)
+{
+  struct timeval *tout;
+
+  ares__channel_lock(channel);
+  tout = ares_timeout_int(channel, maxtv, tvbuf);
+  ares__channel_unlock(channel);
+  return tout;
+}
@@ -17,6 +17,10 @@
  */
 #include "ares-test.h"
 
+#ifndef WIN32
+#include <utime.h>
+#endif
+
 // library initialization is only needed for windows builds
 #ifdef WIN32
 #define EXPECTED_NONINIT ARES_ENOTINITIALIZED
@@ -280,6 +284,293 @@ TEST_F(LibraryTest, EnvInitAllocFail) {
     }
   }
 }
+
+// Backdate a file so that rewriting it within the same second still changes
+// its modification time.
+static void BackdateFile(const char *filename) {
+  struct utimbuf times;
+  times.actime = times.modtime = time(NULL) - 100;
+  EXPECT_EQ(0, utime(filename, &times));
+}
+
+static void RewriteFile(const char *filename, const char *contents) {
+  FILE *fp = fopen(filename, "w");
+  ASSERT_NE(nullptr, fp);
+  fputs(contents, fp);
+  fclose(fp);
+}
+
+// Run the channel for up to the given time, as changes are noticed through
+// its descriptors with inotify and by polling otherwise.
+static void ProcessFor(ares_channel channel, int millis,
+                       std::function<bool()> done) {
+  for (int waited = 0; waited < millis && !done(); waited += 100) {
+    fd_set readers, writers;
+    FD_ZERO(&readers);
+    FD_ZERO(&writers);
+    int nfds = ares_fds(channel, &readers, &writers);
+    struct timeval tv = {0, 100000};
+    select(nfds, &readers, &writers, nullptr, &tv);
+    ares_process(channel, &readers, &writers);
+  }
+}
+
+TEST_F(LibraryTest, FileWatchResolvConf) {
+  TempFile resolvconf("nameserver 1.2.3.4\n");
+  BackdateFile(resolvconf.filename());
+
+  struct ares_options opts = {0};
+  opts.flags = ARES_FLAG_FILEWATCH;
+  opts.resolvconf_path = strdup(resolvconf.filename());
+  int optmask = ARES_OPT_FLAGS | ARES_OPT_RESOLVCONF;
+  ares_channel channel = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
+  free(opts.resolvconf_path);
+  ASSERT_NE(nullptr, channel);
+
+  std::vector<std::string> expected = {"1.2.3.4"};
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  RewriteFile(resolvconf.filename(), "nameserver 5.6.7.8\n");
+  expected = {"5.6.7.8"};
+  ProcessFor(channel, 3000,
+             [&]() { return GetNameServers(channel) == expected; });
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  // A copy of the channel still follows resolv.conf
+  ares_channel dup = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_dup(&dup, channel));
+  ASSERT_NE(nullptr, dup);
+  BackdateFile(resolvconf.filename());
+  RewriteFile(resolvconf.filename(), "nameserver 2.3.4.5\n");
+  expected = {"2.3.4.5"};
+  ProcessFor(dup, 3000, [&]() { return GetNameServers(dup) == expected; });
+  EXPECT_EQ(expected, GetNameServers(dup));
+  ares_destroy(dup);
+
+  // Servers set by hand stay put
+  EXPECT_EQ(ARES_SUCCESS, ares_set_servers_csv(channel, "9.9.9.9"));
+  BackdateFile(resolvconf.filename());
+  RewriteFile(resolvconf.filename(), "nameserver 1.2.3.4\n");
+  ProcessFor(channel, 1500, []() { return false; });
+  expected = {"9.9.9.9"};
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  ares_destroy(channel);
+}
+
+// Other settings than the servers follow resolv.conf too, unless they were
+// given as options
+TEST_F(LibraryTest, FileWatchResolvConfOptions) {
+  TempFile resolvconf("nameserver 1.2.3.4\nsearch first.com\n"
+                      "options ndots:2 attempts:2\n");
+  BackdateFile(resolvconf.filename());
+
+  struct ares_options opts = {0};
+  opts.flags = ARES_FLAG_FILEWATCH;
+  opts.resolvconf_path = strdup(resolvconf.filename());
+  opts.tries = 5;
+  int optmask = ARES_OPT_FLAGS | ARES_OPT_RESOLVCONF | ARES_OPT_TRIES;
+  ares_channel channel = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
+  free(opts.resolvconf_path);
+  ASSERT_NE(nullptr, channel);
+
+  auto saved = [&]() {
+    struct ares_options saved = {0};
+    int mask = 0;
+    EXPECT_EQ(ARES_SUCCESS, ares_save_options(channel, &saved, &mask));
+    std::stringstream ss;
+    ss << "ndots=" << saved.ndots << " tries=" << saved.tries << " search=";
+    for (int i = 0; i < saved.ndomains; i++) {
+      ss << (i > 0 ? "," : "") << saved.domains[i];
+    }
+    ares_destroy_options(&saved);
+    return ss.str();
+  };
+  EXPECT_EQ("ndots=2 tries=5 search=first.com", saved());
+
+  RewriteFile(resolvconf.filename(), "nameserver 1.2.3.4\n"
+              "search second.com third.com\noptions ndots:4 attempts:3\n");
+  const std::string expected = "ndots=4 tries=5 search=second.com,third.com";
+  ProcessFor(channel, 3000, [&]() { return saved() == expected; });
+  EXPECT_EQ(expected, saved());
+
+  ares_destroy(channel);
+}
+
+// A query waiting on a server when resolv.conf changes is sent again to the
+// new server, rather than left to time out
+TEST_F(LibraryTest, FileWatchResolvConfBusy) {
+  testing::NiceMock<MockServer> before(AF_INET, 0);
+  testing::NiceMock<MockServer> after(AF_INET, 0);
+  std::string conf = "nameserver [127.0.0.1]:" +
+                     std::to_string(before.udpport()) + "\n";
+  TempFile resolvconf(conf.c_str());
+  BackdateFile(resolvconf.filename());
+
+  struct ares_options opts = {0};
+  opts.flags = ARES_FLAG_FILEWATCH;
+  opts.resolvconf_path = strdup(resolvconf.filename());
+  opts.lookups = strdup("b");
+  opts.timeout = 10000;
+  opts.tries = 1;
+  int optmask = ARES_OPT_FLAGS | ARES_OPT_RESOLVCONF | ARES_OPT_LOOKUPS |
+                ARES_OPT_TIMEOUTMS | ARES_OPT_TRIES;
+  ares_channel channel = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
+  free(opts.resolvconf_path);
+  free(opts.lookups);
+  ASSERT_NE(nullptr, channel);
+
+  // The first server never answers, and switches the channel to the second,
+  // listed ahead of it
+  conf = "nameserver [127.0.0.1]:" + std::to_string(after.udpport()) + "\n" +
+         "nameserver [127.0.0.1]:" + std::to_string(before.udpport()) + "\n";
+  EXPECT_CALL(before, OnRequest("www.google.com", T_A))
+    .WillOnce(testing::InvokeWithoutArgs(
+      [&]() { RewriteFile(resolvconf.filename(), conf.c_str()); }));
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(after, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&after, &rsp));
+
+  HostResult result;
+  ares_gethostbyname(channel, "www.google.com.", AF_INET, HostCallback,
+                     &result);
+  for (int waited = 0; waited < 3000 && !result.done_; waited += 100) {
+    fd_set readers, writers;
+    FD_ZERO(&readers);
+    FD_ZERO(&writers);
+    int nfds = ares_fds(channel, &readers, &writers);
+    std::set<int> serverfds = before.fds();
+    std::set<int> afterfds = after.fds();
+    serverfds.insert(afterfds.begin(), afterfds.end());
+    for (int fd : serverfds) {
+      FD_SET(fd, &readers);
+      nfds = std::max(nfds, fd + 1);
+    }
+    struct timeval tv = {0, 100000};
+    select(nfds, &readers, &writers, nullptr, &tv);
+    ares_process(channel, &readers, &writers);
+    for (int fd : serverfds) {
+      if (!FD_ISSET(fd, &readers)) {
+        continue;
+      }
+      if (afterfds.count(fd) != 0) {
+        after.ProcessFD(fd);
+      } else {
+        before.ProcessFD(fd);
+      }
+    }
+  }
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+
+  std::vector<std::string> expected = {
+    "127.0.0.1:" + std::to_string(after.udpport()),
+    "127.0.0.1:" + std::to_string(before.udpport())};
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  ares_destroy(channel);
+}
+
+TEST_F(LibraryTest, FileWatchIoUring) {
+  TempFile resolvconf("nameserver 1.2.3.4\n");
+  BackdateFile(resolvconf.filename());
+
+  struct ares_options opts = {0};
+  opts.flags = ARES_FLAG_FILEWATCH | ARES_FLAG_IOURING;
+  opts.resolvconf_path = strdup(resolvconf.filename());
+  int optmask = ARES_OPT_FLAGS | ARES_OPT_RESOLVCONF;
+  ares_channel channel = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
+  free(opts.resolvconf_path);
+  ASSERT_NE(nullptr, channel);
+
+  ares_socket_t efd = ares_event_engine_fd(channel);
+  if (efd == ARES_SOCKET_BAD) {
+    ares_destroy(channel);
+    GTEST_SKIP() << "io_uring not available";
+  }
+
+  // The change wakes an application waiting on nothing but the ring
+  RewriteFile(resolvconf.filename(), "nameserver 5.6.7.8\n");
+  std::vector<std::string> expected = {"5.6.7.8"};
+  for (int waited = 0;
+       waited < 3000 && GetNameServers(channel) != expected; waited += 100) {
+    fd_set readers;
+    FD_ZERO(&readers);
+    FD_SET(efd, &readers);
+    struct timeval tv = {0, 100000};
+    select(efd + 1, &readers, nullptr, nullptr, &tv);
+    if (FD_ISSET(efd, &readers)) {
+      ares_process_pending(channel);
+    }
+  }
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  ares_destroy(channel);
+}
+
+static std::map<ares_socket_t, int> watch_sock_state;
+static void WatchSockStateCallback(void *, ares_socket_t fd, int readable,
+                                   int writable) {
+  watch_sock_state[fd] = (readable ? ARES_SOCK_READ : 0) |
+                         (writable ? ARES_SOCK_WRITE : 0);
+}
+
+TEST_F(LibraryTest, FileWatchHosts) {
+  TempFile hostsfile("1.2.3.4 example.com\n");
+  BackdateFile(hostsfile.filename());
+
+  watch_sock_state.clear();
+  struct ares_options opts = {0};
+  opts.flags = ARES_FLAG_FILEWATCH;
+  opts.hosts_path = strdup(hostsfile.filename());
+  opts.sock_state_cb = WatchSockStateCallback;
+  int optmask = ARES_OPT_FLAGS | ARES_OPT_HOSTS_FILE | ARES_OPT_SOCK_STATE_CB;
+  ares_channel channel = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
+  free(opts.hosts_path);
+  ASSERT_NE(nullptr, channel);
+
+  // The inotify descriptor is announced like a socket, and withdrawn again
+  // when the channel goes away
+  ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+  int bitmask = ares_getsock(channel, socks, ARES_GETSOCK_MAXNUM);
+  ares_socket_t watchfd = ARES_GETSOCK_READABLE(bitmask, 0) ? socks[0]
+                                                            : ARES_SOCKET_BAD;
+  if (watchfd != ARES_SOCKET_BAD) {
+    EXPECT_EQ(ARES_SOCK_READ, watch_sock_state[watchfd]);
+  }
+
+  auto lookup = [&]() {
+    struct hostent *host = nullptr;
+    std::stringstream ss;
+    if (ares_gethostbyname_file(channel, "example.com", AF_INET, &host) ==
+        ARES_SUCCESS) {
+      ss << HostEnt(host);
+      ares_free_hostent(host);
+    }
+    return ss.str();
+  };
+  EXPECT_EQ("{'example.com' aliases=[] addrs=[1.2.3.4]}", lookup());
+
+  RewriteFile(hostsfile.filename(), "5.6.7.8 example.com\n");
+  const std::string expected = "{'example.com' aliases=[] addrs=[5.6.7.8]}";
+  ProcessFor(channel, 3000, [&]() { return lookup() == expected; });
+  EXPECT_EQ(expected, lookup());
+
+  ares_destroy(channel);
+  if (watchfd != ARES_SOCKET_BAD) {
+    EXPECT_EQ(0, watch_sock_state[watchfd]);
+  }
+}
 #endif
 
 TEST_F(DefaultChannelTest, SetAddresses) {
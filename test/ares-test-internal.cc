@@ -24,6 +24,7 @@
 #include <unistd.h>
 #endif
 #include <fcntl.h>
+#include <utime.h>
 
 extern "C" {
 // Remove command-line defines of package variables for the test project...
@@ -422,6 +423,43 @@ TEST_F(FileChannelTest, GetAddrInfoHostsIPV6) {
   EXPECT_EQ("{ipv6.com addr=[[0000:0000:0000:0000:0000:0000:0000:0001]]}", ss.str());
 }
 
+TEST_F(FileChannelTest, GetAddrInfoHostsShared) {
+  TempFile hostsfile("1.2.3.4 example.com\n");
+  EnvValue with_env("CARES_HOSTS", hostsfile.filename());
+  // A file modified in the second it is parsed is parsed again on next use,
+  // so backdate it
+  struct utimbuf times;
+  times.actime = times.modtime = time(NULL) - 100;
+  ASSERT_EQ(0, utime(hostsfile.filename(), &times));
+
+  ares_channel other = nullptr;
+  ASSERT_EQ(ARES_SUCCESS, ares_dup(&other, channel_));
+
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_flags = ARES_AI_ENVHOSTS | ARES_AI_NOSORT;
+  AddrInfoResult result1 = {};
+  ares_getaddrinfo(channel_, "example.com", NULL, &hints, AddrInfoCallback, &result1);
+  Process();
+  AddrInfoResult result2 = {};
+  ares_getaddrinfo(other, "example.com", NULL, &hints, AddrInfoCallback, &result2);
+  ProcessWork(other, NoExtraFDs, nullptr);
+  EXPECT_TRUE(result1.done_);
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+
+  // Both channels use the same parse when channels can share state
+  ASSERT_NE(nullptr, channel_->hf);
+  if (ares_threadsafety()) {
+    EXPECT_EQ(channel_->hf, other->hf);
+  } else {
+    EXPECT_NE(channel_->hf, other->hf);
+  }
+
+  ares_destroy(other);
+  EXPECT_NE(nullptr, channel_->hf);
+}
+
 
 TEST_F(FileChannelTest, GetAddrInfoAllocFail) {
   TempFile hostsfile("1.2.3.4 example.com alias1 alias2\n");
@@ -566,6 +604,105 @@ TEST_F(LibraryTest, SlistMisuse) {
   EXPECT_EQ(NULL, ares__slist_last_val(NULL));
   EXPECT_EQ(NULL, ares__slist_node_claim(NULL));
 }
+
+static struct timeval TimeAfter(const struct timeval &base, long ms) {
+  struct timeval tv = base;
+  tv.tv_sec  += ms / 1000;
+  tv.tv_usec += (ms % 1000) * 1000;
+  if (tv.tv_usec >= 1000000) {
+    tv.tv_sec++;
+    tv.tv_usec -= 1000000;
+  }
+  return tv;
+}
+
+TEST_F(LibraryTest, TimerWheel) {
+  struct timeval base = {1000, 500};
+  ares__timerwheel_t *wheel = ares__timerwheel_create(&base);
+  ASSERT_NE(nullptr, wheel);
+
+  // Spread timers over every level of the wheel and the overflow list.
+  const long delays[] = {5, 63, 64, 65, 700, 4095, 4096, 5000, 300000,
+                         16777215, 16777216, 20000000};
+  const size_t ndelays = sizeof(delays) / sizeof(delays[0]);
+  ares__timerwheel_entry_t entries[ndelays];
+  memset(entries, 0, sizeof(entries));
+  for (size_t i = ndelays; i > 0; i--) {
+    struct timeval expire = TimeAfter(base, delays[i - 1]);
+    ares__timerwheel_add(wheel, &entries[i - 1], &entries[i - 1], &expire);
+  }
+  EXPECT_EQ(ndelays, ares__timerwheel_len(wheel));
+
+  // Cancelling the earliest timer moves the next expiry along.
+  struct timeval next;
+  EXPECT_TRUE(ares__timerwheel_next(wheel, &next));
+  EXPECT_EQ(TimeAfter(base, 5).tv_sec, next.tv_sec);
+  EXPECT_EQ(TimeAfter(base, 5).tv_usec, next.tv_usec);
+  ares__timerwheel_remove(wheel, &entries[0]);
+  EXPECT_TRUE(ares__timerwheel_next(wheel, &next));
+  EXPECT_EQ(TimeAfter(base, 63).tv_usec, next.tv_usec);
+
+  // Each timer fires exactly once, no earlier than its expiry.
+  for (size_t i = 1; i < ndelays; i++) {
+    struct timeval before = TimeAfter(base, delays[i] - 1);
+    struct timeval at     = TimeAfter(base, delays[i]);
+    EXPECT_EQ(nullptr, ares__timerwheel_expire(wheel, &before)) << delays[i];
+    EXPECT_TRUE(ares__timerwheel_next(wheel, &next));
+    EXPECT_EQ(at.tv_sec, next.tv_sec) << delays[i];
+    EXPECT_EQ(at.tv_usec, next.tv_usec) << delays[i];
+    EXPECT_EQ(&entries[i], ares__timerwheel_expire(wheel, &at)) << delays[i];
+    EXPECT_EQ(nullptr, ares__timerwheel_expire(wheel, &at)) << delays[i];
+  }
+  EXPECT_EQ(0, ares__timerwheel_len(wheel));
+  EXPECT_FALSE(ares__timerwheel_next(wheel, &next));
+
+  // Re-arming moves a timer, and a late check fires everything due at once.
+  struct timeval now = TimeAfter(base, 30000000);
+  struct timeval t1  = TimeAfter(now, 10);
+  struct timeval t2  = TimeAfter(now, 20);
+  ares__timerwheel_add(wheel, &entries[0], &entries[0], &t2);
+  ares__timerwheel_add(wheel, &entries[1], &entries[1], &t1);
+  ares__timerwheel_add(wheel, &entries[1], &entries[1], &t2);
+  EXPECT_EQ(2, ares__timerwheel_len(wheel));
+  EXPECT_EQ(nullptr, ares__timerwheel_expire(wheel, &t1));
+  struct timeval late = TimeAfter(now, 100000);
+  EXPECT_NE(nullptr, ares__timerwheel_expire(wheel, &late));
+  EXPECT_NE(nullptr, ares__timerwheel_expire(wheel, &late));
+  EXPECT_EQ(nullptr, ares__timerwheel_expire(wheel, &late));
+
+  ares__timerwheel_destroy(wheel);
+}
+
+TEST_F(DefaultChannelTest, QueryPool) {
+  // Released blocks are handed out again, with the buffer inline for
+  // typical query sizes.
+  struct query *q1 = ares__query_alloc(channel_, 64);
+  ASSERT_NE(nullptr, q1);
+  EXPECT_TRUE(q1->tcpbuf_inline);
+  ares__query_release(q1);
+  EXPECT_EQ(1, channel_->query_pool_len);
+  struct query *q2 = ares__query_alloc(channel_, 64);
+  EXPECT_EQ(q1, q2);
+  EXPECT_EQ(0, channel_->query_pool_len);
+  ares__query_release(q2);
+
+  // Oversized queries still reuse the block but get their own buffer.
+  struct query *big = ares__query_alloc(channel_, 4096);
+  ASSERT_NE(nullptr, big);
+  EXPECT_EQ(q1, big);
+  EXPECT_FALSE(big->tcpbuf_inline);
+  ares__query_release(big);
+
+  // Blocks without room for every server are discarded rather than reused.
+  size_t nservers = channel_->nservers;
+  channel_->nservers = nservers + 1;
+  struct query *q3 = ares__query_alloc(channel_, 64);
+  ASSERT_NE(nullptr, q3);
+  EXPECT_EQ(nservers + 1, q3->pool_nservers);
+  EXPECT_EQ(0, channel_->query_pool_len);
+  ares__query_release(q3);
+  channel_->nservers = nservers;
+}
 #endif
 
 #ifdef CARES_EXPOSE_STATICS
@@ -23,7 +23,10 @@
 #include <sys/stat.h>
 #endif
 
+#include <chrono>
+#include <map>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 using testing::InvokeWithoutArgs;
@@ -129,6 +132,166 @@ TEST_P(MockUDPChannelTest, TruncationRetry) {
   EXPECT_EQ("{'www.google.com' aliases=[] addrs=[1.2.3.4]}", ss.str());
 }
 
+class MockTCPCacheTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockTCPCacheTest()
+    : MockChannelOptsTest(1, GetParam(), false,
+                          FillOptions(&opts_), ARES_OPT_TCP_CACHE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->tcpcache_max_entries = 1;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockTCPCacheTest, TruncatedQuestionSentOverTCP) {
+  DNSPacket rsptruncated;
+  rsptruncated.set_response().set_aa().set_tc()
+    .add_question(new DNSQuestion("www.google.com", T_A));
+  DNSPacket rspok;
+  rspok.set_response()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {1, 2, 3, 4}));
+  // Only accepted as is over TCP, over UDP it would be retried once more
+  DNSPacket rsptcok;
+  rsptcok.set_response().set_tc()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {1, 2, 3, 4}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &rsptruncated))
+    .WillOnce(SetReply(&server_, &rspok))
+    .WillOnce(SetReply(&server_, &rsptcok));
+
+  for (int i = 0; i < 2; i++) {
+    HostResult result;
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.google.com' aliases=[] addrs=[1.2.3.4]}", ss.str());
+  }
+}
+
+TEST_P(MockTCPCacheTest, EarliestExpiringEvicted) {
+  DNSPacket rsptruncated1;
+  rsptruncated1.set_response().set_aa().set_tc()
+    .add_question(new DNSQuestion("www.google.com", T_A));
+  DNSPacket rspok1;
+  rspok1.set_response()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {1, 2, 3, 4}));
+  DNSPacket rsptruncated2;
+  rsptruncated2.set_response().set_aa().set_tc()
+    .add_question(new DNSQuestion("www.example.com", T_A));
+  DNSPacket rspok2;
+  rspok2.set_response()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {2, 3, 4, 5}));
+  // Only room for one question, so www.google.com is forgotten once
+  // www.example.com needs TCP, and is tried over UDP again first
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &rsptruncated1))
+    .WillOnce(SetReply(&server_, &rspok1))
+    .WillOnce(SetReply(&server_, &rsptruncated1))
+    .WillOnce(SetReply(&server_, &rspok1));
+  EXPECT_CALL(server_, OnRequest("www.example.com", T_A))
+    .WillOnce(SetReply(&server_, &rsptruncated2))
+    .WillOnce(SetReply(&server_, &rspok2));
+
+  const char *names[] = { "www.google.com.", "www.example.com.",
+                          "www.google.com." };
+  for (const char *name : names) {
+    HostResult result;
+    ares_gethostbyname(channel_, name, AF_INET, HostCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_SUCCESS, result.status_);
+  }
+}
+
+TEST_P(MockUDPChannelTest, TruncatedQuestionNotRemembered) {
+  DNSPacket rsptruncated;
+  rsptruncated.set_response().set_aa().set_tc()
+    .add_question(new DNSQuestion("www.google.com", T_A));
+  DNSPacket rspok;
+  rspok.set_response()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {1, 2, 3, 4}));
+  // Without ARES_OPT_TCP_CACHE every query starts over UDP
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &rsptruncated))
+    .WillOnce(SetReply(&server_, &rspok))
+    .WillOnce(SetReply(&server_, &rsptruncated))
+    .WillOnce(SetReply(&server_, &rspok));
+
+  for (int i = 0; i < 2; i++) {
+    HostResult result;
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_SUCCESS, result.status_);
+  }
+}
+
+static int recvmulti_calls = 0;
+static ares_ssize_t RecvMultiCallback(ares_socket_t fd,
+                                      struct ares_socket_msg *msgs, size_t cnt,
+                                      void *data) {
+  (void)data;
+  recvmulti_calls++;
+  size_t i;
+  for (i = 0; i < cnt; i++) {
+    ares_ssize_t rc = recvfrom(fd, (char *)msgs[i].data, msgs[i].data_len, 0,
+                               msgs[i].from, &msgs[i].from_len);
+    if (rc < 0) {
+      break;
+    }
+    msgs[i].data_len = (size_t)rc;
+  }
+  return (i == 0) ? -1 : (ares_ssize_t)i;
+}
+
+TEST_P(MockUDPChannelTest, BatchRecvCallback) {
+  DNSPacket rsp1;
+  rsp1.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillByDefault(SetReply(&server_, &rsp1));
+  DNSPacket rsp2;
+  rsp2.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {1, 2, 3, 4}));
+  ON_CALL(server_, OnRequest("www.example.com", T_A))
+    .WillByDefault(SetReply(&server_, &rsp2));
+
+  struct ares_socket_batch_functions funcs = { RecvMultiCallback };
+  recvmulti_calls = 0;
+  ares_set_socket_batch_functions(channel_, &funcs, nullptr);
+
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  HostResult result2;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result2);
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_TRUE(result2.done_);
+  EXPECT_LT(0, recvmulti_calls);
+  std::stringstream ss1;
+  ss1 << result1.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss1.str());
+  std::stringstream ss2;
+  ss2 << result2.host_;
+  EXPECT_EQ("{'www.example.com' aliases=[] addrs=[1.2.3.4]}", ss2.str());
+
+  ares_set_socket_batch_functions(channel_, nullptr, nullptr);
+}
+
 static int sock_cb_count = 0;
 static int SocketConnectCallback(ares_socket_t fd, int type, void *data) {
   int rc = *(int*)data;
@@ -160,6 +323,58 @@ TEST_P(MockChannelTest, SockCallback) {
   EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
 }
 
+struct SockChange {
+  ares_socket_t fd;
+  int old_events;
+  int new_events;
+};
+
+static void SockChangeCallback(void *data, ares_socket_t fd, int old_events,
+                               int new_events) {
+  std::vector<SockChange> *changes = (std::vector<SockChange> *)data;
+  changes->push_back({fd, old_events, new_events});
+}
+
+TEST_P(MockChannelTest, SockChangeCallback) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &rsp));
+
+  std::vector<SockChange> changes;
+  ares_set_sock_change_callback(channel_, SockChangeCallback, &changes);
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+
+  // Every notification is a real change that follows on from the previous
+  // one for the same socket, and every socket ends up closed.
+  std::map<ares_socket_t, int> state;
+  bool write_dropped = false;
+  for (const auto &change : changes) {
+    EXPECT_NE(change.old_events, change.new_events);
+    EXPECT_EQ(state[change.fd], change.old_events);
+    if ((change.old_events & ARES_SOCK_WRITE) &&
+        change.new_events == ARES_SOCK_READ) {
+      write_dropped = true;
+    }
+    state[change.fd] = change.new_events;
+  }
+  EXPECT_FALSE(changes.empty());
+  for (const auto &fd_state : state) {
+    EXPECT_EQ(0, fd_state.second);
+  }
+  // TCP writes go through the send queue, which must drop write interest
+  // once drained.
+  if (GetParam().second) {
+    EXPECT_TRUE(write_dropped);
+  }
+}
+
 TEST_P(MockChannelTest, SockFailCallback) {
   // Notification of new sockets gives an error.
   int rc = -1;
@@ -269,6 +484,45 @@ TEST_P(MockUDPMaxQueriesTest, GetHostByNameParallelLookups) {
   }
 }
 
+TEST_P(MockUDPMaxQueriesTest, GetSockAllBeyondLimit) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  // Enough queries to need more sockets than ares_getsock() can report.
+  const size_t nsocks = ARES_GETSOCK_MAXNUM + 4;
+  size_t generation = ares_getsock_generation(channel_);
+  std::vector<HostResult> result(nsocks * MAXUDPQUERIES_LIMIT);
+  for (size_t i=0; i<result.size(); i++) {
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result[i]);
+  }
+  EXPECT_NE(generation, ares_getsock_generation(channel_));
+  generation = ares_getsock_generation(channel_);
+
+  EXPECT_EQ(nsocks, ares_getsock_all(channel_, nullptr, 0));
+  std::vector<struct ares_sock_info> socks(nsocks);
+  EXPECT_EQ(nsocks, ares_getsock_all(channel_, socks.data(), socks.size()));
+  std::set<ares_socket_t> unique;
+  for (const auto &sock : socks) {
+    EXPECT_NE(ARES_SOCKET_BAD, sock.fd);
+    EXPECT_EQ(ARES_SOCK_READ, sock.events);
+    unique.insert(sock.fd);
+  }
+  EXPECT_EQ(nsocks, unique.size());
+  // Nothing changed, so neither does the generation.
+  EXPECT_EQ(generation, ares_getsock_generation(channel_));
+
+  Process();
+  for (size_t i=0; i<result.size(); i++) {
+    EXPECT_TRUE(result[i].done_);
+  }
+  EXPECT_NE(generation, ares_getsock_generation(channel_));
+  EXPECT_EQ(0, ares_getsock_all(channel_, socks.data(), socks.size()));
+}
+
 #define TCPPARALLELLOOKUPS 32
 TEST_P(MockTCPChannelTest, GetHostByNameParallelLookups) {
   DNSPacket rsp;
@@ -441,6 +695,52 @@ class MockFlagsChannelOptsTest
   struct ares_options opts_;
 };
 
+// Lookups of two names sent together, which the tests for the various
+// channel modes use to check queries are still answered as usual.
+class ParallelLookups {
+ public:
+  ParallelLookups(MockServer &server) {
+    google_rsp_.set_response().set_aa()
+      .add_question(new DNSQuestion("www.google.com", T_A))
+      .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+    ON_CALL(server, OnRequest("www.google.com", T_A))
+      .WillByDefault(SetReply(&server, &google_rsp_));
+    example_rsp_.set_response().set_aa()
+      .add_question(new DNSQuestion("www.example.com", T_A))
+      .add_answer(new DNSARR("www.example.com", 100, {1, 2, 3, 4}));
+    ON_CALL(server, OnRequest("www.example.com", T_A))
+      .WillByDefault(SetReply(&server, &example_rsp_));
+  }
+
+  void Send(ares_channel channel) {
+    ares_gethostbyname(channel, "www.google.com.", AF_INET, HostCallback,
+                       &google_);
+    ares_gethostbyname(channel, "www.example.com.", AF_INET, HostCallback,
+                       &example_);
+  }
+
+  void Check() const {
+    CheckGoogle(google_);
+    EXPECT_TRUE(example_.done_);
+    std::stringstream ss;
+    ss << example_.host_;
+    EXPECT_EQ("{'www.example.com' aliases=[] addrs=[1.2.3.4]}", ss.str());
+  }
+
+  static void CheckGoogle(const HostResult &result) {
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  }
+
+ private:
+  DNSPacket  google_rsp_;
+  DNSPacket  example_rsp_;
+  HostResult google_;
+  HostResult example_;
+};
+
 class MockNoCheckRespChannelTest : public MockFlagsChannelOptsTest {
  public:
   MockNoCheckRespChannelTest() : MockFlagsChannelOptsTest(ARES_FLAG_NOCHECKRESP) {}
@@ -513,97 +813,914 @@ TEST_P(MockEDNSChannelTest, RetryWithoutEDNS) {
   EXPECT_EQ("{'www.google.com' aliases=[] addrs=[1.2.3.4]}", ss.str());
 }
 
-TEST_P(MockChannelTest, SearchDomains) {
-  DNSPacket nofirst;
-  nofirst.set_response().set_aa().set_rcode(NXDOMAIN)
-    .add_question(new DNSQuestion("www.first.com", T_A));
-  ON_CALL(server_, OnRequest("www.first.com", T_A))
-    .WillByDefault(SetReply(&server_, &nofirst));
-  DNSPacket nosecond;
-  nosecond.set_response().set_aa().set_rcode(NXDOMAIN)
-    .add_question(new DNSQuestion("www.second.org", T_A));
-  ON_CALL(server_, OnRequest("www.second.org", T_A))
-    .WillByDefault(SetReply(&server_, &nosecond));
-  DNSPacket yesthird;
-  yesthird.set_response().set_aa()
-    .add_question(new DNSQuestion("www.third.gov", T_A))
-    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
-  ON_CALL(server_, OnRequest("www.third.gov", T_A))
-    .WillByDefault(SetReply(&server_, &yesthird));
+class MockBatchSendChannelTest : public MockFlagsChannelOptsTest {
+ public:
+  MockBatchSendChannelTest() : MockFlagsChannelOptsTest(ARES_FLAG_BATCHSEND) {}
+};
+
+TEST_P(MockBatchSendChannelTest, ParallelLookups) {
+  ParallelLookups lookups(server_);
+  lookups.Send(channel_);
+
+  // Nothing has been sent yet, so the socket wants to be told it's writable.
+  ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+  int bitmask = ares_getsock(channel_, socks, ARES_GETSOCK_MAXNUM);
+  EXPECT_TRUE(ARES_GETSOCK_WRITABLE(bitmask, 0));
 
-  HostResult result;
-  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
   Process();
-  EXPECT_TRUE(result.done_);
-  std::stringstream ss;
-  ss << result.host_;
-  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  lookups.Check();
 }
 
-// Relies on retries so is UDP-only
-TEST_P(MockUDPChannelTest, SearchDomainsWithResentReply) {
-  DNSPacket nofirst;
-  nofirst.set_response().set_aa().set_rcode(NXDOMAIN)
-    .add_question(new DNSQuestion("www.first.com", T_A));
-  EXPECT_CALL(server_, OnRequest("www.first.com", T_A))
-    .WillOnce(SetReply(&server_, &nofirst));
-  DNSPacket nosecond;
-  nosecond.set_response().set_aa().set_rcode(NXDOMAIN)
-    .add_question(new DNSQuestion("www.second.org", T_A));
-  EXPECT_CALL(server_, OnRequest("www.second.org", T_A))
-    .WillOnce(SetReply(&server_, &nosecond));
-  DNSPacket yesthird;
-  yesthird.set_response().set_aa()
-    .add_question(new DNSQuestion("www.third.gov", T_A))
-    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
-  // Before sending the real answer, resend an earlier reply
-  EXPECT_CALL(server_, OnRequest("www.third.gov", T_A))
-    .WillOnce(DoAll(SetReply(&server_, &nofirst),
-                    SetReplyQID(&server_, 123)))
-    .WillOnce(DoAll(SetReply(&server_, &yesthird),
-                    SetReplyQID(&server_, -1)));
+class MockIoUringChannelTest : public MockFlagsChannelOptsTest {
+ public:
+  MockIoUringChannelTest() : MockFlagsChannelOptsTest(ARES_FLAG_IOURING) {}
+};
+
+// Without the event engine enabled, the channel only has a descriptor to
+// hand out in its place when its sockets are owned by a ring.
+#define SKIP_WITHOUT_IOURING()                                  \
+  do {                                                          \
+    if (ares_event_engine_fd(channel_) == ARES_SOCKET_BAD) {    \
+      GTEST_SKIP() << "io_uring not available";                 \
+    }                                                           \
+  } while (0)
+
+TEST_P(MockIoUringChannelTest, ParallelLookups) {
+  SKIP_WITHOUT_IOURING();
+  ParallelLookups lookups(server_);
+  lookups.Send(channel_);
+
+  // The ring descriptor is all the application has to wait on, in place of
+  // the server's socket.
+  struct ares_sock_info socks[4];
+  EXPECT_EQ(1U, ares_getsock_all(channel_, socks, 4));
+  EXPECT_EQ(ares_event_engine_fd(channel_), socks[0].fd);
+  ares_socket_t getsocks[ARES_GETSOCK_MAXNUM];
+  int bitmask = ares_getsock(channel_, getsocks, ARES_GETSOCK_MAXNUM);
+  EXPECT_TRUE(ARES_GETSOCK_READABLE(bitmask, 0));
+  EXPECT_FALSE(ARES_GETSOCK_READABLE(bitmask, 1));
+  EXPECT_EQ(ares_event_engine_fd(channel_), getsocks[0]);
 
-  HostResult result;
-  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
   Process();
-  EXPECT_TRUE(result.done_);
-  std::stringstream ss;
-  ss << result.host_;
-  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  lookups.Check();
 }
 
-TEST_P(MockChannelTest, SearchDomainsBare) {
-  DNSPacket nofirst;
-  nofirst.set_response().set_aa().set_rcode(NXDOMAIN)
-    .add_question(new DNSQuestion("www.first.com", T_A));
-  ON_CALL(server_, OnRequest("www.first.com", T_A))
-    .WillByDefault(SetReply(&server_, &nofirst));
-  DNSPacket nosecond;
-  nosecond.set_response().set_aa().set_rcode(NXDOMAIN)
-    .add_question(new DNSQuestion("www.second.org", T_A));
-  ON_CALL(server_, OnRequest("www.second.org", T_A))
-    .WillByDefault(SetReply(&server_, &nosecond));
-  DNSPacket nothird;
-  nothird.set_response().set_aa().set_rcode(NXDOMAIN)
-    .add_question(new DNSQuestion("www.third.gov", T_A));
-  ON_CALL(server_, OnRequest("www.third.gov", T_A))
-    .WillByDefault(SetReply(&server_, &nothird));
-  DNSPacket yesbare;
-  yesbare.set_response().set_aa()
-    .add_question(new DNSQuestion("www", T_A))
-    .add_answer(new DNSARR("www", 0x0200, {2, 3, 4, 5}));
-  ON_CALL(server_, OnRequest("www", T_A))
-    .WillByDefault(SetReply(&server_, &yesbare));
+TEST_P(MockIoUringChannelTest, EngineFd) {
+  SKIP_WITHOUT_IOURING();
+  ParallelLookups lookups(server_);
+
+  // The ring serves as the event engine as well.
+  ares_socket_t ringfd = ares_event_engine_fd(channel_);
+  EXPECT_EQ(ARES_SUCCESS, ares_event_engine_enable(channel_));
+  EXPECT_EQ(ringfd, ares_event_engine_fd(channel_));
+
+  lookups.Send(channel_);
+  ProcessEngine();
+  lookups.Check();
+}
+
+class MockTimerWheelChannelTest : public MockFlagsChannelOptsTest {
+ public:
+  MockTimerWheelChannelTest() : MockFlagsChannelOptsTest(ARES_FLAG_TIMERWHEEL) {}
+};
+
+TEST_P(MockTimerWheelChannelTest, RetryAfterTimeout) {
+  std::vector<byte> nothing;
+  DNSPacket reply;
+  reply.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 0x0100, {0x01, 0x02, 0x03, 0x04}));
+
+  // Requests are never resent on the same TCP connection, so over TCP the
+  // timeout is final.
+  bool tcp = GetParam().second;
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .Times(tcp ? 1 : 2)
+    .WillOnce(SetReplyData(&server_, nothing))
+    .WillRepeatedly(SetReply(&server_, &reply));
 
   HostResult result;
-  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+
+  struct timeval tv;
+  EXPECT_NE(nullptr, ares_timeout(channel_, nullptr, &tv));
+
   Process();
   EXPECT_TRUE(result.done_);
-  std::stringstream ss;
-  ss << result.host_;
-  EXPECT_EQ("{'www' aliases=[] addrs=[2.3.4.5]}", ss.str());
-}
-
+  EXPECT_EQ(1, result.timeouts_);
+  if (tcp) {
+    EXPECT_EQ(ARES_ETIMEOUT, result.status_);
+  } else {
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.google.com' aliases=[] addrs=[1.2.3.4]}", ss.str());
+  }
+  EXPECT_EQ(nullptr, ares_timeout(channel_, nullptr, &tv));
+}
+
+class MockQueryCacheTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  MockQueryCacheTest()
+    : MockChannelOptsTest(1, GetParam().first, GetParam().second,
+                          FillOptions(&opts_), ARES_OPT_QUERY_CACHE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->qcache_max_ttl = 3600;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockQueryCacheTest, PositiveAnswer) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &rsp));
+
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_SUCCESS, result1.status_);
+
+  // Later lookups are answered without waiting on the server, regardless of
+  // whether the caller wants the raw response or the parsed record.
+  HostResult result2;
+  ares_gethostbyname(channel_, "WWW.Google.com.", AF_INET, HostCallback, &result2);
+  EXPECT_TRUE(result2.done_);
+  std::stringstream ss;
+  ss << result2.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_INET;
+  AddrInfoResult result3;
+  ares_getaddrinfo(channel_, "www.google.com.", NULL, &hints, AddrInfoCallback,
+                   &result3);
+  EXPECT_TRUE(result3.done_);
+  EXPECT_EQ(ARES_SUCCESS, result3.status_);
+  ASSERT_NE(nullptr, result3.ai_.get());
+  ASSERT_NE(nullptr, result3.ai_->nodes);
+  EXPECT_GE(100, result3.ai_->nodes->ai_ttl);
+  EXPECT_LE(98, result3.ai_->nodes->ai_ttl);
+}
+
+TEST_P(MockQueryCacheTest, NegativeAnswer) {
+  // Cached for the SOA's MINIMUM, which is shorter than its TTL.
+  DNSPacket nxdomain;
+  nxdomain.set_response().set_aa().set_rcode(NXDOMAIN)
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_auth(new DNSSoaRR("google.com", 600, "ns1.google.com",
+                           "dns-admin.google.com", 1, 900, 900, 1800, 60));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &nxdomain));
+
+  // Without an SOA there's no telling how long the answer is good for.
+  DNSPacket nodata;
+  nodata.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_AAAA));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_AAAA))
+    .Times(2)
+    .WillRepeatedly(SetReply(&server_, &nodata));
+
+  for (int i = 0; i < 2; i++) {
+    SearchResult result1;
+    ares_query(channel_, "www.google.com", C_IN, T_A, SearchCallback, &result1);
+    Process();
+    EXPECT_TRUE(result1.done_);
+    EXPECT_EQ(ARES_ENOTFOUND, result1.status_);
+
+    SearchResult result2;
+    ares_query(channel_, "www.google.com", C_IN, T_AAAA, SearchCallback, &result2);
+    Process();
+    EXPECT_TRUE(result2.done_);
+    EXPECT_EQ(ARES_ENODATA, result2.status_);
+  }
+}
+
+TEST_P(MockQueryCacheTest, FlushedOnServerChange) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .Times(2)
+    .WillRepeatedly(SetReply(&server_, &rsp));
+
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  Process();
+  EXPECT_TRUE(result1.done_);
+
+  struct ares_addr_port_node *servers = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_servers_ports(channel_, &servers));
+  EXPECT_EQ(ARES_SUCCESS, ares_set_servers_ports(channel_, servers));
+  ares_free_data(servers);
+
+  HostResult result2;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result2);
+  EXPECT_FALSE(result2.done_);
+  Process();
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+}
+
+TEST_P(MockQueryCacheTest, KeyedOnCheckingAndDnssecBits) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .Times(3)
+    .WillRepeatedly(SetReply(&server_, &rsp));
+
+  // Plain, with checking disabled, and with the DNSSEC OK bit in the OPT
+  // record: each is asked once, then answered from the cache.
+  for (int pass = 0; pass < 2; pass++) {
+    for (int variant = 0; variant < 3; variant++) {
+      unsigned char *qbuf;
+      int qlen;
+      EXPECT_EQ(ARES_SUCCESS,
+                ares_create_query("www.google.com", C_IN, T_A, 0x1234, 0,
+                                  &qbuf, &qlen, variant == 2 ? 1232 : 0));
+      if (variant == 1) {
+        qbuf[3] |= 0x10;
+      } else if (variant == 2) {
+        qbuf[qlen - 11 + 7] |= 0x80;
+      }
+      SearchResult result = {};
+      ares_send(channel_, qbuf, qlen, SearchCallback, &result);
+      ares_free_string(qbuf);
+      EXPECT_EQ(pass == 1, result.done_);
+      Process();
+      EXPECT_TRUE(result.done_);
+      EXPECT_EQ(ARES_SUCCESS, result.status_);
+    }
+  }
+}
+
+class MockServeStaleTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  MockServeStaleTest()
+    : MockChannelOptsTest(1, GetParam().first, GetParam().second,
+                          FillOptions(&opts_),
+                          ARES_OPT_SERVE_STALE|ARES_OPT_TIMEOUTMS|ARES_OPT_TRIES) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    // No query cache, so answers are only ever served stale.
+    opts->stale_window = 3600;
+    opts->stale_timeout = 50;
+    opts->timeout = 250;
+    opts->tries = 1;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockServeStaleTest, ServedOnFailure) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  DNSPacket servfail;
+  servfail.set_response().set_aa().set_rcode(SERVFAIL)
+    .add_question(new DNSQuestion("www.google.com", T_A));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &rsp))
+    .WillOnce(SetReply(&server_, &servfail));
+
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  Process();
+  EXPECT_TRUE(result1.done_);
+
+  // Nothing is fresh without the query cache, so the servers are asked again.
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_INET;
+  AddrInfoResult result2;
+  ares_getaddrinfo(channel_, "www.google.com.", NULL, &hints, AddrInfoCallback,
+                   &result2);
+  EXPECT_FALSE(result2.done_);
+  Process();
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+  ASSERT_NE(nullptr, result2.ai_.get());
+  ASSERT_NE(nullptr, result2.ai_->nodes);
+  EXPECT_EQ(30, result2.ai_->nodes->ai_ttl);
+  std::stringstream ss;
+  ss << result2.ai_;
+  EXPECT_EQ("{addr=[2.3.4.5]}", ss.str());
+
+  // Negative answers are never served stale.
+  DNSPacket nxdomain;
+  nxdomain.set_response().set_aa().set_rcode(NXDOMAIN)
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_auth(new DNSSoaRR("example.com", 600, "ns1.example.com",
+                           "dns-admin.example.com", 1, 900, 900, 1800, 60));
+  DNSPacket servfail2;
+  servfail2.set_response().set_aa().set_rcode(SERVFAIL)
+    .add_question(new DNSQuestion("www.example.com", T_A));
+  EXPECT_CALL(server_, OnRequest("www.example.com", T_A))
+    .WillOnce(SetReply(&server_, &nxdomain))
+    .WillOnce(SetReply(&server_, &servfail2));
+  for (int status : {ARES_ENOTFOUND, ARES_ESERVFAIL}) {
+    SearchResult result;
+    ares_query(channel_, "www.example.com", C_IN, T_A, SearchCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(status, result.status_);
+  }
+}
+
+TEST_P(MockServeStaleTest, ServedOnSlowServer) {
+  std::vector<byte> nothing;
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  // One lookup, then one refresh that never gets an answer.
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .Times(2)
+    .WillOnce(SetReply(&server_, &rsp))
+    .WillOnce(SetReplyData(&server_, nothing));
+
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  Process();
+  EXPECT_TRUE(result1.done_);
+
+  // Served well before the query itself times out in the background.
+  HostResult result2;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result2);
+  Process();
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+  EXPECT_EQ(0, result2.timeouts_);
+  std::stringstream ss;
+  ss << result2.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+
+  // With the servers failing to refresh it, the stale answer is served
+  // straight away.
+  HostResult result3;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result3);
+  EXPECT_TRUE(result3.done_);
+  EXPECT_EQ(ARES_SUCCESS, result3.status_);
+}
+
+class MockPrefetchTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockPrefetchTest()
+    : MockChannelOptsTest(1, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_QUERY_CACHE|ARES_OPT_PREFETCH|
+                          ARES_OPT_TIMEOUTMS|ARES_OPT_TRIES) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->qcache_max_ttl = 3600;
+    opts->prefetch_pct = 50;
+    opts->prefetch_hits = 1;
+    // Long enough for a prefetch to come due while a query is outstanding.
+    opts->timeout = 2500;
+    opts->tries = 1;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockPrefetchTest, PopularAnswerRefreshed) {
+  std::vector<byte> nothing;
+  DNSPacket rsp1;
+  rsp1.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 4, {2, 3, 4, 5}));
+  DNSPacket rsp2;
+  rsp2.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 4, {3, 4, 5, 6}));
+  DNSPacket other;
+  other.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 4, {1, 2, 3, 4}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &rsp1))
+    .WillOnce(SetReply(&server_, &rsp2));
+  // Never answered from the cache, so not prefetched.
+  EXPECT_CALL(server_, OnRequest("www.example.com", T_A))
+    .WillOnce(SetReply(&server_, &other));
+  EXPECT_CALL(server_, OnRequest("www.slow.com", T_A))
+    .WillOnce(SetReplyData(&server_, nothing));
+
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  HostResult result2;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result2);
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_TRUE(result2.done_);
+
+  HostResult result3;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result3);
+  EXPECT_TRUE(result3.done_);
+
+  // Nothing is in flight, but the prefetch is pending.
+  struct timeval tv;
+  EXPECT_NE(nullptr, ares_timeout(channel_, nullptr, &tv));
+
+  // Keep the channel busy until the prefetch has been answered.
+  HostResult slow;
+  ares_gethostbyname(channel_, "www.slow.com.", AF_INET, HostCallback, &slow);
+  Process();
+  EXPECT_TRUE(slow.done_);
+  EXPECT_EQ(ARES_ETIMEOUT, slow.status_);
+
+  HostResult result4;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result4);
+  EXPECT_TRUE(result4.done_);
+  std::stringstream ss;
+  ss << result4.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[3.4.5.6]}", ss.str());
+}
+
+class MockAutoTimeoutTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockAutoTimeoutTest()
+    : MockChannelOptsTest(1, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_FLAGS) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->flags = ARES_FLAG_AUTOTIMEOUT;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockAutoTimeoutTest, RetryAfterMeasuredTimeout) {
+  std::vector<byte> nothing;
+  DNSPacket reply;
+  reply.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 0x0100, {0x01, 0x02, 0x03, 0x04}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &reply))
+    .WillOnce(SetReplyData(&server_, nothing))
+    .WillOnce(SetReply(&server_, &reply));
+
+  // Until the server is measured the configured timeout applies.
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  struct timeval tv;
+  EXPECT_NE(nullptr, ares_timeout(channel_, nullptr, &tv));
+  EXPECT_EQ(1, tv.tv_sec);
+  Process();
+  EXPECT_TRUE(result1.done_);
+
+  // The local server answers quickly, so the retry follows quickly too.
+  HostResult result2;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result2);
+  EXPECT_NE(nullptr, ares_timeout(channel_, nullptr, &tv));
+  EXPECT_EQ(0, tv.tv_sec);
+  EXPECT_GT(500000, tv.tv_usec);
+  Process();
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(1, result2.timeouts_);
+  std::stringstream ss;
+  ss << result2.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[1.2.3.4]}", ss.str());
+}
+
+class MockCoalesceChannelTest : public MockFlagsChannelOptsTest {
+ public:
+  MockCoalesceChannelTest() : MockFlagsChannelOptsTest(ARES_FLAG_COALESCE) {}
+};
+
+TEST_P(MockCoalesceChannelTest, ParallelLookups) {
+  ParallelLookups lookups(server_);
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A)).Times(1);
+
+  // Identical questions in flight together go upstream once, whether the
+  // caller wants the raw answer or the parsed record.
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  HostResult result2;
+  ares_gethostbyname(channel_, "WWW.google.com.", AF_INET, HostCallback, &result2);
+  SearchResult result3;
+  ares_search(channel_, "www.google.com.", C_IN, T_A, SearchCallback, &result3);
+  Process();
+
+  ParallelLookups::CheckGoogle(result1);
+  ParallelLookups::CheckGoogle(result2);
+  EXPECT_TRUE(result3.done_);
+  EXPECT_EQ(ARES_SUCCESS, result3.status_);
+
+  // Once answered, the same question goes upstream again.
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A)).Times(1);
+  HostResult result4;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result4);
+  Process();
+  ParallelLookups::CheckGoogle(result4);
+}
+
+TEST_P(MockCoalesceChannelTest, CancelAll) {
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  HostResult result2;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result2);
+  ares_cancel(channel_);
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result1.status_);
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result2.status_);
+}
+
+// Without thread support the flag would make channel creation fail, so the
+// tests get a plain channel and skip themselves.
+class MockThreadSafeChannelTest : public MockFlagsChannelOptsTest {
+ public:
+  MockThreadSafeChannelTest()
+    : MockFlagsChannelOptsTest(ares_threadsafety() ? ARES_FLAG_THREADSAFE : 0) {}
+};
+
+TEST_P(MockThreadSafeChannelTest, ParallelLookups) {
+  if (!ares_threadsafety()) {
+    GTEST_SKIP() << "c-ares built without thread support";
+  }
+  ParallelLookups lookups(server_);
+
+  // Lookups submitted from several threads at once all make it onto the
+  // channel, and a waiting thread is released once they have been answered.
+  const int nthreads = 8;
+  HostResult results[nthreads];
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nthreads; i++) {
+    threads.push_back(std::thread([this, &results, i]() {
+      ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback,
+                         &results[i]);
+    }));
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ((size_t)nthreads, ares_queue_active_queries(channel_));
+  EXPECT_EQ(ARES_ETIMEOUT, ares_queue_wait_empty(channel_, 0));
+
+  ares_status_t waited = ARES_ETIMEOUT;
+  std::thread waiter([this, &waited]() {
+    waited = ares_queue_wait_empty(channel_, -1);
+  });
+  Process();
+  waiter.join();
+
+  EXPECT_EQ(ARES_SUCCESS, waited);
+  EXPECT_EQ((size_t)0, ares_queue_active_queries(channel_));
+  for (const HostResult &result : results) {
+    ParallelLookups::CheckGoogle(result);
+  }
+}
+
+struct WaitEmptyResult {
+  ares_channel channel = nullptr;
+  bool done = false;
+  ares_status_t status = ARES_SUCCESS;
+};
+
+static void WaitEmptyCallback(void *data, int, int, struct hostent *) {
+  WaitEmptyResult *result = reinterpret_cast<WaitEmptyResult *>(data);
+  result->done = true;
+  result->status = ares_queue_wait_empty(result->channel, -1);
+}
+
+TEST_P(MockThreadSafeChannelTest, WaitEmptyFromCallback) {
+  if (!ares_threadsafety()) {
+    GTEST_SKIP() << "c-ares built without thread support";
+  }
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  // Waiting with the channel locked for the callback would never return
+  WaitEmptyResult result;
+  result.channel = channel_;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, WaitEmptyCallback,
+                     &result);
+  Process();
+  EXPECT_TRUE(result.done);
+  EXPECT_EQ(ARES_EFORMERR, result.status);
+  EXPECT_EQ(ARES_SUCCESS, ares_queue_wait_empty(channel_, 0));
+}
+
+// The submission queue needs thread support and isn't available on Windows.
+// Where channels can't be created with it, the tests get a plain channel, on
+// which ares_submit_*() return ARES_ENOTIMP, and skip themselves.
+class MockSubmitQueueChannelTest : public MockFlagsChannelOptsTest {
+ public:
+  MockSubmitQueueChannelTest()
+    : MockFlagsChannelOptsTest(SubmitQueueFlag()) {}
+  static int SubmitQueueFlag() {
+    struct ares_options opts;
+    ares_channel channel = nullptr;
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = ARES_FLAG_SUBMITQ;
+    if (ares_init_options(&channel, &opts, ARES_OPT_FLAGS) != ARES_SUCCESS) {
+      return 0;
+    }
+    ares_destroy(channel);
+    return ARES_FLAG_SUBMITQ;
+  }
+};
+
+TEST_P(MockSubmitQueueChannelTest, ParallelSubmit) {
+  if (ares_submit_send(channel_, nullptr, 0, nullptr, nullptr) ==
+      ARES_ENOTIMP) {
+    GTEST_SKIP() << "submission queue not supported";
+  }
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  // Requests queued from several threads don't touch the channel until the
+  // processing thread is woken up to run them.
+  const int nthreads = 8;
+  std::vector<SearchResult> sresults(nthreads);
+  std::vector<AddrInfoResult> airesults(nthreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nthreads; i++) {
+    threads.push_back(std::thread([this, &sresults, &airesults, i]() {
+      unsigned char *qbuf;
+      int qlen;
+      struct ares_addrinfo_hints hints = {};
+      hints.ai_family = AF_INET;
+      EXPECT_EQ(ARES_SUCCESS,
+                ares_create_query("www.google.com", C_IN, T_A,
+                                  (unsigned short)(0x1000 + i), 0, &qbuf,
+                                  &qlen, 0));
+      EXPECT_EQ(ARES_SUCCESS,
+                ares_submit_send(channel_, qbuf, (size_t)qlen, SearchCallback,
+                                 &sresults[i]));
+      ares_free_string(qbuf);
+      EXPECT_EQ(ARES_SUCCESS,
+                ares_submit_getaddrinfo(channel_, "www.google.com.", NULL,
+                                        &hints, AddrInfoCallback,
+                                        &airesults[i]));
+    }));
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ((size_t)0, ares_queue_active_queries(channel_));
+
+  fd_set readers, writers;
+  FD_ZERO(&readers);
+  FD_ZERO(&writers);
+  int nfds = ares_fds(channel_, &readers, &writers);
+  struct timeval tv = {0, 0};
+  EXPECT_EQ(1, select(nfds, &readers, &writers, nullptr, &tv));
+  ares_process(channel_, &readers, &writers);
+  EXPECT_EQ((size_t)(2 * nthreads), ares_queue_active_queries(channel_));
+
+  Process();
+  for (int i = 0; i < nthreads; i++) {
+    EXPECT_TRUE(sresults[i].done_);
+    EXPECT_EQ(ARES_SUCCESS, sresults[i].status_);
+    EXPECT_TRUE(airesults[i].done_);
+    EXPECT_EQ(ARES_SUCCESS, airesults[i].status_);
+  }
+}
+
+TEST_P(MockSubmitQueueChannelTest, CancelQueued) {
+  AddrInfoResult result;
+  ares_status_t status =
+    ares_submit_getaddrinfo(channel_, "www.google.com.", NULL, NULL,
+                            AddrInfoCallback, &result);
+  if (status == ARES_ENOTIMP) {
+    GTEST_SKIP() << "submission queue not supported";
+  }
+  EXPECT_EQ(ARES_SUCCESS, status);
+  ares_cancel(channel_);
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result.status_);
+  Process();
+}
+
+class MockIoUringSubmitQueueTest : public MockFlagsChannelOptsTest {
+ public:
+  MockIoUringSubmitQueueTest()
+    : MockFlagsChannelOptsTest(ARES_FLAG_IOURING |
+                               MockSubmitQueueChannelTest::SubmitQueueFlag()) {}
+};
+
+TEST_P(MockIoUringSubmitQueueTest, WakesEngineFd) {
+  SKIP_WITHOUT_IOURING();
+  if (ares_submit_send(channel_, nullptr, 0, nullptr, nullptr) ==
+      ARES_ENOTIMP) {
+    GTEST_SKIP() << "submission queue not supported";
+  }
+  ParallelLookups lookups(server_);
+
+  // Each request queued from another thread wakes up an application waiting
+  // on nothing but the ring descriptor.
+  for (int i = 0; i < 2; i++) {
+    AddrInfoResult result;
+    std::thread submitter([this, &result]() {
+      struct ares_addrinfo_hints hints = {};
+      hints.ai_family = AF_INET;
+      EXPECT_EQ(ARES_SUCCESS,
+                ares_submit_getaddrinfo(channel_, "www.google.com.", NULL,
+                                        &hints, AddrInfoCallback, &result));
+    });
+    submitter.join();
+
+    fd_set readers;
+    FD_ZERO(&readers);
+    int efd = ares_event_engine_fd(channel_);
+    FD_SET(efd, &readers);
+    struct timeval tv = {5, 0};
+    EXPECT_EQ(1, select(efd + 1, &readers, nullptr, nullptr, &tv));
+    ares_process_pending(channel_);
+    EXPECT_EQ((size_t)1, ares_queue_active_queries(channel_));
+
+    ProcessEngine();
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_SUCCESS, result.status_);
+  }
+}
+
+TEST_P(MockChannelTest, SubmitQueueNotEnabled) {
+  AddrInfoResult result;
+  EXPECT_EQ(ARES_ENOTIMP,
+            ares_submit_getaddrinfo(channel_, "www.google.com.", NULL, NULL,
+                                    AddrInfoCallback, &result));
+  EXPECT_FALSE(result.done_);
+}
+
+TEST_P(MockChannelTest, QueueWaitEmptyNotThreadSafe) {
+  EXPECT_EQ(ARES_ENOTIMP, ares_queue_wait_empty(channel_, 0));
+  EXPECT_EQ(ARES_EFORMERR, ares_queue_wait_empty(nullptr, 0));
+}
+
+TEST_P(MockChannelTest, PoolRouteAndStats) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  struct ares_options opts;
+  int optmask = 0;
+  EXPECT_EQ(ARES_SUCCESS, ares_save_options(channel_, &opts, &optmask));
+  ares_pool_t *pool = nullptr;
+  ASSERT_EQ(ARES_SUCCESS, ares_pool_create(&pool, 4, &opts, optmask));
+  ares_destroy_options(&opts);
+  EXPECT_EQ((size_t)4, ares_pool_nshards(pool));
+  EXPECT_EQ(nullptr, ares_pool_shard(pool, 4));
+
+  // Every shard carries the configuration of the first
+  ares_channel last = ares_pool_shard(pool, 3);
+  EXPECT_EQ(ARES_SUCCESS, ares_save_options(last, &opts, &optmask));
+  EXPECT_EQ(3, opts.ndomains);
+  EXPECT_EQ(std::string("first.com"), std::string(opts.domains[0]));
+  ares_destroy_options(&opts);
+
+  // Routing ignores case and the trailing dot
+  ares_channel shard = ares_pool_route(pool, "www.google.com");
+  ASSERT_NE(nullptr, shard);
+  EXPECT_EQ(shard, ares_pool_route(pool, "WWW.Google.COM."));
+
+  AddrInfoResult result;
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_INET;
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_pool_getaddrinfo(pool, "www.google.com.", NULL, &hints,
+                                  AddrInfoCallback, &result));
+  struct ares_pool_stats stats;
+  ares_pool_stats(pool, &stats);
+  EXPECT_EQ((size_t)4, stats.shards);
+  EXPECT_EQ((size_t)1, stats.active_queries);
+  EXPECT_EQ((size_t)1, stats.queries);
+  EXPECT_EQ((size_t)1, ares_queue_active_queries(shard));
+
+  ProcessWork(shard, [this]() { return fds(); },
+              [this](int fd) { ProcessFD(fd); });
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  ares_pool_stats(pool, &stats);
+  EXPECT_EQ((size_t)0, stats.active_queries);
+  EXPECT_EQ((size_t)0, stats.timeouts);
+
+  ares_pool_destroy(pool);
+}
+
+TEST_P(MockChannelTest, SearchDomains) {
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa().set_rcode(NXDOMAIN)
+    .add_question(new DNSQuestion("www.first.com", T_A));
+  ON_CALL(server_, OnRequest("www.first.com", T_A))
+    .WillByDefault(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa().set_rcode(NXDOMAIN)
+    .add_question(new DNSQuestion("www.second.org", T_A));
+  ON_CALL(server_, OnRequest("www.second.org", T_A))
+    .WillByDefault(SetReply(&server_, &nosecond));
+  DNSPacket yesthird;
+  yesthird.set_response().set_aa()
+    .add_question(new DNSQuestion("www.third.gov", T_A))
+    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.third.gov", T_A))
+    .WillByDefault(SetReply(&server_, &yesthird));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+// Relies on retries so is UDP-only
+TEST_P(MockUDPChannelTest, SearchDomainsWithResentReply) {
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa().set_rcode(NXDOMAIN)
+    .add_question(new DNSQuestion("www.first.com", T_A));
+  EXPECT_CALL(server_, OnRequest("www.first.com", T_A))
+    .WillOnce(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa().set_rcode(NXDOMAIN)
+    .add_question(new DNSQuestion("www.second.org", T_A));
+  EXPECT_CALL(server_, OnRequest("www.second.org", T_A))
+    .WillOnce(SetReply(&server_, &nosecond));
+  DNSPacket yesthird;
+  yesthird.set_response().set_aa()
+    .add_question(new DNSQuestion("www.third.gov", T_A))
+    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
+  // Before sending the real answer, resend an earlier reply
+  EXPECT_CALL(server_, OnRequest("www.third.gov", T_A))
+    .WillOnce(DoAll(SetReply(&server_, &nofirst),
+                    SetReplyQID(&server_, 123)))
+    .WillOnce(DoAll(SetReply(&server_, &yesthird),
+                    SetReplyQID(&server_, -1)));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+TEST_P(MockChannelTest, SearchDomainsBare) {
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa().set_rcode(NXDOMAIN)
+    .add_question(new DNSQuestion("www.first.com", T_A));
+  ON_CALL(server_, OnRequest("www.first.com", T_A))
+    .WillByDefault(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa().set_rcode(NXDOMAIN)
+    .add_question(new DNSQuestion("www.second.org", T_A));
+  ON_CALL(server_, OnRequest("www.second.org", T_A))
+    .WillByDefault(SetReply(&server_, &nosecond));
+  DNSPacket nothird;
+  nothird.set_response().set_aa().set_rcode(NXDOMAIN)
+    .add_question(new DNSQuestion("www.third.gov", T_A));
+  ON_CALL(server_, OnRequest("www.third.gov", T_A))
+    .WillByDefault(SetReply(&server_, &nothird));
+  DNSPacket yesbare;
+  yesbare.set_response().set_aa()
+    .add_question(new DNSQuestion("www", T_A))
+    .add_answer(new DNSARR("www", 0x0200, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www", T_A))
+    .WillByDefault(SetReply(&server_, &yesbare));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
 TEST_P(MockChannelTest, SearchNoDataThenSuccess) {
   // First two search domains recognize the name but have no A records.
   DNSPacket nofirst;
@@ -714,16 +1831,57 @@ TEST_P(MockChannelTest, SearchHighNdots) {
   ON_CALL(server_, OnRequest("a.b.c.w.w.w.first.com", T_A))
     .WillByDefault(SetReply(&server_, &yesfirst));
 
-  SearchResult result;
-  ares_search(channel_, "a.b.c.w.w.w", C_IN, T_A, SearchCallback, &result);
+  SearchResult result;
+  ares_search(channel_, "a.b.c.w.w.w", C_IN, T_A, SearchCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  std::stringstream ss;
+  ss << PacketToString(result.data_);
+  EXPECT_EQ("RSP QRY AA NOERROR Q:{'a.b.c.w.w.w.first.com' IN A} "
+            "A:{'a.b.c.w.w.w.first.com' IN A TTL=512 2.3.4.5}",
+            ss.str());
+}
+
+TEST_P(MockChannelTest, QuestionCaseInsensitive) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("WWW.Google.COM", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(0, result.timeouts_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'WWW.Google.COM' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+TEST_P(MockUDPChannelTest, MismatchedQuestionIgnored) {
+  DNSPacket wrong;
+  wrong.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.org", T_A))
+    .add_answer(new DNSARR("www.google.org", 100, {1, 1, 1, 1}));
+  DNSPacket right;
+  right.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", T_A))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", T_A))
+    .WillOnce(SetReply(&server_, &wrong))
+    .WillOnce(SetReply(&server_, &right));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
   Process();
   EXPECT_TRUE(result.done_);
-  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_EQ(1, result.timeouts_);
   std::stringstream ss;
-  ss << PacketToString(result.data_);
-  EXPECT_EQ("RSP QRY AA NOERROR Q:{'a.b.c.w.w.w.first.com' IN A} "
-            "A:{'a.b.c.w.w.w.first.com' IN A TTL=512 2.3.4.5}",
-            ss.str());
+  ss << result.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
 }
 
 TEST_P(MockUDPChannelTest, V4WorksV6Timeout) {
@@ -1199,6 +2357,34 @@ TEST_P(MockChannelTest, HostAliasUnreadable) {
 }
 #endif
 
+#ifdef HAVE_EPOLL
+class MockEventEngineTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  MockEventEngineTest()
+    : MockChannelOptsTest(1, GetParam().first, GetParam().second, nullptr, 0) {
+    EXPECT_EQ(ARES_SUCCESS, ares_event_engine_enable(channel_));
+  }
+};
+
+TEST_P(MockEventEngineTest, ParallelLookups) {
+  ParallelLookups lookups(server_);
+  EXPECT_NE(ARES_SOCKET_BAD, ares_event_engine_fd(channel_));
+
+  lookups.Send(channel_);
+  ProcessEngine();
+  lookups.Check();
+
+  // A duplicated channel keeps using its own engine.
+  ares_channel dup = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_dup(&dup, channel_));
+  EXPECT_NE(ARES_SOCKET_BAD, ares_event_engine_fd(dup));
+  EXPECT_NE(ares_event_engine_fd(channel_), ares_event_engine_fd(dup));
+  ares_destroy(dup);
+}
+#endif
+
 class MockMultiServerChannelTest
   : public MockChannelOptsTest,
     public ::testing::WithParamInterface< std::pair<int, bool> > {
@@ -1317,12 +2503,334 @@ TEST_P(NoRotateMultiMockTest, ThirdServer) {
   CheckExample();
 }
 
+class SrttMultiMockTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  SrttMultiMockTest()
+    : MockChannelOptsTest(3, GetParam().first, GetParam().second,
+                          FillOptions(&opts_), ARES_OPT_FLAGS) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->flags = ARES_FLAG_SRTT;
+    return opts;
+  }
+  void CheckExample() {
+    HostResult result;
+    ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(SrttMultiMockTest, FailedServerProbed) {
+  DNSPacket servfailrsp;
+  servfailrsp.set_response().set_aa().set_rcode(SERVFAIL)
+    .add_question(new DNSQuestion("www.example.com", T_A));
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+
+  // Server [0] fails the first query, which then goes to server [1].  Server
+  // [2] is tried next as it hasn't been measured yet, and server [0] is left
+  // alone until it is probed by the 16th query.
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", T_A))
+    .Times(2)
+    .WillOnce(SetReply(servers_[0].get(), &servfailrsp))
+    .WillRepeatedly(SetReply(servers_[0].get(), &okrsp));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", T_A))
+    .Times(::testing::AtLeast(1))
+    .WillRepeatedly(SetReply(servers_[1].get(), &okrsp));
+  EXPECT_CALL(*servers_[2], OnRequest("www.example.com", T_A))
+    .Times(::testing::AtLeast(1))
+    .WillRepeatedly(SetReply(servers_[2].get(), &okrsp));
+
+  for (int i = 0; i < 16; i++) {
+    CheckExample();
+  }
+}
+
+class ServerBackoffMultiMockTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  ServerBackoffMultiMockTest(unsigned int backoff = 500)
+    : MockChannelOptsTest(3, GetParam().first, GetParam().second,
+                          FillOptions(&opts_, backoff),
+                          ARES_OPT_SERVER_BACKOFF|ARES_OPT_NOROTATE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts,
+                                          unsigned int backoff) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->server_backoff = backoff;
+    return opts;
+  }
+  void CheckExample() {
+    HostResult result;
+    ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(ServerBackoffMultiMockTest, FailedServersAvoided) {
+  DNSPacket servfailrsp;
+  servfailrsp.set_response().set_aa().set_rcode(SERVFAIL)
+    .add_question(new DNSQuestion("www.example.com", T_A));
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+
+  // Server [0] fails the first query and is left alone afterwards.  When
+  // server [1] fails too, the retry goes to server [2] rather than wrapping
+  // around to server [0], and so do the queries after it.
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", T_A))
+    .WillOnce(SetReply(servers_[0].get(), &servfailrsp));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", T_A))
+    .WillOnce(SetReply(servers_[1].get(), &okrsp))
+    .WillOnce(SetReply(servers_[1].get(), &okrsp))
+    .WillOnce(SetReply(servers_[1].get(), &servfailrsp));
+  EXPECT_CALL(*servers_[2], OnRequest("www.example.com", T_A))
+    .Times(2)
+    .WillRepeatedly(SetReply(servers_[2].get(), &okrsp));
+
+  for (int i = 0; i < 4; i++) {
+    CheckExample();
+  }
+}
+
+// With a backoff short enough to wait out
+class ServerBackoffProbeMultiMockTest : public ServerBackoffMultiMockTest {
+ public:
+  ServerBackoffProbeMultiMockTest() : ServerBackoffMultiMockTest(20) {}
+};
+
+TEST_P(ServerBackoffProbeMultiMockTest, FailedServerProbed) {
+  DNSPacket servfailrsp;
+  servfailrsp.set_response().set_aa().set_rcode(SERVFAIL)
+    .add_question(new DNSQuestion("www.example.com", T_A));
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+
+  // Once its backoff is over server [0] gets a query again, and having
+  // answered it is back in use.
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", T_A))
+    .WillOnce(SetReply(servers_[0].get(), &servfailrsp))
+    .WillRepeatedly(SetReply(servers_[0].get(), &okrsp));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", T_A))
+    .Times(2)
+    .WillRepeatedly(SetReply(servers_[1].get(), &okrsp));
+
+  CheckExample();
+  CheckExample();
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));
+  CheckExample();
+  CheckExample();
+}
+
+class HedgeMultiMockTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  HedgeMultiMockTest()
+    : MockChannelOptsTest(2, GetParam().first, GetParam().second,
+                          FillOptions(&opts_),
+                          ARES_OPT_HEDGE|ARES_OPT_NOROTATE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->hedge_delay = 250;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(HedgeMultiMockTest, SlowServerHedged) {
+  std::vector<byte> nothing;
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+
+  // Server [0] doesn't answer, so well before the query times out on it, it
+  // is also sent to server [1] whose answer is taken.
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", T_A))
+    .WillOnce(SetReplyData(servers_[0].get(), nothing));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", T_A))
+    .WillOnce(SetReply(servers_[1].get(), &okrsp));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(0, result.timeouts_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+TEST_P(HedgeMultiMockTest, AnsweredNotHedged) {
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", T_A))
+    .WillOnce(SetReply(servers_[0].get(), &okrsp));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", T_A))
+    .Times(0);
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+class EDNSMultiMockTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  EDNSMultiMockTest()
+    : MockChannelOptsTest(2, GetParam().first, GetParam().second,
+                          FillOptions(&opts_),
+                          ARES_OPT_FLAGS|ARES_OPT_ROTATE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->flags = ARES_FLAG_EDNS;
+    return opts;
+  }
+  void CheckExample() {
+    HostResult result;
+    ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(EDNSMultiMockTest, DowngradeOnlyFailingServer) {
+  DNSPacket formerrrsp;
+  formerrrsp.set_response().set_aa().set_rcode(FORMERR)
+    .add_question(new DNSQuestion("www.example.com", T_A));
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", T_A))
+    .WillOnce(SetReply(servers_[0].get(), &formerrrsp))
+    .WillRepeatedly(SetReply(servers_[0].get(), &okrsp));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", T_A))
+    .WillRepeatedly(SetReply(servers_[1].get(), &okrsp));
+
+  // Server [0] rejects EDNS, so the query is retried without the OPT RR
+  CheckExample();
+  EXPECT_EQ(0, servers_[0]->last_arcount());
+
+  // Server [1] is still sent one
+  CheckExample();
+  EXPECT_EQ(1, servers_[1]->last_arcount());
+
+  // While server [0] no longer is
+  CheckExample();
+  EXPECT_EQ(0, servers_[0]->last_arcount());
+}
+
+class EDNSTimeoutMockTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface<int> {
+ public:
+  EDNSTimeoutMockTest()
+    : MockChannelOptsTest(1, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_FLAGS|ARES_OPT_EDNSPSZ|
+                          ARES_OPT_TIMEOUTMS|ARES_OPT_TRIES) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->flags = ARES_FLAG_EDNS;
+    opts->ednspsz = 4096;
+    opts->timeout = 100;
+    opts->tries = 3;
+    return opts;
+  }
+  void CheckExample() {
+    HostResult result;
+    ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  }
+ protected:
+  std::vector<byte> nothing_;
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(EDNSTimeoutMockTest, LostPacketKeepsPayloadSize) {
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+  EXPECT_CALL(server_, OnRequest("www.example.com", T_A))
+    .WillOnce(SetReplyData(&server_, nothing_))
+    .WillRepeatedly(SetReply(&server_, &okrsp));
+
+  // A single timeout is retried at the same size
+  CheckExample();
+  EXPECT_EQ(4096, server_.last_udpsize());
+
+  CheckExample();
+  EXPECT_EQ(4096, server_.last_udpsize());
+}
+
+TEST_P(EDNSTimeoutMockTest, RepeatedTimeoutsCapPayloadSize) {
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", T_A))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+  EXPECT_CALL(server_, OnRequest("www.example.com", T_A))
+    .WillOnce(SetReplyData(&server_, nothing_))
+    .WillOnce(SetReplyData(&server_, nothing_))
+    .WillRepeatedly(SetReply(&server_, &okrsp));
+
+  // The second timeout falls back to the safe size, which gets an answer
+  CheckExample();
+  EXPECT_EQ(1232, server_.last_udpsize());
+
+  // So the server is no longer asked for more
+  CheckExample();
+  EXPECT_EQ(1232, server_.last_udpsize());
+}
+
 INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockChannelTest, ::testing::ValuesIn(ares::test::families_modes));
 
 INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockUDPChannelTest, ::testing::ValuesIn(ares::test::families));
 
 INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockUDPMaxQueriesTest, ::testing::ValuesIn(ares::test::families));
 
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockTCPCacheTest, ::testing::ValuesIn(ares::test::families));
+
 INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockTCPChannelTest, ::testing::ValuesIn(ares::test::families));
 
 INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockExtraOptsTest, ::testing::ValuesIn(ares::test::families_modes));
@@ -1331,9 +2839,47 @@ INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockNoCheckRespChannelTest, ::testing:
 
 INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockEDNSChannelTest, ::testing::ValuesIn(ares::test::families_modes));
 
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockBatchSendChannelTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockIoUringChannelTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockTimerWheelChannelTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockQueryCacheTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockServeStaleTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockPrefetchTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockAutoTimeoutTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockCoalesceChannelTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockThreadSafeChannelTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockSubmitQueueChannelTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockIoUringSubmitQueueTest, ::testing::ValuesIn(ares::test::families_modes));
+
+#ifdef HAVE_EPOLL
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, MockEventEngineTest, ::testing::ValuesIn(ares::test::families_modes));
+#endif
+
 INSTANTIATE_TEST_SUITE_P(TransportModes, RotateMultiMockTest, ::testing::ValuesIn(ares::test::families_modes));
 
 INSTANTIATE_TEST_SUITE_P(TransportModes, NoRotateMultiMockTest, ::testing::ValuesIn(ares::test::families_modes));
 
+INSTANTIATE_TEST_SUITE_P(TransportModes, SrttMultiMockTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(TransportModes, ServerBackoffMultiMockTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(TransportModes, ServerBackoffProbeMultiMockTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(TransportModes, HedgeMultiMockTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(TransportModes, EDNSMultiMockTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_SUITE_P(AddressFamilies, EDNSTimeoutMockTest, ::testing::ValuesIn(ares::test::families));
+
 }  // namespace test
 }  // namespace ares
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 
 #include <functional>
+#include <mutex>
 #include <sstream>
 
 #ifdef WIN32
@@ -77,6 +78,8 @@ std::vector<std::pair<int, bool>> families_modes = both_families_both_modes;
 
 unsigned long long LibraryTest::fails_ = 0;
 std::map<size_t, int> LibraryTest::size_fails_;
+// The allocator hooks may be called from several threads at once.
+static std::mutex alloc_fail_lock;
 
 void ProcessWork(ares_channel channel,
                  std::function<std::set<int>()> get_extrafds,
@@ -145,6 +148,7 @@ void LibraryTest::ClearFails() {
 
 // static
 bool LibraryTest::ShouldAllocFail(size_t size) {
+  std::lock_guard<std::mutex> guard(alloc_fail_lock);
   bool fail = (fails_ & 0x01);
   fails_ >>= 1;
   if (size_fails_[size] > 0) {
@@ -196,7 +200,8 @@ void DefaultChannelModeTest::Process() {
 }
 
 MockServer::MockServer(int family, int port)
-  : udpport_(port), tcpport_(port), qid_(-1) {
+  : udpport_(port), tcpport_(port), qid_(-1), last_arcount_(-1),
+    last_udpsize_(-1) {
   // Create a TCP socket to receive data on.
   tcp_data_ = NULL;
   tcp_data_len_ = 0;
@@ -312,6 +317,13 @@ void MockServer::ProcessPacket(int fd, struct sockaddr_storage *addr, socklen_t
               << ")" << std::endl;
     return;
   }
+  last_arcount_ = DNS_HEADER_ARCOUNT(data);
+  // A bare OPT RR: root name, type, then the payload size as its class
+  last_udpsize_ = -1;
+  if (last_arcount_ == 1 && len >= 12 + 11 && data[len - 11] == 0 &&
+      DNS__16BIT(data + len - 10) == T_OPT) {
+    last_udpsize_ = DNS__16BIT(data + len - 8);
+  }
   byte* question = data + 12;
   int qlen = len - 12;
 
@@ -581,6 +593,34 @@ void MockChannelOptsTest::Process() {
               std::bind(&MockChannelOptsTest::ProcessFD, this, _1));
 }
 
+void MockChannelOptsTest::ProcessEngine() {
+  struct timeval tv;
+  while (ares_timeout(channel_, NULL, &tv) != NULL) {
+    fd_set readers;
+    FD_ZERO(&readers);
+    int efd = ares_event_engine_fd(channel_);
+    FD_SET(efd, &readers);
+    int nfds = efd + 1;
+    std::set<int> extrafds = fds();
+    for (int extrafd : extrafds) {
+      FD_SET(extrafd, &readers);
+      if (extrafd >= nfds) {
+        nfds = extrafd + 1;
+      }
+    }
+    if (select(nfds, &readers, nullptr, nullptr, &tv) < 0) {
+      fprintf(stderr, "select() failed, errno %d\n", errno);
+      return;
+    }
+    ares_process_pending(channel_);
+    for (int extrafd : extrafds) {
+      if (FD_ISSET(extrafd, &readers)) {
+        ProcessFD(extrafd);
+      }
+    }
+  }
+}
+
 std::ostream& operator<<(std::ostream& os, const HostResult& result) {
   os << '{';
   if (result.done_) {
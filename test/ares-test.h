@@ -210,6 +210,20 @@ public:
     qid_ = qid;
   }
 
+  // Additional record count of the last request, which tells whether it
+  // carried an EDNS OPT RR.
+  int last_arcount() const
+  {
+    return last_arcount_;
+  }
+
+  // UDP payload size advertised by the OPT RR ending the last request, or -1
+  // if there was none.
+  int last_udpsize() const
+  {
+    return last_udpsize_;
+  }
+
   void Disconnect()
   {
     for (int fd : connfds_) {
@@ -250,6 +264,8 @@ private:
   std::set<int>     connfds_;
   std::vector<byte> reply_;
   int               qid_;
+  int               last_arcount_;
+  int               last_udpsize_;
   unsigned char    *tcp_data_;
   size_t            tcp_data_len_;
 };
@@ -265,6 +281,10 @@ public:
   // descriptors.
   void Process();
 
+  // Same, but waiting on ares_event_engine_fd() in place of the individual
+  // ares-owned file descriptors, and processing with ares_process_pending().
+  void ProcessEngine();
+
 protected:
   // NiceMockServer doesn't complain about uninteresting calls.
   typedef testing::NiceMock<MockServer>                NiceMockServer;